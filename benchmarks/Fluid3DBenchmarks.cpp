@@ -0,0 +1,142 @@
+/**
+ * @file Fluid3DBenchmarks.cpp
+ * @brief Benchmarks of the Fluid3D solver stages across grid sizes and thread counts.
+ * Every benchmark takes the edge length of a cubic grid and the thread count as arguments and reports cells per
+ * second (items_per_second) and an estimate of the memory traffic (bytes_per_second).
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "Fluid3D.h"
+#include "ThreadPool.h"
+
+namespace
+{
+    /**
+     * @brief A Fluid3D with a smooth swirling velocity field and the scratch fields the stages need
+     */
+    struct Fluid3DFixture
+    {
+        std::unique_ptr<ThreadPool> pool;
+        Fluid3D fluid;
+        std::vector<float> vx;
+        std::vector<float> vy;
+        std::vector<float> vz;
+        std::vector<float> vx0;
+        std::vector<float> vy0;
+        std::vector<float> vz0;
+
+        Fluid3DFixture(size_t _size, size_t _numThreads) : fluid{_size, _size, _size},
+                                                           vx(fluid.numCells()),
+                                                           vy(fluid.numCells()),
+                                                           vz(fluid.numCells()),
+                                                           vx0(fluid.numCells()),
+                                                           vy0(fluid.numCells()),
+                                                           vz0(fluid.numCells())
+        {
+            if (_numThreads != 1)
+            {
+                pool = std::make_unique<ThreadPool>(_numThreads);
+                fluid.setThreadPool(pool.get());
+            }
+
+            const float scale = 6.2831853f / static_cast<float>(_size);
+            for (size_t k = 0; k < _size; k++)
+            {
+                for (size_t j = 0; j < _size; j++)
+                {
+                    for (size_t i = 0; i < _size; i++)
+                    {
+                        vx[fluid.IX(i, j, k)] = 0.01f * std::sin(static_cast<float>(j) * scale);
+                        vy[fluid.IX(i, j, k)] = -0.01f * std::sin(static_cast<float>(k) * scale);
+                        vz[fluid.IX(i, j, k)] = 0.01f * std::sin(static_cast<float>(i) * scale);
+                    }
+                }
+            }
+            vx0 = vx;
+            vy0 = vy;
+            vz0 = vz;
+        }
+    };
+
+    void setCounters(benchmark::State &_state, size_t _cells, size_t _bytesPerCell)
+    {
+        _state.SetItemsProcessed(static_cast<int64_t>(_state.iterations() * _cells));
+        _state.SetBytesProcessed(static_cast<int64_t>(_state.iterations() * _cells * _bytesPerCell));
+        _state.counters["threads"] = static_cast<double>(_state.range(1));
+    }
+
+    void BM_LinearSolve3D(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        Fluid3DFixture f(size, static_cast<size_t>(_state.range(1)));
+        const Fluid3D::SolveMode mode = static_cast<Fluid3D::SolveMode>(_state.range(2));
+        const float a = 0.1f;
+
+        for (auto _ : _state)
+        {
+            f.fluid.linear_solve(Fluid3D::Boundary::X, &f.vx0, &f.vx, a, 1 + 6 * a, mode);
+            benchmark::ClobberMemory();
+        }
+        // every sweep reads x and x0 and writes x
+        setCounters(_state, f.fluid.numCells(), 3 * sizeof(float) * static_cast<size_t>(f.fluid.iterations()));
+        _state.counters["slab"] = static_cast<double>(f.fluid.slabRows());
+    }
+
+    void BM_Advect3D(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        Fluid3DFixture f(size, static_cast<size_t>(_state.range(1)));
+
+        for (auto _ : _state)
+        {
+            f.fluid.advect(Fluid3D::Boundary::X, &f.vx, &f.vx0, &f.vx0, &f.vy0, &f.vz0, 0.0001f);
+            benchmark::ClobberMemory();
+        }
+        // reads the three velocities and the advected field, writes the result
+        setCounters(_state, f.fluid.numCells(), 5 * sizeof(float));
+    }
+
+    void BM_Project3D(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        Fluid3DFixture f(size, static_cast<size_t>(_state.range(1)));
+
+        for (auto _ : _state)
+        {
+            f.fluid.project(&f.vx, &f.vy, &f.vz, &f.vx0, &f.vy0);
+            benchmark::ClobberMemory();
+        }
+        // divergence reads 3 writes 2, the solve reads 2 writes 1 per sweep, the gradient reads 1 and updates 3
+        const size_t sweeps = static_cast<size_t>(f.fluid.iterations());
+        setCounters(_state, f.fluid.numCells(), (5 + 3 * sweeps + 7) * sizeof(float));
+    }
+
+    void sizesAndThreads(benchmark::internal::Benchmark *_benchmark)
+    {
+        _benchmark->ArgNames({"size", "threads"});
+        _benchmark->ArgsProduct({{32, 64, 128, 256}, {1, 2, 4}});
+        _benchmark->UseRealTime();
+    }
+
+    void sizesThreadsAndModes(benchmark::internal::Benchmark *_benchmark)
+    {
+        _benchmark->ArgNames({"size", "threads", "mode"});
+        _benchmark->ArgsProduct({{32, 64, 128, 256},
+                                 {1, 2, 4},
+                                 {static_cast<int64_t>(Fluid3D::SolveMode::GaussSeidel),
+                                  static_cast<int64_t>(Fluid3D::SolveMode::RedBlack),
+                                  static_cast<int64_t>(Fluid3D::SolveMode::Jacobi)}});
+        _benchmark->UseRealTime();
+    }
+}
+
+BENCHMARK(BM_LinearSolve3D)->Apply(sizesThreadsAndModes);
+BENCHMARK(BM_Advect3D)->Apply(sizesAndThreads);
+BENCHMARK(BM_Project3D)->Apply(sizesAndThreads);
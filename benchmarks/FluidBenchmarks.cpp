@@ -0,0 +1,267 @@
+/**
+ * @file FluidBenchmarks.cpp
+ * @brief Benchmarks of each Fluid solver stage across grid sizes and thread counts.
+ * Every benchmark takes the grid size and thread count as arguments and reports cells per second (items_per_second)
+ * and an estimate of the memory traffic (bytes_per_second) from the fields each stage reads and writes.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "Fluid.h"
+#include "ThreadPool.h"
+
+namespace
+{
+    /**
+     * @brief A Fluid with a smooth swirling velocity field and the scratch fields the stages need
+     */
+    struct FluidFixture
+    {
+        std::unique_ptr<ThreadPool> pool;
+        Fluid fluid;
+        std::vector<float> vx;
+        std::vector<float> vy;
+        std::vector<float> vx0;
+        std::vector<float> vy0;
+
+        FluidFixture(size_t _size, size_t _numThreads) : fluid{_size, _size},
+                                                         vx(_size * _size),
+                                                         vy(_size * _size),
+                                                         vx0(_size * _size),
+                                                         vy0(_size * _size)
+        {
+            if (_numThreads != 1)
+            {
+                pool = std::make_unique<ThreadPool>(_numThreads);
+                fluid.setThreadPool(pool.get());
+            }
+
+            const float scale = 6.2831853f / static_cast<float>(_size);
+            for (size_t j = 0; j < _size; j++)
+            {
+                for (size_t i = 0; i < _size; i++)
+                {
+                    vx[fluid.IX(i, j)] = 0.01f * std::sin(static_cast<float>(j) * scale);
+                    vy[fluid.IX(i, j)] = -0.01f * std::sin(static_cast<float>(i) * scale);
+                }
+            }
+            vx0 = vx;
+            vy0 = vy;
+        }
+    };
+
+    void setCounters(benchmark::State &_state, size_t _cells, size_t _bytesPerCell)
+    {
+        _state.SetItemsProcessed(static_cast<int64_t>(_state.iterations() * _cells));
+        _state.SetBytesProcessed(static_cast<int64_t>(_state.iterations() * _cells * _bytesPerCell));
+        _state.counters["threads"] = static_cast<double>(_state.range(1));
+    }
+
+    void BM_LinearSolve(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidFixture f(size, static_cast<size_t>(_state.range(1)));
+        const Fluid::SolveMode mode = static_cast<Fluid::SolveMode>(_state.range(2));
+        const float a = 0.1f;
+
+        for (auto _ : _state)
+        {
+            f.fluid.linear_solve(Fluid::Boundary::X, &f.vx0, &f.vx, a, 1 + 4 * a, mode);
+            benchmark::ClobberMemory();
+        }
+        // every sweep reads x and x0 and writes x
+        setCounters(_state, size * size, 3 * sizeof(float) * static_cast<size_t>(f.fluid.iterations()));
+    }
+
+    void BM_LinearSolveTiled(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidFixture f(size, static_cast<size_t>(_state.range(1)));
+        const Fluid::SolveMode mode = static_cast<Fluid::SolveMode>(_state.range(2));
+        const int sweepsPerTile = static_cast<int>(_state.range(3));
+        const int sweeps = 16;
+        const float a = 0.1f;
+        f.fluid.setIterations(sweeps);
+        f.fluid.setSweepsPerTile(sweepsPerTile);
+
+        for (auto _ : _state)
+        {
+            f.fluid.linear_solve(Fluid::Boundary::X, &f.vx0, &f.vx, a, 1 + 4 * a, mode);
+            benchmark::ClobberMemory();
+        }
+        // same traffic estimate as the untiled sweeps, so bytes_per_second shows how much the tiling saves
+        setCounters(_state, size * size, 3 * sizeof(float) * static_cast<size_t>(sweeps));
+        _state.counters["sweeps"] = benchmark::Counter(static_cast<double>(_state.iterations() * sweeps),
+                                                       benchmark::Counter::kIsRate);
+    }
+
+    void BM_Advect(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidFixture f(size, static_cast<size_t>(_state.range(1)));
+
+        for (auto _ : _state)
+        {
+            f.fluid.advect(Fluid::Boundary::X, &f.vx, &f.vx0, &f.vx0, &f.vy0, 0.0001f);
+            benchmark::ClobberMemory();
+        }
+        // reads both velocities and the advected field, writes the result
+        setCounters(_state, size * size, 4 * sizeof(float));
+    }
+
+    void BM_AdvectVelocity(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidFixture f(size, static_cast<size_t>(_state.range(1)));
+        std::vector<float> p(size * size);
+        std::vector<float> div(size * size);
+
+        for (auto _ : _state)
+        {
+            f.fluid.advectVelocity(f.vx.data(), f.vy.data(), f.vx0.data(), f.vy0.data(), 0.0001f, p.data(), div.data());
+            benchmark::ClobberMemory();
+        }
+        // the fused X and Y advection plus divergence, reads both velocities, writes both results, p and div
+        setCounters(_state, size * size, 6 * sizeof(float));
+    }
+
+    /**
+     * @brief Scalar fields to advect, each a copy of the X velocity so the interpolation reads real data
+     */
+    struct ScalarFixture
+    {
+        std::vector<std::vector<float>> d;
+        std::vector<std::vector<float>> d0;
+
+        ScalarFixture(const FluidFixture &_f, size_t _count) : d(_count, _f.vx), d0(_count, _f.vx0) {}
+    };
+
+    void BM_AdvectSeparate(benchmark::State &_state)
+    {
+        // one advect call per field, each repeating the back-trace, to compare with BM_AdvectFields
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidFixture f(size, static_cast<size_t>(_state.range(1)));
+        const size_t count = static_cast<size_t>(_state.range(2));
+        ScalarFixture s(f, count);
+
+        for (auto _ : _state)
+        {
+            for (size_t n = 0; n < count; n++)
+            {
+                f.fluid.advect(Fluid::Boundary::None, &s.d[n], &s.d0[n], &f.vx0, &f.vy0, 0.0001f);
+            }
+            benchmark::ClobberMemory();
+        }
+        // reads both velocities for every field, and each field and its result
+        setCounters(_state, size * size, count * 4 * sizeof(float));
+    }
+
+    void BM_AdvectFields(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidFixture f(size, static_cast<size_t>(_state.range(1)));
+        const size_t count = static_cast<size_t>(_state.range(2));
+        ScalarFixture s(f, count);
+        std::vector<float *> targets;
+        std::vector<const float *> sources;
+        for (size_t n = 0; n < count; n++)
+        {
+            targets.push_back(s.d[n].data());
+            sources.push_back(s.d0[n].data());
+        }
+
+        for (auto _ : _state)
+        {
+            f.fluid.advectFields(targets.data(), sources.data(), count, f.vx0.data(), f.vy0.data(), 0.0001f);
+            benchmark::ClobberMemory();
+        }
+        // reads both velocities once, and each field and its result
+        setCounters(_state, size * size, (2 + count * 2) * sizeof(float));
+    }
+
+    void BM_Project(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidFixture f(size, static_cast<size_t>(_state.range(1)));
+
+        for (auto _ : _state)
+        {
+            // project overwrites its pressure and divergence fields, so the velocity can be reused every iteration
+            f.fluid.project(&f.vx, &f.vy, &f.vx0, &f.vy0);
+            benchmark::ClobberMemory();
+        }
+        // divergence reads 2 writes 2, the solve reads 2 writes 1 per sweep, the gradient reads 1 and updates 2
+        const size_t sweeps = static_cast<size_t>(f.fluid.iterations());
+        setCounters(_state, size * size, (4 + 3 * sweeps + 5) * sizeof(float));
+    }
+
+    void BM_SetBoundary(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidFixture f(size, static_cast<size_t>(_state.range(1)));
+
+        for (auto _ : _state)
+        {
+            f.fluid.set_boundary(Fluid::Boundary::X, &f.vx);
+            benchmark::ClobberMemory();
+        }
+        // only the boundary ring is touched, each cell reads its neighbour and writes itself
+        setCounters(_state, 4 * size, 2 * sizeof(float));
+    }
+
+    void sizesAndThreads(benchmark::internal::Benchmark *_benchmark)
+    {
+        _benchmark->ArgNames({"size", "threads"});
+        _benchmark->ArgsProduct({{64, 128, 256, 512, 1024}, {1, 2, 4}});
+        _benchmark->UseRealTime();
+    }
+
+    void sizesThreadsAndModes(benchmark::internal::Benchmark *_benchmark)
+    {
+        _benchmark->ArgNames({"size", "threads", "mode"});
+        _benchmark->ArgsProduct({{64, 128, 256, 512, 1024},
+                                 {1, 2, 4},
+                                 {static_cast<int64_t>(Fluid::SolveMode::GaussSeidel),
+                                  static_cast<int64_t>(Fluid::SolveMode::RedBlack),
+                                  static_cast<int64_t>(Fluid::SolveMode::Jacobi)}});
+        _benchmark->UseRealTime();
+    }
+
+    void sizesThreadsAndFields(benchmark::internal::Benchmark *_benchmark)
+    {
+        _benchmark->ArgNames({"size", "threads", "fields"});
+        _benchmark->ArgsProduct({{128, 512, 1024}, {1, 4}, {1, 2, 4, 8}});
+        _benchmark->UseRealTime();
+    }
+
+    /**
+     * @brief Grids larger than cache, where sweeping a few rows several times before moving on pays off.
+     * 1 sweep per tile is the untiled row loop to compare against.
+     */
+    void largeSizesModesAndTiles(benchmark::internal::Benchmark *_benchmark)
+    {
+        _benchmark->ArgNames({"size", "threads", "mode", "tile"});
+        _benchmark->ArgsProduct({{1024, 2048},
+                                 {1, 4},
+                                 {static_cast<int64_t>(Fluid::SolveMode::GaussSeidel),
+                                  static_cast<int64_t>(Fluid::SolveMode::RedBlack),
+                                  static_cast<int64_t>(Fluid::SolveMode::Jacobi)},
+                                 {1, 2, 4, 8}});
+        _benchmark->UseRealTime();
+    }
+}
+
+BENCHMARK(BM_LinearSolve)->Apply(sizesThreadsAndModes);
+BENCHMARK(BM_LinearSolveTiled)->Apply(largeSizesModesAndTiles);
+BENCHMARK(BM_Advect)->Apply(sizesAndThreads);
+BENCHMARK(BM_AdvectVelocity)->Apply(sizesAndThreads);
+BENCHMARK(BM_AdvectSeparate)->Apply(sizesThreadsAndFields);
+BENCHMARK(BM_AdvectFields)->Apply(sizesThreadsAndFields);
+BENCHMARK(BM_Project)->Apply(sizesAndThreads);
+BENCHMARK(BM_SetBoundary)->Apply(sizesAndThreads);
@@ -0,0 +1,279 @@
+/**
+ * @file FluidGridBenchmarks.cpp
+ * @brief Benchmarks of a full FluidGrid step and of the particle update across grid sizes and thread counts, using
+ * the same viscosity and time step as the demo.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "FluidGrid.h"
+
+namespace
+{
+    constexpr float c_viscosity = 20.0f;
+    constexpr float c_dt = 0.0000001f;
+
+    /**
+     * @brief Bytes moved per cell by one relaxation solve, reading x and x0 and writing x on every sweep
+     */
+    constexpr size_t c_solveBytes = 3 * sizeof(float) * c_defaultIterations;
+    /**
+     * @brief Bytes moved per particle, its position, 4 samples of both velocities, and the new position and direction
+     */
+    constexpr size_t c_particleBytes = (2 + 8 + 4) * sizeof(float);
+
+    void setCounters(benchmark::State &_state, size_t _cells, size_t _bytesPerCell)
+    {
+        _state.SetItemsProcessed(static_cast<int64_t>(_state.iterations() * _cells));
+        _state.SetBytesProcessed(static_cast<int64_t>(_state.iterations() * _cells * _bytesPerCell));
+        _state.counters["threads"] = static_cast<double>(_state.range(1));
+    }
+
+    /**
+     * @brief Report the heap allocations of the last step in builds that count them, which should be 0
+     */
+    void setAllocationCounter(benchmark::State &_state, const FluidGrid &_grid)
+    {
+        if (Workspace::countsHeapAllocations())
+        {
+            _state.counters["allocs"] = static_cast<double>(_grid.lastStepAllocations());
+        }
+    }
+
+    void BM_Step(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidGrid grid(size, size, c_viscosity, c_dt);
+        grid.setThreadCount(static_cast<size_t>(_state.range(1)));
+
+        for (auto _ : _state)
+        {
+            grid.addVelocity(size / 2.0f, size / 2.0f, 0.001f, 0.0005f);
+            grid.step();
+            benchmark::ClobberMemory();
+        }
+        // 2 diffusions, 2 projections of 9 fields plus a solve, 2 advections of 4 fields, and the particles
+        const size_t project = 9 * sizeof(float) + c_solveBytes;
+        setCounters(_state, size * size, 2 * c_solveBytes + 2 * project + 2 * 4 * sizeof(float) + c_particleBytes);
+        setAllocationCounter(_state, grid);
+    }
+
+    void BM_StepFused(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidGrid grid(size, size, c_viscosity, c_dt);
+        grid.setThreadCount(static_cast<size_t>(_state.range(1)));
+        grid.setFused(true);
+
+        for (auto _ : _state)
+        {
+            grid.addVelocity(size / 2.0f, size / 2.0f, 0.001f, 0.0005f);
+            grid.step();
+            benchmark::ClobberMemory();
+        }
+        // as BM_Step, but one advection pass of 6 fields that also writes the second divergence
+        const size_t project = 9 * sizeof(float) + c_solveBytes;
+        setCounters(_state, size * size, 2 * c_solveBytes + project + 6 * sizeof(float) + 5 * sizeof(float) +
+                                             c_solveBytes + c_particleBytes);
+        setAllocationCounter(_state, grid);
+    }
+
+    void BM_StepSparse(benchmark::State &_state)
+    {
+        // a single stirred spot in a grid at rest, with few particles so the step cost is the solver's
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidGrid grid(size, size, c_viscosity, c_dt, 1024);
+        grid.setThreadCount(static_cast<size_t>(_state.range(1)));
+        grid.setSparse(true);
+
+        for (auto _ : _state)
+        {
+            grid.addVelocity(size / 2.0f, size / 2.0f, 0.001f, 0.0005f);
+            grid.step();
+            benchmark::ClobberMemory();
+        }
+        // cells of the whole grid, so items_per_second compares with BM_Step, and the fraction of it that was stepped
+        _state.SetItemsProcessed(static_cast<int64_t>(_state.iterations() * size * size));
+        _state.counters["threads"] = static_cast<double>(_state.range(1));
+        const ActivityMask &mask = *grid.activityMask();
+        _state.counters["active"] = static_cast<double>(mask.numActive()) / static_cast<double>(mask.numTiles());
+        setAllocationCounter(_state, grid);
+    }
+
+    void BM_UpdateParticles(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        FluidGrid grid(size, size, c_viscosity, c_dt);
+        grid.setThreadCount(static_cast<size_t>(_state.range(1)));
+        // give the particles a velocity field to follow
+        grid.addVelocity(size / 2.0f, size / 2.0f, 0.001f, 0.0005f);
+        grid.step();
+
+        for (auto _ : _state)
+        {
+            grid.updateParticles();
+            benchmark::ClobberMemory();
+        }
+        setCounters(_state, grid.getNumParticles(), c_particleBytes);
+    }
+
+    void BM_UpdateTracers(benchmark::State &_state)
+    {
+        // many more particles than cells, as when seeding tracers on a modest grid
+        const size_t size = 256;
+        const size_t numParticles = static_cast<size_t>(_state.range(0));
+        FluidGrid grid(size, size, c_viscosity, c_dt, numParticles);
+        grid.setThreadCount(static_cast<size_t>(_state.range(1)));
+        grid.addVelocity(size / 2.0f, size / 2.0f, 0.001f, 0.0005f);
+        grid.step();
+
+        for (auto _ : _state)
+        {
+            grid.updateParticles();
+            benchmark::ClobberMemory();
+        }
+        setCounters(_state, numParticles, c_particleBytes);
+    }
+
+    void BM_SplatImpulses(benchmark::State &_state)
+    {
+        // emitters scattered over the grid with a fixed seed, splatted the way a step applies them
+        const size_t size = 512;
+        const size_t count = static_cast<size_t>(_state.range(0));
+        const float radius = static_cast<float>(_state.range(1));
+        FluidGrid grid(size, size, c_viscosity, c_dt, 1024);
+        grid.setThreadCount(static_cast<size_t>(_state.range(2)));
+        std::vector<Impulse> impulses(count);
+        uint32_t seed = 12345;
+        auto random = [&seed]() {
+            seed = seed * 1664525u + 1013904223u;
+            return static_cast<float>(seed >> 8) / static_cast<float>(1u << 24);
+        };
+        for (Impulse &impulse : impulses)
+        {
+            impulse = {random() * size, random() * size, random() - 0.5f, random() - 0.5f, radius};
+        }
+
+        for (auto _ : _state)
+        {
+            grid.addImpulses(impulses.data(), impulses.size());
+            grid.applyImpulses();
+            benchmark::ClobberMemory();
+        }
+        _state.SetItemsProcessed(static_cast<int64_t>(_state.iterations() * count));
+        _state.counters["threads"] = static_cast<double>(_state.range(2));
+    }
+
+    /**
+     * @brief The enstrophy of the velocity, the sum of the squared vorticity over the interior in units of the domain,
+     * which numerical diffusion wears down as it smooths out the vortices
+     */
+    double enstrophy(const FluidGrid &_grid)
+    {
+        const size_t w = _grid.width();
+        const float *vx = _grid.getVelocityX();
+        const float *vy = _grid.getVelocityY();
+        double sum = 0.0;
+        for (size_t j = 1; j < _grid.height() - 1; j++)
+        {
+            for (size_t i = 1; i < w - 1; i++)
+            {
+                const size_t c = i + j * w;
+                // the cell size cancels between the vorticity and the area
+                const double curl = 0.5 * ((vy[c + 1] - vy[c - 1]) - (vx[c + w] - vx[c - w]));
+                sum += curl * curl;
+            }
+        }
+        return sum;
+    }
+
+    /**
+     * @brief Set up a pair of counter-rotating Gaussian vortices, which travel together across the unit domain
+     */
+    void addVortexPair(FluidGrid *_grid)
+    {
+        const float n = static_cast<float>(_grid->width() - 2);
+        const float radius = 0.05f;
+        const float centres[2][3] = {{0.4f, 0.3f, 1.0f}, {0.6f, 0.3f, -1.0f}};
+        for (size_t j = 1; j < _grid->height() - 1; j++)
+        {
+            for (size_t i = 1; i < _grid->width() - 1; i++)
+            {
+                float vx = 0.0f;
+                float vy = 0.0f;
+                for (const float *centre : centres)
+                {
+                    const float dx = static_cast<float>(i) / n - centre[0];
+                    const float dy = static_cast<float>(j) / n - centre[1];
+                    // a peak speed of about 1 at the edge of the core
+                    const float speed = centre[2] * 2.3f * std::exp(-(dx * dx + dy * dy) / (radius * radius)) / radius;
+                    vx -= speed * dy;
+                    vy += speed * dx;
+                }
+                _grid->addVelocity(static_cast<float>(i), static_cast<float>(j), vx, vy);
+            }
+        }
+    }
+
+    void BM_VortexRetention(benchmark::State &_state)
+    {
+        // the same physical time on every grid, with the time step scaled to keep the same CFL number, so the cost
+        // and the enstrophy left at the end compare across resolutions and advection schemes
+        const size_t size = static_cast<size_t>(_state.range(0));
+        const auto scheme = static_cast<Fluid::AdvectionScheme>(_state.range(1));
+        const float dt = 0.5f / static_cast<float>(size - 2);
+        const size_t steps = (size - 2) / 2;
+        FluidGrid grid(size, size, 0.0f, dt, 1024);
+        grid.setAdvectionScheme(scheme);
+        grid.setPressureSolver({PressureSolver::Type::Multigrid});
+
+        double retained = 0.0;
+        for (auto _ : _state)
+        {
+            _state.PauseTiming();
+            grid.reset();
+            addVortexPair(&grid);
+            const double initial = enstrophy(grid);
+            _state.ResumeTiming();
+            for (size_t step = 0; step < steps; step++)
+            {
+                grid.step();
+            }
+            benchmark::ClobberMemory();
+            _state.PauseTiming();
+            retained = enstrophy(grid) / initial;
+            _state.ResumeTiming();
+        }
+        // steps per second, and the fraction of the starting enstrophy the last run kept
+        _state.SetItemsProcessed(static_cast<int64_t>(_state.iterations() * steps));
+        _state.counters["retained"] = retained;
+    }
+
+    void sizesAndThreads(benchmark::internal::Benchmark *_benchmark)
+    {
+        _benchmark->ArgNames({"size", "threads"});
+        _benchmark->ArgsProduct({{64, 128, 256, 512, 1024}, {1, 2, 4}});
+        _benchmark->UseRealTime();
+    }
+}
+
+BENCHMARK(BM_Step)->Apply(sizesAndThreads);
+BENCHMARK(BM_StepFused)->Apply(sizesAndThreads);
+BENCHMARK(BM_StepSparse)->Apply(sizesAndThreads);
+BENCHMARK(BM_SplatImpulses)
+    ->ArgNames({"impulses", "radius", "threads"})
+    ->ArgsProduct({{1024, 16384}, {0, 2, 4}, {1, 2, 4}})
+    ->UseRealTime();
+BENCHMARK(BM_VortexRetention)
+    ->ArgNames({"size", "scheme"})
+    ->ArgsProduct({{66, 130, 258}, {0, 1, 2}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK(BM_UpdateParticles)->Apply(sizesAndThreads);
+BENCHMARK(BM_UpdateTracers)->ArgNames({"particles", "threads"})->ArgsProduct({{1 << 20, 1 << 22}, {1, 2, 4}})->UseRealTime();
@@ -0,0 +1,206 @@
+/**
+ * @file MixedPrecisionBenchmarks.cpp
+ * @brief Benchmarks of the MixedPrecisionFluid step with float, half and bfloat16 storage across grid sizes and thread
+ * counts, reporting the bytes each moves and how far the 16 bit formats drift from float, and of the row conversions
+ * at each SIMD level.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "HalfPrecision.h"
+#include "MixedPrecisionFluid.h"
+#include "ThreadPool.h"
+
+namespace
+{
+    constexpr float c_viscosity = 0.0001f;
+    /**
+     * @brief Steps run from the same start with float and the storage format under test before comparing them
+     */
+    constexpr int c_accuracySteps = 20;
+
+    /**
+     * @brief The time step moving the fastest of the flow about half a cell a step on any grid size
+     */
+    float timeStep(size_t _size)
+    {
+        return 0.5f / static_cast<float>(_size - 2);
+    }
+
+    /**
+     * @brief Bytes moved per cell by one step with _bytes per stored value. Each of the 2 diffusions reads x and x0
+     * and writes x every sweep, each of the 2 projections reads both velocities, writes the float divergence and
+     * pressure, relaxes the pressure and then reads it to update both velocities, and each of the 2 advections reads
+     * both velocities and the field and writes the result.
+     */
+    size_t stepBytesPerCell(size_t _bytes)
+    {
+        const size_t solve = 3 * sizeof(float) * c_defaultIterations;
+        const size_t diffuse = 3 * _bytes * c_defaultIterations;
+        const size_t project = 2 * _bytes + 2 * sizeof(float) + solve + sizeof(float) + 4 * _bytes;
+        const size_t advect = 4 * _bytes;
+        return 2 * diffuse + 2 * project + 2 * advect;
+    }
+
+    /**
+     * @brief Set up a pair of counter-rotating Gaussian vortices, as in BM_VortexRetention
+     */
+    template <typename Storage>
+    void addVortexPair(MixedPrecisionFluid<Storage> *_fluid)
+    {
+        const float n = static_cast<float>(_fluid->width() - 2);
+        const float radius = 0.05f;
+        const float centres[2][3] = {{0.4f, 0.3f, 1.0f}, {0.6f, 0.3f, -1.0f}};
+        for (size_t j = 1; j < _fluid->height() - 1; j++)
+        {
+            for (size_t i = 1; i < _fluid->width() - 1; i++)
+            {
+                float vx = 0.0f;
+                float vy = 0.0f;
+                for (const float *centre : centres)
+                {
+                    const float dx = static_cast<float>(i) / n - centre[0];
+                    const float dy = static_cast<float>(j) / n - centre[1];
+                    const float speed = centre[2] * 2.3f * std::exp(-(dx * dx + dy * dy) / (radius * radius)) / radius;
+                    vx -= speed * dy;
+                    vy += speed * dx;
+                }
+                _fluid->addVelocity(static_cast<float>(i), static_cast<float>(j), vx, vy);
+            }
+        }
+    }
+
+    template <typename Storage>
+    std::vector<float> runVortexPair(size_t _size)
+    {
+        MixedPrecisionFluid<Storage> fluid(_size, _size, c_viscosity, timeStep(_size));
+        addVortexPair(&fluid);
+        for (int step = 0; step < c_accuracySteps; step++)
+        {
+            fluid.step();
+        }
+        std::vector<float> velocity(2 * fluid.numCells());
+        fluid.readVelocity(velocity.data(), velocity.data() + fluid.numCells());
+        return velocity;
+    }
+
+    /**
+     * @brief Set the root mean square and the largest difference of the velocity from the float run, both relative
+     * to the float velocity, after c_accuracySteps steps of the vortex pair
+     */
+    template <typename Storage>
+    void setErrorCounters(benchmark::State &_state, size_t _size)
+    {
+        const std::vector<float> expected = runVortexPair<float>(_size);
+        const std::vector<float> actual = runVortexPair<Storage>(_size);
+        double difference = 0.0;
+        double magnitude = 0.0;
+        double largestDifference = 0.0;
+        double largest = 0.0;
+        for (size_t c = 0; c < expected.size(); c++)
+        {
+            const double error = static_cast<double>(actual[c]) - expected[c];
+            difference += error * error;
+            magnitude += static_cast<double>(expected[c]) * expected[c];
+            largestDifference = std::max(largestDifference, std::fabs(error));
+            largest = std::max(largest, std::fabs(static_cast<double>(expected[c])));
+        }
+        _state.counters["rmsError"] = std::sqrt(difference / magnitude);
+        _state.counters["maxError"] = largestDifference / largest;
+    }
+
+    template <typename Storage>
+    void BM_MixedPrecisionStep(benchmark::State &_state)
+    {
+        const size_t size = static_cast<size_t>(_state.range(0));
+        const size_t threads = static_cast<size_t>(_state.range(1));
+        MixedPrecisionFluid<Storage> fluid(size, size, c_viscosity, timeStep(size));
+        std::unique_ptr<ThreadPool> pool;
+        if (threads > 1)
+        {
+            pool = std::make_unique<ThreadPool>(threads);
+            fluid.setThreadPool(pool.get());
+        }
+        addVortexPair(&fluid);
+
+        for (auto _ : _state)
+        {
+            fluid.step();
+            benchmark::ClobberMemory();
+        }
+        const size_t cells = size * size;
+        _state.SetItemsProcessed(static_cast<int64_t>(_state.iterations() * cells));
+        _state.SetBytesProcessed(static_cast<int64_t>(_state.iterations() * cells * stepBytesPerCell(sizeof(Storage))));
+        _state.counters["threads"] = static_cast<double>(threads);
+        _state.counters["bytesPerValue"] = static_cast<double>(sizeof(Storage));
+        if (threads == 1)
+        {
+            // the thread count does not change the result, so only measure it once per size
+            setErrorCounters<Storage>(_state, size);
+        }
+    }
+
+    /**
+     * @brief Widen a row of halves or bfloat16s to floats and round it back, range(0) is the SIMD level
+     */
+    template <typename Storage>
+    void BM_ConvertRoundTrip(benchmark::State &_state)
+    {
+        const SimdLevel level = static_cast<SimdLevel>(_state.range(0));
+        const ConversionKernels &kernels = conversionKernels(level);
+        const size_t count = 1 << 16;
+        std::vector<Storage> stored(count);
+        std::vector<float> floats(count);
+        for (size_t n = 0; n < count; n++)
+        {
+            stored[n] = fromFloat<Storage>(std::sin(0.001f * static_cast<float>(n)));
+        }
+
+        for (auto _ : _state)
+        {
+            if constexpr (std::is_same_v<Storage, Half>)
+            {
+                kernels.halfToFloat(stored.data(), floats.data(), count);
+                kernels.floatToHalf(floats.data(), stored.data(), count);
+            }
+            else
+            {
+                kernels.bfloat16ToFloat(stored.data(), floats.data(), count);
+                kernels.floatToBFloat16(floats.data(), stored.data(), count);
+            }
+            benchmark::ClobberMemory();
+        }
+        _state.SetItemsProcessed(static_cast<int64_t>(_state.iterations() * count));
+        _state.SetBytesProcessed(
+            static_cast<int64_t>(_state.iterations() * count * 2 * (sizeof(Storage) + sizeof(float))));
+        _state.SetLabel(simdLevelName(std::min(level, detectSimdLevel())));
+    }
+
+    void sizesAndThreads(benchmark::internal::Benchmark *_benchmark)
+    {
+        _benchmark->ArgNames({"size", "threads"});
+        _benchmark->ArgsProduct({{128, 512, 1024, 2048}, {1, 2, 4}});
+        _benchmark->UseRealTime();
+    }
+
+    void simdLevels(benchmark::internal::Benchmark *_benchmark)
+    {
+        _benchmark->ArgName("level");
+        _benchmark->DenseRange(static_cast<int>(SimdLevel::Scalar), static_cast<int>(SimdLevel::AVX512));
+    }
+}
+
+BENCHMARK_TEMPLATE(BM_MixedPrecisionStep, float)->Apply(sizesAndThreads);
+BENCHMARK_TEMPLATE(BM_MixedPrecisionStep, Half)->Apply(sizesAndThreads);
+BENCHMARK_TEMPLATE(BM_MixedPrecisionStep, BFloat16)->Apply(sizesAndThreads);
+BENCHMARK_TEMPLATE(BM_ConvertRoundTrip, Half)->Apply(simdLevels);
+BENCHMARK_TEMPLATE(BM_ConvertRoundTrip, BFloat16)->Apply(simdLevels);
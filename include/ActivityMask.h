@@ -0,0 +1,122 @@
+/**
+ * @file ActivityMask.h
+ * @brief Tracks which 16x16 tiles of a grid hold moving fluid, so the solver can skip the tiles at rest.
+ * A tile is hot when any of its velocities is above a fraction of the fastest velocity in the grid. The active set is the hot tiles grown by a halo of
+ * tiles, far enough that fluid cannot move past it in one step. Every field of the solver is kept at zero in the
+ * inactive tiles, so the solver reads zero there without writing it, and a tile is cleared in every field as it goes
+ * inactive.
+ * Only the active tiles are scanned when the set is updated, tiles that fluid moves into are picked up by the halo
+ * and velocity added to a cell activates its tile directly.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef ACTIVITY_MASK_H_
+#define ACTIVITY_MASK_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief By default velocities at or below this fraction of the fastest velocity in the grid are treated as at rest
+ */
+constexpr float c_defaultActivityThreshold = 1.0e-4f;
+
+class ActivityMask
+{
+public:
+    /**
+     * @brief The width and height of a tile in cells
+     */
+    static constexpr size_t c_tileSize = 16;
+
+    /**
+     * @brief A run of consecutive active tiles in a row of tiles, as the cells [begin, end) along X
+     */
+    struct Span
+    {
+        size_t begin;
+        size_t end;
+    };
+
+    /**
+     * @brief Construct a mask for a grid of the given size, including the boundary, with every tile active
+     */
+    ActivityMask(size_t _width, size_t _height);
+
+    /**
+     * @brief Activate every tile, used when the fields are replaced wholesale
+     */
+    void activateAll();
+    /**
+     * @brief Activate the tile holding a cell, used when velocity is added to it
+     */
+    void activateCell(size_t _x, size_t _y);
+    /**
+     * @brief Activate every tile overlapping the cells [_x0, _x1) x [_y0, _y1), used when velocity is splatted into
+     * them
+     */
+    void activateRegion(size_t _x0, size_t _y0, size_t _x1, size_t _y1);
+    /**
+     * @brief Recompute the active set from the velocity, scanning only the tiles active now. The tiles that go
+     * inactive are listed for clearDeactivated.
+     *
+     * @param _threshold A tile is hot when the magnitude of any of its velocity components is above this fraction of
+     * the largest magnitude in the grid
+     * @param _halo The number of tiles around each hot tile that are also active
+     */
+    void update(const float *_velocX, const float *_velocY, float _threshold, size_t _halo);
+    /**
+     * @brief Zero the tiles of a field that went inactive in the last update
+     */
+    void clearDeactivated(float *_field) const;
+    /**
+     * @brief Zero every inactive tile of a field, for solvers that write the whole grid
+     */
+    void clearInactive(float *_field) const;
+    /**
+     * @brief Copy every inactive tile of one field into another. Passive scalars are not zero at rest, and with no
+     * velocity there a stage leaves them unchanged, so this stands in for the stage outside the active tiles.
+     */
+    void copyInactive(float *_dst, const float *_src) const;
+
+    /**
+     * @brief The runs of active tiles in the row of tiles holding row _y of the grid
+     */
+    const std::vector<Span> &spans(size_t _y) const { return m_spans[_y / c_tileSize]; }
+    /**
+     * @brief Whether the tile holding a cell is active
+     */
+    bool isActive(size_t _x, size_t _y) const
+    {
+        return m_active[_x / c_tileSize + (_y / c_tileSize) * m_tilesX] != 0;
+    }
+    /**
+     * @brief The number of active tiles
+     */
+    size_t numActive() const { return m_numActive; }
+    /**
+     * @brief The number of tiles covering the grid
+     */
+    size_t numTiles() const { return m_active.size(); }
+
+private:
+    size_t m_width;
+    size_t m_height;
+    size_t m_tilesX;
+    size_t m_tilesY;
+    size_t m_numActive = 0;
+
+    std::vector<uint8_t> m_active;
+    std::vector<uint8_t> m_hot;
+    std::vector<uint8_t> m_grownX;
+    std::vector<float> m_peaks;
+    std::vector<size_t> m_deactivated;
+    std::vector<std::vector<Span>> m_spans;
+
+    void clearTile(float *_field, size_t _tile) const;
+    void buildSpans();
+};
+
+#endif // !ACTIVITY_MASK_H_
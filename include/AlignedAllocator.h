@@ -0,0 +1,60 @@
+/**
+ * @file AlignedAllocator.h
+ * @brief A std::allocator replacement that aligns every allocation, so vector loads of the data start on a cache line
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef ALIGNED_ALLOCATOR_H_
+#define ALIGNED_ALLOCATOR_H_
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/**
+ * @brief Alignment of the particle and field arrays, one cache line and one AVX-512 register
+ */
+constexpr size_t c_cacheLine = 64;
+
+template <typename T, size_t Alignment = c_cacheLine>
+class AlignedAllocator
+{
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() noexcept = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &) noexcept
+    {
+    }
+
+    T *allocate(size_t _n)
+    {
+        return static_cast<T *>(::operator new(_n * sizeof(T), std::align_val_t{Alignment}));
+    }
+
+    void deallocate(T *_p, size_t) noexcept
+    {
+        ::operator delete(_p, std::align_val_t{Alignment});
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment> &) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment> &) const noexcept { return false; }
+};
+
+/**
+ * @brief A vector whose data starts on a cache line
+ */
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+#endif // !ALIGNED_ALLOCATOR_H_
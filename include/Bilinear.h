@@ -0,0 +1,59 @@
+/**
+ * @file Bilinear.h
+ * @brief The bilinear back-trace of semi-Lagrangian advection, shared by the solvers that advect 2D fields
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef BILINEAR_H_
+#define BILINEAR_H_
+
+#include <cmath>
+#include <cstddef>
+
+#include "HalfPrecision.h"
+
+/**
+ * @brief The four cells around a back-traced point and their bilinear weights
+ */
+struct BilinearSample
+{
+    size_t i0, i1, j0, j1;
+    float s0, s1, t0, t1;
+};
+
+/**
+ * @brief Clamp a back-traced point inside the interior so the four samples never leave the grid, and find them
+ */
+inline BilinearSample backtrace(float _x, float _y, float _maxX, float _maxY)
+{
+    float x = std::fmin(std::fmax(_x, 0.5f), _maxX);
+    float i0 = std::floor(x);
+    float i1 = i0 + 1.0f;
+    float y = std::fmin(std::fmax(_y, 0.5f), _maxY);
+    float j0 = std::floor(y);
+    float j1 = j0 + 1.0f;
+
+    BilinearSample sample;
+    sample.s1 = x - i0;
+    sample.s0 = 1.0f - sample.s1;
+    sample.t1 = y - j0;
+    sample.t0 = 1.0f - sample.t1;
+    sample.i0 = static_cast<size_t>(i0);
+    sample.i1 = static_cast<size_t>(i1);
+    sample.j0 = static_cast<size_t>(j0);
+    sample.j1 = static_cast<size_t>(j1);
+    return sample;
+}
+
+/**
+ * @brief Interpolate a field of floats, or of one of the 16 bit storage formats widened to float, at a sample
+ */
+template <typename T>
+inline float interpolate(const T *_d0, const BilinearSample &_s, size_t _w)
+{
+    return _s.s0 * (_s.t0 * toFloat(_d0[_s.i0 + _s.j0 * _w]) + _s.t1 * toFloat(_d0[_s.i0 + _s.j1 * _w])) +
+           _s.s1 * (_s.t0 * toFloat(_d0[_s.i1 + _s.j0 * _w]) + _s.t1 * toFloat(_d0[_s.i1 + _s.j1 * _w]));
+}
+
+#endif // !BILINEAR_H_
@@ -0,0 +1,273 @@
+/**
+ * @file Checkpoint.h
+ * @brief Saving the state of a FluidGrid to a versioned binary file and mapping it back in to restart a run.
+ * A file is a fixed header (dimensions, dt, viscosity, step index and a table of the arrays with their CRC-32C
+ * checksums) and a table of the scalar channels, followed by the velocity fields, particle arrays and scalar fields,
+ * each starting on a page boundary. Values are stored in the machine's byte order, so the file maps straight into
+ * memory with no parsing.
+ * Files are written to a temporary name and renamed over the old one, so a crash mid-write leaves the last complete
+ * checkpoint in place.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AlignedAllocator.h"
+
+/**
+ * @brief The version of the format written, files with any other version are rejected
+ */
+constexpr uint32_t c_checkpointVersion = 2;
+
+/**
+ * @brief The longest scalar channel name a checkpoint can hold
+ */
+constexpr size_t c_checkpointNameLength = 47;
+
+/**
+ * @brief A scalar channel of a CheckpointState. The previous field is the starting guess of the next diffusion, so
+ * both are kept for the restarted run to match one that never stopped.
+ */
+struct CheckpointScalar
+{
+    std::string name;
+    float diffusion = 0.0f;
+    std::vector<float> current;
+    std::vector<float> previous;
+};
+
+/**
+ * @brief Everything needed to restart a FluidGrid, filled by FluidGrid::capture
+ */
+struct CheckpointState
+{
+    size_t width = 0;
+    size_t height = 0;
+    float dt = 0.0f;
+    float viscosity = 0.0f;
+    uint64_t step = 0;
+    std::vector<float> velocityX;
+    std::vector<float> velocityY;
+    std::vector<float> velocityX0;
+    std::vector<float> velocityY0;
+    AlignedVector<float> x;
+    AlignedVector<float> y;
+    AlignedVector<float> dirX;
+    AlignedVector<float> dirY;
+    std::vector<CheckpointScalar> scalars;
+};
+
+/**
+ * @brief Write a checkpoint file, replacing any file already at _path once the new one is complete
+ *
+ * @param _error Receives the reason when the file cannot be written
+ * @return false if the file cannot be written, or a scalar channel name is longer than c_checkpointNameLength
+ */
+bool writeCheckpoint(const std::string &_path, const CheckpointState &_state, std::string *_error);
+
+/**
+ * @brief A checkpoint file mapped read-only into memory. The arrays are read straight from the mapping, so opening
+ * costs no more than checking the checksums, and pages are only read from disk as they are touched.
+ */
+class Checkpoint
+{
+public:
+    /**
+     * @brief The arrays stored in a checkpoint, in file order
+     */
+    enum class Array
+    {
+        VelocityX,
+        VelocityY,
+        VelocityX0,
+        VelocityY0,
+        ParticleX,
+        ParticleY,
+        ParticleDirX,
+        ParticleDirY
+    };
+    static constexpr size_t c_numArrays = 8;
+
+    Checkpoint() = default;
+    /**
+     * @brief Unmaps the file
+     */
+    ~Checkpoint();
+
+    Checkpoint(const Checkpoint &) = delete;
+    Checkpoint &operator=(const Checkpoint &) = delete;
+
+    /**
+     * @brief Map a checkpoint file and check its header, unmapping any file already open
+     *
+     * @param _error Receives the reason when the file is not a valid checkpoint
+     * @param _verify Also check the checksum of every array, which reads the whole file
+     * @return false if the file cannot be mapped or is not a valid checkpoint
+     */
+    bool open(const std::string &_path, std::string *_error, bool _verify = true);
+    /**
+     * @brief Unmap the file, invalidating every array pointer
+     */
+    void close();
+    /**
+     * @brief Whether a file is mapped
+     */
+    bool isOpen() const { return m_data != nullptr; }
+
+    /**
+     * @brief The number of cells along X, including the boundary
+     */
+    size_t width() const { return m_width; }
+    /**
+     * @brief The number of cells along Y, including the boundary
+     */
+    size_t height() const { return m_height; }
+    /**
+     * @brief The number of tracer particles
+     */
+    size_t numParticles() const { return m_numParticles; }
+    /**
+     * @brief The timestep of the saved run
+     */
+    float dt() const { return m_dt; }
+    /**
+     * @brief The viscosity of the saved run
+     */
+    float viscosity() const { return m_viscosity; }
+    /**
+     * @brief The number of steps taken when the checkpoint was captured
+     */
+    uint64_t step() const { return m_step; }
+    /**
+     * @brief An array of the checkpoint, pointing into the mapping so valid until close. Page aligned.
+     */
+    const float *data(Array _array) const { return m_arrays[static_cast<size_t>(_array)]; }
+    /**
+     * @brief The number of values in an array
+     */
+    size_t size(Array _array) const { return m_sizes[static_cast<size_t>(_array)]; }
+    /**
+     * @brief The number of scalar channels
+     */
+    size_t numScalars() const { return m_scalars.size(); }
+    /**
+     * @brief The name of a scalar channel
+     */
+    const std::string &scalarName(size_t _channel) const { return m_scalars[_channel].name; }
+    /**
+     * @brief The diffusion rate of a scalar channel
+     */
+    float scalarDiffusion(size_t _channel) const { return m_scalars[_channel].diffusion; }
+    /**
+     * @brief The current field of a scalar channel, width() * height() values pointing into the mapping. Page aligned.
+     */
+    const float *scalarCurrent(size_t _channel) const { return m_scalars[_channel].current; }
+    /**
+     * @brief The previous field of a scalar channel, see ScalarFields::previous
+     */
+    const float *scalarPrevious(size_t _channel) const { return m_scalars[_channel].previous; }
+
+private:
+    struct Scalar
+    {
+        std::string name;
+        float diffusion;
+        const float *current;
+        const float *previous;
+    };
+
+    void *m_data = nullptr;
+    size_t m_mappedSize = 0;
+
+    size_t m_width = 0;
+    size_t m_height = 0;
+    size_t m_numParticles = 0;
+    float m_dt = 0.0f;
+    float m_viscosity = 0.0f;
+    uint64_t m_step = 0;
+    std::array<const float *, c_numArrays> m_arrays{};
+    std::array<size_t, c_numArrays> m_sizes{};
+    std::vector<Scalar> m_scalars;
+};
+
+/**
+ * @brief Writes checkpoints on a background thread, so the simulation only pays for copying its state.
+ * There are two states to capture into, so one can be filled while the other is written. Capturing waits only when
+ * checkpoints are requested faster than they can be written.
+ */
+class CheckpointWriter
+{
+public:
+    /**
+     * @brief Construct a Checkpoint Writer and start its thread
+     */
+    CheckpointWriter();
+    /**
+     * @brief Finishes the submitted checkpoints and joins the thread
+     */
+    ~CheckpointWriter();
+
+    CheckpointWriter(const CheckpointWriter &) = delete;
+    CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+    /**
+     * @brief A state to capture the next checkpoint into, waiting for one to be free if needed. The arrays keep their
+     * capacity between checkpoints, so capturing the same grid again does not allocate.
+     */
+    CheckpointState &acquire();
+    /**
+     * @brief Write the state returned by the last acquire() to _path in the background
+     */
+    void submit(const std::string &_path);
+    /**
+     * @brief Wait for every submitted checkpoint to be written
+     *
+     * @param _error Receives the reason the last failed write failed
+     * @return false if any write failed since the last call
+     */
+    bool wait(std::string *_error);
+
+private:
+    enum class SlotState
+    {
+        Free,
+        Filling,
+        Queued,
+        Writing
+    };
+
+    struct Slot
+    {
+        CheckpointState state;
+        SlotState status = SlotState::Free;
+        std::string path;
+        uint64_t order = 0;
+    };
+
+    std::array<Slot, 2> m_slots;
+    uint64_t m_submitted = 0;
+    bool m_failed = false;
+    std::string m_error;
+    bool m_stop = false;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::thread m_thread;
+
+    void run();
+    bool idle() const;
+};
+
+#endif // !CHECKPOINT_H_
@@ -0,0 +1,61 @@
+/**
+ * @file ConjugateGradientSolver.h
+ * @brief Preconditioned conjugate gradient pressure solver with a Jacobi or modified incomplete Cholesky (MIC(0))
+ * preconditioner, stopping when the residual drops below the tolerance.
+ * The MIC(0) factor follows Bridson's "Fluid Simulation for Computer Graphics". Its triangular solves are sequential,
+ * the rest of the iteration is split across the Fluid's thread pool.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef CONJUGATE_GRADIENT_SOLVER_H_
+#define CONJUGATE_GRADIENT_SOLVER_H_
+
+#include "PressureSolver.h"
+#include "Workspace.h"
+
+class ConjugateGradientSolver : public PressureSolver
+{
+public:
+    /**
+     * @brief Construct a Conjugate Gradient Solver, allocating the work vectors and factorising the preconditioner
+     *
+     * @param _settings The tolerance, iteration cap and preconditioner
+     * @param _width The number of cells along X, including the boundary
+     * @param _height The number of cells along Y, including the boundary
+     * @param _pool The pool whose threads first write the work vectors, nullptr for the calling thread
+     */
+    ConjugateGradientSolver(const Settings &_settings, size_t _width, size_t _height, ThreadPool *_pool = nullptr);
+
+    int solve(Fluid &_fluid, float *_p, const float *_div) override;
+    void placeArrays(ThreadPool *_pool) override;
+    Type type() const override { return Type::ConjugateGradient; }
+
+private:
+    Settings m_settings;
+    size_t m_width;
+    size_t m_height;
+
+    // residual, preconditioned residual, search direction and the operator applied to the search direction, then
+    // the inverse diagonal for Jacobi or the MIC(0) factor with a zero boundary, and the row sums of dot
+    Workspace m_workspace;
+    float *m_r = nullptr;
+    float *m_z = nullptr;
+    float *m_s = nullptr;
+    float *m_q = nullptr;
+    float *m_precon = nullptr;
+    double *m_rowSums = nullptr;
+
+    void bindArrays();
+    void buildPreconditioner();
+    /**
+     * @brief _z = M^-1 _r
+     */
+    void applyPreconditioner(const Fluid &_fluid, const float *_r, float *_z);
+    /**
+     * @brief The diagonal of the operator, 4 less one for each neighbour that is boundary
+     */
+    float diagonal(size_t _i, size_t _j) const;
+};
+
+#endif // !CONJUGATE_GRADIENT_SOLVER_H_
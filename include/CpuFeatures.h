@@ -0,0 +1,36 @@
+/**
+ * @file CpuFeatures.h
+ * @brief Runtime detection of the vector instruction sets the solver kernels can use
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef CPU_FEATURES_H_
+#define CPU_FEATURES_H_
+
+/**
+ * @brief The widest vector instruction set a kernel may use, ordered from narrowest to widest
+ */
+enum class SimdLevel
+{
+    Scalar,
+    AVX2,
+    AVX512
+};
+
+/**
+ * @brief Query the CPU (and OS support for the wider registers) once and return the widest usable level
+ */
+SimdLevel detectSimdLevel();
+
+/**
+ * @brief Whether the CPU has the F16C half precision conversions, which AVX2 does not imply
+ */
+bool detectF16C();
+
+/**
+ * @brief Human readable name of a SIMD level, used for logging and benchmark labels
+ */
+const char *simdLevelName(SimdLevel _level);
+
+#endif // !CPU_FEATURES_H_
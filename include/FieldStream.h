@@ -0,0 +1,253 @@
+/**
+ * @file FieldStream.h
+ * @brief Writing a time series of grid fields to disk for offline analysis without slowing the solver, and reading
+ * it back.
+ * The solver copies each frame into one of a fixed pool of buffers and carries on. A background thread compresses
+ * and writes the queued frames. When every buffer is queued the writer either makes the solver wait or drops a
+ * frame, as configured, so a slow disk never stalls a step unless asked to.
+ * A stream file is a header naming the fields followed by one chunk per frame. Each field of a chunk can be XORed
+ * with the same field of the previous frame, which leaves mostly zero bits in a slowly changing field, and then
+ * compressed. Every keyframeInterval frames is stored without the delta so a reader can start there.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef FIELD_STREAM_H_
+#define FIELD_STREAM_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief The version of the stream format written, files with any other version are rejected
+ */
+constexpr uint32_t c_fieldStreamVersion = 1;
+
+/**
+ * @brief One frame of a field time series
+ */
+struct FieldFrame
+{
+    uint64_t step = 0;
+    /**
+     * @brief One array of width * height values per field
+     */
+    std::vector<std::vector<float>> fields;
+};
+
+class FieldWriter
+{
+public:
+    /**
+     * @brief How the frames are laid out on disk
+     */
+    enum class Format
+    {
+        // one stream file holding every frame, which can be compressed
+        Stream,
+        // one uncompressed file per frame, <path>_<step>.raw, holding each field in turn as 32 bit floats
+        RawFrames
+    };
+
+    /**
+     * @brief The lossless compression applied to each field of a stream. Shuffle is built in, it splits the floats
+     * into byte planes and run-length encodes the zero bytes. Zstd and LZ4 also shuffle first, and are only
+     * available when the library was built with them, see isSupported.
+     */
+    enum class Compression
+    {
+        None,
+        Shuffle,
+        Zstd,
+        LZ4
+    };
+
+    /**
+     * @brief What write does when every buffer is already queued
+     */
+    enum class FullPolicy
+    {
+        // wait for the writer to free a buffer
+        Block,
+        // drop the new frame
+        DropNewest,
+        // drop the oldest frame not yet being written and queue the new one
+        DropOldest
+    };
+
+    struct Settings
+    {
+        // the stream file, or the prefix of the raw frame files
+        std::string path;
+        Format format = Format::Stream;
+        Compression compression = Compression::None;
+        // XOR each field with the previous frame before compressing
+        bool delta = false;
+        // frames between frames stored without the delta
+        size_t keyframeInterval = 32;
+        // buffers in the pool, at least 2
+        size_t queueFrames = 4;
+        FullPolicy policy = FullPolicy::Block;
+        std::vector<std::string> fields = {"velocityX", "velocityY"};
+    };
+
+    /**
+     * @brief Construct a closed Field Writer
+     */
+    FieldWriter();
+    /**
+     * @brief Writes the queued frames and closes the file
+     */
+    ~FieldWriter();
+
+    FieldWriter(const FieldWriter &) = delete;
+    FieldWriter &operator=(const FieldWriter &) = delete;
+
+    /**
+     * @brief Whether this build of the library can write a compression
+     */
+    static bool isSupported(Compression _compression);
+
+    /**
+     * @brief Create the output, allocate the frame buffers and start the writer thread
+     *
+     * @param _width The number of cells along X of every field
+     * @param _height The number of cells along Y of every field
+     * @param _error Receives the reason when the output cannot be created
+     * @return false if the settings are not valid or the output cannot be created
+     */
+    bool open(size_t _width, size_t _height, const Settings &_settings, std::string *_error);
+    /**
+     * @brief Write every queued frame, stop the thread and close the file
+     *
+     * @param _error Receives the reason the first failed write failed
+     * @return false if any frame could not be written
+     */
+    bool close(std::string *_error);
+    /**
+     * @brief Whether the writer is open
+     */
+    bool isOpen() const { return m_thread.joinable(); }
+
+    /**
+     * @brief Copy a frame into a free buffer and queue it, without touching the disk. Each field must hold
+     * width * height values, one for each name in the settings.
+     *
+     * @return false if the frame was dropped because the queue was full
+     */
+    bool write(uint64_t _step, std::initializer_list<const float *> _fields);
+
+    /**
+     * @brief The number of frames written to disk so far
+     */
+    uint64_t framesWritten() const;
+    /**
+     * @brief The number of frames dropped because the queue was full
+     */
+    uint64_t framesDropped() const;
+
+private:
+    Settings m_settings;
+    size_t m_width = 0;
+    size_t m_height = 0;
+    FILE *m_file = nullptr;
+
+    std::vector<FieldFrame> m_frames;
+    // frame indices, the queue is a ring of m_queueCount indices starting at m_queueHead
+    std::vector<size_t> m_free;
+    std::vector<size_t> m_queue;
+    size_t m_queueHead = 0;
+    size_t m_queueCount = 0;
+
+    uint64_t m_written = 0;
+    uint64_t m_dropped = 0;
+    bool m_failed = false;
+    std::string m_error;
+    bool m_stop = false;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_queued;
+    std::condition_variable m_freed;
+    std::thread m_thread;
+
+    // only used by the writer thread
+    std::vector<std::vector<float>> m_previous;
+    std::vector<unsigned char> m_shuffled;
+    std::vector<unsigned char> m_encoded;
+    uint64_t m_framesSinceKey = 0;
+    struct Codec;
+    std::unique_ptr<Codec> m_codec;
+
+    void run();
+    bool writeFrame(const FieldFrame &_frame, std::string *_error);
+    bool writeRawFrame(const FieldFrame &_frame, std::string *_error);
+};
+
+/**
+ * @brief Reads back the frames of a stream written by FieldWriter
+ */
+class FieldStreamReader
+{
+public:
+    FieldStreamReader() = default;
+    /**
+     * @brief Closes the file
+     */
+    ~FieldStreamReader();
+
+    FieldStreamReader(const FieldStreamReader &) = delete;
+    FieldStreamReader &operator=(const FieldStreamReader &) = delete;
+
+    /**
+     * @brief Open a stream and read its header
+     *
+     * @return false if the file cannot be read or is not a stream this build can decompress
+     */
+    bool open(const std::string &_path, std::string *_error);
+    /**
+     * @brief Read the next frame
+     *
+     * @param _error Receives the reason when the frame is corrupt, and is cleared at the end of the stream
+     * @return false at the end of the stream or if the frame is corrupt
+     */
+    bool next(FieldFrame *_frame, std::string *_error);
+
+    /**
+     * @brief The number of cells along X of every field
+     */
+    size_t width() const { return m_width; }
+    /**
+     * @brief The number of cells along Y of every field
+     */
+    size_t height() const { return m_height; }
+    /**
+     * @brief The names of the fields, in the order they are stored in each frame
+     */
+    const std::vector<std::string> &fields() const { return m_fields; }
+    /**
+     * @brief The compression of the stream
+     */
+    FieldWriter::Compression compression() const { return m_compression; }
+
+private:
+    FILE *m_file = nullptr;
+    size_t m_width = 0;
+    size_t m_height = 0;
+    std::vector<std::string> m_fields;
+    FieldWriter::Compression m_compression = FieldWriter::Compression::None;
+    bool m_delta = false;
+
+    std::vector<std::vector<float>> m_previous;
+    std::vector<unsigned char> m_encoded;
+    std::vector<unsigned char> m_shuffled;
+};
+
+#endif // !FIELD_STREAM_H_
@@ -2,24 +2,40 @@
  * @file Fluid.h
  * @brief This class implements the methods from https://www.dgp.toronto.edu/public_user/stam/reality/Research/pdf/GDC03.pdf.
  * They are slightly modified versions of the originals, trying to use C++ syntax instead of C
- * 
+ *
  * @copyright Copyright (c) 2021
  */
 
 #ifndef FLUID_H_
 #define FLUID_H_
 
+#include <cstddef>
+#include <memory>
 #include <vector>
 
-const int c_iter = 4;
-const size_t c_size = 100;
+#include "CpuFeatures.h"
+#include "PressureSolver.h"
+#include "ThreadPool.h"
+#include "Workspace.h"
+
+class ActivityMask;
+
+/**
+ * @brief Default number of Gauss-Seidel sweeps used by linear_solve
+ */
+constexpr int c_defaultIterations = 4;
+
+/**
+ * @brief The fewest cells a grid can have along each axis, one interior cell between the two boundary layers
+ */
+constexpr size_t c_minGridSize = 3;
 
 class Fluid
 {
 public:
     /**
      * @brief Enum used to determine which boundary to set when set_boundary is called
-     * 
+     *
      */
     enum class Boundary
     {
@@ -29,43 +45,265 @@ public:
     };
 
     /**
-     * @brief Set the boundaries of the fluid grid so that all exterior velocities are the inverse of the next layer 
+     * @brief Enum used to choose how linear_solve orders its sweeps.
+     * GaussSeidel is the original in-place sweep, each cell reads its already updated neighbours so it can only run
+     * scalar. RedBlack updates the two colours of a checkerboard in turn and Jacobi only reads the previous sweep,
+     * so both of these vectorize.
+     */
+    enum class SolveMode
+    {
+        GaussSeidel,
+        RedBlack,
+        Jacobi
+    };
+
+    /**
+     * @brief Enum used to choose how advect moves the fields.
+     * SemiLagrangian is the bilinear back-trace of the paper, which blurs the field a little on every step.
+     * MacCormack traces the result forwards again and adds back half the error this shows, BFECC corrects the source
+     * by half the error and traces it once more. Both are second order, and limit each cell to the four values its
+     * back-trace sampled so they cannot overshoot.
+     */
+    enum class AdvectionScheme
+    {
+        SemiLagrangian,
+        MacCormack,
+        BFECC
+    };
+
+    /**
+     * @brief Construct a solver for a grid of the given size. The size includes the one cell boundary layer on each
+     * side, so the interior of the grid is (_width - 2) x (_height - 2) cells.
+     * Widths of 128, 256 and 512 use compile-time specialised kernels.
+     *
+     * @param _width The number of cells along X, at least c_minGridSize
+     * @param _height The number of cells along Y, at least c_minGridSize
+     * @param _iterations The number of sweeps used by linear_solve
+     * @throws std::invalid_argument if the grid is smaller than c_minGridSize along either axis
+     */
+    Fluid(size_t _width, size_t _height, int _iterations = c_defaultIterations);
+
+    /**
+     * @brief Set the boundaries of the fluid grid so that all exterior velocities are the inverse of the next layer
      * inside the grid.
      * This stops the fluid from "leaking" out of the grid.
      */
-    static void set_boundary(Boundary _b, std::vector<float> *_x);
+    void set_boundary(Boundary _b, std::vector<float> *_x) const;
     /**
-     * @brief Diffuse the velocities through the grid by precalculating a value and using the linear_solve function to 
+     * @brief Diffuse the velocities through the grid by precalculating a value and using the linear_solve function to
      * solve the partial differential equation
      */
-    static void diffuse(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _diff, float _dt);
+    void diffuse(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _diff, float _dt);
     /**
-     * @brief Advect the velocities through the grid by going to the previous iteration and following the velocity 
+     * @brief Advect the velocities through the grid by going to the previous iteration and following the velocity
      * backwards to find the affecting velocities, then calculates the weighted average and uses this new value.
      */
-    static void advect(Boundary _b, std::vector<float> *_d, std::vector<float> *_d0, std::vector<float> *_velocX, std::vector<float> *_velocY, float _dt);
+    void advect(Boundary _b, std::vector<float> *_d, std::vector<float> *_d0, std::vector<float> *_velocX, std::vector<float> *_velocY, float _dt) const;
+    /**
+     * @brief Advect several fields through the velocity in one pass, tracing each cell back once and interpolating
+     * every field at that point, rather than repeating the back-trace in one advect call per field. Each _d[n] is
+     * the result for _d0[n], with the boundary set as Boundary::None. The fields are raw arrays of numCells() values.
+     */
+    void advectFields(float *const *_d, const float *const *_d0, size_t _count, const float *_velocX,
+                      const float *_velocY, float _dt) const;
     /**
      * @brief Project the velocities making sure the fluid remains incompressible, fixing-up the data.
      */
-    static void project(std::vector<float> *_velocX, std::vector<float> *_velocY, std::vector<float> *_p, std::vector<float> *_div);
+    void project(std::vector<float> *_velocX, std::vector<float> *_velocY, std::vector<float> *_p, std::vector<float> *_div);
+
+    // The fused steps below do the same arithmetic as advect and project, so they give identical results, but make
+    // fewer passes over the grid and set the boundaries as each row is written instead of with set_boundary.
+    // All fields are raw arrays of numCells() values.
+
+    /**
+     * @brief The first half of project, the divergence of the velocity into _div and a zeroed pressure in _p, both
+     * with their boundaries set
+     */
+    void divergence(const float *_velocX, const float *_velocY, float *_p, float *_div) const;
+    /**
+     * @brief The pressure solve of project
+     */
+    void solvePressure(float *_p, const float *_div);
+    /**
+     * @brief The last half of project, subtracting the pressure gradient from the velocity and setting the X and Y
+     * boundaries in the same pass
+     */
+    void subtractGradient(float *_velocX, float *_velocY, const float *_p) const;
+    /**
+     * @brief Advect both velocity components through themselves in one pass, sharing the back-trace, and set their
+     * boundaries. The divergence of the result and a zeroed pressure for the following project are written in the
+     * same pass, a row behind the advection while the rows are still in cache.
+     */
+    void advectVelocity(float *_velocX, float *_velocY, const float *_velocX0, const float *_velocY0, float _dt,
+                        float *_p, float *_div);
+    /**
+     * @brief Solve the partial differential equation with the given sweep ordering, overriding the solver's mode for
+     * this one solve
+     */
+    void linear_solve(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _a, float _c, SolveMode _mode);
     /**
      * @brief Converts XY coordinates into an index of a 1D array
      */
-    static size_t IX(size_t _x, size_t _y)
+    size_t IX(size_t _x, size_t _y) const
+    {
+        return _x + _y * m_width;
+    }
+    /**
+     * @brief The number of cells along X, including the boundary
+     */
+    size_t width() const { return m_width; }
+    /**
+     * @brief The number of cells along Y, including the boundary
+     */
+    size_t height() const { return m_height; }
+    /**
+     * @brief The total number of cells, the size every field passed to the solver must have
+     */
+    size_t numCells() const { return m_width * m_height; }
+    /**
+     * @brief The number of sweeps used by linear_solve
+     */
+    int iterations() const { return m_iterations; }
+    /**
+     * @brief Set the number of sweeps used by linear_solve
+     */
+    void setIterations(int _iterations) { m_iterations = _iterations; }
+    /**
+     * @brief The number of sweeps linear_solve runs over a few rows at a time, see setSweepsPerTile
+     */
+    int sweepsPerTile() const { return m_sweepsPerTile; }
+    /**
+     * @brief Run up to this many sweeps of linear_solve as a wavefront, each sweep a row or two behind the last, so
+     * a row is swept that many times while it is in cache instead of once per pass over the grid. Worth it once the
+     * fields no longer fit in cache. Every cell reads the same values either way, so results do not change.
+     * 1 runs each sweep over the whole grid.
+     */
+    void setSweepsPerTile(int _sweeps) { m_sweepsPerTile = _sweeps > 1 ? _sweeps : 1; }
+    /**
+     * @brief The sweep ordering used by diffuse and project
+     */
+    SolveMode solveMode() const { return m_solveMode; }
+    /**
+     * @brief Set the sweep ordering used by diffuse and project
+     */
+    void setSolveMode(SolveMode _mode) { m_solveMode = _mode; }
+    /**
+     * @brief The scheme used by advect and advectFields
+     */
+    AdvectionScheme advectionScheme() const { return m_advectionScheme; }
+    /**
+     * @brief Set the scheme used by advect and advectFields. MacCormack takes two passes over the grid and BFECC three,
+     * rather than one, but keep far more detail. advectVelocity is always semi-Lagrangian.
+     */
+    void setAdvectionScheme(AdvectionScheme _scheme) { m_advectionScheme = _scheme; }
+    /**
+     * @brief The widest SIMD instruction set the kernels will use
+     */
+    SimdLevel simdLevel() const { return m_simdLevel; }
+    /**
+     * @brief Limit the SIMD instruction set the kernels use, levels the CPU does not support fall back to the widest
+     * supported one. Defaults to the widest level the CPU supports.
+     */
+    void setSimdLevel(SimdLevel _level) { m_simdLevel = _level; }
+    /**
+     * @brief Split the row loops of the solver across a thread pool, nullptr runs them on the calling thread.
+     * Every row is computed the same way whichever thread runs it, so results do not depend on the thread count.
+     * Gauss-Seidel sweeps always run on one thread as their result depends on the order cells are visited.
+     * The solver's scratch fields move onto pages first written by the pool's threads.
+     */
+    void setThreadPool(ThreadPool *_pool);
+    /**
+     * @brief Replace the pressure solver used by project. Defaults to relaxation with the solver's sweep ordering
+     * and iteration count, as in the paper.
+     */
+    void setPressureSolver(const PressureSolver::Settings &_settings);
+    /**
+     * @brief The pressure solver used by project, to read back its iteration count and residual
+     */
+    const PressureSolver &pressureSolver() const { return *m_pressureSolver; }
+    /**
+     * @brief Only update the cells of the active tiles of a mask in advect, project and linear_solve, nullptr updates
+     * every cell. Every field passed in must be zero in the inactive tiles, see ActivityMask. While a mask is set
+     * linear_solve does not tile its sweeps, and the fused methods still cover the whole grid.
+     */
+    void setActivityMask(const ActivityMask *_mask) { m_mask = _mask; }
+    /**
+     * @brief Zero the tiles of the solver's own scratch fields that went inactive in the last update of the mask
+     */
+    void clearDeactivated();
+
+    /**
+     * @brief Run _fn(first, last) over the rows [_begin, _end), split across the thread pool if there is one
+     */
+    template <typename Fn>
+    void parallelRows(size_t _begin, size_t _end, Fn &&_fn) const
     {
-        return _x + _y * c_size;
+        if (m_pool != nullptr)
+        {
+            m_pool->parallelFor(_begin, _end, _fn);
+        }
+        else
+        {
+            _fn(_begin, _end);
+        }
     }
+
+    /**
+     * @brief set_boundary on a raw field of numCells() values
+     */
+    void set_boundary(Boundary _b, float *_x) const;
+    /**
+     * @brief Solve the partial differential equation using the chosen sweep ordering, on raw fields of numCells()
+     * values. Used by the pressure solvers.
+     */
+    void linear_solve(Boundary _b, float *_x, const float *_x0, float _a, float _c, SolveMode _mode);
+    /**
+     * @brief diffuse on raw fields of numCells() values with the given sweep ordering
+     */
+    void diffuse(Boundary _b, float *_x, const float *_x0, float _diff, float _dt, SolveMode _mode);
+    /**
+     * @brief advect on raw fields of numCells() values
+     */
+    void advect(Boundary _b, float *_d, const float *_d0, const float *_velocX, const float *_velocY, float _dt) const;
+    /**
+     * @brief project on raw fields of numCells() values
+     */
+    void project(float *_velocX, float *_velocY, float *_p, float *_div);
+
 private:
+    size_t m_width;
+    size_t m_height;
+    int m_iterations;
+    SolveMode m_solveMode = SolveMode::GaussSeidel;
+    AdvectionScheme m_advectionScheme = AdvectionScheme::SemiLagrangian;
+    SimdLevel m_simdLevel;
+    int m_sweepsPerTile = 1;
+    ThreadPool *m_pool = nullptr;
+    std::unique_ptr<PressureSolver> m_pressureSolver;
+    const ActivityMask *m_mask = nullptr;
+
+    /**
+     * @brief Second buffers for Jacobi sweeps, which cannot update in place. One for X and one for Y.
+     * advectVelocity also uses them for the rows each thread recomputes from its neighbours, and the higher order
+     * advection schemes for the field they trace back.
+     */
+    Workspace m_workspace;
+    float *m_scratch[2] = {nullptr, nullptr};
     /**
-     * @brief This class is static so don't allow construction
+     * @brief Rows each thread sweeps into when linear_solve is tiled, one for X and one for Y as with m_scratch.
+     * Allocated by the first tiled solve, and again only if a later one needs more rows.
      */
-    Fluid() {}
+    Workspace m_tileScratch[2];
+    size_t m_tileScratchSize[2] = {0, 0};
 
+    float *tileScratch(size_t _index, size_t _count);
     /**
-     * @brief Solve the partial differential equation using Gauss-Seidel reduction
-     * 
+     * @brief Apply the MacCormack or BFECC correction to _d, which holds the semi-Lagrangian advection of _d0 with its
+     * boundary set, tracing back into _scratch
      */
-    static void linear_solve(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _a, float _c);
+    void correctAdvection(Boundary _b, float *_d, const float *_d0, float *_scratch, const float *_velocX,
+                          const float *_velocY, float _dt) const;
+    void linearSolveTiled(Boundary _b, float *_x, const float *_x0, float _a, float _cRecip, SolveMode _mode);
 };
 
-#endif // !FLUID_H_
\ No newline at end of file
+#endif // !FLUID_H_
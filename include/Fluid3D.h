@@ -0,0 +1,191 @@
+/**
+ * @file Fluid3D.h
+ * @brief The methods of Fluid extended to a 3D grid for volumetric scenes, following the 3D version of the solver in
+ * https://www.dgp.toronto.edu/public_user/stam/reality/Research/pdf/GDC03.pdf.
+ * Fields are stored X fastest, then Y, then Z, so every row of a slice is contiguous and the same SIMD row kernels and
+ * thread pool as the 2D solver apply. The relaxation sweeps visit the grid in slabs of rows running through every
+ * slice, sized so the three slices of a slab the 7-point stencil reads stay in cache.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef FLUID_3D_H_
+#define FLUID_3D_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "CpuFeatures.h"
+#include "Fluid.h"
+#include "ThreadPool.h"
+#include "Workspace.h"
+
+class Fluid3D
+{
+public:
+    /**
+     * @brief Enum used to determine which boundary to set when set_boundary is called
+     */
+    enum class Boundary
+    {
+        None,
+        X,
+        Y,
+        Z
+    };
+
+    /**
+     * @brief The sweep orderings of linear_solve, as for the 2D solver
+     */
+    using SolveMode = Fluid::SolveMode;
+
+    /**
+     * @brief Construct a solver for a grid of the given size. The size includes the one cell boundary layer on each
+     * side, so the interior of the grid is (_width - 2) x (_height - 2) x (_depth - 2) cells.
+     *
+     * @param _width The number of cells along X, at least c_minGridSize
+     * @param _height The number of cells along Y, at least c_minGridSize
+     * @param _depth The number of cells along Z, at least c_minGridSize
+     * @param _iterations The number of sweeps used by linear_solve
+     * @throws std::invalid_argument if the grid is smaller than c_minGridSize along any axis
+     */
+    Fluid3D(size_t _width, size_t _height, size_t _depth, int _iterations = c_defaultIterations);
+
+    /**
+     * @brief Set the boundaries of the fluid grid so that all exterior velocities are the inverse of the next layer
+     * inside the grid. Edges are the average of the two face cells next to them and corners of the three edge cells.
+     */
+    void set_boundary(Boundary _b, std::vector<float> *_x) const;
+    /**
+     * @brief Diffuse the velocities through the grid using linear_solve
+     */
+    void diffuse(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _diff, float _dt);
+    /**
+     * @brief Advect a field through the grid by following the velocity backwards from each cell and trilinearly
+     * interpolating the previous field there
+     */
+    void advect(Boundary _b, std::vector<float> *_d, std::vector<float> *_d0, std::vector<float> *_velocX,
+                std::vector<float> *_velocY, std::vector<float> *_velocZ, float _dt) const;
+    /**
+     * @brief Project the velocities making sure the fluid remains incompressible. The pressure is solved by
+     * relaxation with the solver's sweep ordering.
+     */
+    void project(std::vector<float> *_velocX, std::vector<float> *_velocY, std::vector<float> *_velocZ,
+                 std::vector<float> *_p, std::vector<float> *_div);
+    /**
+     * @brief Solve the partial differential equation of the 7-point stencil with the given sweep ordering
+     */
+    void linear_solve(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _a, float _c, SolveMode _mode);
+    /**
+     * @brief Converts XYZ coordinates into an index of a 1D array
+     */
+    size_t IX(size_t _x, size_t _y, size_t _z) const
+    {
+        return _x + (_y + _z * m_height) * m_width;
+    }
+    /**
+     * @brief The number of cells along X, including the boundary
+     */
+    size_t width() const { return m_width; }
+    /**
+     * @brief The number of cells along Y, including the boundary
+     */
+    size_t height() const { return m_height; }
+    /**
+     * @brief The number of cells along Z, including the boundary
+     */
+    size_t depth() const { return m_depth; }
+    /**
+     * @brief The total number of cells, the size every field passed to the solver must have
+     */
+    size_t numCells() const { return m_width * m_height * m_depth; }
+    /**
+     * @brief The number of sweeps used by linear_solve
+     */
+    int iterations() const { return m_iterations; }
+    /**
+     * @brief Set the number of sweeps used by linear_solve
+     */
+    void setIterations(int _iterations) { m_iterations = _iterations; }
+    /**
+     * @brief The sweep ordering used by diffuse and project
+     */
+    SolveMode solveMode() const { return m_solveMode; }
+    /**
+     * @brief Set the sweep ordering used by diffuse and project
+     */
+    void setSolveMode(SolveMode _mode) { m_solveMode = _mode; }
+    /**
+     * @brief The widest SIMD instruction set the kernels will use
+     */
+    SimdLevel simdLevel() const { return m_simdLevel; }
+    /**
+     * @brief Limit the SIMD instruction set the kernels use, as Fluid::setSimdLevel
+     */
+    void setSimdLevel(SimdLevel _level) { m_simdLevel = _level; }
+    /**
+     * @brief The number of rows of a slab the relaxation sweeps run through every slice
+     */
+    size_t slabRows() const { return m_slabRows; }
+    /**
+     * @brief Set the number of rows in a slab, 0 picks the most that keep three slices of a slab in cache.
+     * Red-black and Jacobi sweeps give the same result for any slab size.
+     */
+    void setSlabRows(size_t _rows);
+    /**
+     * @brief Split the slice and slab loops of the solver across a thread pool, nullptr runs them on the calling
+     * thread. Results do not depend on the thread count, Gauss-Seidel sweeps always run on one thread.
+     * The scratch fields move onto pages first written by the pool's threads, a slice at a time.
+     */
+    void setThreadPool(ThreadPool *_pool);
+
+    /**
+     * @brief Run _fn(first, last) over the range [_begin, _end), split across the thread pool if there is one
+     */
+    template <typename Fn>
+    void parallelRows(size_t _begin, size_t _end, Fn &&_fn) const
+    {
+        if (m_pool != nullptr)
+        {
+            m_pool->parallelFor(_begin, _end, _fn);
+        }
+        else
+        {
+            _fn(_begin, _end);
+        }
+    }
+
+    /**
+     * @brief set_boundary on a raw field of numCells() values
+     */
+    void set_boundary(Boundary _b, float *_x) const;
+    /**
+     * @brief linear_solve on raw fields of numCells() values
+     */
+    void linear_solve(Boundary _b, float *_x, const float *_x0, float _a, float _c, SolveMode _mode);
+
+private:
+    size_t m_width;
+    size_t m_height;
+    size_t m_depth;
+    int m_iterations;
+    SolveMode m_solveMode = SolveMode::GaussSeidel;
+    SimdLevel m_simdLevel;
+    // 0 until set, then the rows per slab asked for
+    size_t m_requestedSlabRows = 0;
+    size_t m_slabRows = 1;
+    ThreadPool *m_pool = nullptr;
+
+    /**
+     * @brief Second buffers for Jacobi sweeps, which cannot update in place. One for each velocity component, so
+     * their diffusions can run concurrently.
+     */
+    Workspace m_workspace;
+    float *m_scratch[3] = {nullptr, nullptr, nullptr};
+
+    void bindScratch();
+
+    void updateSlabRows();
+};
+
+#endif // !FLUID_3D_H_
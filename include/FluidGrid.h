@@ -1,89 +1,379 @@
 /**
  * @file FluidGrid.h
- * @brief This class uses the Fluid solver and the NGL particle system to display a fluid to a screen
- * 
+ * @brief This class holds the state of a fluid simulation using the Fluid solver and moves tracer particles
+ * through the velocity field. It has no OpenGL or Qt dependencies, drawing is done by ParticleRenderer in the demo.
+ *
  * @copyright Copyright (c) 2021
  */
 
 #ifndef FLUID_GRID_H_
 #define FLUID_GRID_H_
 
+#include <cstdint>
+#include <memory>
+#include <string>
 #include <vector>
 
-#include <ngl/AbstractVAO.h>
-#include <ngl/Vec2.h>
-#include <ngl/Vec3.h>
-
+#include "ActivityMask.h"
 #include "Fluid.h"
+#include "ImpulseQueue.h"
+#include "ParticleSystem.h"
+#include "Profiler.h"
+#include "ScalarFields.h"
+#include "ThreadPool.h"
+#include "Workspace.h"
+
+class Checkpoint;
+struct CheckpointState;
 
 class FluidGrid
 {
 public:
+    /**
+     * @brief Force along +Y from scalar channels, lift * temperature - weight * density per unit time, so hot fluid
+     * rises and dense fluid sinks. Temperature is taken relative to the ambient fluid, which is 0.
+     */
+    struct Buoyancy
+    {
+        // channel holding the temperature, npos turns buoyancy off
+        size_t temperature = ScalarFields::npos;
+        float lift = 0.0f;
+        // channel holding the density, npos for none
+        size_t density = ScalarFields::npos;
+        float weight = 0.0f;
+    };
+
+    /**
+     * @brief How step picks its time step from the speed of the fluid. The speed is found after the impulses are
+     * added at the start of each step, so a strong impulse shortens the step it is added in.
+     */
+    struct TimeStepping
+    {
+        enum class Mode
+        {
+            // one step of the grid's dt
+            Fixed,
+            // one step of the dt that moves the fastest fluid cfl cells, kept within [minDt, maxDt]
+            Adaptive,
+            // the grid's dt split into as many equal sub-steps as keep the fastest fluid under cfl cells each
+            SubSteps
+        };
+
+        Mode mode = Mode::Fixed;
+        // the most cells the fastest fluid may cross in one step or sub-step
+        float cfl = 1.0f;
+        float minDt = 0.0f;
+        float maxDt = 1.0f;
+        int maxSubSteps = 8;
+    };
+
     /**
      * @brief Construct a Fluid Grid
      * 
+     * @param _width The number of cells along X, including the boundary
+     * @param _height The number of cells along Y, including the boundary
      * @param _viscosity The viscosity of the fluid
      * @param _dt The timestep of each iteration
+     * @param _numParticles The number of tracer particles, 0 places one on every cell
      */
-    FluidGrid(float _viscosity, float _dt);
+    FluidGrid(size_t _width, size_t _height, float _viscosity, float _dt, size_t _numParticles = 0);
     /**
-     * @brief Step through one iteration of the solver
+     * @brief Step through one iteration of the solver, which is split into sub-steps when the time stepping asks for
+     * them. The queued impulses are added first and the particles are moved last, once per step. Every field lives
+     * in workspaces allocated up front, so once the first step has sized the solver's scratch a step makes no heap
+     * allocations, see lastStepAllocations.
      * 
      */
     void step();
     /**
      * @brief Add velocity to the grid
      * 
-     * @param _pos The position to add velocity
-     * @param _v The velocity vector
+     * @param _x The cell along X to add velocity to, clamped to the grid
+     * @param _y The cell along Y to add velocity to, clamped to the grid
+     * @param _vx The velocity along X
+     * @param _vy The velocity along Y
      */
-    void addVelocity(ngl::Vec2 _pos, ngl::Vec2 _v);
+    void addVelocity(float _x, float _y, float _vx, float _vy);
+    /**
+     * @brief Queue impulses, velocity splatted around points, to be added at the start of the next step before
+     * anything else runs. Use this rather than addVelocity for brushes and for many emitters, the whole batch is
+     * splatted in one pass split across the threads. Adding the same impulses gives the same result for any thread
+     * count.
+     */
+    void addImpulses(const Impulse *_impulses, size_t _count) { m_impulses.add(_impulses, _count); }
+    /**
+     * @brief Add the queued impulses to the velocity now, the first stage of step
+     */
+    void applyImpulses();
     /**
      * @brief Reset the grid to default
      * 
      */
     void reset()
     {
+        m_impulses.clear();
         resetVelocities();
-        initGrid();
+        m_scalars.clear();
+        m_particles.seed();
     }
     /**
-     * @brief Draw the grid
-     * 
+     * @brief Add a passive scalar channel, such as dye density or temperature, carried by the fluid from the next
+     * step. Every channel is advected in the same pass over the grid, sharing the back-trace of each cell.
+     *
+     * @param _name The name of the channel, see getScalars
+     * @param _diffusion The rate the channel diffuses through the fluid at, 0 only advects it
+     * @return The index of the channel
+     */
+    size_t addScalar(const std::string &_name, float _diffusion = 0.0f);
+    /**
+     * @brief Add an amount of a scalar to a cell
+     *
+     * @param _channel The index returned by addScalar
+     * @param _x The cell along X, clamped to the grid
+     * @param _y The cell along Y, clamped to the grid
      */
-    void draw() const;
+    void addScalarSource(size_t _channel, float _x, float _y, float _amount);
+    /**
+     * @brief The scalar channels, read their current fields
+     */
+    const ScalarFields &getScalars() const { return m_scalars; }
+    /**
+     * @brief Push the fluid along Y with its temperature and density channels before each step. While sparse the
+     * force only acts in the active tiles, adding a scalar to a cell activates its tile.
+     */
+    void setBuoyancy(const Buoyancy &_buoyancy) { m_buoyancy = _buoyancy; }
+    /**
+     * @brief Copy everything needed to restart the simulation into a state to write as a checkpoint. The state's
+     * arrays keep their capacity, so capturing into the same state again does not allocate.
+     *
+     * @param _step The number of steps taken so far, stored in the checkpoint
+     */
+    void capture(CheckpointState *_state, uint64_t _step) const;
+    /**
+     * @brief Continue from a checkpoint, taking its velocities, particles, scalar fields and diffusion rates, dt and
+     * viscosity. The solver settings, which checkpoints do not hold, are kept.
+     *
+     * @param _error Receives the reason when the checkpoint is for a different grid size or particle count, or has
+     * other scalar channels than the grid, which must be added with the checkpoint's names in its order first
+     * @return false if the checkpoint does not match the grid, which is then unchanged
+     */
+    bool restore(const Checkpoint &_checkpoint, std::string *_error);
     /**
      * @brief Get the Num Particles object
      * 
      * @return size_t 
      */
-    size_t getNumParticles() const { return m_numParticles; }
+    size_t getNumParticles() const { return m_particles.size(); }
+    /**
+     * @brief The tracer particles
+     */
+    const ParticleSystem &getParticles() const { return m_particles; }
+    /**
+     * @brief The X velocity field, numCells() values
+     */
+    const float *getVelocityX() const { return m_Vx; }
+    /**
+     * @brief The Y velocity field, numCells() values
+     */
+    const float *getVelocityY() const { return m_Vy; }
+    /**
+     * @brief The number of cells in each field, including the boundary
+     */
+    size_t numCells() const { return m_fluid.numCells(); }
+    /**
+     * @brief The heap allocations made while the last step ran, by any thread, in builds where
+     * Workspace::countsHeapAllocations. 0 once the first step has run unless something else was allocating.
+     */
+    size_t lastStepAllocations() const { return m_stepAllocations; }
+    /**
+     * @brief The number of cells along X, including the boundary
+     */
+    size_t width() const { return m_fluid.width(); }
+    /**
+     * @brief The number of cells along Y, including the boundary
+     */
+    size_t height() const { return m_fluid.height(); }
+    /**
+     * @brief Set the number of solver sweeps used for diffusion and projection
+     */
+    void setIterations(int _iterations)
+    {
+        m_iterations = _iterations;
+        m_fluid.setIterations(_iterations);
+    }
+    /**
+     * @brief The number of solver sweeps the next step uses, fewer than set while a frame budget is cutting them
+     */
+    int iterations() const { return m_fluid.iterations(); }
+    /**
+     * @brief Set how step picks its time step, see TimeStepping. Fixed steps give the same results as before.
+     */
+    void setTimeStepping(const TimeStepping &_stepping) { m_stepping = _stepping; }
+    /**
+     * @brief Keep each step under a wall clock budget. After every step its measured time per sub-step caps the
+     * sub-steps of the next, and when a single sub-step is over budget the solver sweeps are cut, coming back one at
+     * a time while there is room. Results then depend on the speed of the machine. 0 turns the budget off and
+     * restores the sweeps.
+     */
+    void setFrameBudget(double _milliseconds);
+    /**
+     * @brief The time step of each sub-step of the last step
+     */
+    float lastDt() const { return m_stepDt; }
+    /**
+     * @brief The number of sub-steps the last step was split into
+     */
+    int lastSubSteps() const { return m_subSteps; }
+    /**
+     * @brief The speed of the fastest fluid at the start of the last step, in cells per unit time, 0 with fixed
+     * steps which do not measure it
+     */
+    float lastSpeed() const { return m_speed; }
+    /**
+     * @brief Set the sweep ordering used for diffusion and projection
+     */
+    void setSolveMode(Fluid::SolveMode _mode) { m_fluid.setSolveMode(_mode); }
+    /**
+     * @brief Set the number of solver sweeps run on a few rows at a time while they are in cache, see
+     * Fluid::setSweepsPerTile
+     */
+    void setSweepsPerTile(int _sweeps) { m_fluid.setSweepsPerTile(_sweeps); }
+    /**
+     * @brief Set the scheme used to advect the velocity and the scalar channels, see Fluid::AdvectionScheme. The
+     * higher order schemes keep enough detail to match the semi-Lagrangian step on a grid of twice the resolution.
+     */
+    void setAdvectionScheme(Fluid::AdvectionScheme _scheme) { m_fluid.setAdvectionScheme(_scheme); }
+    /**
+     * @brief Set the solver used for the pressure in the projection steps
+     */
+    void setPressureSolver(const PressureSolver::Settings &_settings) { m_fluid.setPressureSolver(_settings); }
+    /**
+     * @brief The solver used for the pressure, to read back its iteration count and residual
+     */
+    const PressureSolver &pressureSolver() const { return m_fluid.pressureSolver(); }
+    /**
+     * @brief Run step with the fused kernels, which advect both velocity components in one pass, compute the
+     * divergence as the advection writes each row, and set boundaries inline. Results are identical either way,
+     * the fused step just makes fewer passes over the grid. The fused kernels are only used with semi-Lagrangian
+     * advection.
+     */
+    void setFused(bool _fused);
+    /**
+     * @brief Whether step uses the fused kernels
+     */
+    bool isFused() const { return m_fused; }
+    /**
+     * @brief Only step the 16x16 tiles holding moving fluid and a halo around them, so the cost of a step follows
+     * the area of moving fluid instead of the size of the grid. A tile goes inactive when its velocities fall to the
+     * activity threshold, and they are then set to zero, so results differ slightly from the dense step. The fused kernels
+     * are not used while sparse.
+     */
+    void setSparse(bool _sparse);
+    /**
+     * @brief Whether step only updates the active tiles
+     */
+    bool isSparse() const { return m_mask != nullptr; }
+    /**
+     * @brief Set the fraction of the fastest velocity in the grid above which a tile is active, see setSparse
+     */
+    void setActivityThreshold(float _threshold) { m_activityThreshold = _threshold; }
+    /**
+     * @brief Set the number of tiles around each moving tile that are also updated, far enough that fluid cannot
+     * leave the active tiles in one step
+     */
+    void setActivityHalo(size_t _tiles) { m_activityHalo = _tiles; }
+    /**
+     * @brief The tiles step updates, nullptr when not sparse
+     */
+    const ActivityMask *activityMask() const { return m_mask.get(); }
+    /**
+     * @brief Set the number of threads used by step. 1 runs everything on the calling thread, 0 uses every core.
+     * The workers are created here and reused by every step, and every field moves onto pages first written by the
+     * workers that will sweep it. Results are the same for any thread count.
+     */
+    void setThreadCount(size_t _numThreads);
+    /**
+     * @brief The number of threads used by step, including the calling thread
+     */
+    size_t getThreadCount() const { return m_pool ? m_pool->numThreads() : 1; }
+    /**
+     * @brief Move the particles through the current velocity field, the last stage of step
+     */
+    void updateParticles();
+    /**
+     * @brief Time each stage of step into a profiler, nullptr turns the timing off. The profiler must outlive the grid
+     * or be unset first.
+     */
+    void setProfiler(Profiler *_profiler) { m_profiler = _profiler; }
+    /**
+     * @brief Also write the particles to these arrays whenever they are updated, so a snapshot of them is filled
+     * without a second pass over the particles. nullptr stops the extra writes. The arrays must hold
+     * getNumParticles() values and stay valid until replaced.
+     */
+    void setParticleMirror(const ParticleArrays *_mirror) { m_particleMirror = _mirror; }
 
 private:
+    std::unique_ptr<ThreadPool> m_pool;
+    Fluid m_fluid;
+    Profiler *m_profiler = nullptr;
+
     float m_dt;
     float m_diff;
     float m_visc;
 
-    std::vector<float> m_Vx;
-    std::vector<float> m_Vy;
+    TimeStepping m_stepping;
+    // the dt and number of sub-steps of the current or last step, and the speed they were picked from
+    float m_stepDt;
+    int m_subSteps = 1;
+    float m_speed = 0.0f;
+    // the largest speed in each row, reduced to the grid's speed after the rows are scanned in parallel
+    std::vector<float> m_rowSpeeds;
+    int m_iterations = c_defaultIterations;
+    double m_frameBudget = 0.0;
+    // the measured wall clock time of one sub-step in milliseconds, 0 until a step has been timed
+    double m_subStepTime = 0.0;
 
-    std::vector<float> m_Vx0;
-    std::vector<float> m_Vy0;
+    /**
+     * @brief Every field of the grid. The fused step swaps the previous velocities with its pressure and divergence,
+     * so the arrays each field is in are tracked to find them again when the workspace moves.
+     */
+    Workspace m_workspace;
+    // the arrays holding Vx, Vy, Vx0, Vy0, pressure and divergence, the last two only once fused
+    size_t m_arrays[6];
+    float *m_Vx = nullptr;
+    float *m_Vy = nullptr;
 
-    size_t m_numParticles;
+    float *m_Vx0 = nullptr;
+    float *m_Vy0 = nullptr;
 
-    std::unique_ptr<ngl::AbstractVAO> m_vao;
-    GLuint m_svao;
-    GLuint m_vboID;
+    bool m_fused = false;
+    /**
+     * @brief Pressure and divergence for the second projection of the fused step, which cannot reuse m_Vx0 and m_Vy0
+     * as they are still being advected from. Added to the workspace the first time the grid is fused.
+     */
+    float *m_pressure = nullptr;
+    float *m_divergence = nullptr;
+    size_t m_stepAllocations = 0;
 
-    std::vector<ngl::Vec3> m_pos;
-    std::vector<ngl::Vec3> m_dir;
+    ImpulseQueue m_impulses;
+    ParticleSystem m_particles;
+    const ParticleArrays *m_particleMirror = nullptr;
 
-    void initGrid();
-    void resetVelocities();
+    ScalarFields m_scalars;
+    Buoyancy m_buoyancy;
+    // the fields advectFields writes and reads, sized as channels are added so a step does not allocate
+    std::vector<float *> m_scalarTargets;
+    std::vector<const float *> m_scalarSources;
 
-    void resetParticle(size_t i, size_t j);
-    void updateParticles();
+    std::unique_ptr<ActivityMask> m_mask;
+    float m_activityThreshold = c_defaultActivityThreshold;
+    size_t m_activityHalo = 1;
+
+    void bindFields();
+    void resetVelocities();
+    void updateActivity();
+    void applyBuoyancy();
+    void stepScalars();
 
     void diffuseX();
     void diffuseY();
@@ -91,6 +381,28 @@ private:
     void advectX();
     void advectY();
     void projectBackwards();
+    float maxSpeed();
+    void planStep();
+    void fitBudget(double _milliseconds);
+    void stepSeparate();
+    void stepFused();
+
+    /**
+     * @brief Run two independent stages, concurrently when there is a thread pool
+     */
+    template <typename A, typename B>
+    void runPair(A &&_a, B &&_b)
+    {
+        if (m_pool)
+        {
+            m_pool->parallelInvoke(_a, _b);
+        }
+        else
+        {
+            _a();
+            _b();
+        }
+    }
 };
 
 #endif // !FLUID_GRID_H_
\ No newline at end of file
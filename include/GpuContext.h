@@ -0,0 +1,49 @@
+/**
+ * @file GpuContext.h
+ * @brief A GL 4.3 core context with no window, made with EGL on Mesa's surfaceless platform, so the compute backend
+ * can run in the headless runner and on CI machines with no display. Without a GPU driver Mesa falls back to the
+ * llvmpipe software rasterizer, which runs the same shaders on the CPU.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef GPU_CONTEXT_H_
+#define GPU_CONTEXT_H_
+
+#include <string>
+
+class GpuContext
+{
+public:
+    GpuContext() = default;
+    /**
+     * @brief Releases the context if one was created
+     */
+    ~GpuContext();
+
+    GpuContext(const GpuContext &) = delete;
+    GpuContext &operator=(const GpuContext &) = delete;
+
+    /**
+     * @brief Create the context and make it current on the calling thread
+     *
+     * @param _error Set to the reason when no context could be created
+     * @return Whether the context was created
+     */
+    bool create(std::string *_error);
+    /**
+     * @brief Whether create succeeded
+     */
+    bool isCreated() const { return m_context != nullptr; }
+    /**
+     * @brief The name of the renderer the context runs on, such as llvmpipe
+     */
+    std::string renderer() const;
+
+private:
+    // the EGLDisplay and EGLContext, kept as pointers so users of the class do not need the EGL headers
+    void *m_display = nullptr;
+    void *m_context = nullptr;
+};
+
+#endif // !GPU_CONTEXT_H_
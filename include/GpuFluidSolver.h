@@ -0,0 +1,150 @@
+/**
+ * @file GpuFluidSolver.h
+ * @brief The velocity solve and tracer particles of a FluidGrid run as GL compute shaders, with every field kept in
+ * shader storage buffers on the GPU. The particles are written straight into a buffer laid out as the renderer reads
+ * them, so drawing a step needs no copies back to the CPU.
+ * The shaders do the same arithmetic in the same order as the CPU solver with red-black sweeps, marked precise so
+ * the compiler cannot fuse multiply-adds, and follow it closely enough to compare the two, see the headless runner's
+ * compare backend. Buoyancy, scalar channels, impulses, sparse stepping and the multigrid and CG pressure solvers
+ * stay on the CPU.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef GPU_FLUID_SOLVER_H_
+#define GPU_FLUID_SOLVER_H_
+
+#include <array>
+#include <cstddef>
+#include <string>
+
+#include "Fluid.h"
+
+class GpuFluidSolver
+{
+public:
+    /**
+     * @brief Construct a solver for a grid of the given size. Nothing is created on the GPU until create is called.
+     *
+     * @param _width The number of cells along X, including the boundary
+     * @param _height The number of cells along Y, including the boundary
+     * @param _viscosity The viscosity of the fluid
+     * @param _dt The timestep of each iteration
+     * @param _numParticles The number of tracer particles, 0 places one on every cell
+     */
+    GpuFluidSolver(size_t _width, size_t _height, float _viscosity, float _dt, size_t _numParticles = 0);
+    /**
+     * @brief Releases the buffers and programs, the context they were created in must be current
+     */
+    ~GpuFluidSolver();
+
+    GpuFluidSolver(const GpuFluidSolver &) = delete;
+    GpuFluidSolver &operator=(const GpuFluidSolver &) = delete;
+
+    /**
+     * @brief Compile the shaders and create the buffers in the current context, which must support GL 4.3, and reset
+     * the grid. Every other call needs the same context current on the calling thread.
+     *
+     * @param _error Set to the reason, such as a compile log, when the solver cannot be created
+     * @return Whether the solver was created
+     */
+    bool create(std::string *_error);
+    /**
+     * @brief Whether create succeeded
+     */
+    bool isCreated() const { return m_programs[0] != 0; }
+
+    /**
+     * @brief Step through one iteration of the solver and move the particles, as FluidGrid::step does
+     */
+    void step();
+    /**
+     * @brief Add velocity to a cell, as FluidGrid::addVelocity
+     */
+    void addVelocity(float _x, float _y, float _vx, float _vy);
+    /**
+     * @brief Zero the velocity and put the particles back at their starting positions, as FluidGrid::reset
+     */
+    void reset();
+    /**
+     * @brief Set the number of red-black sweeps used for diffusion and projection
+     */
+    void setIterations(int _iterations) { m_iterations = _iterations; }
+
+    /**
+     * @brief Wait for every queued step to finish on the GPU, to time them
+     */
+    void finish() const;
+    /**
+     * @brief Copy the velocity back to the CPU, each array holds numCells() values. Waits for the GPU to finish.
+     */
+    void readVelocity(float *_velocX, float *_velocY) const;
+    /**
+     * @brief Copy the particles back to the CPU, each array holds numParticles() values. Waits for the GPU to finish.
+     */
+    void readParticles(float *_x, float *_y, float *_dirX, float *_dirY) const;
+    /**
+     * @brief The buffer holding the particles as four arrays of numParticles() floats, x, y, dirX then dirY, the
+     * layout ParticleRenderer draws from. Every step writes to it, so draws after a step see the new positions.
+     */
+    unsigned int particleBuffer() const { return m_particles; }
+
+    /**
+     * @brief The number of cells along X, including the boundary
+     */
+    size_t width() const { return m_width; }
+    /**
+     * @brief The number of cells along Y, including the boundary
+     */
+    size_t height() const { return m_height; }
+    /**
+     * @brief The total number of cells of each velocity field
+     */
+    size_t numCells() const { return m_width * m_height; }
+    /**
+     * @brief The number of tracer particles
+     */
+    size_t numParticles() const { return m_numParticles; }
+
+private:
+    /**
+     * @brief The compute programs, one per kernel
+     */
+    enum Program
+    {
+        SetBoundary,
+        RedBlack,
+        Advect,
+        Divergence,
+        SubtractGradient,
+        AddVelocity,
+        AdvectParticles,
+        NumPrograms
+    };
+
+    size_t m_width;
+    size_t m_height;
+    float m_visc;
+    float m_dt;
+    size_t m_numParticles;
+    int m_iterations = c_defaultIterations;
+
+    std::array<unsigned int, NumPrograms> m_programs{};
+    // Vx, Vy, Vx0 and Vy0, used in the same roles as the fields of FluidGrid
+    std::array<unsigned int, 4> m_fields{};
+    unsigned int m_particles = 0;
+
+    void seedParticles();
+    void setBoundary(Fluid::Boundary _b, unsigned int _x);
+    void linearSolve(Fluid::Boundary _b, unsigned int _x, unsigned int _x0, float _a, float _c);
+    void diffuse(Fluid::Boundary _b, unsigned int _x, unsigned int _x0);
+    void advect(Fluid::Boundary _b, unsigned int _d, unsigned int _d0, unsigned int _velocX, unsigned int _velocY);
+    void project(unsigned int _velocX, unsigned int _velocY, unsigned int _p, unsigned int _div);
+    void advectParticles();
+    /**
+     * @brief Run one program over the interior cells, with a barrier so the next dispatch sees what it wrote
+     */
+    void dispatchInterior(size_t _columns);
+};
+
+#endif // !GPU_FLUID_SOLVER_H_
@@ -0,0 +1,159 @@
+/**
+ * @file HalfPrecision.h
+ * @brief 16 bit storage formats for fields, IEEE half precision and bfloat16, with conversions to and from float.
+ * Fields are only stored in these formats, every calculation converts them to float first. Half keeps 11 bits of
+ * precision over a range of about 6e-5 to 65504, bfloat16 keeps the range of float with 8 bits of precision.
+ * Both round to nearest even when converted from float. The row conversions have scalar, AVX2 with F16C and AVX-512
+ * versions selected at runtime, which give identical results.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef HALF_PRECISION_H_
+#define HALF_PRECISION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "CpuFeatures.h"
+#include "StencilKernels.h"
+
+/**
+ * @brief An IEEE 754 binary16 value
+ */
+struct Half
+{
+    uint16_t bits;
+};
+
+/**
+ * @brief The top 16 bits of a float
+ */
+struct BFloat16
+{
+    uint16_t bits;
+};
+
+inline float toFloat(float _value)
+{
+    return _value;
+}
+
+inline float toFloat(Half _value)
+{
+    const uint32_t sign = static_cast<uint32_t>(_value.bits & 0x8000u) << 16;
+    const uint32_t magnitude = _value.bits & 0x7fffu;
+    uint32_t bits;
+    if (magnitude >= 0x7c00u)
+    {
+        // infinity, or a NaN made quiet and keeping its payload, as F16C does
+        bits = sign | 0x7f800000u | ((magnitude & 0x3ffu) << 13);
+        if (magnitude > 0x7c00u)
+        {
+            bits |= 0x400000u;
+        }
+    }
+    else if (magnitude >= 0x400u)
+    {
+        // rebias the exponent from 15 to 127
+        bits = sign | ((magnitude << 13) + 0x38000000u);
+    }
+    else
+    {
+        // zero or subnormal, a whole number of 2^-24 which float holds exactly
+        const float value = static_cast<float>(magnitude) * 5.9604644775390625e-8f;
+        std::memcpy(&bits, &value, sizeof(bits));
+        bits |= sign;
+    }
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline float toFloat(BFloat16 _value)
+{
+    const uint32_t bits = static_cast<uint32_t>(_value.bits) << 16;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Round a float to a storage format, to nearest even
+ */
+template <typename T>
+T fromFloat(float _value);
+
+template <>
+inline float fromFloat<float>(float _value)
+{
+    return _value;
+}
+
+template <>
+inline Half fromFloat<Half>(float _value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &_value, sizeof(bits));
+    const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000u);
+    uint32_t magnitude = bits & 0x7fffffffu;
+    if (magnitude >= 0x7f800000u)
+    {
+        // infinity, or a quiet NaN keeping the top of its payload
+        const uint32_t nan = magnitude > 0x7f800000u ? 0x200u | ((magnitude >> 13) & 0x3ffu) : 0u;
+        return Half{static_cast<uint16_t>(sign | 0x7c00u | nan)};
+    }
+    if (magnitude >= 0x47800000u)
+    {
+        // 65536 and above overflow, anything from 65520 overflows when rounded below
+        return Half{static_cast<uint16_t>(sign | 0x7c00u)};
+    }
+    if (magnitude < 0x38800000u)
+    {
+        // below the smallest normal half, adding 0.5 lines the subnormal's bits up with the bottom of the mantissa
+        // and rounds them to nearest even as the float add does
+        float value;
+        std::memcpy(&value, &magnitude, sizeof(value));
+        value += 0.5f;
+        std::memcpy(&magnitude, &value, sizeof(magnitude));
+        return Half{static_cast<uint16_t>(sign | (magnitude - 0x3f000000u))};
+    }
+    // rebias the exponent from 127 to 15 and round the 13 dropped bits, ties going to the even mantissa
+    const uint32_t odd = (magnitude >> 13) & 1u;
+    magnitude += 0xc8000fffu + odd;
+    return Half{static_cast<uint16_t>(sign | (magnitude >> 13))};
+}
+
+template <>
+inline BFloat16 fromFloat<BFloat16>(float _value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &_value, sizeof(bits));
+    if ((bits & 0x7fffffffu) > 0x7f800000u)
+    {
+        // keep NaNs NaN, rounding could carry a small payload into infinity
+        return BFloat16{static_cast<uint16_t>((bits >> 16) | 0x40u)};
+    }
+    bits += 0x7fffu + ((bits >> 16) & 1u);
+    return BFloat16{static_cast<uint16_t>(bits >> 16)};
+}
+
+/**
+ * @brief Convert _count consecutive values of a row between a storage format and float
+ */
+struct ConversionKernels
+{
+    void (*halfToFloat)(const Half *FLUID_RESTRICT _src, float *FLUID_RESTRICT _dst, size_t _count);
+    void (*floatToHalf)(const float *FLUID_RESTRICT _src, Half *FLUID_RESTRICT _dst, size_t _count);
+    void (*bfloat16ToFloat)(const BFloat16 *FLUID_RESTRICT _src, float *FLUID_RESTRICT _dst, size_t _count);
+    void (*floatToBFloat16)(const float *FLUID_RESTRICT _src, BFloat16 *FLUID_RESTRICT _dst, size_t _count);
+};
+
+/**
+ * @brief Get the conversions for a SIMD level. Levels the CPU does not support fall back to the widest one it does,
+ * and the AVX2 half conversions also need F16C.
+ */
+const ConversionKernels &conversionKernels(SimdLevel _level);
+
+#endif // !HALF_PRECISION_H_
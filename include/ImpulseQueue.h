@@ -0,0 +1,94 @@
+/**
+ * @file ImpulseQueue.h
+ * @brief Impulses queued for a grid and splatted into its velocity field in one parallel pass, for brushes and
+ * emitters that add velocity around many points each frame.
+ * The queued impulses are binned into bands of rows, and each band adds every impulse overlapping it in the order they
+ * were queued. A band is only ever written by one thread, so there are no atomics or per-thread copies to reduce,
+ * and the sum in every cell is the same whatever the number of threads.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef IMPULSE_QUEUE_H_
+#define IMPULSE_QUEUE_H_
+
+#include <cstddef>
+#include <vector>
+
+class ActivityMask;
+class ThreadPool;
+
+/**
+ * @brief Velocity added around a point. Positions are in cells, with cell i at x = i as in advect.
+ */
+struct Impulse
+{
+    float x = 0.0f;
+    float y = 0.0f;
+    float vx = 0.0f;
+    float vy = 0.0f;
+    // the radius of a Gaussian splat in cells, which adds the whole velocity at the centre and fades out to three
+    // radii away. 0 splits the velocity bilinearly between the four cells around the point.
+    float radius = 0.0f;
+};
+
+class ImpulseQueue
+{
+public:
+    /**
+     * @brief The rows in each band, the same as the tiles of an ActivityMask
+     */
+    static constexpr size_t c_bandRows = 16;
+
+    /**
+     * @brief Construct an empty queue for a grid of the given size, including the boundary
+     */
+    ImpulseQueue(size_t _width, size_t _height);
+
+    /**
+     * @brief Queue impulses. Points are clamped to the interior of the grid. The storage grows to the largest batch
+     * queued and is kept, so queueing as many again does not allocate.
+     */
+    void add(const Impulse *_impulses, size_t _count);
+    /**
+     * @brief Drop the queued impulses
+     */
+    void clear();
+    /**
+     * @brief The number of queued impulses
+     */
+    size_t size() const { return m_impulses.size(); }
+    /**
+     * @brief Whether nothing is queued
+     */
+    bool empty() const { return m_impulses.empty(); }
+    /**
+     * @brief Add every queued impulse to the interior of the velocity fields and empty the queue. The bands are
+     * split across the pool, nullptr runs them on the calling thread.
+     *
+     * @param _mask The active tiles of a sparse grid, which gain the tiles the impulses touch, or nullptr
+     */
+    void apply(float *_velocX, float *_velocY, ThreadPool *_pool, ActivityMask *_mask);
+
+private:
+    /**
+     * @brief The interior cells [i0, i1) x [j0, j1) an impulse adds to
+     */
+    struct Footprint
+    {
+        size_t i0, i1, j0, j1;
+    };
+
+    size_t m_width;
+    size_t m_height;
+    std::vector<Impulse> m_impulses;
+    std::vector<Footprint> m_footprints;
+    // the impulses overlapping band b are m_bandImpulses[m_bandStarts[b]] up to m_bandStarts[b + 1]
+    std::vector<size_t> m_bandStarts;
+    std::vector<size_t> m_bandImpulses;
+
+    void binByBand();
+    void splatBand(size_t _band, float *_velocX, float *_velocY) const;
+};
+
+#endif // !IMPULSE_QUEUE_H_
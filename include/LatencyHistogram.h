@@ -0,0 +1,75 @@
+/**
+ * @file LatencyHistogram.h
+ * @brief A lock-free histogram of durations in nanoseconds, used to report percentiles of the solver stages.
+ * Buckets are log-linear, 16 per power of two, so any recorded value is known to within 1/16 of itself. Recording is
+ * a few relaxed atomic increments and never allocates, so any number of threads can record at once.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef LATENCY_HISTOGRAM_H_
+#define LATENCY_HISTOGRAM_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    LatencyHistogram(const LatencyHistogram &) = delete;
+    LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+    /**
+     * @brief Add one duration
+     */
+    void record(uint64_t _nanoseconds);
+    /**
+     * @brief Forget every recorded duration. Not safe while other threads are recording.
+     */
+    void reset();
+
+    /**
+     * @brief The number of recorded durations
+     */
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    /**
+     * @brief The sum of the recorded durations
+     */
+    uint64_t total() const { return m_total.load(std::memory_order_relaxed); }
+    /**
+     * @brief The longest recorded duration
+     */
+    uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+    /**
+     * @brief The mean of the recorded durations, 0 when there are none
+     */
+    double mean() const;
+    /**
+     * @brief The duration _quantile of the recorded durations are at or below, e.g. 0.99 for p99.
+     * Reported as the upper edge of its bucket, capped at the maximum. 0 when nothing has been recorded.
+     */
+    uint64_t percentile(double _quantile) const;
+
+private:
+    static constexpr int c_subBucketBits = 4;
+    static constexpr size_t c_subBuckets = size_t{1} << c_subBucketBits;
+    // values below c_subBuckets get a bucket each, every power of two above gets c_subBuckets
+    static constexpr size_t c_numBuckets = (64 - c_subBucketBits + 1) * c_subBuckets;
+
+    std::array<std::atomic<uint64_t>, c_numBuckets> m_buckets;
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_total{0};
+    std::atomic<uint64_t> m_max{0};
+
+    static size_t bucketIndex(uint64_t _value);
+    /**
+     * @brief The largest value that falls in a bucket
+     */
+    static uint64_t bucketUpperBound(size_t _index);
+};
+
+#endif // !LATENCY_HISTOGRAM_H_
@@ -0,0 +1,156 @@
+/**
+ * @file MixedPrecisionFluid.h
+ * @brief The velocity step of FluidGrid with the velocity fields stored in a 16 bit format, to halve the memory
+ * traffic of the passes that are limited by it.
+ * Storage is float, Half or BFloat16. Every pass converts the rows it reads into float buffers a block at a time,
+ * computes them exactly as Fluid does and rounds the results back into the storage format, so arithmetic is always
+ * float and only the stored values lose precision. The pressure and divergence stay float and the pressure solve is
+ * Fluid's, so projection is as accurate as the velocities it is given. With float storage nothing is converted and
+ * each stage gives the same result as Fluid's with Jacobi sweeps and semi-Lagrangian advection.
+ * Scalar channels such as dye are stored in the same format and carried by the velocity as FluidGrid carries its
+ * channels, sampling the stored values of the last step directly when advected.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef MIXED_PRECISION_FLUID_H_
+#define MIXED_PRECISION_FLUID_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "Fluid.h"
+#include "HalfPrecision.h"
+#include "Workspace.h"
+
+template <typename Storage>
+class MixedPrecisionFluid
+{
+public:
+    /**
+     * @brief Construct the fields for a grid of the given size, including its boundary layer, and add the small
+     * initial velocity FluidGrid starts with
+     *
+     * @param _iterations The number of Jacobi sweeps used by diffuse and the relaxation pressure solve
+     */
+    MixedPrecisionFluid(size_t _width, size_t _height, float _viscosity, float _dt,
+                        int _iterations = c_defaultIterations);
+
+    /**
+     * @brief Diffuse, project, advect and project the velocity, then diffuse and advect the scalar channels through
+     * it, in the order of FluidGrid::step
+     */
+    void step();
+    /**
+     * @brief Add velocity to the cell containing a point, clamped inside the grid
+     */
+    void addVelocity(float _x, float _y, float _vx, float _vy);
+    /**
+     * @brief Add a scalar channel with both of its fields zeroed. Adding a channel moves the storage, so pointers
+     * to the fields are no longer valid.
+     *
+     * @param _diffusion The rate the channel diffuses through the fluid at, 0 only advects it
+     * @return The index of the new channel
+     */
+    size_t addScalar(float _diffusion);
+    /**
+     * @brief Add to a scalar channel at the cell containing a point, clamped inside the grid
+     */
+    void addScalarSource(size_t _channel, float _x, float _y, float _amount);
+    /**
+     * @brief Copy the current field of a scalar channel out as floats, numCells() values
+     */
+    void readScalar(size_t _channel, float *_values) const;
+    /**
+     * @brief Zero the velocity and add the initial velocity again
+     */
+    void reset();
+    /**
+     * @brief Copy the velocity out as floats, each field numCells() values
+     */
+    void readVelocity(float *_velocX, float *_velocY) const;
+
+    /**
+     * @brief diffuse of Fluid with Jacobi sweeps, on fields in the storage format
+     */
+    void diffuse(Fluid::Boundary _b, Storage *_x, const Storage *_x0, float _diff, float _dt);
+    /**
+     * @brief Semi-Lagrangian advect of Fluid, on fields in the storage format
+     */
+    void advect(Fluid::Boundary _b, Storage *_d, const Storage *_d0, const Storage *_velocX, const Storage *_velocY,
+                float _dt) const;
+    /**
+     * @brief project of Fluid, with the velocity in the storage format and the pressure and divergence in float
+     */
+    void project(Storage *_velocX, Storage *_velocY);
+    /**
+     * @brief set_boundary of Fluid on a field in the storage format, computed in float
+     */
+    void set_boundary(Fluid::Boundary _b, Storage *_x) const;
+
+    /**
+     * @brief Split the row loops across a thread pool, nullptr runs them on the calling thread. Results do not depend
+     * on the thread count. The fields move onto pages first written by the pool's threads.
+     */
+    void setThreadPool(ThreadPool *_pool);
+    /**
+     * @brief Replace the pressure solver used by project, see Fluid::setPressureSolver
+     */
+    void setPressureSolver(const PressureSolver::Settings &_settings) { m_fluid.setPressureSolver(_settings); }
+    /**
+     * @brief Limit the SIMD instruction set of the stencil and conversion kernels
+     */
+    void setSimdLevel(SimdLevel _level);
+
+    const Storage *velocityX() const { return m_Vx; }
+    const Storage *velocityY() const { return m_Vy; }
+    size_t numScalars() const { return m_scalars.size(); }
+    /**
+     * @brief The current field of a scalar channel in the storage format
+     */
+    const Storage *scalar(size_t _channel) const { return m_workspace.array<Storage>(m_scalars[_channel].current); }
+    size_t width() const { return m_fluid.width(); }
+    size_t height() const { return m_fluid.height(); }
+    size_t numCells() const { return m_fluid.numCells(); }
+    /**
+     * @brief The solver doing the pressure solve, to read back its iteration count and residual
+     */
+    const Fluid &fluid() const { return m_fluid; }
+
+private:
+    Fluid m_fluid;
+    float m_visc;
+    float m_dt;
+
+    Workspace m_workspace;
+    size_t m_arrays[7] = {};
+    Storage *m_Vx = nullptr;
+    Storage *m_Vy = nullptr;
+    Storage *m_Vx0 = nullptr;
+    Storage *m_Vy0 = nullptr;
+    /**
+     * @brief The second field Jacobi sweeps write into
+     */
+    Storage *m_scratch = nullptr;
+    float *m_pressure = nullptr;
+    float *m_divergence = nullptr;
+
+    struct ScalarChannel
+    {
+        float diffusion;
+        // workspace arrays of the two fields, which the stages swap
+        size_t current;
+        size_t previous;
+    };
+    std::vector<ScalarChannel> m_scalars;
+    ThreadPool *m_pool = nullptr;
+
+    void bindFields();
+    void stepScalars();
+};
+
+extern template class MixedPrecisionFluid<float>;
+extern template class MixedPrecisionFluid<Half>;
+extern template class MixedPrecisionFluid<BFloat16>;
+
+#endif // !MIXED_PRECISION_FLUID_H_
@@ -0,0 +1,82 @@
+/**
+ * @file MultigridSolver.h
+ * @brief Geometric multigrid pressure solver. Runs V-cycles with red-black Gauss-Seidel smoothing until the residual
+ * drops below the tolerance.
+ * Each coarser level halves the interior in both directions (rounding up), so any grid size works.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef MULTIGRID_SOLVER_H_
+#define MULTIGRID_SOLVER_H_
+
+#include "PressureSolver.h"
+#include "Workspace.h"
+
+class MultigridSolver : public PressureSolver
+{
+public:
+    /**
+     * @brief Construct a Multigrid Solver and allocate every level
+     *
+     * @param _settings The tolerance and V-cycle cap
+     * @param _width The number of cells along X, including the boundary
+     * @param _height The number of cells along Y, including the boundary
+     * @param _pool The pool whose threads first write the levels, nullptr for the calling thread
+     */
+    MultigridSolver(const Settings &_settings, size_t _width, size_t _height, ThreadPool *_pool = nullptr);
+
+    int solve(Fluid &_fluid, float *_p, const float *_div) override;
+    void placeArrays(ThreadPool *_pool) override;
+    Type type() const override { return Type::Multigrid; }
+
+    /**
+     * @brief The number of levels, including the finest
+     */
+    size_t numLevels() const { return m_levels.size(); }
+
+private:
+    struct Level
+    {
+        // size including the one cell boundary
+        size_t width;
+        size_t height;
+        // solution, right hand side and residual, the finest level solves straight into the caller's pressure
+        float *u;
+        float *f;
+        float *r;
+        // index of u in the workspace, f and r follow it
+        size_t firstArray;
+    };
+
+    Settings m_settings;
+    std::vector<Level> m_levels;
+    // every level's arrays and the row sums of dot
+    Workspace m_workspace;
+    double *m_rowSums = nullptr;
+
+    void bindArrays();
+    /**
+     * @brief One V-cycle starting at _level, solving for _u
+     */
+    void vCycle(Fluid &_fluid, size_t _level, float *_u);
+    void smooth(Fluid &_fluid, const Level &_level, float *_u, int _sweeps) const;
+    /**
+     * @brief Compute the residual of _u on _fine and restrict it onto the right hand side of _coarse. Each coarse cell
+     * is the sum of the fine residuals it covers, the average scaled by 4 for the doubled spacing, with the cells
+     * missing from an odd-sized level counted as zero so the coarse problem keeps a zero mean.
+     */
+    void restrictResidual(Fluid &_fluid, Level &_fine, float *_u, Level &_coarse) const;
+    /**
+     * @brief Add the bilinearly interpolated correction of _coarse to _u on _fine
+     */
+    void prolongAndCorrect(Fluid &_fluid, const Level &_fine, Level &_coarse, float *_u) const;
+
+    /**
+     * @brief Split rows across the Fluid's thread pool, small levels stay on the calling thread
+     */
+    template <typename Fn>
+    void levelRows(const Fluid &_fluid, const Level &_level, Fn &&_fn) const;
+};
+
+#endif // !MULTIGRID_SOLVER_H_
@@ -2,13 +2,17 @@
 #define NGLSCENE_H_
 
 #include "FluidGrid.h"
+#include "GpuFluidSolver.h"
+#include "ParticleRenderer.h"
+#include "Profiler.h"
+#include "SimulationThread.h"
 #include "WindowParams.h"
 
 #include <QOpenGLWindow>
-#include <deque>
+#include <chrono>
 #include <memory>
-#include <ngl/AbstractVAO.h>
 #include <ngl/Mat4.h>
+#include <string>
 #include <ngl/Text.h>
 #include <ngl/Vec3.h>
 
@@ -30,9 +34,16 @@ class NGLScene : public QOpenGLWindow
 public:
   //----------------------------------------------------------------------------------------------------------------------
   /// @brief ctor for our NGL drawing class
-  /// @param [in] parent the parent window to the class
+  /// @param [in] _gridWidth the number of fluid cells along X
+  /// @param [in] _gridHeight the number of fluid cells along Y
+  /// @param [in] _numThreads the number of threads the solver uses, 0 for every core
+  /// @param [in] _numParticles the number of tracer particles, 0 for one on every cell
+  /// @param [in] _pressureSolver the solver used for the pressure in the projection steps
+  /// @param [in] _stepsPerSecond how often the simulation thread steps, 0 for as fast as it can
+  /// @param [in] _gpu solve with compute shaders in the window's context rather than on the simulation thread
   //----------------------------------------------------------------------------------------------------------------------
-  NGLScene();
+  NGLScene(size_t _gridWidth, size_t _gridHeight, size_t _numThreads, size_t _numParticles,
+           const PressureSolver::Settings &_pressureSolver, double _stepsPerSecond, bool _gpu);
   //----------------------------------------------------------------------------------------------------------------------
   /// @brief dtor must close down ngl and release OpenGL resources
   //----------------------------------------------------------------------------------------------------------------------
@@ -103,13 +114,61 @@ private:
   //----------------------------------------------------------------------------------------------------------------------
   void wheelEvent(QWheelEvent *_event) override;
   void timerEvent(QTimerEvent *) override;
-  
-  std::unique_ptr<FluidGrid> m_fluidGrid;
+  //----------------------------------------------------------------------------------------------------------------------
+  /// @brief height of the camera above the grid, scaled so the whole grid is in view
+  //----------------------------------------------------------------------------------------------------------------------
+  float cameraHeight() const;
+  //----------------------------------------------------------------------------------------------------------------------
+  /// @brief far clipping plane, pushed back for large grids
+  //----------------------------------------------------------------------------------------------------------------------
+  float farPlane() const;
+  //----------------------------------------------------------------------------------------------------------------------
+  /// @brief draw every this many particles, more than one when zoomed out far enough that several fall on each pixel
+  //----------------------------------------------------------------------------------------------------------------------
+  size_t particleStride() const;
+
+  //----------------------------------------------------------------------------------------------------------------------
+  /// @brief the resolution of the fluid grid
+  //----------------------------------------------------------------------------------------------------------------------
+  size_t m_gridWidth;
+  size_t m_gridHeight;
+  size_t m_numThreads;
+  size_t m_numParticles;
+  PressureSolver::Settings m_pressureSolver;
+  double m_stepsPerSecond;
+  //----------------------------------------------------------------------------------------------------------------------
+  /// @brief per stage timings of the solver and the particle upload, [P] saves them
+  //----------------------------------------------------------------------------------------------------------------------
+  Profiler m_profiler;
+  //----------------------------------------------------------------------------------------------------------------------
+  /// @brief steps the fluid grid on its own thread, frames are read from it and input is queued to it
+  //----------------------------------------------------------------------------------------------------------------------
+  std::unique_ptr<SimulationThread> m_simulation;
+  std::unique_ptr<ParticleRenderer> m_renderer;
+  //----------------------------------------------------------------------------------------------------------------------
+  /// @brief the shader the particles are drawn with, and whether it drops particles outside the view, [C] toggles it
+  //----------------------------------------------------------------------------------------------------------------------
+  std::string m_particleShader;
+  bool m_cull = true;
+  //----------------------------------------------------------------------------------------------------------------------
+  /// @brief the compute shader solver used instead of the simulation thread when asked for, stepped before each
+  /// paint so its particles are drawn straight from its buffer
+  //----------------------------------------------------------------------------------------------------------------------
+  bool m_useGpu;
+  std::unique_ptr<GpuFluidSolver> m_gpu;
+  std::chrono::steady_clock::time_point m_nextGpuStep;
+  //----------------------------------------------------------------------------------------------------------------------
+  /// @brief step the compute shader solver if a step is due
+  //----------------------------------------------------------------------------------------------------------------------
+  void stepGpu();
   //----------------------------------------------------------------------------------------------------------------------
   /// @brief text renderer
   //----------------------------------------------------------------------------------------------------------------------
   std::unique_ptr<ngl::Text> m_text;
-  std::deque<long> m_updateTime;
+  //----------------------------------------------------------------------------------------------------------------------
+  /// @brief write the profile as profile.csv, profile.json and profile.trace.json in the working directory
+  //----------------------------------------------------------------------------------------------------------------------
+  void saveProfile() const;
 };
 
 #endif
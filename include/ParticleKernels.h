@@ -0,0 +1,51 @@
+/**
+ * @file ParticleKernels.h
+ * @brief Unchecked kernels that move structure-of-arrays particles through a velocity field, with scalar, AVX2 and
+ * AVX-512 versions selected at runtime.
+ * Each particle moves by 0.2 of the mean velocity of the 4 cells around it, wraps to the other side when it leaves
+ * [0, width - 1) x [0, height - 1), and stores half the unit direction of that velocity for drawing.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef PARTICLE_KERNELS_H_
+#define PARTICLE_KERNELS_H_
+
+#include <cstddef>
+
+#include "CpuFeatures.h"
+#include "StencilKernels.h"
+
+/**
+ * @brief Pointers to the four particle arrays, none of which may overlap
+ */
+struct ParticleArrays
+{
+    float *x = nullptr;
+    float *y = nullptr;
+    float *dirX = nullptr;
+    float *dirY = nullptr;
+};
+
+struct ParticleKernels
+{
+    /**
+     * @brief Move _count particles. Every position must be inside the wrap range, which every update keeps it in.
+     *
+     * @param _particles The particles, updated in place
+     * @param _mirror nullptr, or arrays that also receive every updated value, such as a mapped GPU buffer.
+     * They are only written, so write-combined memory is fine.
+     * @param _width The number of cells along X of the velocity fields, also their row stride
+     * @param _height The number of cells along Y of the velocity fields
+     */
+    void (*advect)(const ParticleArrays &_particles, const ParticleArrays *_mirror, size_t _count,
+                   const float *_velocX, const float *_velocY, size_t _width, size_t _height);
+};
+
+/**
+ * @brief Get the kernels for a SIMD level. Levels the CPU does not support fall back to the widest one it does.
+ * All levels do the same operations in the same order, so they give identical results.
+ */
+const ParticleKernels &particleKernels(SimdLevel _level);
+
+#endif // !PARTICLE_KERNELS_H_
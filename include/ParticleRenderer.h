@@ -0,0 +1,101 @@
+/**
+ * @file ParticleRenderer.h
+ * @brief This class owns the OpenGL buffers used to draw the particles of a simulation frame, so the simulation itself
+ * does not need a GL context.
+ * On GL 4.4 and later the particles go into a persistently mapped buffer split into three slots. Each frame is
+ * written to one slot while the GPU may still be drawing another, and fences stop a slot being rewritten before
+ * the GPU has finished with it, so there is no driver side copy or synchronisation per frame. Older contexts
+ * fall back to copying the particles with glBufferSubData.
+ * The renderer can also draw from a buffer written on the GPU, such as the particles of a GpuFluidSolver, which never
+ * pass through the CPU at all.
+ * On GL 4.3 and later the particles are pulled from the buffer by the PosDirPull vertex shader, bound as a shader
+ * storage buffer, and drawn as lines two vertices a particle with no vertex attributes or geometry shader, which can
+ * also skip particles when they are too dense to see. Older contexts draw points through the PosDir shaders.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef PARTICLE_RENDERER_H_
+#define PARTICLE_RENDERER_H_
+
+#include <array>
+
+#include <ngl/Types.h>
+
+#include "SimulationThread.h"
+
+class ParticleRenderer
+{
+public:
+    /**
+     * @brief Construct a Particle Renderer sized for the particles of a frame, needs a current GL context
+     *
+     * @param _frame The first frame to draw, later frames must have the same number of particles
+     */
+    explicit ParticleRenderer(const SimulationFrame &_frame);
+    /**
+     * @brief Construct a Particle Renderer that draws a buffer someone else writes and owns, holding four arrays of
+     * _numParticles floats, x, y, dirX then dirY. Nothing is uploaded, so upload must not be called.
+     */
+    ParticleRenderer(GLuint _buffer, size_t _numParticles);
+    /**
+     * @brief Releases the GL buffers and fences, other than a buffer it was given to draw
+     */
+    ~ParticleRenderer();
+
+    ParticleRenderer(const ParticleRenderer &) = delete;
+    ParticleRenderer &operator=(const ParticleRenderer &) = delete;
+
+    /**
+     * @brief Whether the current context can draw with vertex pulling, which needs shader storage buffers
+     */
+    static bool canPullVertices();
+
+    /**
+     * @brief Whether the particles are drawn with the PosDirPull shader rather than the PosDir shaders
+     */
+    bool pullsVertices() const { return m_pulling; }
+    /**
+     * @brief The number of particles drawn, before any are skipped
+     */
+    size_t numParticles() const { return m_numParticles; }
+    /**
+     * @brief Whether frames are copied straight into persistently mapped buffers
+     */
+    bool isPersistent() const { return m_mapped != nullptr; }
+    /**
+     * @brief Copy the particles of a frame into a free slot, waiting for the GPU to finish drawing it if needed, and
+     * draw that slot from now on
+     */
+    void upload(const SimulationFrame &_frame);
+    /**
+     * @brief Draw the last uploaded particles with the current shader, which sets the count and stride uniforms of the
+     * PosDirPull shader when pulling vertices
+     *
+     * @param _stride Draw every _stride-th particle, when pulling vertices, older contexts always draw every one
+     */
+    void draw(size_t _stride = 1);
+
+private:
+    /**
+     * @brief The number of slots, one being drawn, one being written, and one spare so neither waits on the other
+     */
+    static constexpr size_t c_numSlots = 3;
+
+    void createVertexArray(GLuint _vao, size_t _offset) const;
+    void waitForSlot(size_t _slot);
+    void copyToSlot(const SimulationFrame &_frame, size_t _slot);
+
+    size_t m_numParticles;
+    bool m_pulling;
+    // the bytes from one slot to the next, rounded up so each slot can be bound as a storage buffer range
+    size_t m_slotBytes;
+    GLuint m_vboID = 0;
+    bool m_ownsBuffer = true;
+    std::array<GLuint, c_numSlots> m_vaos{};
+    std::array<GLsync, c_numSlots> m_fences{};
+    float *m_mapped = nullptr;
+    size_t m_drawSlot = 0;
+};
+
+#endif // !PARTICLE_RENDERER_H_
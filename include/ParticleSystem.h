@@ -0,0 +1,90 @@
+/**
+ * @file ParticleSystem.h
+ * @brief Tracer particles stored as separate aligned arrays of X, Y and direction, so the update can run several
+ * particles per vector instruction. The number of particles is independent of the grid size.
+ * Positions are in cell units, within [0, width - 1) x [0, height - 1) of the grid the particles follow.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef PARTICLE_SYSTEM_H_
+#define PARTICLE_SYSTEM_H_
+
+#include <cstddef>
+
+#include "AlignedAllocator.h"
+#include "CpuFeatures.h"
+#include "ParticleKernels.h"
+
+class ParticleSystem
+{
+public:
+    /**
+     * @brief Construct a Particle System and seed it
+     *
+     * @param _numParticles The number of particles
+     * @param _width The number of cells along X of the grid the particles follow
+     * @param _height The number of cells along Y of the grid the particles follow
+     */
+    ParticleSystem(size_t _numParticles, size_t _width, size_t _height);
+
+    /**
+     * @brief Put the particles back at their starting positions. With one particle per cell each sits on its cell,
+     * otherwise they are spread evenly over the grid with a low discrepancy sequence.
+     */
+    void seed();
+    /**
+     * @brief Move particles [_first, _last) through the velocity field. Ranges that do not overlap can be updated
+     * from different threads.
+     *
+     * @param _mirror nullptr, or arrays of size() particles that are also written with the updated particles
+     */
+    void advect(size_t _first, size_t _last, const float *_velocX, const float *_velocY,
+                const ParticleArrays *_mirror = nullptr);
+    /**
+     * @brief Replace every particle, each array holds size() values
+     */
+    void assign(const float *_x, const float *_y, const float *_dirX, const float *_dirY);
+
+    /**
+     * @brief The number of particles
+     */
+    size_t size() const { return m_x.size(); }
+    /**
+     * @brief The X positions
+     */
+    const float *x() const { return m_x.data(); }
+    /**
+     * @brief The Y positions
+     */
+    const float *y() const { return m_y.data(); }
+    /**
+     * @brief The X component of half the unit direction of each particle's velocity
+     */
+    const float *dirX() const { return m_dirX.data(); }
+    /**
+     * @brief The Y component of half the unit direction of each particle's velocity
+     */
+    const float *dirY() const { return m_dirY.data(); }
+
+    /**
+     * @brief The widest SIMD instruction set the update will use
+     */
+    SimdLevel simdLevel() const { return m_simdLevel; }
+    /**
+     * @brief Limit the SIMD instruction set the update uses. Defaults to the widest level the CPU supports.
+     */
+    void setSimdLevel(SimdLevel _level) { m_simdLevel = _level; }
+
+private:
+    size_t m_width;
+    size_t m_height;
+    SimdLevel m_simdLevel;
+
+    AlignedVector<float> m_x;
+    AlignedVector<float> m_y;
+    AlignedVector<float> m_dirX;
+    AlignedVector<float> m_dirY;
+};
+
+#endif // !PARTICLE_SYSTEM_H_
@@ -0,0 +1,129 @@
+/**
+ * @file PressureSolver.h
+ * @brief Interface for the pressure solve in Fluid::project, so the Gauss-Seidel relaxation from the paper can be
+ * swapped for solvers that converge to a tolerance.
+ * Every solver works on the unit-spaced 2D Poisson equation 4 p - (sum of the 4 neighbours of p) = div over the
+ * interior of the grid, with the boundary of p a copy of the neighbouring interior cell.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef PRESSURE_SOLVER_H_
+#define PRESSURE_SOLVER_H_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class Fluid;
+class ThreadPool;
+
+class PressureSolver
+{
+public:
+    /**
+     * @brief Enum used to choose the pressure solver
+     *
+     */
+    enum class Type
+    {
+        Relaxation,
+        Multigrid,
+        ConjugateGradient
+    };
+
+    /**
+     * @brief Enum used to choose the preconditioner of the conjugate gradient solver
+     *
+     */
+    enum class Preconditioner
+    {
+        Jacobi,
+        MIC0
+    };
+
+    struct Settings
+    {
+        Type type = Type::Relaxation;
+        // relative residual |div - A p| / |div| the iterative solvers stop at
+        float tolerance = 1e-4f;
+        // cap on V-cycles or CG iterations, relaxation always runs the Fluid's iteration count
+        int maxIterations = 100;
+        Preconditioner preconditioner = Preconditioner::MIC0;
+    };
+
+    /**
+     * @brief Create a solver for a grid of the given size, including the boundary, with its arrays first written by
+     * the threads of _pool
+     */
+    static std::unique_ptr<PressureSolver> create(const Settings &_settings, size_t _width, size_t _height,
+                                                  ThreadPool *_pool = nullptr);
+
+    virtual ~PressureSolver() = default;
+
+    /**
+     * @brief Move the solver's arrays onto pages first written by a pool's threads, see Workspace
+     */
+    virtual void placeArrays(ThreadPool *) {}
+
+    /**
+     * @brief Solve for the pressure. _p holds the initial guess and receives the result, boundary included.
+     *
+     * @return The number of iterations used
+     */
+    virtual int solve(Fluid &_fluid, float *_p, const float *_div) = 0;
+    /**
+     * @brief The type of this solver
+     */
+    virtual Type type() const = 0;
+
+    /**
+     * @brief The number of iterations the last solve used
+     */
+    int lastIterations() const { return m_lastIterations; }
+    /**
+     * @brief The relative residual after the last solve, negative when the solver does not measure it
+     */
+    float lastResidual() const { return m_lastResidual; }
+
+    /**
+     * @brief Compute the relative residual |div - A p| / |div| of a pressure field, with div shifted to zero mean
+     * as the solvers do. Used to compare solvers.
+     */
+    static float relativeResidual(const Fluid &_fluid, const float *_p, const float *_div);
+
+protected:
+    int m_lastIterations = 0;
+    float m_lastResidual = -1.0f;
+
+    /**
+     * @brief Copy the interior cells next to the boundary into the boundary, corners take their diagonal neighbour
+     */
+    static void setNeumannBoundary(size_t _width, size_t _height, float *_x);
+    /**
+     * @brief _r = _b - A _x over the interior rows [_first, _last). The boundary of _x must be set.
+     */
+    static void residualRows(size_t _width, const float *_x, const float *_b, float *_r, size_t _first, size_t _last);
+    /**
+     * @brief Sum of _a * _b over the interior. Rows are summed in double and then added in row order, so the result
+     * is the same for any thread count.
+     */
+    static double dot(const Fluid &_fluid, const float *_a, const float *_b, double *_rowSums);
+    /**
+     * @brief Copy the interior of _src into _dst shifted to zero mean. The Neumann problem only has a solution when
+     * the right hand side sums to zero.
+     */
+    static void removeMean(const Fluid &_fluid, const float *_src, float *_dst, double *_rowSums);
+};
+
+/**
+ * @brief The original fixed count of relaxation sweeps using Fluid::linear_solve and the Fluid's solve mode
+ */
+class RelaxationSolver : public PressureSolver
+{
+public:
+    int solve(Fluid &_fluid, float *_p, const float *_div) override;
+    Type type() const override { return Type::Relaxation; }
+};
+
+#endif // !PRESSURE_SOLVER_H_
@@ -0,0 +1,105 @@
+/**
+ * @file ScalarFields.h
+ * @brief Passive scalar channels carried by the fluid, such as dye density or temperature, kept together in one
+ * workspace so the solver can advect all of them in a single pass over the grid.
+ * Each channel has a current and a previous field of numCells() values, which the solver uses in turn as the source
+ * and the result of a stage.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef SCALAR_FIELDS_H_
+#define SCALAR_FIELDS_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "Workspace.h"
+
+class ScalarFields
+{
+public:
+    /**
+     * @brief Returned by find when there is no channel with the name
+     */
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    /**
+     * @brief Construct an empty set of channels for a grid of the given size, including the boundary
+     */
+    ScalarFields(size_t _width, size_t _height) : m_width{_width}, m_numCells{_width * _height} {}
+
+    /**
+     * @brief Add a channel with both of its fields zeroed. Adding a channel moves the storage, so pointers to the
+     * fields of the other channels are no longer valid.
+     *
+     * @param _name The name the channel is found by, which should be unique
+     * @param _diffusion The rate the channel diffuses through the fluid at, 0 only advects it
+     * @return The index of the new channel
+     */
+    size_t add(const std::string &_name, float _diffusion);
+    /**
+     * @brief The index of the channel with a name, or npos
+     */
+    size_t find(const std::string &_name) const;
+    /**
+     * @brief Zero both fields of every channel
+     */
+    void clear();
+    /**
+     * @brief Move the fields onto pages first written by a pool's threads, and place the fields of channels added
+     * later the same way. nullptr uses the calling thread.
+     */
+    void setThreadPool(ThreadPool *_pool);
+
+    /**
+     * @brief The number of channels
+     */
+    size_t size() const { return m_channels.size(); }
+    /**
+     * @brief The number of values in each field
+     */
+    size_t numCells() const { return m_numCells; }
+    /**
+     * @brief The name of a channel
+     */
+    const std::string &name(size_t _channel) const { return m_channels[_channel].name; }
+    /**
+     * @brief The diffusion rate of a channel
+     */
+    float diffusion(size_t _channel) const { return m_channels[_channel].diffusion; }
+    void setDiffusion(size_t _channel, float _diffusion) { m_channels[_channel].diffusion = _diffusion; }
+    /**
+     * @brief The current field of a channel, the one that is read back and drawn
+     */
+    float *current(size_t _channel) { return m_workspace.array<float>(m_channels[_channel].current); }
+    const float *current(size_t _channel) const { return m_workspace.array<float>(m_channels[_channel].current); }
+    /**
+     * @brief The previous field of a channel, the solver's second buffer
+     */
+    float *previous(size_t _channel) { return m_workspace.array<float>(m_channels[_channel].previous); }
+    const float *previous(size_t _channel) const { return m_workspace.array<float>(m_channels[_channel].previous); }
+    /**
+     * @brief Exchange the current and previous fields of a channel without copying them
+     */
+    void swap(size_t _channel);
+
+private:
+    struct Channel
+    {
+        std::string name;
+        float diffusion;
+        // workspace arrays of the two fields, which swap exchanges
+        size_t current;
+        size_t previous;
+    };
+
+    size_t m_width;
+    size_t m_numCells;
+    std::vector<Channel> m_channels;
+    Workspace m_workspace;
+    ThreadPool *m_pool = nullptr;
+};
+
+#endif // !SCALAR_FIELDS_H_
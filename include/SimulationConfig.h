@@ -0,0 +1,169 @@
+/**
+ * @file SimulationConfig.h
+ * @brief The settings of a batch simulation run, read from "key = value" config files and "--key value" command line
+ * arguments using the same keys.
+ * Keys are width, height, dt, viscosity, steps, threads, particles, iterations, solve (gauss-seidel, red-black or jacobi),
+ * tile, advection (semi-lagrangian, maccormack or bfecc), timestep (fixed, adaptive or substeps), cfl, min-dt, max-dt,
+ * max-substeps, frame-budget, backend (cpu, gpu or compare), fused, sparse, sparse-threshold, sparse-halo, pressure (relaxation, multigrid or cg), tolerance, preconditioner (mic0 or jacobi), output, profile,
+ * checkpoint, checkpoint-every, restart, fields, fields-every, fields-format (stream or raw), compression (none, shuffle,
+ * zstd or lz4), delta, queue, when-full (block, drop-newest or drop-oldest), force, impulse, scalar, source and
+ * buoyancy.
+ * A force is "step x y vx vy" and adds velocity to a cell before that step, an impulse is "step x y vx vy [radius]"
+ * and splats velocity around a point at the start of that step, and both can be given any number of times.
+ * A scalar is "name [diffusion]" and adds a channel carried by the fluid, a source is "step name x y amount" and adds
+ * to a channel's cell before that step, and both can be given any number of times. Buoyancy is
+ * "temperature lift [density weight]", naming the channels that push the fluid along Y.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef SIMULATION_CONFIG_H_
+#define SIMULATION_CONFIG_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "ActivityMask.h"
+#include "FieldStream.h"
+#include "Fluid.h"
+#include "FluidGrid.h"
+#include "ImpulseQueue.h"
+#include "PressureSolver.h"
+
+/**
+ * @brief Where a run is stepped. Compare steps the CPU and GPU solvers side by side and checks they agree.
+ */
+enum class SolverBackend
+{
+    Cpu,
+    Gpu,
+    Compare
+};
+
+/**
+ * @brief Velocity added to one cell before the given step
+ */
+struct ForceInjection
+{
+    size_t step = 0;
+    float x = 0.0f;
+    float y = 0.0f;
+    float vx = 0.0f;
+    float vy = 0.0f;
+};
+
+/**
+ * @brief An impulse queued before the given step, see FluidGrid::addImpulses
+ */
+struct ImpulseInjection
+{
+    size_t step = 0;
+    Impulse impulse;
+};
+
+/**
+ * @brief A scalar channel added to the grid, see FluidGrid::addScalar
+ */
+struct ScalarChannel
+{
+    std::string name;
+    float diffusion = 0.0f;
+};
+
+/**
+ * @brief An amount of a scalar added to one cell before the given step
+ */
+struct ScalarInjection
+{
+    size_t step = 0;
+    std::string channel;
+    float x = 0.0f;
+    float y = 0.0f;
+    float amount = 0.0f;
+};
+
+struct SimulationConfig
+{
+    // the defaults match the demo
+    size_t width = 100;
+    size_t height = 100;
+    float dt = 0.0000001f;
+    float viscosity = 20.0f;
+    size_t steps = 100;
+    size_t threads = 1;
+    // 0 places one particle on every cell
+    size_t particles = 0;
+    int iterations = c_defaultIterations;
+    Fluid::SolveMode solveMode = Fluid::SolveMode::GaussSeidel;
+    // sweeps run on each cache tile of rows, see Fluid::setSweepsPerTile
+    int sweepsPerTile = 1;
+    Fluid::AdvectionScheme advectionScheme = Fluid::AdvectionScheme::SemiLagrangian;
+    FluidGrid::TimeStepping timeStepping;
+    // wall clock milliseconds each step should fit in, 0 for no budget, see FluidGrid::setFrameBudget
+    double frameBudget = 0.0;
+    SolverBackend backend = SolverBackend::Cpu;
+    // step with the fused kernels, see FluidGrid::setFused
+    bool fused = false;
+    // only step the tiles with moving fluid, see FluidGrid::setSparse
+    bool sparse = false;
+    float activityThreshold = c_defaultActivityThreshold;
+    size_t activityHalo = 1;
+    PressureSolver::Settings pressureSolver;
+    std::vector<ForceInjection> forces;
+    std::vector<ImpulseInjection> impulses;
+    std::vector<ScalarChannel> scalars;
+    std::vector<ScalarInjection> sources;
+    // buoyancy from the channels with these names, none when buoyancyTemperature is empty, see FluidGrid::Buoyancy
+    std::string buoyancyTemperature;
+    float buoyancyLift = 0.0f;
+    std::string buoyancyDensity;
+    float buoyancyWeight = 0.0f;
+    // file the final velocity field and scalar channels are written to, nothing is written when empty
+    std::string output;
+    // prefix of the stage timing files, <profile>.csv, <profile>.json and <profile>.trace.json, nothing when empty
+    std::string profile;
+    // checkpoint file rewritten every checkpointInterval steps and after the last step, nothing when empty
+    std::string checkpoint;
+    // 0 only writes the checkpoint after the last step
+    size_t checkpointInterval = 0;
+    // checkpoint to continue from, its size, dt, viscosity and particles replace the ones set here
+    std::string restart;
+    // the velocity field is streamed to fieldOutput.path every fieldInterval steps, nothing when the path is empty
+    FieldWriter::Settings fieldOutput;
+    size_t fieldInterval = 1;
+
+    /**
+     * @brief Set one setting from its text form
+     *
+     * @param _error Receives the reason when the key or value is not valid
+     * @return false if the key or value is not valid
+     */
+    bool set(const std::string &_key, const std::string &_value, std::string *_error);
+    /**
+     * @brief Read a config file of "key = value" lines, blank lines and lines starting with # are skipped
+     *
+     * @return false if the file cannot be read or a line is not valid
+     */
+    bool load(const std::string &_path, std::string *_error);
+    /**
+     * @brief Read "--key value" pairs. "--config path" loads a file at that point, so later arguments override it.
+     *
+     * @return false if an argument is not valid
+     */
+    bool parseArguments(int _argc, const char *const *_argv, std::string *_error);
+    /**
+     * @brief The forces sorted by step, stable so forces on the same step keep their order
+     */
+    std::vector<ForceInjection> sortedForces() const;
+    /**
+     * @brief The impulses sorted by step, stable so impulses on the same step keep their order
+     */
+    std::vector<ImpulseInjection> sortedImpulses() const;
+    /**
+     * @brief The scalar sources sorted by step, stable so sources on the same step keep their order
+     */
+    std::vector<ScalarInjection> sortedSources() const;
+};
+
+#endif // !SIMULATION_CONFIG_H_
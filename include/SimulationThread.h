@@ -0,0 +1,151 @@
+/**
+ * @file SimulationThread.h
+ * @brief Steps a FluidGrid on its own thread at a fixed rate, so a slow step does not drop frames and vsync does not
+ * throttle the simulation.
+ * Each step publishes a snapshot of the particles and velocity through a triple buffer the renderer reads without
+ * blocking, and user input reaches the simulation through a single producer single consumer queue.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef SIMULATION_THREAD_H_
+#define SIMULATION_THREAD_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "AlignedAllocator.h"
+#include "FluidGrid.h"
+#include "SpscQueue.h"
+#include "TripleBuffer.h"
+
+/**
+ * @brief The state of the grid after one step
+ */
+struct SimulationFrame
+{
+    AlignedVector<float> x;
+    AlignedVector<float> y;
+    AlignedVector<float> dirX;
+    AlignedVector<float> dirY;
+    std::vector<float> velocityX;
+    std::vector<float> velocityY;
+    /**
+     * @brief The number of steps taken when this frame was published, 0 for the state before the first step
+     */
+    uint64_t step = 0;
+};
+
+/**
+ * @brief User input for the simulation thread, applied before the next step
+ */
+struct SimulationCommand
+{
+    enum class Type
+    {
+        AddVelocity,
+        AddImpulse,
+        Reset
+    };
+
+    Type type = Type::AddVelocity;
+    float x = 0.0f;
+    float y = 0.0f;
+    float vx = 0.0f;
+    float vy = 0.0f;
+    // the splat radius of an impulse
+    float radius = 0.0f;
+};
+
+class SimulationThread
+{
+public:
+    /**
+     * @brief Construct a Simulation Thread, which does not step until start() is called
+     *
+     * @param _grid The grid to step, only the simulation thread touches it once started
+     * @param _interval The wall clock time between the start of each step. A step that overruns starts the next
+     * straight away rather than trying to catch up. 0 steps as fast as possible.
+     */
+    SimulationThread(std::unique_ptr<FluidGrid> _grid, std::chrono::nanoseconds _interval);
+    /**
+     * @brief Stops the thread
+     */
+    ~SimulationThread();
+
+    SimulationThread(const SimulationThread &) = delete;
+    SimulationThread &operator=(const SimulationThread &) = delete;
+
+    /**
+     * @brief Start stepping on a new thread
+     */
+    void start();
+    /**
+     * @brief Finish the current step and join the thread. The grid can be used from the calling thread afterwards.
+     */
+    void stop();
+    /**
+     * @brief Whether the thread is stepping
+     */
+    bool isRunning() const { return m_thread.joinable(); }
+
+    /**
+     * @brief Queue velocity to add before the next step, see FluidGrid::addVelocity. Call from one thread only.
+     *
+     * @return false if the queue is full and the input was dropped
+     */
+    bool addVelocity(float _x, float _y, float _vx, float _vy);
+    /**
+     * @brief Queue an impulse to splat at the start of the next step, see FluidGrid::addImpulses. Call from the same
+     * thread as addVelocity.
+     *
+     * @return false if the queue is full and the input was dropped
+     */
+    bool addImpulse(const Impulse &_impulse);
+    /**
+     * @brief Queue a reset of the grid before the next step. Call from the same thread as addVelocity.
+     *
+     * @return false if the queue is full and the input was dropped
+     */
+    bool reset();
+
+    /**
+     * @brief Move frame() on to the newest published step. Call from one thread only.
+     *
+     * @return Whether there was a newer frame
+     */
+    bool updateFrame() { return m_frames.update(); }
+    /**
+     * @brief The newest frame as of the last updateFrame(), stable until the next one
+     */
+    const SimulationFrame &frame() const { return m_frames.readBuffer(); }
+    /**
+     * @brief The number of steps taken so far
+     */
+    uint64_t steps() const { return m_steps.load(std::memory_order_relaxed); }
+    /**
+     * @brief The grid, only safe to use while the thread is not running
+     */
+    FluidGrid &grid() { return *m_grid; }
+
+private:
+    static constexpr size_t c_queueCapacity = 1024;
+
+    void run();
+    void apply(const SimulationCommand &_command);
+    bool push(const SimulationCommand &_command);
+
+    std::unique_ptr<FluidGrid> m_grid;
+    std::chrono::nanoseconds m_interval;
+    TripleBuffer<SimulationFrame> m_frames;
+    SpscQueue<SimulationCommand, c_queueCapacity> m_commands;
+    std::atomic<uint64_t> m_steps{0};
+    std::atomic<bool> m_running{false};
+    std::thread m_thread;
+};
+
+#endif // !SIMULATION_THREAD_H_
@@ -0,0 +1,79 @@
+/**
+ * @file SpscQueue.h
+ * @brief A fixed size lock-free queue from one producer thread to one consumer thread, used to pass user input to
+ * the simulation thread without either side blocking.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef SPSC_QUEUE_H_
+#define SPSC_QUEUE_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+#include "AlignedAllocator.h"
+
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    SpscQueue() = default;
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    /**
+     * @brief Producer side, add a value to the back
+     *
+     * @return false, and the value is dropped, if the queue is full
+     */
+    bool push(const T &_value)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_headCache == Capacity)
+        {
+            m_headCache = m_head.load(std::memory_order_acquire);
+            if (tail - m_headCache == Capacity)
+            {
+                return false;
+            }
+        }
+        m_items[tail & (Capacity - 1)] = _value;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Consumer side, take the value at the front
+     *
+     * @return false, leaving _value untouched, if the queue is empty
+     */
+    bool pop(T &_value)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tailCache)
+        {
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tailCache)
+            {
+                return false;
+            }
+        }
+        _value = m_items[head & (Capacity - 1)];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::array<T, Capacity> m_items{};
+    // each side keeps a copy of the other's index so it only reads the shared one when it looks full or empty
+    alignas(c_cacheLine) std::atomic<size_t> m_head{0};
+    size_t m_tailCache = 0;
+    alignas(c_cacheLine) std::atomic<size_t> m_tail{0};
+    size_t m_headCache = 0;
+};
+
+#endif // !SPSC_QUEUE_H_
@@ -0,0 +1,57 @@
+/**
+ * @file StencilKernels.h
+ * @brief Unchecked row kernels for the 5-point stencil solved by Fluid::linear_solve and the 7-point stencil solved by
+ * Fluid3D::linear_solve, with scalar, AVX2 and AVX-512 versions selected at runtime.
+ * Every kernel updates _count consecutive cells of one row. The pointers point at the first of those cells and
+ * _stride is the distance in floats to the same cell one row down, _planeStride to the same cell one slice back.
+ * The Jacobi kernels take their source rows separately instead, so they do not have to be rows of one field.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef STENCIL_KERNELS_H_
+#define STENCIL_KERNELS_H_
+
+#include <cstddef>
+
+#include "CpuFeatures.h"
+
+#define FLUID_RESTRICT __restrict
+
+struct StencilKernels
+{
+    /**
+     * @brief One Jacobi sweep over a row, reading only the source rows so the cells can be updated in any order.
+     * _dst[i] = (_x0[i] + _a * (_src[i + 1] + _src[i - 1] + _above[i] + _below[i])) * _cRecip
+     */
+    void (*jacobiRow)(float *FLUID_RESTRICT _dst, const float *FLUID_RESTRICT _below, const float *FLUID_RESTRICT _src,
+                      const float *FLUID_RESTRICT _above, const float *FLUID_RESTRICT _x0, size_t _count, float _a,
+                      float _cRecip);
+    /**
+     * @brief One colour of a red-black sweep over a row, updating cells _first, _first + 2, ... in place.
+     * The neighbours of a cell are always the other colour so the updated cells do not depend on each other.
+     */
+    void (*redBlackRow)(float *_x, const float *_x0, size_t _stride, size_t _count, size_t _first, float _a,
+                        float _cRecip);
+    /**
+     * @brief jacobiRow with the rows in front of and behind the row in the two neighbouring slices as well.
+     * _dst[i] = (_x0[i] + _a * (_src[i + 1] + _src[i - 1] + _above[i] + _below[i] + _front[i] + _back[i])) * _cRecip
+     */
+    void (*jacobiRow7)(float *FLUID_RESTRICT _dst, const float *FLUID_RESTRICT _below, const float *FLUID_RESTRICT _src,
+                       const float *FLUID_RESTRICT _above, const float *FLUID_RESTRICT _back,
+                       const float *FLUID_RESTRICT _front, const float *FLUID_RESTRICT _x0, size_t _count, float _a,
+                       float _cRecip);
+    /**
+     * @brief redBlackRow for the 7-point stencil
+     */
+    void (*redBlackRow7)(float *_x, const float *_x0, size_t _stride, size_t _planeStride, size_t _count, size_t _first,
+                         float _a, float _cRecip);
+};
+
+/**
+ * @brief Get the kernels for a SIMD level. Levels the CPU does not support fall back to the widest one it does.
+ * All levels sum the neighbours in the same order and do not fuse multiply-adds, so they give identical results.
+ */
+const StencilKernels &stencilKernels(SimdLevel _level);
+
+#endif // !STENCIL_KERNELS_H_
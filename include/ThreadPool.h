@@ -0,0 +1,135 @@
+/**
+ * @file ThreadPool.h
+ * @brief A persistent pool of worker threads used to split the solver loops across cores.
+ * The workers are created once and sleep between jobs, so a step never creates threads.
+ * Work is split into contiguous chunks of an index range (normally grid rows), and the calling thread works on its
+ * own job too, so parallelFor can be called from inside another parallelFor without deadlocking.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    /**
+     * @brief Construct a Thread Pool
+     *
+     * @param _numThreads The number of threads working on each job, including the calling thread.
+     * 0 uses one thread per hardware core.
+     */
+    explicit ThreadPool(size_t _numThreads);
+    /**
+     * @brief Wakes and joins the workers
+     */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+     * @brief The number of threads working on each job, including the calling thread
+     */
+    size_t numThreads() const { return m_workers.size() + 1; }
+
+    /**
+     * @brief Call _fn(begin, end) over contiguous chunks covering [_begin, _end) and wait for all of them.
+     * Which thread runs a chunk is not fixed, so chunks must write to disjoint data for results to be deterministic.
+     */
+    template <typename Fn>
+    void parallelFor(size_t _begin, size_t _end, Fn &&_fn)
+    {
+        if (_end <= _begin)
+        {
+            return;
+        }
+        // split into a few chunks per thread so uneven rows still balance
+        size_t chunks = std::min(_end - _begin, numThreads() * 4);
+        if (chunks == 1 || m_workers.empty())
+        {
+            _fn(_begin, _end);
+            return;
+        }
+        using Function = std::remove_reference_t<Fn>;
+        Job job;
+        job.m_invoke = [](void *_context, size_t _b, size_t _e) { (*static_cast<Function *>(_context))(_b, _e); };
+        job.m_context = const_cast<void *>(static_cast<const void *>(&_fn));
+        job.m_begin = _begin;
+        job.m_end = _end;
+        job.m_numChunks = chunks;
+        run(job);
+    }
+
+    /**
+     * @brief Run two independent tasks concurrently and wait for both
+     */
+    template <typename A, typename B>
+    void parallelInvoke(A &&_a, B &&_b)
+    {
+        parallelFor(0, 2, [&](size_t _first, size_t _last) {
+            for (size_t i = _first; i < _last; i++)
+            {
+                if (i == 0)
+                {
+                    _a();
+                }
+                else
+                {
+                    _b();
+                }
+            }
+        });
+    }
+
+private:
+    /**
+     * @brief A parallelFor call. Lives on the caller's stack so submitting work does not allocate.
+     */
+    struct Job
+    {
+        void (*m_invoke)(void *_context, size_t _begin, size_t _end) = nullptr;
+        void *m_context = nullptr;
+        size_t m_begin = 0;
+        size_t m_end = 0;
+        size_t m_numChunks = 0;
+        std::atomic<size_t> m_nextChunk{0};
+        std::atomic<size_t> m_remaining{0};
+        /**
+         * @brief Workers currently inside work() for this job, guarded by m_mutex
+         */
+        size_t m_active = 0;
+        Job *m_next = nullptr;
+    };
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    Job *m_jobs = nullptr;
+    bool m_stop = false;
+
+    void run(Job &_job);
+    void workerLoop();
+    /**
+     * @brief Claim and run chunks of the job until none are left unclaimed
+     */
+    void work(Job &_job);
+    /**
+     * @brief Find a job that still has unclaimed chunks, dropping finished ones from the list. Needs m_mutex.
+     */
+    Job *findJob();
+    void unlinkJob(Job &_job);
+};
+
+#endif // !THREAD_POOL_H_
@@ -0,0 +1,75 @@
+/**
+ * @file TripleBuffer.h
+ * @brief A lock-free triple buffer passing whole values from one writer thread to one reader thread.
+ * The writer always has a buffer to fill and the reader always has the newest complete one, so neither ever waits
+ * for the other. Values the reader is too slow to see are skipped.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef TRIPLE_BUFFER_H_
+#define TRIPLE_BUFFER_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+#include "AlignedAllocator.h"
+
+template <typename T>
+class TripleBuffer
+{
+public:
+    /**
+     * @brief Construct a Triple Buffer with every buffer a copy of _initial, so buffers holding arrays can be sized
+     * up front and never reallocate
+     */
+    explicit TripleBuffer(const T &_initial = T{}) : m_buffers{_initial, _initial, _initial} {}
+
+    TripleBuffer(const TripleBuffer &) = delete;
+    TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+    /**
+     * @brief The buffer only the writer may fill, it keeps whatever it held two publishes ago
+     */
+    T &writeBuffer() { return m_buffers[m_write]; }
+    /**
+     * @brief Writer side, hand the write buffer to the reader and take the spare one to fill next
+     */
+    void publish()
+    {
+        m_write = m_spare.exchange(m_write | c_fresh, std::memory_order_acq_rel) & c_index;
+    }
+
+    /**
+     * @brief Reader side, swap to the newest published buffer if there is one
+     *
+     * @return Whether readBuffer() changed
+     */
+    bool update()
+    {
+        if ((m_spare.load(std::memory_order_relaxed) & c_fresh) == 0)
+        {
+            return false;
+        }
+        m_read = m_spare.exchange(m_read, std::memory_order_acq_rel) & c_index;
+        return true;
+    }
+    /**
+     * @brief The buffer only the reader may read, stable until the next update()
+     */
+    const T &readBuffer() const { return m_buffers[m_read]; }
+
+private:
+    // the spare index has its low bits as the buffer and this bit set while it holds a buffer the reader has not seen
+    static constexpr unsigned c_fresh = 4;
+    static constexpr unsigned c_index = 3;
+
+    std::array<T, 3> m_buffers;
+    // each index is only touched by its own side, so keep them on separate cache lines
+    alignas(c_cacheLine) unsigned m_write = 0;
+    alignas(c_cacheLine) std::atomic<unsigned> m_spare{1};
+    alignas(c_cacheLine) unsigned m_read = 2;
+};
+
+#endif // !TRIPLE_BUFFER_H_
@@ -0,0 +1,117 @@
+/**
+ * @file Workspace.h
+ * @brief An arena holding the arrays a solver works in, laid out in one allocation with every array starting on a
+ * cache line, each at a different offset within a page. Blocks of 2 MiB or more are mapped on huge page boundaries and, on Linux, marked for transparent huge
+ * pages, so walking a field takes few TLB misses.
+ * An owner adds its arrays and then allocates them all at once, so the arrays never move or grow while the solver
+ * steps and a step never allocates. The rows of each array are written first by the threads of a pool, in the row
+ * chunks the solver loops use, so on NUMA systems their pages are placed near the threads that sweep them.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef WORKSPACE_H_
+#define WORKSPACE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "AlignedAllocator.h"
+
+class ThreadPool;
+
+/**
+ * @brief Blocks at least this large are mapped on huge page boundaries
+ */
+constexpr size_t c_hugePageSize = 2 * 1024 * 1024;
+
+class Workspace
+{
+public:
+    Workspace() = default;
+    ~Workspace();
+
+    Workspace(const Workspace &) = delete;
+    Workspace &operator=(const Workspace &) = delete;
+    Workspace(Workspace &&_other) noexcept;
+    Workspace &operator=(Workspace &&_other) noexcept;
+
+    /**
+     * @brief Add an array to the layout, it can be used once allocate is next called
+     *
+     * @param _count The number of values
+     * @param _rowLength The values per row when the array is a field split by rows across the pool, 0 when it is not
+     * @return The index of the array
+     */
+    template <typename T>
+    size_t add(size_t _count, size_t _rowLength = 0)
+    {
+        return addBytes(_count * sizeof(T), _rowLength * sizeof(T));
+    }
+    /**
+     * @brief Allocate one block holding every array added so far. The arrays of an earlier allocate keep their
+     * contents but move to the new block, the others start zeroed. Every row is first written by the pool's threads,
+     * or by the calling thread without a pool.
+     * Called again with a new pool, this moves the arrays onto pages first touched by its threads.
+     */
+    void allocate(ThreadPool *_pool);
+    /**
+     * @brief An allocated array, valid until the next allocate
+     */
+    template <typename T>
+    T *array(size_t _index) const
+    {
+        return reinterpret_cast<T *>(m_block + m_arrays[_index].offset);
+    }
+
+    /**
+     * @brief The number of arrays added
+     */
+    size_t size() const { return m_arrays.size(); }
+    /**
+     * @brief The size of the block in bytes, 0 before allocate
+     */
+    size_t bytes() const { return m_bytes; }
+    /**
+     * @brief Whether the block was marked for transparent huge pages
+     */
+    bool usesHugePages() const { return m_hugePages; }
+
+    /**
+     * @brief The number of blocks every workspace has allocated so far, which only grows while arrays are being
+     * added or moved to a new pool and never during a step
+     */
+    static size_t blockAllocations();
+    /**
+     * @brief The number of heap allocations made by the whole program so far, from any thread. Only counted in builds
+     * with FLUID_COUNT_ALLOCATIONS, which Debug builds define, otherwise always 0.
+     */
+    static size_t heapAllocations();
+    /**
+     * @brief Whether heapAllocations counts
+     */
+    static bool countsHeapAllocations();
+
+private:
+    struct Array
+    {
+        size_t offset;
+        size_t bytes;
+        size_t rowBytes;
+    };
+
+    std::vector<Array> m_arrays;
+    // the number of arrays in the current block, the rest are new
+    size_t m_allocatedArrays = 0;
+    size_t m_layoutBytes = 0;
+    uint8_t *m_block = nullptr;
+    size_t m_bytes = 0;
+    bool m_mapped = false;
+    bool m_hugePages = false;
+
+    size_t addBytes(size_t _bytes, size_t _rowBytes);
+    void release();
+};
+
+#endif // !WORKSPACE_H_
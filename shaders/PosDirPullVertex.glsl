@@ -0,0 +1,41 @@
+#version 430 core
+
+// each particle is drawn as a line from its position along its direction, with no vertex attributes or geometry
+// shader: vertex 2p starts the line of particle p and vertex 2p + 1 ends it, both read from the particle arrays.
+// The grid lies in the XZ plane.
+layout(std430, binding = 0) readonly buffer Particles { float particles[]; };
+uniform mat4 MVP;
+// set by ParticleRenderer::draw, the number of particles in each array and the step between the particles drawn
+layout(location = 1) uniform int count;
+layout(location = 2) uniform int stride;
+// collapse lines wholly outside the view onto one point past its edge, so they are rejected before clipping
+uniform bool cull;
+out vec3 colour;
+
+bool outside(vec4 _start, vec4 _end)
+{
+  // both ends beyond the same clip plane
+  return (_start.x > _start.w && _end.x > _end.w) || (_start.x < -_start.w && _end.x < -_end.w) ||
+         (_start.y > _start.w && _end.y > _end.w) || (_start.y < -_start.w && _end.y < -_end.w) ||
+         (_start.z > _start.w && _end.z > _end.w) || (_start.z < -_start.w && _end.z < -_end.w);
+}
+
+void main()
+{
+  int p = (gl_VertexID / 2) * stride;
+  bool end = (gl_VertexID & 1) == 1;
+  vec2 position = vec2(particles[p], particles[count + p]);
+  vec2 dir = vec2(particles[2 * count + p], particles[3 * count + p]);
+
+  vec4 start = MVP * vec4(position.x, 0.0, position.y, 1.0);
+  vec4 tip = MVP * vec4(position.x + dir.x, 0.0, position.y + dir.y, 1.0);
+  if (cull && outside(start, tip))
+  {
+    gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+  }
+  else
+  {
+    gl_Position = end ? tip : start;
+  }
+  colour = end ? vec3(1, 0, 0) : vec3(1, 1, 1);
+}
@@ -1,13 +1,16 @@
 #version 400 core
 
-layout(location=0) in vec3 inPos;
-layout(location=1) in vec3 inDir;
+// the particles are stored as separate arrays, the grid lies in the XZ plane
+layout(location=0) in float inX;
+layout(location=1) in float inZ;
+layout(location=2) in float inDirX;
+layout(location=3) in float inDirZ;
 uniform mat4 MVP;
 flat out vec3 dir;
 
 void main()
 {
-    gl_Position=MVP*vec4(inPos,1.0);
-    dir=vec3(MVP*vec4(inDir,0));
+    gl_Position=MVP*vec4(inX,0.0,inZ,1.0);
+    dir=vec3(MVP*vec4(inDirX,0.0,inDirZ,0.0));
 
 }
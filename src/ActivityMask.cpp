@@ -0,0 +1,209 @@
+/**
+ * @file ActivityMask.cpp
+ * @brief Tracks which 16x16 tiles of a grid hold moving fluid, so the solver can skip the tiles at rest.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "ActivityMask.h"
+
+#include <algorithm>
+#include <cmath>
+
+ActivityMask::ActivityMask(size_t _width, size_t _height) : m_width{_width},
+                                                            m_height{_height},
+                                                            m_tilesX{(_width + c_tileSize - 1) / c_tileSize},
+                                                            m_tilesY{(_height + c_tileSize - 1) / c_tileSize},
+                                                            m_active(m_tilesX * m_tilesY),
+                                                            m_hot(m_tilesX * m_tilesY),
+                                                            m_grownX(m_tilesX * m_tilesY),
+                                                            m_peaks(m_tilesX * m_tilesY),
+                                                            m_spans(m_tilesY)
+{
+    m_deactivated.reserve(m_active.size());
+    activateAll();
+}
+
+void ActivityMask::activateAll()
+{
+    std::fill(m_active.begin(), m_active.end(), 1);
+    m_deactivated.clear();
+    buildSpans();
+}
+
+void ActivityMask::activateCell(size_t _x, size_t _y)
+{
+    uint8_t &active = m_active[std::min(_x, m_width - 1) / c_tileSize + (std::min(_y, m_height - 1) / c_tileSize) * m_tilesX];
+    if (active == 0)
+    {
+        active = 1;
+        buildSpans();
+    }
+}
+
+void ActivityMask::activateRegion(size_t _x0, size_t _y0, size_t _x1, size_t _y1)
+{
+    bool changed = false;
+    for (size_t ty = _y0 / c_tileSize; ty * c_tileSize < std::min(_y1, m_height); ty++)
+    {
+        for (size_t tx = _x0 / c_tileSize; tx * c_tileSize < std::min(_x1, m_width); tx++)
+        {
+            uint8_t &active = m_active[tx + ty * m_tilesX];
+            changed |= active == 0;
+            active = 1;
+        }
+    }
+    if (changed)
+    {
+        buildSpans();
+    }
+}
+
+void ActivityMask::update(const float *_velocX, const float *_velocY, float _threshold, size_t _halo)
+{
+    // the peak of each active tile, the inactive tiles are zero
+    std::fill(m_peaks.begin(), m_peaks.end(), 0.0f);
+    float gridPeak = 0.0f;
+    for (size_t ty = 0; ty < m_tilesY; ty++)
+    {
+        for (const Span &span : m_spans[ty])
+        {
+            for (size_t tx = span.begin / c_tileSize; tx * c_tileSize < span.end; tx++)
+            {
+                const size_t x1 = std::min(m_width, (tx + 1) * c_tileSize);
+                const size_t y1 = std::min(m_height, (ty + 1) * c_tileSize);
+                float peak = 0.0f;
+                for (size_t y = ty * c_tileSize; y < y1; y++)
+                {
+                    for (size_t x = tx * c_tileSize; x < x1; x++)
+                    {
+                        peak = std::fmax(peak, std::fmax(std::fabs(_velocX[x + y * m_width]),
+                                                         std::fabs(_velocY[x + y * m_width])));
+                    }
+                }
+                m_peaks[tx + ty * m_tilesX] = peak;
+                gridPeak = std::fmax(gridPeak, peak);
+            }
+        }
+    }
+    for (size_t tile = 0; tile < m_hot.size(); tile++)
+    {
+        m_hot[tile] = m_peaks[tile] > _threshold * gridPeak ? 1 : 0;
+    }
+
+    // grow the hot tiles by the halo, first along X into m_grownX then along Y back into m_hot
+    std::vector<uint8_t> &grown = m_hot;
+    std::vector<uint8_t> &rows = m_grownX;
+    std::fill(rows.begin(), rows.end(), 0);
+    for (size_t ty = 0; ty < m_tilesY; ty++)
+    {
+        for (size_t tx = 0; tx < m_tilesX; tx++)
+        {
+            if (grown[tx + ty * m_tilesX] != 0)
+            {
+                const size_t x0 = tx > _halo ? tx - _halo : 0;
+                const size_t x1 = std::min(m_tilesX, tx + _halo + 1);
+                std::fill(rows.begin() + static_cast<ptrdiff_t>(x0 + ty * m_tilesX),
+                          rows.begin() + static_cast<ptrdiff_t>(x1 + ty * m_tilesX), 1);
+            }
+        }
+    }
+    std::fill(grown.begin(), grown.end(), 0);
+    for (size_t ty = 0; ty < m_tilesY; ty++)
+    {
+        const size_t y0 = ty > _halo ? ty - _halo : 0;
+        const size_t y1 = std::min(m_tilesY, ty + _halo + 1);
+        for (size_t tx = 0; tx < m_tilesX; tx++)
+        {
+            for (size_t y = y0; y < y1 && grown[tx + ty * m_tilesX] == 0; y++)
+            {
+                grown[tx + ty * m_tilesX] = rows[tx + y * m_tilesX];
+            }
+        }
+    }
+
+    m_deactivated.clear();
+    for (size_t tile = 0; tile < m_active.size(); tile++)
+    {
+        if (m_active[tile] != 0 && grown[tile] == 0)
+        {
+            m_deactivated.push_back(tile);
+        }
+    }
+    m_active.swap(grown);
+    buildSpans();
+}
+
+void ActivityMask::clearDeactivated(float *_field) const
+{
+    for (size_t tile : m_deactivated)
+    {
+        clearTile(_field, tile);
+    }
+}
+
+void ActivityMask::clearInactive(float *_field) const
+{
+    for (size_t tile = 0; tile < m_active.size(); tile++)
+    {
+        if (m_active[tile] == 0)
+        {
+            clearTile(_field, tile);
+        }
+    }
+}
+
+void ActivityMask::copyInactive(float *_dst, const float *_src) const
+{
+    // the gaps between the spans of each row
+    for (size_t y = 0; y < m_height; y++)
+    {
+        size_t x = 0;
+        for (const Span &span : spans(y))
+        {
+            std::copy(_src + x + y * m_width, _src + span.begin + y * m_width, _dst + x + y * m_width);
+            x = span.end;
+        }
+        std::copy(_src + x + y * m_width, _src + (y + 1) * m_width, _dst + x + y * m_width);
+    }
+}
+
+void ActivityMask::clearTile(float *_field, size_t _tile) const
+{
+    const size_t x0 = (_tile % m_tilesX) * c_tileSize;
+    const size_t y0 = (_tile / m_tilesX) * c_tileSize;
+    const size_t x1 = std::min(m_width, x0 + c_tileSize);
+    const size_t y1 = std::min(m_height, y0 + c_tileSize);
+    for (size_t y = y0; y < y1; y++)
+    {
+        std::fill(_field + x0 + y * m_width, _field + x1 + y * m_width, 0.0f);
+    }
+}
+
+void ActivityMask::buildSpans()
+{
+    m_numActive = 0;
+    for (size_t ty = 0; ty < m_tilesY; ty++)
+    {
+        std::vector<Span> &spans = m_spans[ty];
+        spans.clear();
+        for (size_t tx = 0; tx < m_tilesX; tx++)
+        {
+            if (m_active[tx + ty * m_tilesX] == 0)
+            {
+                continue;
+            }
+            m_numActive++;
+            const size_t begin = tx * c_tileSize;
+            const size_t end = std::min(m_width, begin + c_tileSize);
+            if (!spans.empty() && spans.back().end == begin)
+            {
+                spans.back().end = end;
+            }
+            else
+            {
+                spans.push_back({begin, end});
+            }
+        }
+    }
+}
@@ -0,0 +1,571 @@
+/**
+ * @file Checkpoint.cpp
+ * @brief Saving the state of a FluidGrid to a versioned binary file and mapping it back in to restart a run
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "Checkpoint.h"
+
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+
+#include "CpuFeatures.h"
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define FLUID_X86_CRC 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FLUID_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define FLUID_TARGET_SSE42
+#endif
+
+namespace
+{
+    constexpr char c_magic[8] = {'F', 'L', 'U', 'I', 'D', 'C', 'K', 'P'};
+    /**
+     * @brief Every array starts on a multiple of this, a page on the usual systems, so mapped arrays are aligned for
+     * any vector load
+     */
+    constexpr uint64_t c_arrayAlignment = 4096;
+
+    struct ArrayEntry
+    {
+        uint64_t offset;
+        uint64_t count;
+        uint32_t checksum;
+        uint32_t reserved;
+    };
+
+    /**
+     * @brief The start of every checkpoint file. headerChecksum covers the whole header with itself set to 0.
+     */
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerChecksum;
+        uint64_t width;
+        uint64_t height;
+        uint64_t step;
+        uint64_t numParticles;
+        uint64_t numScalars;
+        float dt;
+        float viscosity;
+        ArrayEntry arrays[Checkpoint::c_numArrays];
+        // covers the scalar table, which follows the header
+        uint32_t scalarsChecksum;
+        uint32_t reserved;
+    };
+    static_assert(std::is_trivially_copyable<FileHeader>::value, "the header is written and read as raw bytes");
+    static_assert(sizeof(FileHeader) == 264, "changing the header layout needs a new c_checkpointVersion");
+
+    /**
+     * @brief A scalar channel in the table after the header, the name padded with zeros
+     */
+    struct ScalarEntry
+    {
+        char name[c_checkpointNameLength + 1];
+        float diffusion;
+        uint32_t reserved;
+        ArrayEntry current;
+        ArrayEntry previous;
+    };
+    static_assert(std::is_trivially_copyable<ScalarEntry>::value, "the scalar table is written and read as raw bytes");
+    static_assert(sizeof(ScalarEntry) == 104, "changing the scalar table layout needs a new c_checkpointVersion");
+
+    uint64_t alignUp(uint64_t _value)
+    {
+        return (_value + c_arrayAlignment - 1) / c_arrayAlignment * c_arrayAlignment;
+    }
+
+    // CRC-32C (Castagnoli), using the SSE 4.2 instruction when the CPU has it. Both paths give the same result.
+
+    const uint32_t *crcTable()
+    {
+        static const std::array<uint32_t, 256> table = []() {
+            std::array<uint32_t, 256> t{};
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    crc = (crc >> 1) ^ ((crc & 1u) != 0 ? 0x82f63b78u : 0u);
+                }
+                t[i] = crc;
+            }
+            return t;
+        }();
+        return table.data();
+    }
+
+    uint32_t crcScalar(uint32_t _crc, const unsigned char *_data, size_t _size)
+    {
+        const uint32_t *table = crcTable();
+        for (size_t i = 0; i < _size; i++)
+        {
+            _crc = (_crc >> 8) ^ table[(_crc ^ _data[i]) & 0xffu];
+        }
+        return _crc;
+    }
+
+#ifdef FLUID_X86_CRC
+    FLUID_TARGET_SSE42 uint32_t crcSSE42(uint32_t _crc, const unsigned char *_data, size_t _size)
+    {
+        uint64_t crc = _crc;
+        size_t i = 0;
+        for (; i + 8 <= _size; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, _data + i, sizeof(word));
+            crc = _mm_crc32_u64(crc, word);
+        }
+        return crcScalar(static_cast<uint32_t>(crc), _data + i, _size - i);
+    }
+#endif
+
+    uint32_t checksum(const void *_data, size_t _size)
+    {
+        const unsigned char *data = static_cast<const unsigned char *>(_data);
+#ifdef FLUID_X86_CRC
+        // every CPU with AVX2 has SSE 4.2
+        static const bool hardware = detectSimdLevel() >= SimdLevel::AVX2;
+        if (hardware)
+        {
+            return ~crcSSE42(~0u, data, _size);
+        }
+#endif
+        return ~crcScalar(~0u, data, _size);
+    }
+
+    uint32_t headerChecksum(FileHeader _header)
+    {
+        _header.headerChecksum = 0;
+        return checksum(&_header, sizeof(_header));
+    }
+
+    /**
+     * @brief The arrays of a state in file order
+     */
+    std::array<std::pair<const float *, size_t>, Checkpoint::c_numArrays> stateArrays(const CheckpointState &_state)
+    {
+        return {{{_state.velocityX.data(), _state.velocityX.size()},
+                 {_state.velocityY.data(), _state.velocityY.size()},
+                 {_state.velocityX0.data(), _state.velocityX0.size()},
+                 {_state.velocityY0.data(), _state.velocityY0.size()},
+                 {_state.x.data(), _state.x.size()},
+                 {_state.y.data(), _state.y.size()},
+                 {_state.dirX.data(), _state.dirX.size()},
+                 {_state.dirY.data(), _state.dirY.size()}}};
+    }
+
+    bool flushToDisk(FILE *_file)
+    {
+        if (std::fflush(_file) != 0)
+        {
+            return false;
+        }
+#if defined(_WIN32)
+        return _commit(_fileno(_file)) == 0;
+#else
+        return fsync(fileno(_file)) == 0;
+#endif
+    }
+}
+
+bool writeCheckpoint(const std::string &_path, const CheckpointState &_state, std::string *_error)
+{
+    const size_t cells = _state.width * _state.height;
+    const size_t particles = _state.x.size();
+    bool sizesMatch = _state.velocityX.size() == cells && _state.velocityY.size() == cells &&
+                      _state.velocityX0.size() == cells && _state.velocityY0.size() == cells &&
+                      _state.y.size() == particles && _state.dirX.size() == particles &&
+                      _state.dirY.size() == particles;
+    for (const CheckpointScalar &scalar : _state.scalars)
+    {
+        sizesMatch = sizesMatch && scalar.current.size() == cells && scalar.previous.size() == cells;
+        if (scalar.name.size() > c_checkpointNameLength)
+        {
+            *_error = "the scalar channel name '" + scalar.name + "' is longer than " +
+                      std::to_string(c_checkpointNameLength) + " characters";
+            return false;
+        }
+    }
+    if (!sizesMatch)
+    {
+        *_error = "the arrays of the state do not match its size";
+        return false;
+    }
+
+    FileHeader header{};
+    std::memcpy(header.magic, c_magic, sizeof(c_magic));
+    header.version = c_checkpointVersion;
+    header.width = _state.width;
+    header.height = _state.height;
+    header.step = _state.step;
+    header.numParticles = particles;
+    header.numScalars = _state.scalars.size();
+    header.dt = _state.dt;
+    header.viscosity = _state.viscosity;
+
+    // the fixed arrays and then the scalar fields, each with the table entry that locates it
+    std::vector<ScalarEntry> scalars(_state.scalars.size());
+    std::vector<std::pair<const float *, ArrayEntry *>> arrays;
+    for (const auto &array : stateArrays(_state))
+    {
+        arrays.emplace_back(array.first, &header.arrays[arrays.size()]);
+        arrays.back().second->count = array.second;
+    }
+    for (size_t channel = 0; channel < scalars.size(); channel++)
+    {
+        const CheckpointScalar &scalar = _state.scalars[channel];
+        std::memcpy(scalars[channel].name, scalar.name.data(), scalar.name.size());
+        scalars[channel].diffusion = scalar.diffusion;
+        scalars[channel].current.count = scalar.current.size();
+        scalars[channel].previous.count = scalar.previous.size();
+        arrays.emplace_back(scalar.current.data(), &scalars[channel].current);
+        arrays.emplace_back(scalar.previous.data(), &scalars[channel].previous);
+    }
+    const size_t tableBytes = scalars.size() * sizeof(ScalarEntry);
+    uint64_t offset = alignUp(sizeof(FileHeader) + tableBytes);
+    for (const auto &array : arrays)
+    {
+        ArrayEntry &entry = *array.second;
+        entry.offset = offset;
+        entry.checksum = checksum(array.first, entry.count * sizeof(float));
+        offset = alignUp(offset + entry.count * sizeof(float));
+    }
+    header.scalarsChecksum = checksum(scalars.data(), tableBytes);
+    header.headerChecksum = headerChecksum(header);
+
+    // write beside the old checkpoint and swap it in once the new one is safely on disk
+    const std::string temporary = _path + ".tmp";
+    FILE *file = std::fopen(temporary.c_str(), "wb");
+    if (file == nullptr)
+    {
+        *_error = "cannot create " + temporary;
+        return false;
+    }
+    static const char c_padding[c_arrayAlignment] = {};
+    bool written = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   std::fwrite(scalars.data(), 1, tableBytes, file) == tableBytes;
+    uint64_t position = sizeof(header) + tableBytes;
+    for (size_t i = 0; i < arrays.size() && written; i++)
+    {
+        const ArrayEntry &entry = *arrays[i].second;
+        const size_t padding = static_cast<size_t>(entry.offset - position);
+        const size_t bytes = entry.count * sizeof(float);
+        written = std::fwrite(c_padding, 1, padding, file) == padding &&
+                  std::fwrite(arrays[i].first, 1, bytes, file) == bytes;
+        position = entry.offset + bytes;
+    }
+    written = flushToDisk(file) && written;
+    written = std::fclose(file) == 0 && written;
+    if (!written)
+    {
+        std::remove(temporary.c_str());
+        *_error = "cannot write " + temporary;
+        return false;
+    }
+
+#if defined(_WIN32)
+    // rename does not replace an existing file here
+    std::remove(_path.c_str());
+#endif
+    if (std::rename(temporary.c_str(), _path.c_str()) != 0)
+    {
+        std::remove(temporary.c_str());
+        *_error = "cannot replace " + _path;
+        return false;
+    }
+    return true;
+}
+
+Checkpoint::~Checkpoint()
+{
+    close();
+}
+
+bool Checkpoint::open(const std::string &_path, std::string *_error, bool _verify)
+{
+    close();
+
+#if defined(_WIN32)
+    // no mmap, read the file into an aligned buffer instead
+    FILE *file = std::fopen(_path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        *_error = "cannot open " + _path;
+        return false;
+    }
+    std::fseek(file, 0, SEEK_END);
+    long end = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+    size_t fileSize = end > 0 ? static_cast<size_t>(end) : 0;
+    void *data = fileSize > 0 ? ::operator new(fileSize, std::align_val_t{c_arrayAlignment}) : nullptr;
+    if (data != nullptr && std::fread(data, 1, fileSize, file) != fileSize)
+    {
+        ::operator delete(data, std::align_val_t{c_arrayAlignment});
+        data = nullptr;
+    }
+    std::fclose(file);
+    if (data == nullptr)
+    {
+        *_error = "cannot read " + _path;
+        return false;
+    }
+#else
+    int descriptor = ::open(_path.c_str(), O_RDONLY);
+    if (descriptor < 0)
+    {
+        *_error = "cannot open " + _path;
+        return false;
+    }
+    struct stat info;
+    size_t fileSize = fstat(descriptor, &info) == 0 ? static_cast<size_t>(info.st_size) : 0;
+    void *data = fileSize > 0 ? mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, descriptor, 0) : MAP_FAILED;
+    ::close(descriptor);
+    if (data == MAP_FAILED)
+    {
+        *_error = "cannot map " + _path;
+        return false;
+    }
+    // restoring reads every array once from start to end, so start reading ahead now
+    madvise(data, fileSize, MADV_SEQUENTIAL);
+    madvise(data, fileSize, MADV_WILLNEED);
+#endif
+    m_data = data;
+    m_mappedSize = fileSize;
+
+    auto fail = [&](const std::string &_reason) {
+        close();
+        *_error = _path + ": " + _reason;
+        return false;
+    };
+
+    if (fileSize < sizeof(FileHeader))
+    {
+        return fail("too small to be a checkpoint");
+    }
+    FileHeader header;
+    std::memcpy(&header, m_data, sizeof(header));
+    if (std::memcmp(header.magic, c_magic, sizeof(c_magic)) != 0)
+    {
+        return fail("not a checkpoint");
+    }
+    if (header.version != c_checkpointVersion)
+    {
+        return fail("unsupported checkpoint version " + std::to_string(header.version));
+    }
+    if (header.headerChecksum != headerChecksum(header))
+    {
+        return fail("the header is corrupt");
+    }
+
+    const unsigned char *bytes = static_cast<const unsigned char *>(m_data);
+    if (header.numScalars > (fileSize - sizeof(FileHeader)) / sizeof(ScalarEntry))
+    {
+        return fail("the scalar table is truncated");
+    }
+    std::vector<ScalarEntry> scalars(static_cast<size_t>(header.numScalars));
+    const size_t tableBytes = scalars.size() * sizeof(ScalarEntry);
+    std::memcpy(scalars.data(), bytes + sizeof(FileHeader), tableBytes);
+    if (header.scalarsChecksum != checksum(scalars.data(), tableBytes))
+    {
+        return fail("the scalar table is corrupt");
+    }
+
+    auto findArray = [&](const ArrayEntry &_entry, uint64_t _count, const std::string &_name, const float **_data) {
+        if (_entry.count != _count || _entry.offset % c_arrayAlignment != 0 || _entry.offset > fileSize ||
+            _entry.count > (fileSize - _entry.offset) / sizeof(float))
+        {
+            return fail(_name + " is truncated or misplaced");
+        }
+        if (_verify && checksum(bytes + _entry.offset, _entry.count * sizeof(float)) != _entry.checksum)
+        {
+            return fail(_name + " fails its checksum");
+        }
+        *_data = reinterpret_cast<const float *>(bytes + _entry.offset);
+        return true;
+    };
+    for (size_t i = 0; i < c_numArrays; i++)
+    {
+        const uint64_t expected = i < 4 ? header.width * header.height : header.numParticles;
+        if (!findArray(header.arrays[i], expected, "array " + std::to_string(i), &m_arrays[i]))
+        {
+            return false;
+        }
+        m_sizes[i] = static_cast<size_t>(header.arrays[i].count);
+    }
+    m_scalars.resize(scalars.size());
+    for (size_t channel = 0; channel < scalars.size(); channel++)
+    {
+        const ScalarEntry &entry = scalars[channel];
+        if (entry.name[c_checkpointNameLength] != '\0')
+        {
+            return fail("scalar channel " + std::to_string(channel) + " has no name");
+        }
+        m_scalars[channel].name = entry.name;
+        m_scalars[channel].diffusion = entry.diffusion;
+        const std::string name = "scalar channel '" + m_scalars[channel].name + "'";
+        if (!findArray(entry.current, header.width * header.height, name, &m_scalars[channel].current) ||
+            !findArray(entry.previous, header.width * header.height, name, &m_scalars[channel].previous))
+        {
+            return false;
+        }
+    }
+
+    m_width = static_cast<size_t>(header.width);
+    m_height = static_cast<size_t>(header.height);
+    m_numParticles = static_cast<size_t>(header.numParticles);
+    m_dt = header.dt;
+    m_viscosity = header.viscosity;
+    m_step = header.step;
+    return true;
+}
+
+void Checkpoint::close()
+{
+    if (m_data == nullptr)
+    {
+        return;
+    }
+#if defined(_WIN32)
+    ::operator delete(m_data, std::align_val_t{c_arrayAlignment});
+#else
+    munmap(m_data, m_mappedSize);
+#endif
+    m_data = nullptr;
+    m_mappedSize = 0;
+    m_arrays.fill(nullptr);
+    m_sizes.fill(0);
+    m_scalars.clear();
+}
+
+CheckpointWriter::CheckpointWriter()
+{
+    m_thread = std::thread(&CheckpointWriter::run, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+}
+
+CheckpointState &CheckpointWriter::acquire()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    Slot *slot = nullptr;
+    m_done.wait(lock, [&]() {
+        for (Slot &candidate : m_slots)
+        {
+            // a slot acquired again without being submitted is reused
+            if (candidate.status == SlotState::Free || candidate.status == SlotState::Filling)
+            {
+                slot = &candidate;
+                return true;
+            }
+        }
+        return false;
+    });
+    slot->status = SlotState::Filling;
+    return slot->state;
+}
+
+void CheckpointWriter::submit(const std::string &_path)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (Slot &slot : m_slots)
+        {
+            if (slot.status == SlotState::Filling)
+            {
+                slot.status = SlotState::Queued;
+                slot.path = _path;
+                slot.order = m_submitted++;
+                break;
+            }
+        }
+    }
+    m_wake.notify_one();
+}
+
+bool CheckpointWriter::wait(std::string *_error)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return idle(); });
+    bool failed = m_failed;
+    if (failed)
+    {
+        *_error = m_error;
+    }
+    m_failed = false;
+    return !failed;
+}
+
+bool CheckpointWriter::idle() const
+{
+    for (const Slot &slot : m_slots)
+    {
+        if (slot.status == SlotState::Queued || slot.status == SlotState::Writing)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void CheckpointWriter::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        // the oldest queued checkpoint goes first, so the newest file on disk is always the newest state
+        Slot *next = nullptr;
+        m_wake.wait(lock, [&]() {
+            for (Slot &slot : m_slots)
+            {
+                if (slot.status == SlotState::Queued && (next == nullptr || slot.order < next->order))
+                {
+                    next = &slot;
+                }
+            }
+            return next != nullptr || m_stop;
+        });
+        if (next == nullptr)
+        {
+            return;
+        }
+
+        next->status = SlotState::Writing;
+        lock.unlock();
+        std::string error;
+        bool written = writeCheckpoint(next->path, next->state, &error);
+        lock.lock();
+        if (!written)
+        {
+            m_failed = true;
+            m_error = error;
+        }
+        next->status = SlotState::Free;
+        m_done.notify_all();
+    }
+}
@@ -0,0 +1,218 @@
+/**
+ * @file ConjugateGradientSolver.cpp
+ * @brief Preconditioned conjugate gradient pressure solver with a Jacobi or modified incomplete Cholesky (MIC(0))
+ * preconditioner, stopping when the residual drops below the tolerance.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "ConjugateGradientSolver.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Fluid.h"
+
+namespace
+{
+    // MIC(0) blend and safety threshold from Bridson
+    constexpr float c_micTuning = 0.97f;
+    constexpr float c_micSafety = 0.25f;
+}
+
+ConjugateGradientSolver::ConjugateGradientSolver(const Settings &_settings, size_t _width, size_t _height,
+                                                 ThreadPool *_pool) : m_settings{_settings},
+                                                                      m_width{_width},
+                                                                      m_height{_height}
+{
+    for (int i = 0; i < 5; i++)
+    {
+        m_workspace.add<float>(_width * _height, _width);
+    }
+    m_workspace.add<double>(_height);
+    m_workspace.allocate(_pool);
+    bindArrays();
+    buildPreconditioner();
+}
+
+void ConjugateGradientSolver::placeArrays(ThreadPool *_pool)
+{
+    m_workspace.allocate(_pool);
+    bindArrays();
+}
+
+void ConjugateGradientSolver::bindArrays()
+{
+    m_r = m_workspace.array<float>(0);
+    m_z = m_workspace.array<float>(1);
+    m_s = m_workspace.array<float>(2);
+    m_q = m_workspace.array<float>(3);
+    m_precon = m_workspace.array<float>(4);
+    m_rowSums = m_workspace.array<double>(5);
+}
+
+float ConjugateGradientSolver::diagonal(size_t _i, size_t _j) const
+{
+    // a boundary neighbour copies this cell, which cancels one of the 4
+    float diag = 4.0f;
+    diag -= (_i == 1) ? 1.0f : 0.0f;
+    diag -= (_i == m_width - 2) ? 1.0f : 0.0f;
+    diag -= (_j == 1) ? 1.0f : 0.0f;
+    diag -= (_j == m_height - 2) ? 1.0f : 0.0f;
+    return diag;
+}
+
+void ConjugateGradientSolver::buildPreconditioner()
+{
+    const size_t w = m_width;
+    for (size_t j = 1; j < m_height - 1; j++)
+    {
+        for (size_t i = 1; i < w - 1; i++)
+        {
+            const size_t c = i + j * w;
+            const float diag = diagonal(i, j);
+            if (m_settings.preconditioner == Preconditioner::Jacobi)
+            {
+                m_precon[c] = 1.0f / diag;
+                continue;
+            }
+
+            // the off diagonal entries are -1 between interior cells and 0 towards the boundary, whose precon is 0
+            const float left = m_precon[c - 1];
+            const float down = m_precon[c - w];
+            const float leftUp = (j < m_height - 2) ? left : 0.0f;
+            const float downRight = (i < w - 2) ? down : 0.0f;
+            float e = diag - left * left - down * down - c_micTuning * (leftUp * leftUp + downRight * downRight);
+            if (e < c_micSafety * diag)
+            {
+                e = diag;
+            }
+            m_precon[c] = 1.0f / std::sqrt(e);
+        }
+    }
+}
+
+void ConjugateGradientSolver::applyPreconditioner(const Fluid &_fluid, const float *_r, float *_z)
+{
+    const size_t w = m_width;
+    const size_t h = m_height;
+    const float *precon = m_precon;
+
+    if (m_settings.preconditioner == Preconditioner::Jacobi)
+    {
+        _fluid.parallelRows(1, h - 1, [&](size_t _first, size_t _last) {
+            for (size_t j = _first; j < _last; j++)
+            {
+                for (size_t i = j * w + 1; i < (j + 1) * w - 1; i++)
+                {
+                    _z[i] = _r[i] * precon[i];
+                }
+            }
+        });
+        return;
+    }
+
+    // forward then backward substitution in place, both depend on the previous cell so they stay sequential.
+    // The boundary of _z stays zero and the boundary of precon is zero, which drops the couplings to the boundary.
+    for (size_t j = 1; j < h - 1; j++)
+    {
+        for (size_t i = j * w + 1; i < (j + 1) * w - 1; i++)
+        {
+            const float t = _r[i] + precon[i - 1] * _z[i - 1] + precon[i - w] * _z[i - w];
+            _z[i] = t * precon[i];
+        }
+    }
+    for (size_t j = h - 2; j >= 1; j--)
+    {
+        for (size_t i = (j + 1) * w - 2; i > j * w; i--)
+        {
+            const float t = _z[i] + precon[i] * (_z[i + 1] + _z[i + w]);
+            _z[i] = t * precon[i];
+        }
+    }
+}
+
+int ConjugateGradientSolver::solve(Fluid &_fluid, float *_p, const float *_div)
+{
+    const size_t w = m_width;
+    const size_t h = m_height;
+    float *r = m_r;
+    float *z = m_z;
+    float *s = m_s;
+    float *q = m_q;
+
+    // r = div - A p, with div shifted to zero mean so the Neumann problem has a solution
+    removeMean(_fluid, _div, r, m_rowSums);
+    const double bNorm = std::sqrt(dot(_fluid, r, r, m_rowSums));
+    setNeumannBoundary(w, h, _p);
+    _fluid.parallelRows(1, h - 1, [&](size_t _first, size_t _last) {
+        residualRows(w, _p, r, r, _first, _last);
+    });
+
+    double rNorm = std::sqrt(dot(_fluid, r, r, m_rowSums));
+    int iteration = 0;
+    if (bNorm > 0.0 && rNorm > m_settings.tolerance * bNorm)
+    {
+        applyPreconditioner(_fluid, r, z);
+        std::copy(z, z + m_width * m_height, s);
+        double rho = dot(_fluid, r, z, m_rowSums);
+
+        while (iteration < m_settings.maxIterations)
+        {
+            // q = A s
+            setNeumannBoundary(w, h, s);
+            _fluid.parallelRows(1, h - 1, [&](size_t _first, size_t _last) {
+                for (size_t j = _first; j < _last; j++)
+                {
+                    for (size_t i = j * w + 1; i < (j + 1) * w - 1; i++)
+                    {
+                        q[i] = 4.0f * s[i] - (s[i + 1] + s[i - 1] + s[i + w] + s[i - w]);
+                    }
+                }
+            });
+            const double sq = dot(_fluid, s, q, m_rowSums);
+            if (sq <= 0.0)
+            {
+                break;
+            }
+
+            const float alpha = static_cast<float>(rho / sq);
+            _fluid.parallelRows(1, h - 1, [&](size_t _first, size_t _last) {
+                for (size_t j = _first; j < _last; j++)
+                {
+                    for (size_t i = j * w + 1; i < (j + 1) * w - 1; i++)
+                    {
+                        _p[i] += alpha * s[i];
+                        r[i] -= alpha * q[i];
+                    }
+                }
+            });
+            iteration++;
+
+            rNorm = std::sqrt(dot(_fluid, r, r, m_rowSums));
+            if (rNorm <= m_settings.tolerance * bNorm)
+            {
+                break;
+            }
+
+            applyPreconditioner(_fluid, r, z);
+            const double rhoNew = dot(_fluid, r, z, m_rowSums);
+            const float beta = static_cast<float>(rhoNew / rho);
+            rho = rhoNew;
+            _fluid.parallelRows(1, h - 1, [&](size_t _first, size_t _last) {
+                for (size_t j = _first; j < _last; j++)
+                {
+                    for (size_t i = j * w + 1; i < (j + 1) * w - 1; i++)
+                    {
+                        s[i] = z[i] + beta * s[i];
+                    }
+                }
+            });
+        }
+    }
+
+    _fluid.set_boundary(Fluid::Boundary::None, _p);
+    m_lastIterations = iteration;
+    m_lastResidual = bNorm > 0.0 ? static_cast<float>(rNorm / bNorm) : 0.0f;
+    return iteration;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file CpuFeatures.cpp
+ * @brief Runtime detection of the vector instruction sets the solver kernels can use
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "CpuFeatures.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+namespace
+{
+    SimdLevel querySimdLevel()
+    {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+        // the builtins also check that the OS saves the wider registers on a context switch
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            return SimdLevel::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return SimdLevel::AVX2;
+        }
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        int info[4];
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        if (!osxsave)
+        {
+            return SimdLevel::Scalar;
+        }
+        unsigned long long xcr0 = _xgetbv(0);
+        bool ymmState = (xcr0 & 0x6) == 0x6;
+        bool zmmState = (xcr0 & 0xe6) == 0xe6;
+
+        __cpuid(info, 0);
+        if (info[0] < 7)
+        {
+            return SimdLevel::Scalar;
+        }
+        __cpuidex(info, 7, 0);
+        if (zmmState && (info[1] & (1 << 16)) != 0)
+        {
+            return SimdLevel::AVX512;
+        }
+        if (ymmState && (info[1] & (1 << 5)) != 0)
+        {
+            return SimdLevel::AVX2;
+        }
+#endif
+        return SimdLevel::Scalar;
+    }
+
+    bool queryF16C()
+    {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        // the conversions use the ymm registers, so only offer them where AVX2 is usable
+        int info[4];
+        __cpuid(info, 1);
+        return detectSimdLevel() != SimdLevel::Scalar && (info[2] & (1 << 29)) != 0;
+#else
+        return false;
+#endif
+    }
+}
+
+SimdLevel detectSimdLevel()
+{
+    static const SimdLevel s_level = querySimdLevel();
+    return s_level;
+}
+
+bool detectF16C()
+{
+    static const bool s_f16c = queryF16C();
+    return s_f16c;
+}
+
+const char *simdLevelName(SimdLevel _level)
+{
+    switch (_level)
+    {
+    case SimdLevel::AVX2:
+        return "AVX2";
+    case SimdLevel::AVX512:
+        return "AVX-512";
+    default:
+        return "Scalar";
+    }
+}
@@ -0,0 +1,746 @@
+/**
+ * @file FieldStream.cpp
+ * @brief Writing a time series of grid fields to disk for offline analysis without slowing the solver, and reading
+ * it back
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "FieldStream.h"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+#ifdef FLUID_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef FLUID_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+namespace
+{
+    constexpr char c_magic[8] = {'F', 'L', 'U', 'I', 'D', 'S', 'T', 'R'};
+    /**
+     * @brief Zstd level, low enough to keep up with a frame every step
+     */
+    constexpr int c_zstdLevel = 3;
+
+    struct StreamHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t compression;
+        uint64_t width;
+        uint64_t height;
+        uint32_t numFields;
+        uint32_t delta;
+    };
+    static_assert(std::is_trivially_copyable<StreamHeader>::value, "the header is written and read as raw bytes");
+
+    /**
+     * @brief The start of every frame, followed by each field as its encoded size in a uint64_t then its bytes
+     */
+    struct ChunkHeader
+    {
+        uint64_t step;
+        uint32_t numFields;
+        // 1 when the fields are stored without the delta against the previous frame
+        uint32_t keyframe;
+    };
+    static_assert(std::is_trivially_copyable<ChunkHeader>::value, "the header is written and read as raw bytes");
+
+    /**
+     * @brief Split 32 bit values into four planes of their first, second, third and fourth bytes. Neighbouring values
+     * of a smooth field share their high bytes, so the planes compress far better than the values.
+     */
+    void shuffle(const float *_values, size_t _count, unsigned char *_planes)
+    {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(_values);
+        for (size_t i = 0; i < _count; i++)
+        {
+            for (size_t b = 0; b < sizeof(float); b++)
+            {
+                _planes[b * _count + i] = bytes[i * sizeof(float) + b];
+            }
+        }
+    }
+
+    void unshuffle(const unsigned char *_planes, size_t _count, float *_values)
+    {
+        unsigned char *bytes = reinterpret_cast<unsigned char *>(_values);
+        for (size_t i = 0; i < _count; i++)
+        {
+            for (size_t b = 0; b < sizeof(float); b++)
+            {
+                bytes[i * sizeof(float) + b] = _planes[b * _count + i];
+            }
+        }
+    }
+
+    void xorInto(float *_values, const float *_previous, size_t _count)
+    {
+        uint32_t *bits = reinterpret_cast<uint32_t *>(_values);
+        const uint32_t *previous = reinterpret_cast<const uint32_t *>(_previous);
+        for (size_t i = 0; i < _count; i++)
+        {
+            bits[i] ^= previous[i];
+        }
+    }
+
+    // The built in shuffle compression: a run of bytes is a varint of (length << 1 | zero) followed, when zero is 0,
+    // by that many literal bytes. Runs of fewer than c_minZeroRun zeros stay in the literals.
+
+    constexpr size_t c_minZeroRun = 4;
+
+    size_t zeroRunBound(size_t _size)
+    {
+        // a zero run only splits the literals when its token and the next literal token fit in the zeros it replaces
+        return _size + _size / 64 + 32;
+    }
+
+    unsigned char *putVarint(unsigned char *_out, uint64_t _value)
+    {
+        while (_value >= 0x80)
+        {
+            *_out++ = static_cast<unsigned char>(_value | 0x80);
+            _value >>= 7;
+        }
+        *_out++ = static_cast<unsigned char>(_value);
+        return _out;
+    }
+
+    bool getVarint(const unsigned char **_in, const unsigned char *_end, uint64_t *_value)
+    {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            if (*_in == _end)
+            {
+                return false;
+            }
+            unsigned char byte = *(*_in)++;
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                *_value = value;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t encodeZeroRuns(const unsigned char *_in, size_t _size, unsigned char *_out)
+    {
+        unsigned char *out = _out;
+        size_t literalStart = 0;
+        size_t i = 0;
+        auto flushLiterals = [&](size_t _end) {
+            if (_end > literalStart)
+            {
+                out = putVarint(out, (_end - literalStart) << 1);
+                std::memcpy(out, _in + literalStart, _end - literalStart);
+                out += _end - literalStart;
+            }
+        };
+        while (i < _size)
+        {
+            if (_in[i] != 0)
+            {
+                i++;
+                continue;
+            }
+            size_t run = i;
+            while (run < _size && _in[run] == 0)
+            {
+                run++;
+            }
+            if (run - i >= c_minZeroRun)
+            {
+                flushLiterals(i);
+                out = putVarint(out, ((run - i) << 1) | 1);
+                literalStart = run;
+            }
+            i = run;
+        }
+        flushLiterals(_size);
+        return static_cast<size_t>(out - _out);
+    }
+
+    bool decodeZeroRuns(const unsigned char *_in, size_t _size, unsigned char *_out, size_t _outSize)
+    {
+        const unsigned char *end = _in + _size;
+        size_t written = 0;
+        while (_in != end)
+        {
+            uint64_t token;
+            if (!getVarint(&_in, end, &token))
+            {
+                return false;
+            }
+            const uint64_t length = token >> 1;
+            if (length > _outSize - written)
+            {
+                return false;
+            }
+            if ((token & 1) != 0)
+            {
+                std::memset(_out + written, 0, length);
+            }
+            else
+            {
+                if (length > static_cast<uint64_t>(end - _in))
+                {
+                    return false;
+                }
+                std::memcpy(_out + written, _in, length);
+                _in += length;
+            }
+            written += length;
+        }
+        return written == _outSize;
+    }
+
+    const char *compressionName(FieldWriter::Compression _compression)
+    {
+        switch (_compression)
+        {
+        case FieldWriter::Compression::None:
+            return "none";
+        case FieldWriter::Compression::Shuffle:
+            return "shuffle";
+        case FieldWriter::Compression::Zstd:
+            return "zstd";
+        case FieldWriter::Compression::LZ4:
+            return "lz4";
+        }
+        return "unknown";
+    }
+}
+
+/**
+ * @brief State the compressors keep between frames, so compressing a frame does not allocate
+ */
+struct FieldWriter::Codec
+{
+#ifdef FLUID_HAVE_ZSTD
+    ZSTD_CCtx *zstd = ZSTD_createCCtx();
+    ~Codec() { ZSTD_freeCCtx(zstd); }
+#endif
+};
+
+bool FieldWriter::isSupported(Compression _compression)
+{
+    switch (_compression)
+    {
+    case Compression::None:
+    case Compression::Shuffle:
+        return true;
+    case Compression::Zstd:
+#ifdef FLUID_HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    case Compression::LZ4:
+#ifdef FLUID_HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+FieldWriter::FieldWriter() = default;
+
+FieldWriter::~FieldWriter()
+{
+    std::string error;
+    close(&error);
+}
+
+bool FieldWriter::open(size_t _width, size_t _height, const Settings &_settings, std::string *_error)
+{
+    if (!close(_error))
+    {
+        return false;
+    }
+    if (_settings.fields.empty() || _width == 0 || _height == 0)
+    {
+        *_error = "a field stream needs at least one field of at least one cell";
+        return false;
+    }
+    if (_settings.format == Format::Stream && !isSupported(_settings.compression))
+    {
+        *_error = std::string("this build cannot write ") + compressionName(_settings.compression) + " compression";
+        return false;
+    }
+
+    m_settings = _settings;
+    m_settings.queueFrames = std::max<size_t>(m_settings.queueFrames, 2);
+    m_settings.keyframeInterval = std::max<size_t>(m_settings.keyframeInterval, 1);
+    m_width = _width;
+    m_height = _height;
+
+    if (m_settings.format == Format::Stream)
+    {
+        m_file = std::fopen(m_settings.path.c_str(), "wb");
+        if (m_file == nullptr)
+        {
+            *_error = "cannot create " + m_settings.path;
+            return false;
+        }
+        StreamHeader header{};
+        std::memcpy(header.magic, c_magic, sizeof(c_magic));
+        header.version = c_fieldStreamVersion;
+        header.compression = static_cast<uint32_t>(m_settings.compression);
+        header.width = m_width;
+        header.height = m_height;
+        header.numFields = static_cast<uint32_t>(m_settings.fields.size());
+        header.delta = m_settings.delta ? 1 : 0;
+        bool written = std::fwrite(&header, sizeof(header), 1, m_file) == 1;
+        for (const std::string &name : m_settings.fields)
+        {
+            uint32_t length = static_cast<uint32_t>(name.size());
+            written = written && std::fwrite(&length, sizeof(length), 1, m_file) == 1 &&
+                      std::fwrite(name.data(), 1, name.size(), m_file) == name.size();
+        }
+        if (!written)
+        {
+            std::fclose(m_file);
+            m_file = nullptr;
+            *_error = "cannot write " + m_settings.path;
+            return false;
+        }
+    }
+
+    // everything the frames need is allocated here, so neither thread allocates while running
+    const size_t cells = m_width * m_height;
+    const size_t numFields = m_settings.fields.size();
+    m_frames.assign(m_settings.queueFrames, FieldFrame{});
+    for (FieldFrame &frame : m_frames)
+    {
+        frame.fields.assign(numFields, std::vector<float>(cells));
+    }
+    m_free.clear();
+    m_free.reserve(m_frames.size());
+    for (size_t i = m_frames.size(); i > 0; i--)
+    {
+        m_free.push_back(i - 1);
+    }
+    m_queue.assign(m_frames.size(), 0);
+    m_queueHead = 0;
+    m_queueCount = 0;
+    m_previous.assign(m_settings.delta ? numFields : 0, std::vector<float>(cells));
+    size_t encodedBound = zeroRunBound(cells * sizeof(float));
+#ifdef FLUID_HAVE_ZSTD
+    encodedBound = std::max(encodedBound, ZSTD_compressBound(cells * sizeof(float)));
+#endif
+#ifdef FLUID_HAVE_LZ4
+    encodedBound = std::max(encodedBound, static_cast<size_t>(LZ4_compressBound(static_cast<int>(cells * sizeof(float)))));
+#endif
+    m_shuffled.resize(cells * sizeof(float));
+    m_encoded.resize(encodedBound);
+    m_codec = std::make_unique<Codec>();
+    m_framesSinceKey = 0;
+    m_written = 0;
+    m_dropped = 0;
+    m_failed = false;
+    m_error.clear();
+    m_stop = false;
+
+    m_thread = std::thread(&FieldWriter::run, this);
+    return true;
+}
+
+bool FieldWriter::close(std::string *_error)
+{
+    if (!m_thread.joinable())
+    {
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_queued.notify_one();
+    m_thread.join();
+
+    if (m_file != nullptr)
+    {
+        if (std::fclose(m_file) != 0 && !m_failed)
+        {
+            m_failed = true;
+            m_error = "cannot write " + m_settings.path;
+        }
+        m_file = nullptr;
+    }
+    if (m_failed)
+    {
+        *_error = m_error;
+    }
+    return !m_failed;
+}
+
+bool FieldWriter::write(uint64_t _step, std::initializer_list<const float *> _fields)
+{
+    size_t index;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_free.empty())
+        {
+            switch (m_settings.policy)
+            {
+            case FullPolicy::Block:
+                m_freed.wait(lock, [this]() { return !m_free.empty(); });
+                break;
+            case FullPolicy::DropNewest:
+                m_dropped++;
+                return false;
+            case FullPolicy::DropOldest:
+                // the writer always takes the oldest frame, so with two or more buffers one is still queued
+                m_free.push_back(m_queue[m_queueHead]);
+                m_queueHead = (m_queueHead + 1) % m_queue.size();
+                m_queueCount--;
+                m_dropped++;
+                break;
+            }
+        }
+        index = m_free.back();
+        m_free.pop_back();
+    }
+
+    // the copy is the only work done on the solver's thread
+    FieldFrame &frame = m_frames[index];
+    frame.step = _step;
+    const size_t cells = m_width * m_height;
+    size_t field = 0;
+    for (const float *values : _fields)
+    {
+        if (field < frame.fields.size())
+        {
+            std::copy(values, values + cells, frame.fields[field].begin());
+        }
+        field++;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue[(m_queueHead + m_queueCount) % m_queue.size()] = index;
+        m_queueCount++;
+    }
+    m_queued.notify_one();
+    return true;
+}
+
+uint64_t FieldWriter::framesWritten() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_written;
+}
+
+uint64_t FieldWriter::framesDropped() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_dropped;
+}
+
+void FieldWriter::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_queued.wait(lock, [this]() { return m_queueCount > 0 || m_stop; });
+        if (m_queueCount == 0)
+        {
+            return;
+        }
+        const size_t index = m_queue[m_queueHead];
+        m_queueHead = (m_queueHead + 1) % m_queue.size();
+        m_queueCount--;
+        lock.unlock();
+
+        // after a failure the frames are still taken off the queue, so the solver never waits on a broken disk
+        std::string error;
+        bool written = !m_failed && (m_settings.format == Format::Stream ? writeFrame(m_frames[index], &error)
+                                                                         : writeRawFrame(m_frames[index], &error));
+
+        lock.lock();
+        if (written)
+        {
+            m_written++;
+        }
+        else if (!m_failed)
+        {
+            m_failed = true;
+            m_error = error;
+        }
+        m_free.push_back(index);
+        m_freed.notify_one();
+    }
+}
+
+bool FieldWriter::writeFrame(const FieldFrame &_frame, std::string *_error)
+{
+    const size_t cells = m_width * m_height;
+    const bool keyframe = !m_settings.delta || m_framesSinceKey == 0;
+    m_framesSinceKey = (m_framesSinceKey + 1) % m_settings.keyframeInterval;
+
+    ChunkHeader chunk{};
+    chunk.step = _frame.step;
+    chunk.numFields = static_cast<uint32_t>(_frame.fields.size());
+    chunk.keyframe = keyframe ? 1 : 0;
+    bool written = std::fwrite(&chunk, sizeof(chunk), 1, m_file) == 1;
+
+    for (size_t f = 0; f < _frame.fields.size() && written; f++)
+    {
+        const float *values = _frame.fields[f].data();
+        if (m_settings.delta)
+        {
+            // the frame's buffer goes back to the solver, so the delta is taken in the previous frame's copy
+            std::vector<float> &previous = m_previous[f];
+            if (keyframe)
+            {
+                std::copy(values, values + cells, previous.begin());
+            }
+            else
+            {
+                xorInto(previous.data(), values, cells);
+            }
+            values = previous.data();
+        }
+
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(values);
+        size_t size = cells * sizeof(float);
+        if (m_settings.compression != Compression::None)
+        {
+            shuffle(values, cells, m_shuffled.data());
+            bytes = m_shuffled.data();
+        }
+        switch (m_settings.compression)
+        {
+        case Compression::None:
+            break;
+        case Compression::Shuffle:
+            size = encodeZeroRuns(m_shuffled.data(), size, m_encoded.data());
+            bytes = m_encoded.data();
+            break;
+        case Compression::Zstd:
+#ifdef FLUID_HAVE_ZSTD
+            size = ZSTD_compressCCtx(m_codec->zstd, m_encoded.data(), m_encoded.size(), m_shuffled.data(), size,
+                                     c_zstdLevel);
+            if (ZSTD_isError(size) != 0)
+            {
+                *_error = std::string("zstd: ") + ZSTD_getErrorName(size);
+                return false;
+            }
+            bytes = m_encoded.data();
+#endif
+            break;
+        case Compression::LZ4:
+#ifdef FLUID_HAVE_LZ4
+            size = static_cast<size_t>(LZ4_compress_default(reinterpret_cast<const char *>(m_shuffled.data()),
+                                                            reinterpret_cast<char *>(m_encoded.data()),
+                                                            static_cast<int>(size), static_cast<int>(m_encoded.size())));
+            bytes = m_encoded.data();
+#endif
+            break;
+        }
+
+        uint64_t encodedSize = size;
+        written = std::fwrite(&encodedSize, sizeof(encodedSize), 1, m_file) == 1 &&
+                  std::fwrite(bytes, 1, size, m_file) == size;
+
+        if (m_settings.delta && !keyframe)
+        {
+            // the delta has been written, so the next frame's delta is taken against this one
+            std::copy(_frame.fields[f].begin(), _frame.fields[f].end(), m_previous[f].begin());
+        }
+    }
+
+    if (!written)
+    {
+        *_error = "cannot write " + m_settings.path;
+    }
+    return written;
+}
+
+bool FieldWriter::writeRawFrame(const FieldFrame &_frame, std::string *_error)
+{
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "_%06llu.raw", static_cast<unsigned long long>(_frame.step));
+    const std::string path = m_settings.path + suffix;
+    FILE *file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        *_error = "cannot create " + path;
+        return false;
+    }
+    bool written = true;
+    for (const std::vector<float> &field : _frame.fields)
+    {
+        written = written && std::fwrite(field.data(), sizeof(float), field.size(), file) == field.size();
+    }
+    written = std::fclose(file) == 0 && written;
+    if (!written)
+    {
+        *_error = "cannot write " + path;
+    }
+    return written;
+}
+
+FieldStreamReader::~FieldStreamReader()
+{
+    if (m_file != nullptr)
+    {
+        std::fclose(m_file);
+    }
+}
+
+bool FieldStreamReader::open(const std::string &_path, std::string *_error)
+{
+    if (m_file != nullptr)
+    {
+        std::fclose(m_file);
+    }
+    m_file = std::fopen(_path.c_str(), "rb");
+    if (m_file == nullptr)
+    {
+        *_error = "cannot open " + _path;
+        return false;
+    }
+
+    StreamHeader header;
+    if (std::fread(&header, sizeof(header), 1, m_file) != 1 || std::memcmp(header.magic, c_magic, sizeof(c_magic)) != 0)
+    {
+        *_error = _path + ": not a field stream";
+        return false;
+    }
+    if (header.version != c_fieldStreamVersion)
+    {
+        *_error = _path + ": unsupported field stream version " + std::to_string(header.version);
+        return false;
+    }
+    m_compression = static_cast<FieldWriter::Compression>(header.compression);
+    if (header.compression > static_cast<uint32_t>(FieldWriter::Compression::LZ4) ||
+        !FieldWriter::isSupported(m_compression))
+    {
+        *_error = _path + ": this build cannot read " + compressionName(m_compression) + " compression";
+        return false;
+    }
+
+    m_width = static_cast<size_t>(header.width);
+    m_height = static_cast<size_t>(header.height);
+    m_delta = header.delta != 0;
+    m_fields.clear();
+    for (uint32_t f = 0; f < header.numFields; f++)
+    {
+        uint32_t length;
+        if (std::fread(&length, sizeof(length), 1, m_file) != 1)
+        {
+            *_error = _path + ": truncated header";
+            return false;
+        }
+        std::string name(length, '\0');
+        if (std::fread(&name[0], 1, length, m_file) != length)
+        {
+            *_error = _path + ": truncated header";
+            return false;
+        }
+        m_fields.push_back(name);
+    }
+
+    const size_t bytes = m_width * m_height * sizeof(float);
+    m_previous.assign(m_delta ? m_fields.size() : 0, std::vector<float>(m_width * m_height));
+    m_shuffled.resize(bytes);
+    return true;
+}
+
+bool FieldStreamReader::next(FieldFrame *_frame, std::string *_error)
+{
+    _error->clear();
+    if (m_file == nullptr)
+    {
+        return false;
+    }
+    ChunkHeader chunk;
+    if (std::fread(&chunk, sizeof(chunk), 1, m_file) != 1)
+    {
+        return false;
+    }
+    if (chunk.numFields != m_fields.size() || (m_delta && chunk.keyframe == 0 && m_previous.empty()))
+    {
+        *_error = "corrupt frame header";
+        return false;
+    }
+
+    const size_t cells = m_width * m_height;
+    const size_t bytes = cells * sizeof(float);
+    _frame->step = chunk.step;
+    _frame->fields.resize(m_fields.size());
+    for (size_t f = 0; f < m_fields.size(); f++)
+    {
+        std::vector<float> &values = _frame->fields[f];
+        values.resize(cells);
+        uint64_t size;
+        if (std::fread(&size, sizeof(size), 1, m_file) != 1 || size > bytes * 2 + 64)
+        {
+            *_error = "corrupt frame at step " + std::to_string(chunk.step);
+            return false;
+        }
+        m_encoded.resize(static_cast<size_t>(size));
+        if (std::fread(m_encoded.data(), 1, m_encoded.size(), m_file) != m_encoded.size())
+        {
+            *_error = "truncated frame at step " + std::to_string(chunk.step);
+            return false;
+        }
+
+        bool decoded = true;
+        switch (m_compression)
+        {
+        case FieldWriter::Compression::None:
+            decoded = size == bytes;
+            if (decoded)
+            {
+                std::memcpy(values.data(), m_encoded.data(), bytes);
+            }
+            break;
+        case FieldWriter::Compression::Shuffle:
+            decoded = decodeZeroRuns(m_encoded.data(), m_encoded.size(), m_shuffled.data(), bytes);
+            break;
+        case FieldWriter::Compression::Zstd:
+#ifdef FLUID_HAVE_ZSTD
+            decoded = ZSTD_decompress(m_shuffled.data(), bytes, m_encoded.data(), m_encoded.size()) == bytes;
+#endif
+            break;
+        case FieldWriter::Compression::LZ4:
+#ifdef FLUID_HAVE_LZ4
+            decoded = LZ4_decompress_safe(reinterpret_cast<const char *>(m_encoded.data()),
+                                          reinterpret_cast<char *>(m_shuffled.data()), static_cast<int>(size),
+                                          static_cast<int>(bytes)) == static_cast<int>(bytes);
+#endif
+            break;
+        }
+        if (!decoded)
+        {
+            *_error = "cannot decompress frame at step " + std::to_string(chunk.step);
+            return false;
+        }
+        if (m_compression != FieldWriter::Compression::None)
+        {
+            unshuffle(m_shuffled.data(), cells, values.data());
+        }
+
+        if (m_delta)
+        {
+            if (chunk.keyframe == 0)
+            {
+                xorInto(values.data(), m_previous[f].data(), cells);
+            }
+            std::copy(values.begin(), values.end(), m_previous[f].begin());
+        }
+    }
+    return true;
+}
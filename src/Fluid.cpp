@@ -2,134 +2,959 @@
  * @file Fluid.cpp
  * @brief This class implements the methods from https://www.dgp.toronto.edu/public_user/stam/reality/Research/pdf/GDC03.pdf.
  * They are slightly modified versions of the originals, trying to use C++ syntax instead of C
- * 
+ *
  * @copyright Copyright (c) 2021
  */
 
 #include "Fluid.h"
 
-void Fluid::set_boundary(Boundary _b, std::vector<float> *_x)
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "ActivityMask.h"
+#include "Bilinear.h"
+#include "StencilKernels.h"
+
+namespace
+{
+    /**
+     * @brief _cells, if a grid can have that many along an axis, as every loop steps over the boundary layers
+     */
+    size_t checkedSize(size_t _cells, const char *_axis)
+    {
+        if (_cells < c_minGridSize)
+        {
+            throw std::invalid_argument(std::string("a fluid grid needs a ") + _axis + " of at least " +
+                                        std::to_string(c_minGridSize) + " cells, not " + std::to_string(_cells));
+        }
+        return _cells;
+    }
+
+    /**
+     * @brief Grid width known at compile time, so the stencil loops get a constant row stride and trip count
+     */
+    template <size_t N>
+    struct FixedWidth
+    {
+        constexpr size_t operator()() const { return N; }
+    };
+
+    /**
+     * @brief Grid width only known at runtime
+     */
+    struct DynamicWidth
+    {
+        size_t m_width;
+        size_t operator()() const { return m_width; }
+    };
+
+    /**
+     * @brief Call the kernel with the width of the grid, using a compile-time width for the common sizes
+     */
+    template <typename Kernel>
+    void dispatchWidth(size_t _width, Kernel &&_kernel)
+    {
+        switch (_width)
+        {
+        case 128:
+            _kernel(FixedWidth<128>{});
+            break;
+        case 256:
+            _kernel(FixedWidth<256>{});
+            break;
+        case 512:
+            _kernel(FixedWidth<512>{});
+            break;
+        default:
+            _kernel(DynamicWidth{_width});
+            break;
+        }
+    }
+
+    /**
+     * @brief Call _row(j, first, last) for each row j in [_first, _last) with the interior cells [first, last) of the
+     * row to update: all of them without a mask, otherwise each run of active tiles
+     */
+    template <typename Row>
+    inline void activeRows(const ActivityMask *_mask, size_t _first, size_t _last, size_t _w, Row &&_row)
+    {
+        for (size_t j = _first; j < _last; j++)
+        {
+            if (_mask == nullptr)
+            {
+                _row(j, size_t{1}, _w - 1);
+                continue;
+            }
+            for (const ActivityMask::Span &span : _mask->spans(j))
+            {
+                const size_t first = std::max<size_t>(span.begin, 1);
+                const size_t last = std::min(span.end, _w - 1);
+                if (first < last)
+                {
+                    _row(j, first, last);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Cells advectFields traces back before interpolating the fields at them
+     */
+    constexpr size_t c_advectBlock = 64;
+
+    /**
+     * @brief Clamp a value to the range of the four cells a back-trace sampled, which limits the higher order
+     * advection schemes so they cannot create new extremes
+     */
+    inline float limitToSample(float _value, const float *_d0, const BilinearSample &_s, size_t _w)
+    {
+        const float a = _d0[_s.i0 + _s.j0 * _w];
+        const float b = _d0[_s.i0 + _s.j1 * _w];
+        const float c = _d0[_s.i1 + _s.j0 * _w];
+        const float d = _d0[_s.i1 + _s.j1 * _w];
+        const float low = std::fmin(std::fmin(a, b), std::fmin(c, d));
+        const float high = std::fmax(std::fmax(a, b), std::fmax(c, d));
+        return std::fmin(std::fmax(_value, low), high);
+    }
+
+    /**
+     * @brief Set the first and last cell of a row from their inner neighbours, as set_boundary does.
+     * _sign is -1 for the X field, 1 for the others.
+     */
+    inline void setRowEdges(float *_row, size_t _w, float _sign)
+    {
+        _row[0] = _sign * _row[1];
+        _row[_w - 1] = _sign * _row[_w - 2];
+    }
+
+    /**
+     * @brief Set the bottom or top row of a field from the next row in, with the corners, as set_boundary does.
+     * The edges of the inner row must already be set. _sign is -1 for the Y field, 1 for the others.
+     */
+    inline void setOuterRow(float *_outer, const float *_inner, size_t _w, float _sign)
+    {
+        for (size_t i = 1; i < _w - 1; i++)
+        {
+            _outer[i] = _sign * _inner[i];
+        }
+        _outer[0] = 0.5f * (_outer[1] + _inner[0]);
+        _outer[_w - 1] = 0.5f * (_outer[_w - 2] + _inner[_w - 1]);
+    }
+
+    /**
+     * @brief The divergence of row _j into _div and a zeroed pressure into _p, as the first half of project computes
+     * them, with their boundaries. _div, _p and _velocX point at the start of the fields, _below and _above at the Y
+     * velocity of rows _j - 1 and _j + 1.
+     */
+    inline void divergenceRow(size_t _j, size_t _w, size_t _h, float *_div, float *_p, const float *_velocX,
+                              const float *_below, const float *_above, float _wFloat, float _hFloat)
+    {
+        float *div = _div + _j * _w;
+        const float *velocX = _velocX + _j * _w;
+        for (size_t i = 1; i < _w - 1; i++)
+        {
+            div[i] = -0.5f * ((velocX[i + 1] - velocX[i - 1]) / _wFloat + (_above[i] - _below[i]) / _hFloat);
+        }
+        setRowEdges(div, _w, 1.0f);
+        std::fill(_p + _j * _w, _p + (_j + 1) * _w, 0.0f);
+
+        if (_j == 1)
+        {
+            setOuterRow(_div, div, _w, 1.0f);
+            std::fill(_p, _p + _w, 0.0f);
+        }
+        if (_j == _h - 2)
+        {
+            setOuterRow(div + _w, div, _w, 1.0f);
+            std::fill(_p + (_h - 1) * _w, _p + _h * _w, 0.0f);
+        }
+    }
+
+    /**
+     * @brief Set the boundary cells that depend on row _j of the X and Y velocity, which point at the start of the
+     * fields: the row's edges, and the bottom or top row when _j is next to it
+     */
+    inline void velocityBoundaryRow(size_t _j, size_t _w, size_t _h, float *_velocX, float *_velocY)
+    {
+        float *rowX = _velocX + _j * _w;
+        float *rowY = _velocY + _j * _w;
+        setRowEdges(rowX, _w, -1.0f);
+        setRowEdges(rowY, _w, 1.0f);
+        if (_j == 1)
+        {
+            setOuterRow(_velocX, rowX, _w, 1.0f);
+            setOuterRow(_velocY, rowY, _w, -1.0f);
+        }
+        if (_j == _h - 2)
+        {
+            setOuterRow(rowX + _w, rowX, _w, 1.0f);
+            setOuterRow(rowY + _w, rowY, _w, -1.0f);
+        }
+    }
+
+    /**
+     * @brief Set the boundary cells that depend on interior row _j of a field once it holds the result of a sweep, as
+     * set_boundary does: the row's edges, and the bottom or top row when _j is next to it. _rowOf(j) gives the
+     * address of row j, so the rows do not have to be laid out as one field.
+     */
+    template <typename RowOf>
+    inline void setRowBoundary(RowOf &&_rowOf, size_t _j, size_t _w, size_t _h, float _edgeSign, float _outerSign)
+    {
+        setRowEdges(_rowOf(_j), _w, _edgeSign);
+        if (_j == 1)
+        {
+            setOuterRow(_rowOf(0), _rowOf(1), _w, _outerSign);
+        }
+        if (_j == _h - 2)
+        {
+            setOuterRow(_rowOf(_h - 1), _rowOf(_h - 2), _w, _outerSign);
+        }
+    }
+
+    /**
+     * @brief Run _sweeps sweeps over the rows [_first, _last) as a wavefront, calling _fn(sweep, row) for each.
+     * At every step each sweep moves on one row, working _skew rows behind the sweep before it, so a row is swept
+     * several times while it is still in cache instead of once per pass over the whole grid.
+     */
+    template <typename Fn>
+    void wavefront(size_t _first, size_t _last, int _sweeps, size_t _skew, Fn &&_fn)
+    {
+        const size_t lag = _skew * static_cast<size_t>(_sweeps - 1);
+        for (size_t step = _first; step < _last + lag; step++)
+        {
+            for (int k = 0; k < _sweeps; k++)
+            {
+                const size_t behind = _skew * static_cast<size_t>(k);
+                if (step >= _first + behind && step - behind < _last)
+                {
+                    _fn(k, step - behind);
+                }
+            }
+        }
+    }
+}
+
+Fluid::Fluid(size_t _width, size_t _height, int _iterations) : m_width{checkedSize(_width, "width")},
+                                                                m_height{checkedSize(_height, "height")},
+                                                                m_iterations{_iterations},
+                                                                m_simdLevel{detectSimdLevel()},
+                                                                m_pressureSolver{PressureSolver::create(PressureSolver::Settings{}, _width, _height)}
+{
+    m_workspace.add<float>(_width * _height, _width);
+    m_workspace.add<float>(_width * _height, _width);
+    m_workspace.allocate(nullptr);
+    m_scratch[0] = m_workspace.array<float>(0);
+    m_scratch[1] = m_workspace.array<float>(1);
+}
+
+void Fluid::setThreadPool(ThreadPool *_pool)
+{
+    m_pool = _pool;
+    m_workspace.allocate(_pool);
+    m_scratch[0] = m_workspace.array<float>(0);
+    m_scratch[1] = m_workspace.array<float>(1);
+    for (size_t i = 0; i < 2; i++)
+    {
+        m_tileScratch[i].allocate(_pool);
+    }
+    m_pressureSolver->placeArrays(_pool);
+}
+
+void Fluid::setPressureSolver(const PressureSolver::Settings &_settings)
 {
-    for (int i = 1; i < c_size - 1; i++)
+    m_pressureSolver = PressureSolver::create(_settings, m_width, m_height, m_pool);
+}
+
+float *Fluid::tileScratch(size_t _index, size_t _count)
+{
+    if (m_tileScratchSize[_index] < _count)
     {
-        _x->at(IX(i, 0)) = _b == Boundary::Y ? -_x->at(IX(i, 1)) : _x->at(IX(i, 1));
-        _x->at(IX(i, c_size - 1)) = _b == Boundary::Y ? -_x->at(IX(i, c_size - 2)) : _x->at(IX(i, c_size - 2));
+        m_tileScratch[_index] = Workspace();
+        m_tileScratch[_index].add<float>(_count, m_width);
+        m_tileScratch[_index].allocate(m_pool);
+        m_tileScratchSize[_index] = _count;
     }
-    for (int j = 1; j < c_size - 1; j++)
+    return m_tileScratch[_index].array<float>(0);
+}
+
+void Fluid::clearDeactivated()
+{
+    if (m_mask != nullptr)
     {
-        _x->at(IX(0, j)) = _b == Boundary::X ? -_x->at(IX(1, j)) : _x->at(IX(1, j));
-        _x->at(IX(c_size - 1, j)) = _b == Boundary::X ? -_x->at(IX(c_size - 2, j)) : _x->at(IX(c_size - 2, j));
+        m_mask->clearDeactivated(m_scratch[0]);
+        m_mask->clearDeactivated(m_scratch[1]);
     }
+}
 
-    _x->at(IX(0, 0)) = 0.5f * (_x->at(IX(1, 0)) + _x->at(IX(0, 1)));
-    _x->at(IX(0, c_size - 1)) = 0.5f * (_x->at(IX(1, c_size - 1)) + _x->at(IX(0, c_size - 2)));
-    _x->at(IX(c_size - 1, 0)) = 0.5f * (_x->at(IX(c_size - 2, 0)) + _x->at(IX(c_size - 1, 1)));
-    _x->at(IX(c_size - 1, c_size - 1)) = 0.5f * (_x->at(IX(c_size - 2, c_size - 1)) + _x->at(IX(c_size - 1, c_size - 2)));
+void Fluid::set_boundary(Boundary _b, std::vector<float> *_x) const
+{
+    assert(_x->size() == numCells());
+    set_boundary(_b, _x->data());
 }
 
-void Fluid::linear_solve(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _a, float _c)
+void Fluid::set_boundary(Boundary _b, float *_x) const
+{
+    const size_t top = IX(0, m_height - 1);
+    for (size_t i = 1; i < m_width - 1; i++)
+    {
+        _x[i] = _b == Boundary::Y ? -_x[i + m_width] : _x[i + m_width];
+        _x[top + i] = _b == Boundary::Y ? -_x[top + i - m_width] : _x[top + i - m_width];
+    }
+    for (size_t j = 1; j < m_height - 1; j++)
+    {
+        float *row = _x + IX(0, j);
+        row[0] = _b == Boundary::X ? -row[1] : row[1];
+        row[m_width - 1] = _b == Boundary::X ? -row[m_width - 2] : row[m_width - 2];
+    }
+
+    _x[IX(0, 0)] = 0.5f * (_x[IX(1, 0)] + _x[IX(0, 1)]);
+    _x[IX(0, m_height - 1)] = 0.5f * (_x[IX(1, m_height - 1)] + _x[IX(0, m_height - 2)]);
+    _x[IX(m_width - 1, 0)] = 0.5f * (_x[IX(m_width - 2, 0)] + _x[IX(m_width - 1, 1)]);
+    _x[IX(m_width - 1, m_height - 1)] = 0.5f * (_x[IX(m_width - 2, m_height - 1)] + _x[IX(m_width - 1, m_height - 2)]);
+}
+
+void Fluid::linear_solve(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _a, float _c, SolveMode _mode)
+{
+    assert(_x->size() == numCells() && _x0->size() == numCells());
+    linear_solve(_b, _x->data(), _x0->data(), _a, _c, _mode);
+}
+
+void Fluid::linear_solve(Boundary _b, float *_x, const float *_x0, float _a, float _c, SolveMode _mode)
 {
     float cRecip = 1.0f / _c;
-    for (int k = 0; k < c_iter; k++)
+
+    if (m_sweepsPerTile > 1 && m_iterations > 1 && m_mask == nullptr)
+    {
+        linearSolveTiled(_b, _x, _x0, _a, cRecip, _mode);
+        return;
+    }
+
+    switch (_mode)
+    {
+    case SolveMode::GaussSeidel:
+        // every cell reads the cells already updated this sweep, so this ordering has to stay on one thread
+        dispatchWidth(m_width, [&](auto _w) {
+            const size_t w = _w();
+            for (int k = 0; k < m_iterations; k++)
+            {
+                activeRows(m_mask, 1, m_height - 1, w, [&](size_t _j, size_t _i0, size_t _i1) {
+                    for (size_t i = _i0; i < _i1; i++)
+                    {
+                        const size_t c = i + _j * w;
+                        _x[c] = (_x0[c] + _a * (_x[c + 1] + _x[c - 1] + _x[c + w] + _x[c - w])) * cRecip;
+                    }
+                });
+
+                set_boundary(_b, _x);
+            }
+        });
+        break;
+    case SolveMode::RedBlack:
+    {
+        const StencilKernels &kernels = stencilKernels(m_simdLevel);
+        for (int k = 0; k < m_iterations; k++)
+        {
+            // cell (i, j) is red when i + j is even, the first interior cell of row j is i = 1
+            for (size_t colour = 0; colour < 2; colour++)
+            {
+                parallelRows(1, m_height - 1, [&](size_t _first, size_t _last) {
+                    activeRows(m_mask, _first, _last, m_width, [&](size_t _j, size_t _i0, size_t _i1) {
+                        const size_t row = IX(_i0, _j);
+                        kernels.redBlackRow(_x + row, _x0 + row, m_width, _i1 - _i0, (_i0 + _j + colour) % 2, _a,
+                                            cRecip);
+                    });
+                });
+            }
+
+            set_boundary(_b, _x);
+        }
+        break;
+    }
+    case SolveMode::Jacobi:
+    {
+        const StencilKernels &kernels = stencilKernels(m_simdLevel);
+        // X and Y solves get their own scratch field so the two diffusions can run concurrently
+        float *src = _x;
+        float *dst = m_scratch[_b == Boundary::Y ? 1 : 0];
+        for (int k = 0; k < m_iterations; k++)
+        {
+            parallelRows(1, m_height - 1, [&](size_t _first, size_t _last) {
+                activeRows(m_mask, _first, _last, m_width, [&](size_t _j, size_t _i0, size_t _i1) {
+                    const size_t row = IX(_i0, _j);
+                    kernels.jacobiRow(dst + row, src + row - m_width, src + row, src + row + m_width, _x0 + row,
+                                      _i1 - _i0, _a, cRecip);
+                });
+            });
+
+            set_boundary(_b, dst);
+            std::swap(src, dst);
+        }
+        if (src != _x && m_mask == nullptr)
+        {
+            std::memcpy(_x, src, numCells() * sizeof(float));
+        }
+        else if (src != _x)
+        {
+            // the inactive tiles are zero in both fields, the boundary rows and columns are part of their tiles
+            for (size_t j = 0; j < m_height; j++)
+            {
+                for (const ActivityMask::Span &span : m_mask->spans(j))
+                {
+                    std::memcpy(_x + IX(span.begin, j), src + IX(span.begin, j), (span.end - span.begin) * sizeof(float));
+                }
+            }
+        }
+        break;
+    }
+    }
+}
+
+void Fluid::linearSolveTiled(Boundary _b, float *_x, const float *_x0, float _a, float _cRecip, SolveMode _mode)
+{
+    // Each sweep trails the one before it far enough that every cell reads exactly the values it would if the sweeps
+    // ran one after another, and the boundary is set one row at a time as set_boundary would, so the result is
+    // identical to linear_solve without tiling.
+    const size_t w = m_width;
+    const size_t h = m_height;
+    const size_t interior = w - 2;
+    const size_t interiorRows = h - 2;
+    const float edgeSign = _b == Boundary::X ? -1.0f : 1.0f;
+    const float outerSign = _b == Boundary::Y ? -1.0f : 1.0f;
+    const StencilKernels &kernels = stencilKernels(m_simdLevel);
+    // X and Y solves run concurrently, so like m_scratch each gets its own rows
+    const size_t scratchIndex = _b == Boundary::Y ? 1 : 0;
+    // Jacobi sweeps ping-pong between the field and the scratch field as the untiled sweeps do
+    float *src = _x;
+    float *dst = m_scratch[scratchIndex];
+
+    // Threads each take a band of rows. A band also sweeps the rows around it that the last sweep depends on, into
+    // rows of its own, so bands never wait on each other. Only the rows next to a band are swept twice.
+    auto numBands = [&](size_t _halo) {
+        const size_t threads = m_pool != nullptr ? m_pool->numThreads() : 1;
+        return std::max<size_t>(1, std::min(threads, interiorRows / (4 * _halo)));
+    };
+    auto bandRows = [&](size_t _band, size_t _bands) {
+        return std::make_pair(1 + _band * interiorRows / _bands, 1 + (_band + 1) * interiorRows / _bands);
+    };
+
+    for (int done = 0; done < m_iterations; done += m_sweepsPerTile)
     {
-        for (int j = 1; j < c_size - 1; j++)
+        const int sweeps = std::min(m_sweepsPerTile, m_iterations - done);
+        const size_t depth = static_cast<size_t>(sweeps);
+
+        switch (_mode)
+        {
+        case SolveMode::GaussSeidel:
+            // a row reads the row above from the previous sweep, so each sweep can run one row behind the last
+            dispatchWidth(w, [&](auto _w) {
+                const size_t fixedW = _w();
+                wavefront(1, h - 1, sweeps, 1, [&](int, size_t _j) {
+                    float *row = _x + _j * fixedW;
+                    const float *x0 = _x0 + _j * fixedW;
+                    for (size_t i = 1; i < fixedW - 1; i++)
+                    {
+                        row[i] = (x0[i] + _a * (row[i + 1] + row[i - 1] + row[i + fixedW] + row[i - fixedW])) * _cRecip;
+                    }
+                    setRowBoundary([&](size_t _r) { return _x + _r * fixedW; }, _j, fixedW, h, edgeSign, outerSign);
+                });
+            });
+            break;
+        case SolveMode::RedBlack:
         {
-            for (int i = 1; i < c_size - 1; i++)
+            // Sweep the rows [_lo + 1, _hi - 1) of a window of the field that starts at row _lo. Red cells of a row
+            // read black cells from the rows either side, and the black cells then read the new red ones, so each
+            // sweep updates the reds of row j then the blacks of row j - 1 and runs two rows behind the last.
+            auto sweepWindow = [&](float *_window, size_t _lo, size_t _hi) {
+                auto rowOf = [&](size_t _r) { return _window + (_r - _lo) * w; };
+                wavefront(_lo + 1, _hi, sweeps, 2, [&](int, size_t _j) {
+                    if (_j < _hi - 1)
+                    {
+                        kernels.redBlackRow(rowOf(_j) + 1, _x0 + _j * w + 1, w, interior, (1 + _j) % 2, _a, _cRecip);
+                    }
+                    if (_j > _lo + 1)
+                    {
+                        kernels.redBlackRow(rowOf(_j - 1) + 1, _x0 + (_j - 1) * w + 1, w, interior, (_j - 1) % 2, _a,
+                                            _cRecip);
+                        setRowBoundary(rowOf, _j - 1, w, h, edgeSign, outerSign);
+                    }
+                });
+            };
+
+            const size_t halo = 2 * depth;
+            const size_t bands = numBands(halo);
+            if (bands == 1)
             {
-                _x->at(IX(i, j)) =
-                    (_x0->at(IX(i, j)) + _a * (_x->at(IX(i + 1, j)) + _x->at(IX(i - 1, j)) + _x->at(IX(i, j + 1)) + _x->at(IX(i, j - 1)))) * cRecip;
+                sweepWindow(_x, 0, h);
+                break;
             }
+
+            // Each band copies its rows and two rows per sweep either side, which is as far as a change can travel in
+            // its sweeps. The rows at the edge of the copy go stale but never reach the band's own rows.
+            const size_t windowRows = (interiorRows + bands - 1) / bands + 2 * halo + 2;
+            float *copies = tileScratch(scratchIndex, bands * windowRows * w);
+            auto window = [&](size_t _band) {
+                std::pair<size_t, size_t> rows = bandRows(_band, bands);
+                return std::make_pair(rows.first > halo ? rows.first - halo : 0, std::min(h, rows.second + halo));
+            };
+            parallelRows(0, bands, [&](size_t _first, size_t _last) {
+                for (size_t band = _first; band < _last; band++)
+                {
+                    std::pair<size_t, size_t> rows = window(band);
+                    std::memcpy(copies + band * windowRows * w, _x + rows.first * w,
+                                (rows.second - rows.first) * w * sizeof(float));
+                }
+            });
+            parallelRows(0, bands, [&](size_t _first, size_t _last) {
+                for (size_t band = _first; band < _last; band++)
+                {
+                    float *copy = copies + band * windowRows * w;
+                    std::pair<size_t, size_t> rows = window(band);
+                    sweepWindow(copy, rows.first, rows.second);
+
+                    // the first and last bands also own the bottom and top boundary rows
+                    std::pair<size_t, size_t> owned = bandRows(band, bands);
+                    owned.first -= owned.first == 1 ? 1 : 0;
+                    owned.second += owned.second == h - 1 ? 1 : 0;
+                    std::memcpy(_x + owned.first * w, copy + (owned.first - rows.first) * w,
+                                (owned.second - owned.first) * w * sizeof(float));
+                }
+            });
+            break;
         }
+        case SolveMode::Jacobi:
+        {
+            // Each sweep reads the rows either side from the last one, so runs one row behind it. A sweep's rows are
+            // only needed until the next sweep has moved past them, so all but the last sweep write to a ring of
+            // four rows, and only the first and last touch the full fields.
+            const size_t ringRows = 4;
+            const size_t bands = numBands(depth);
+            const size_t bandScratch = (depth - 1) * ringRows * w;
+            float *rings = tileScratch(scratchIndex, bands * bandScratch);
 
-        set_boundary(_b, _x);
+            parallelRows(0, bands, [&](size_t _first, size_t _last) {
+                for (size_t band = _first; band < _last; band++)
+                {
+                    float *ring = rings + band * bandScratch;
+                    const std::pair<size_t, size_t> rows = bandRows(band, bands);
+                    auto rowOf = [&](int _k, size_t _r) {
+                        if (_k < 0)
+                        {
+                            return src + _r * w;
+                        }
+                        if (_k == sweeps - 1)
+                        {
+                            return dst + _r * w;
+                        }
+                        return ring + (static_cast<size_t>(_k) * ringRows + _r % ringRows) * w;
+                    };
+
+                    // sweep k covers the band and the sweeps - 1 - k rows either side the later sweeps read
+                    const size_t lo = rows.first > depth - 1 ? std::max<size_t>(1, rows.first - (depth - 1)) : 1;
+                    const size_t hi = std::min(h - 1, rows.second + depth - 1);
+                    wavefront(lo, hi, sweeps, 1, [&](int _k, size_t _j) {
+                        const size_t reach = depth - 1 - static_cast<size_t>(_k);
+                        if (_j + reach < rows.first || _j >= rows.second + reach)
+                        {
+                            return;
+                        }
+                        kernels.jacobiRow(rowOf(_k, _j) + 1, rowOf(_k - 1, _j - 1) + 1, rowOf(_k - 1, _j) + 1,
+                                          rowOf(_k - 1, _j + 1) + 1, _x0 + _j * w + 1, interior, _a, _cRecip);
+                        setRowBoundary([&](size_t _r) { return rowOf(_k, _r); }, _j, w, h, edgeSign, outerSign);
+                    });
+                }
+            });
+
+            std::swap(src, dst);
+            break;
+        }
+        }
+    }
+
+    if (src != _x)
+    {
+        std::memcpy(_x, src, numCells() * sizeof(float));
     }
 }
 
 void Fluid::diffuse(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _diff, float _dt)
 {
-    float a = _dt * _diff * (c_size - 2) * (c_size - 2);
-    linear_solve(_b, _x, _x0, a, 1 + 4 * a);
+    assert(_x->size() == numCells() && _x0->size() == numCells());
+    diffuse(_b, _x->data(), _x0->data(), _diff, _dt, m_solveMode);
+}
+
+void Fluid::diffuse(Boundary _b, float *_x, const float *_x0, float _diff, float _dt, SolveMode _mode)
+{
+    float a = _dt * _diff * (m_width - 2) * (m_height - 2);
+    linear_solve(_b, _x, _x0, a, 1 + 4 * a, _mode);
+}
+
+void Fluid::advect(Boundary _b, std::vector<float> *_d, std::vector<float> *_d0, std::vector<float> *_velocX, std::vector<float> *_velocY, float _dt) const
+{
+    assert(_d->size() == numCells() && _d0->size() == numCells());
+    assert(_velocX->size() == numCells() && _velocY->size() == numCells());
+    advect(_b, _d->data(), _d0->data(), _velocX->data(), _velocY->data(), _dt);
 }
 
-void Fluid::advect(Boundary _b, std::vector<float> *_d, std::vector<float> *_d0, std::vector<float> *_velocX, std::vector<float> *_velocY, float _dt)
+void Fluid::advect(Boundary _b, float *_d, const float *_d0, const float *_velocX, const float *_velocY, float _dt) const
 {
-    float i0, i1, j0, j1;
+    float *FLUID_RESTRICT d = _d;
+    const float *FLUID_RESTRICT d0 = _d0;
+    const float *FLUID_RESTRICT velocX = _velocX;
+    const float *FLUID_RESTRICT velocY = _velocY;
 
-    float dtx = _dt * (c_size - 2);
-    float dty = _dt * (c_size - 2);
+    float dtx = _dt * (m_width - 2);
+    float dty = _dt * (m_height - 2);
 
-    float s0, s1, t0, t1;
-    float tmp1, tmp2, x, y;
+    // keep the back-traced point inside the interior so the four samples never leave the grid
+    float maxX = static_cast<float>(m_width) - 1.5f;
+    float maxY = static_cast<float>(m_height) - 1.5f;
 
-    float Nfloat = static_cast<float>(c_size);
-    int i, j;
-    float ifloat, jfloat;
+    dispatchWidth(m_width, [&](auto _w) {
+        parallelRows(1, m_height - 1, [&](size_t _first, size_t _last) {
+            const size_t w = _w();
+            activeRows(m_mask, _first, _last, w, [&](size_t _j, size_t _i0, size_t _i1) {
+                const float jfloat = static_cast<float>(_j);
+                size_t i;
+                float ifloat;
+                for (i = _i0, ifloat = static_cast<float>(_i0); i < _i1; i++, ifloat++)
+                {
+                    float tmp1 = dtx * velocX[i + _j * w];
+                    float tmp2 = dty * velocY[i + _j * w];
+                    BilinearSample sample = backtrace(ifloat - tmp1, jfloat - tmp2, maxX, maxY);
+                    d[i + _j * w] = interpolate(d0, sample, w);
+                }
+            });
+        });
+    });
 
-    for (j = 1, jfloat = 1.0f; j < c_size - 1; j++, jfloat++)
+    set_boundary(_b, d);
+    if (m_advectionScheme != AdvectionScheme::SemiLagrangian)
     {
-        for (i = 1, ifloat = 1.0f; i < c_size - 1; i++, ifloat++)
-        {
-            tmp1 = dtx * _velocX->at(IX(i, j));
-            tmp2 = dty * _velocY->at(IX(i, j));
-            x = ifloat - tmp1;
-            y = jfloat - tmp2;
+        // X and Y are advected concurrently, so each traces back into its own scratch field
+        correctAdvection(_b, _d, _d0, m_scratch[_b == Boundary::Y ? 1 : 0], _velocX, _velocY, _dt);
+    }
+}
 
-            if (x < 0.5f)
-                x = 0.5f;
-            if (x > Nfloat + 0.5f)
-                x = Nfloat + 0.5f;
-            i0 = floorf(x);
-            i1 = i0 + 1.0f;
-            if (y < 0.5f)
-                y = 0.5f;
-            if (y > Nfloat + 0.5f)
-                y = Nfloat + 0.5f;
-            j0 = floorf(y);
-            j1 = j0 + 1.0f;
+void Fluid::correctAdvection(Boundary _b, float *_d, const float *_d0, float *_scratch, const float *_velocX,
+                             const float *_velocY, float _dt) const
+{
+    float *FLUID_RESTRICT d = _d;
+    const float *FLUID_RESTRICT d0 = _d0;
+    float *FLUID_RESTRICT scratch = _scratch;
+    const float *FLUID_RESTRICT velocX = _velocX;
+    const float *FLUID_RESTRICT velocY = _velocY;
 
-            s1 = x - i0;
-            s0 = 1.0f - s1;
-            t1 = y - j0;
-            t0 = 1.0f - t1;
+    const float dtx = _dt * (m_width - 2);
+    const float dty = _dt * (m_height - 2);
+    const float maxX = static_cast<float>(m_width) - 1.5f;
+    const float maxY = static_cast<float>(m_height) - 1.5f;
+    const bool bfecc = m_advectionScheme == AdvectionScheme::BFECC;
 
-            int i0i = static_cast<int>(i0);
-            int i1i = static_cast<int>(i1);
-            int j0i = static_cast<int>(j0);
-            int j1i = static_cast<int>(j1);
+    // trace the advected field forwards, which would give back _d0 if advecting lost nothing. MacCormack keeps what
+    // came back to correct the result, BFECC corrects the source by half the error straight away
+    dispatchWidth(m_width, [&](auto _w) {
+        parallelRows(1, m_height - 1, [&](size_t _first, size_t _last) {
+            const size_t w = _w();
+            activeRows(m_mask, _first, _last, w, [&](size_t _j, size_t _i0, size_t _i1) {
+                const float jfloat = static_cast<float>(_j);
+                size_t i;
+                float ifloat;
+                for (i = _i0, ifloat = static_cast<float>(_i0); i < _i1; i++, ifloat++)
+                {
+                    const size_t c = i + _j * w;
+                    BilinearSample sample = backtrace(ifloat + dtx * velocX[c], jfloat + dty * velocY[c], maxX, maxY);
+                    scratch[c] = interpolate(d, sample, w);
+                }
+                if (bfecc)
+                {
+                    for (i = _i0; i < _i1; i++)
+                    {
+                        const size_t c = i + _j * w;
+                        scratch[c] = d0[c] + 0.5f * (d0[c] - scratch[c]);
+                    }
+                }
+            });
+        });
+    });
 
-            _d->at(IX(i, j)) =
-                s0 * (t0 * _d0->at(IX(i0i, j0i)) + t1 * _d0->at(IX(i0i, j1i))) +
-                s1 * (t0 * _d0->at(IX(i1i, j0i)) + t1 * _d0->at(IX(i1i, j1i)));
-        }
+    if (bfecc)
+    {
+        set_boundary(_b, scratch);
     }
+    dispatchWidth(m_width, [&](auto _w) {
+        parallelRows(1, m_height - 1, [&](size_t _first, size_t _last) {
+            const size_t w = _w();
+            activeRows(m_mask, _first, _last, w, [&](size_t _j, size_t _i0, size_t _i1) {
+                const float jfloat = static_cast<float>(_j);
+                size_t i;
+                float ifloat;
+                if (bfecc)
+                {
+                    // advect the corrected source
+                    for (i = _i0, ifloat = static_cast<float>(_i0); i < _i1; i++, ifloat++)
+                    {
+                        const size_t c = i + _j * w;
+                        BilinearSample sample =
+                            backtrace(ifloat - dtx * velocX[c], jfloat - dty * velocY[c], maxX, maxY);
+                        d[c] = limitToSample(interpolate(scratch, sample, w), d0, sample, w);
+                    }
+                    return;
+                }
+                // add back half the error to the result
+                for (i = _i0, ifloat = static_cast<float>(_i0); i < _i1; i++, ifloat++)
+                {
+                    const size_t c = i + _j * w;
+                    BilinearSample sample = backtrace(ifloat - dtx * velocX[c], jfloat - dty * velocY[c], maxX, maxY);
+                    d[c] = limitToSample(d[c] + 0.5f * (d0[c] - scratch[c]), d0, sample, w);
+                }
+            });
+        });
+    });
 
-    set_boundary(_b, _d);
+    set_boundary(_b, d);
 }
 
-void Fluid::project(std::vector<float> *_velocX, std::vector<float> *_velocY, std::vector<float> *_p, std::vector<float> *_div)
+void Fluid::advectFields(float *const *_d, const float *const *_d0, size_t _count, const float *_velocX,
+                         const float *_velocY, float _dt) const
 {
+    const float *FLUID_RESTRICT velocX = _velocX;
+    const float *FLUID_RESTRICT velocY = _velocY;
+
+    const float dtx = _dt * (m_width - 2);
+    const float dty = _dt * (m_height - 2);
+    const float maxX = static_cast<float>(m_width) - 1.5f;
+    const float maxY = static_cast<float>(m_height) - 1.5f;
+
+    dispatchWidth(m_width, [&](auto _w) {
+        parallelRows(1, m_height - 1, [&](size_t _first, size_t _last) {
+            const size_t w = _w();
+            // trace a block of cells back once, then interpolate each field over the block while the samples are
+            // still in L1
+            BilinearSample samples[c_advectBlock];
+            activeRows(m_mask, _first, _last, w, [&](size_t _j, size_t _i0, size_t _i1) {
+                const float jfloat = static_cast<float>(_j);
+                for (size_t block = _i0; block < _i1; block += c_advectBlock)
+                {
+                    const size_t count = std::min(c_advectBlock, _i1 - block);
+                    float ifloat = static_cast<float>(block);
+                    for (size_t k = 0; k < count; k++, ifloat++)
+                    {
+                        const size_t c = block + k + _j * w;
+                        samples[k] = backtrace(ifloat - dtx * velocX[c], jfloat - dty * velocY[c], maxX, maxY);
+                    }
+                    for (size_t n = 0; n < _count; n++)
+                    {
+                        float *FLUID_RESTRICT d = _d[n] + block + _j * w;
+                        const float *FLUID_RESTRICT d0 = _d0[n];
+                        for (size_t k = 0; k < count; k++)
+                        {
+                            d[k] = interpolate(d0, samples[k], w);
+                        }
+                    }
+                }
+            });
+        });
+    });
 
-    for (int j = 1; j < c_size - 1; j++)
+    for (size_t n = 0; n < _count; n++)
     {
-        for (int i = 1; i < c_size - 1; i++)
+        set_boundary(Boundary::None, _d[n]);
+    }
+    if (m_advectionScheme != AdvectionScheme::SemiLagrangian)
+    {
+        for (size_t n = 0; n < _count; n++)
         {
-            _div->at(IX(i, j)) = -0.5f * (_velocX->at(IX(i + 1, j)) - _velocX->at(IX(i - 1, j)) + _velocY->at(IX(i, j + 1)) - _velocY->at(IX(i, j - 1))) / c_size;
-            _p->at(IX(i, j)) = 0;
+            correctAdvection(Boundary::None, _d[n], _d0[n], m_scratch[0], _velocX, _velocY, _dt);
         }
     }
+}
 
-    set_boundary(Boundary::None, _div);
-    set_boundary(Boundary::None, _p);
-    linear_solve(Boundary::None, _p, _div, 1, 6);
+void Fluid::project(std::vector<float> *_velocX, std::vector<float> *_velocY, std::vector<float> *_p, std::vector<float> *_div)
+{
+    assert(_velocX->size() == numCells() && _velocY->size() == numCells());
+    assert(_p->size() == numCells() && _div->size() == numCells());
+    project(_velocX->data(), _velocY->data(), _p->data(), _div->data());
+}
 
-    for (int j = 1; j < c_size - 1; j++)
+void Fluid::project(float *_velocX, float *_velocY, float *_p, float *_div)
+{
+    float *FLUID_RESTRICT velocX = _velocX;
+    float *FLUID_RESTRICT velocY = _velocY;
+    float *FLUID_RESTRICT p = _p;
+    float *FLUID_RESTRICT div = _div;
+
+    float Wfloat = static_cast<float>(m_width);
+    float Hfloat = static_cast<float>(m_height);
+
+    dispatchWidth(m_width, [&](auto _w) {
+        parallelRows(1, m_height - 1, [&](size_t _first, size_t _last) {
+            const size_t w = _w();
+            activeRows(m_mask, _first, _last, w, [&](size_t _j, size_t _i0, size_t _i1) {
+                for (size_t i = _i0; i < _i1; i++)
+                {
+                    const size_t c = i + _j * w;
+                    div[c] = -0.5f * ((velocX[c + 1] - velocX[c - 1]) / Wfloat + (velocY[c + w] - velocY[c - w]) / Hfloat);
+                    p[c] = 0;
+                }
+            });
+        });
+    });
+
+    set_boundary(Boundary::None, div);
+    set_boundary(Boundary::None, p);
+    m_pressureSolver->solve(*this, p, div);
+
+    dispatchWidth(m_width, [&](auto _w) {
+        parallelRows(1, m_height - 1, [&](size_t _first, size_t _last) {
+            const size_t w = _w();
+            activeRows(m_mask, _first, _last, w, [&](size_t _j, size_t _i0, size_t _i1) {
+                for (size_t i = _i0; i < _i1; i++)
+                {
+                    const size_t c = i + _j * w;
+                    velocX[c] -= 0.5f * (p[c + 1] - p[c - 1]) * Wfloat;
+                    velocY[c] -= 0.5f * (p[c + w] - p[c - w]) * Hfloat;
+                }
+            });
+        });
+    });
+    set_boundary(Boundary::X, velocX);
+    set_boundary(Boundary::Y, velocY);
+    if (m_mask != nullptr && m_pressureSolver->type() != PressureSolver::Type::Relaxation)
     {
-        for (int i = 1; i < c_size - 1; i++)
-        {
-            _velocX->at(IX(i, j)) -= 0.5f * (_p->at(IX(i + 1, j)) - _p->at(IX(i - 1, j))) * c_size;
-            _velocY->at(IX(i, j)) -= 0.5f * (_p->at(IX(i, j + 1)) - _p->at(IX(i, j - 1))) * c_size;
-        }
+        // the other solvers cover the whole grid, but every field must be zero in the inactive tiles
+        m_mask->clearInactive(p);
     }
-    set_boundary(Boundary::X, _velocX);
-    set_boundary(Boundary::Y, _velocY);
-}
\ No newline at end of file
+}
+
+void Fluid::divergence(const float *_velocX, const float *_velocY, float *_p, float *_div) const
+{
+    const float Wfloat = static_cast<float>(m_width);
+    const float Hfloat = static_cast<float>(m_height);
+
+    dispatchWidth(m_width, [&](auto _w) {
+        parallelRows(1, m_height - 1, [&](size_t _first, size_t _last) {
+            const size_t w = _w();
+            for (size_t j = _first; j < _last; j++)
+            {
+                divergenceRow(j, w, m_height, _div, _p, _velocX, _velocY + (j - 1) * w, _velocY + (j + 1) * w, Wfloat,
+                              Hfloat);
+            }
+        });
+    });
+}
+
+void Fluid::solvePressure(float *_p, const float *_div)
+{
+    m_pressureSolver->solve(*this, _p, _div);
+}
+
+void Fluid::subtractGradient(float *_velocX, float *_velocY, const float *_p) const
+{
+    float *FLUID_RESTRICT velocX = _velocX;
+    float *FLUID_RESTRICT velocY = _velocY;
+    const float *FLUID_RESTRICT p = _p;
+
+    const float Wfloat = static_cast<float>(m_width);
+    const float Hfloat = static_cast<float>(m_height);
+
+    dispatchWidth(m_width, [&](auto _w) {
+        parallelRows(1, m_height - 1, [&](size_t _first, size_t _last) {
+            const size_t w = _w();
+            for (size_t j = _first; j < _last; j++)
+            {
+                for (size_t i = 1; i < w - 1; i++)
+                {
+                    const size_t c = i + j * w;
+                    velocX[c] -= 0.5f * (p[c + 1] - p[c - 1]) * Wfloat;
+                    velocY[c] -= 0.5f * (p[c + w] - p[c - w]) * Hfloat;
+                }
+                velocityBoundaryRow(j, w, m_height, velocX, velocY);
+            }
+        });
+    });
+}
+
+void Fluid::advectVelocity(float *_velocX, float *_velocY, const float *_velocX0, const float *_velocY0, float _dt,
+                           float *_p, float *_div)
+{
+    float *FLUID_RESTRICT velocX = _velocX;
+    float *FLUID_RESTRICT velocY = _velocY;
+    const float *FLUID_RESTRICT velocX0 = _velocX0;
+    const float *FLUID_RESTRICT velocY0 = _velocY0;
+
+    const float dtx = _dt * (m_width - 2);
+    const float dty = _dt * (m_height - 2);
+    const float maxX = static_cast<float>(m_width) - 1.5f;
+    const float maxY = static_cast<float>(m_height) - 1.5f;
+    const float Wfloat = static_cast<float>(m_width);
+    const float Hfloat = static_cast<float>(m_height);
+    const size_t h = m_height;
+
+    // the divergence of a row needs the Y velocity of the rows either side, so each thread recomputes the row just
+    // outside its range into scratch rather than waiting for the thread that owns it
+    float *haloAbove = m_scratch[0];
+    float *haloBelow = m_scratch[1];
+
+    dispatchWidth(m_width, [&](auto _w) {
+        parallelRows(1, h - 1, [&](size_t _first, size_t _last) {
+            const size_t w = _w();
+            auto advectRow = [&](size_t _j, float *_rowX, float *_rowY) {
+                const float jfloat = static_cast<float>(_j);
+                float ifloat = 1.0f;
+                for (size_t i = 1; i < w - 1; i++, ifloat++)
+                {
+                    const size_t c = i + _j * w;
+                    BilinearSample sample = backtrace(ifloat - dtx * velocX0[c], jfloat - dty * velocY0[c], maxX, maxY);
+                    _rowX[i] = interpolate(velocX0, sample, w);
+                    _rowY[i] = interpolate(velocY0, sample, w);
+                }
+            };
+            auto advectRowY = [&](size_t _j, float *_rowY) {
+                const float jfloat = static_cast<float>(_j);
+                float ifloat = 1.0f;
+                for (size_t i = 1; i < w - 1; i++, ifloat++)
+                {
+                    const size_t c = i + _j * w;
+                    BilinearSample sample = backtrace(ifloat - dtx * velocX0[c], jfloat - dty * velocY0[c], maxX, maxY);
+                    _rowY[i] = interpolate(velocY0, sample, w);
+                }
+            };
+            // the Y velocity of row _j, the boundary rows are written by the thread owning the row next to them
+            auto rowY = [&](size_t _j) -> const float * {
+                if ((_j < _first && _j != 0) || (_j >= _last && _j != h - 1))
+                {
+                    return (_j < _first ? haloBelow : haloAbove) + _j * w;
+                }
+                return velocY + _j * w;
+            };
+            auto divergenceAt = [&](size_t _j) {
+                divergenceRow(_j, w, h, _div, _p, velocX, rowY(_j - 1), rowY(_j + 1), Wfloat, Hfloat);
+            };
+
+            if (_first > 1)
+            {
+                advectRowY(_first - 1, haloBelow + (_first - 1) * w);
+            }
+            for (size_t j = _first; j < _last; j++)
+            {
+                advectRow(j, velocX + j * w, velocY + j * w);
+                velocityBoundaryRow(j, w, h, velocX, velocY);
+                // a row behind, so the row above is done
+                if (j > _first)
+                {
+                    divergenceAt(j - 1);
+                }
+            }
+            if (_last < h - 1)
+            {
+                advectRowY(_last, haloAbove + _last * w);
+            }
+            divergenceAt(_last - 1);
+        });
+    });
+}
@@ -0,0 +1,449 @@
+/**
+ * @file Fluid3D.cpp
+ * @brief The methods of Fluid extended to a 3D grid for volumetric scenes, following the 3D version of the solver in
+ * https://www.dgp.toronto.edu/public_user/stam/reality/Research/pdf/GDC03.pdf.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "Fluid3D.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "StencilKernels.h"
+
+namespace
+{
+    /**
+     * @brief _cells, if a grid can have that many along an axis, as every loop steps over the boundary layers
+     */
+    size_t checkedSize(size_t _cells, const char *_axis)
+    {
+        if (_cells < c_minGridSize)
+        {
+            throw std::invalid_argument(std::string("a 3D fluid grid needs a ") + _axis + " of at least " +
+                                        std::to_string(c_minGridSize) + " cells, not " + std::to_string(_cells));
+        }
+        return _cells;
+    }
+
+    /**
+     * @brief The cache a slab of a relaxation sweep should fit in, about the size of a per-core L2
+     */
+    constexpr size_t c_slabCacheBytes = 256 * 1024;
+    /**
+     * @brief Slab rows held in cache per row of the slab: three slices of the field being read, the right-hand side
+     * and the field being written
+     */
+    constexpr size_t c_slabRowsPerRow = 5;
+
+    /**
+     * @brief The eight cells around a back-traced point and their trilinear weights
+     */
+    struct TrilinearSample
+    {
+        size_t i0, i1, j0, j1, k0, k1;
+        float s0, s1, t0, t1, u0, u1;
+    };
+
+    /**
+     * @brief Clamp a point inside the interior so the eight samples never leave the grid, and find them
+     */
+    inline TrilinearSample backtrace(float _x, float _y, float _z, float _maxX, float _maxY, float _maxZ)
+    {
+        float x = std::fmin(std::fmax(_x, 0.5f), _maxX);
+        float y = std::fmin(std::fmax(_y, 0.5f), _maxY);
+        float z = std::fmin(std::fmax(_z, 0.5f), _maxZ);
+        float i0 = std::floor(x);
+        float j0 = std::floor(y);
+        float k0 = std::floor(z);
+
+        TrilinearSample sample;
+        sample.s1 = x - i0;
+        sample.s0 = 1.0f - sample.s1;
+        sample.t1 = y - j0;
+        sample.t0 = 1.0f - sample.t1;
+        sample.u1 = z - k0;
+        sample.u0 = 1.0f - sample.u1;
+        sample.i0 = static_cast<size_t>(i0);
+        sample.i1 = sample.i0 + 1;
+        sample.j0 = static_cast<size_t>(j0);
+        sample.j1 = sample.j0 + 1;
+        sample.k0 = static_cast<size_t>(k0);
+        sample.k1 = sample.k0 + 1;
+        return sample;
+    }
+
+    inline float interpolate(const float *_d0, const TrilinearSample &_s, size_t _w, size_t _plane)
+    {
+        const float *back = _d0 + _s.k0 * _plane;
+        const float *front = _d0 + _s.k1 * _plane;
+        return _s.s0 * (_s.t0 * (_s.u0 * back[_s.i0 + _s.j0 * _w] + _s.u1 * front[_s.i0 + _s.j0 * _w]) +
+                        _s.t1 * (_s.u0 * back[_s.i0 + _s.j1 * _w] + _s.u1 * front[_s.i0 + _s.j1 * _w])) +
+               _s.s1 * (_s.t0 * (_s.u0 * back[_s.i1 + _s.j0 * _w] + _s.u1 * front[_s.i1 + _s.j0 * _w]) +
+                        _s.t1 * (_s.u0 * back[_s.i1 + _s.j1 * _w] + _s.u1 * front[_s.i1 + _s.j1 * _w]));
+    }
+}
+
+Fluid3D::Fluid3D(size_t _width, size_t _height, size_t _depth, int _iterations)
+    : m_width{checkedSize(_width, "width")},
+      m_height{checkedSize(_height, "height")},
+      m_depth{checkedSize(_depth, "depth")},
+      m_iterations{_iterations},
+      m_simdLevel{detectSimdLevel()}
+{
+    for (size_t i = 0; i < 3; i++)
+    {
+        m_workspace.add<float>(_width * _height * _depth, _width * _height);
+    }
+    m_workspace.allocate(nullptr);
+    bindScratch();
+    updateSlabRows();
+}
+
+void Fluid3D::bindScratch()
+{
+    for (size_t i = 0; i < 3; i++)
+    {
+        m_scratch[i] = m_workspace.array<float>(i);
+    }
+}
+
+void Fluid3D::setSlabRows(size_t _rows)
+{
+    m_requestedSlabRows = _rows;
+    updateSlabRows();
+}
+
+void Fluid3D::setThreadPool(ThreadPool *_pool)
+{
+    m_pool = _pool;
+    m_workspace.allocate(_pool);
+    bindScratch();
+    updateSlabRows();
+}
+
+void Fluid3D::updateSlabRows()
+{
+    const size_t interiorRows = m_height - 2;
+    size_t rows = m_requestedSlabRows;
+    if (rows == 0)
+    {
+        rows = c_slabCacheBytes / (c_slabRowsPerRow * m_width * sizeof(float));
+        // enough slabs to give every thread one
+        const size_t threads = m_pool != nullptr ? m_pool->numThreads() : 1;
+        rows = std::min(rows, (interiorRows + threads - 1) / threads);
+    }
+    m_slabRows = std::max<size_t>(1, std::min(rows, interiorRows));
+}
+
+void Fluid3D::set_boundary(Boundary _b, std::vector<float> *_x) const
+{
+    assert(_x->size() == numCells());
+    set_boundary(_b, _x->data());
+}
+
+void Fluid3D::set_boundary(Boundary _b, float *_x) const
+{
+    const size_t w = m_width;
+    const size_t h = m_height;
+    const size_t d = m_depth;
+    const size_t plane = w * h;
+    const float signX = _b == Boundary::X ? -1.0f : 1.0f;
+    const float signY = _b == Boundary::Y ? -1.0f : 1.0f;
+    const float signZ = _b == Boundary::Z ? -1.0f : 1.0f;
+
+    // the X and Y faces of each interior slice
+    parallelRows(1, d - 1, [&](size_t _first, size_t _last) {
+        for (size_t k = _first; k < _last; k++)
+        {
+            float *slice = _x + k * plane;
+            for (size_t j = 1; j < h - 1; j++)
+            {
+                float *row = slice + j * w;
+                row[0] = signX * row[1];
+                row[w - 1] = signX * row[w - 2];
+            }
+            for (size_t i = 1; i < w - 1; i++)
+            {
+                slice[i] = signY * slice[i + w];
+                slice[i + (h - 1) * w] = signY * slice[i + (h - 2) * w];
+            }
+        }
+    });
+
+    // the Z faces
+    float *back = _x;
+    float *front = _x + (d - 1) * plane;
+    for (size_t j = 1; j < h - 1; j++)
+    {
+        for (size_t i = 1; i < w - 1; i++)
+        {
+            const size_t c = i + j * w;
+            back[c] = signZ * back[c + plane];
+            front[c] = signZ * front[c - plane];
+        }
+    }
+
+    // the edges, from the two face cells next to them
+    for (size_t k : {size_t{0}, d - 1})
+    {
+        const size_t inK = k == 0 ? 1 : d - 2;
+        for (size_t j : {size_t{0}, h - 1})
+        {
+            const size_t inJ = j == 0 ? 1 : h - 2;
+            for (size_t i = 1; i < w - 1; i++)
+            {
+                _x[IX(i, j, k)] = 0.5f * (_x[IX(i, inJ, k)] + _x[IX(i, j, inK)]);
+            }
+        }
+        for (size_t i : {size_t{0}, w - 1})
+        {
+            const size_t inI = i == 0 ? 1 : w - 2;
+            for (size_t j = 1; j < h - 1; j++)
+            {
+                _x[IX(i, j, k)] = 0.5f * (_x[IX(inI, j, k)] + _x[IX(i, j, inK)]);
+            }
+        }
+    }
+    for (size_t j : {size_t{0}, h - 1})
+    {
+        const size_t inJ = j == 0 ? 1 : h - 2;
+        for (size_t i : {size_t{0}, w - 1})
+        {
+            const size_t inI = i == 0 ? 1 : w - 2;
+            for (size_t k = 1; k < d - 1; k++)
+            {
+                _x[IX(i, j, k)] = 0.5f * (_x[IX(inI, j, k)] + _x[IX(i, inJ, k)]);
+            }
+        }
+    }
+
+    // the corners, from the three edge cells next to them
+    for (size_t k : {size_t{0}, d - 1})
+    {
+        const size_t inK = k == 0 ? 1 : d - 2;
+        for (size_t j : {size_t{0}, h - 1})
+        {
+            const size_t inJ = j == 0 ? 1 : h - 2;
+            for (size_t i : {size_t{0}, w - 1})
+            {
+                const size_t inI = i == 0 ? 1 : w - 2;
+                _x[IX(i, j, k)] = (_x[IX(inI, j, k)] + _x[IX(i, inJ, k)] + _x[IX(i, j, inK)]) / 3.0f;
+            }
+        }
+    }
+}
+
+void Fluid3D::linear_solve(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _a, float _c,
+                           SolveMode _mode)
+{
+    assert(_x->size() == numCells() && _x0->size() == numCells());
+    linear_solve(_b, _x->data(), _x0->data(), _a, _c, _mode);
+}
+
+void Fluid3D::linear_solve(Boundary _b, float *_x, const float *_x0, float _a, float _c, SolveMode _mode)
+{
+    const float cRecip = 1.0f / _c;
+    const size_t w = m_width;
+    const size_t h = m_height;
+    const size_t plane = w * h;
+    const size_t interior = w - 2;
+    const size_t interiorRows = h - 2;
+    const size_t numSlabs = (interiorRows + m_slabRows - 1) / m_slabRows;
+    // _fn(j, k) for every interior row, a slab of rows at a time through every slice, slabs split across the threads
+    auto slabs = [&](auto &&_fn) {
+        parallelRows(0, numSlabs, [&](size_t _first, size_t _last) {
+            for (size_t slab = _first; slab < _last; slab++)
+            {
+                const size_t j0 = 1 + slab * m_slabRows;
+                const size_t j1 = std::min(h - 1, j0 + m_slabRows);
+                for (size_t k = 1; k < m_depth - 1; k++)
+                {
+                    for (size_t j = j0; j < j1; j++)
+                    {
+                        _fn(j, k);
+                    }
+                }
+            }
+        });
+    };
+
+    switch (_mode)
+    {
+    case SolveMode::GaussSeidel:
+        // every cell reads the cells already updated this sweep, so this ordering has to stay on one thread
+        for (int iteration = 0; iteration < m_iterations; iteration++)
+        {
+            for (size_t k = 1; k < m_depth - 1; k++)
+            {
+                for (size_t j = 1; j < h - 1; j++)
+                {
+                    for (size_t i = 1; i < w - 1; i++)
+                    {
+                        const size_t c = IX(i, j, k);
+                        _x[c] = (_x0[c] + _a * (_x[c + 1] + _x[c - 1] + _x[c + w] + _x[c - w] + _x[c + plane] +
+                                                _x[c - plane])) *
+                                cRecip;
+                    }
+                }
+            }
+            set_boundary(_b, _x);
+        }
+        break;
+    case SolveMode::RedBlack:
+    {
+        const StencilKernels &kernels = stencilKernels(m_simdLevel);
+        for (int iteration = 0; iteration < m_iterations; iteration++)
+        {
+            // cell (i, j, k) is red when i + j + k is even, the first interior cell of a row is i = 1
+            for (size_t colour = 0; colour < 2; colour++)
+            {
+                slabs([&](size_t _j, size_t _k) {
+                    const size_t row = IX(1, _j, _k);
+                    kernels.redBlackRow7(_x + row, _x0 + row, w, plane, interior, (1 + _j + _k + colour) % 2, _a,
+                                         cRecip);
+                });
+            }
+            set_boundary(_b, _x);
+        }
+        break;
+    }
+    case SolveMode::Jacobi:
+    {
+        const StencilKernels &kernels = stencilKernels(m_simdLevel);
+        // each velocity component gets its own scratch field so their diffusions can run concurrently
+        float *src = _x;
+        float *dst = m_scratch[_b == Boundary::None ? 0 : static_cast<size_t>(_b) - 1];
+        for (int iteration = 0; iteration < m_iterations; iteration++)
+        {
+            slabs([&](size_t _j, size_t _k) {
+                const size_t row = IX(1, _j, _k);
+                kernels.jacobiRow7(dst + row, src + row - w, src + row, src + row + w, src + row - plane,
+                                   src + row + plane, _x0 + row, interior, _a, cRecip);
+            });
+            set_boundary(_b, dst);
+            std::swap(src, dst);
+        }
+        if (src != _x)
+        {
+            std::memcpy(_x, src, numCells() * sizeof(float));
+        }
+        break;
+    }
+    }
+}
+
+void Fluid3D::diffuse(Boundary _b, std::vector<float> *_x, std::vector<float> *_x0, float _diff, float _dt)
+{
+    // scaled as the 2D solver scales it, so a slice diffuses at the same rate as a 2D grid of the same size
+    float a = _dt * _diff * (m_width - 2) * (m_height - 2);
+    linear_solve(_b, _x, _x0, a, 1 + 6 * a, m_solveMode);
+}
+
+void Fluid3D::advect(Boundary _b, std::vector<float> *_d, std::vector<float> *_d0, std::vector<float> *_velocX,
+                     std::vector<float> *_velocY, std::vector<float> *_velocZ, float _dt) const
+{
+    assert(_d->size() == numCells() && _d0->size() == numCells());
+    assert(_velocX->size() == numCells() && _velocY->size() == numCells() && _velocZ->size() == numCells());
+
+    float *FLUID_RESTRICT d = _d->data();
+    const float *FLUID_RESTRICT d0 = _d0->data();
+    const float *FLUID_RESTRICT velocX = _velocX->data();
+    const float *FLUID_RESTRICT velocY = _velocY->data();
+    const float *FLUID_RESTRICT velocZ = _velocZ->data();
+
+    const float dtx = _dt * (m_width - 2);
+    const float dty = _dt * (m_height - 2);
+    const float dtz = _dt * (m_depth - 2);
+    const float maxX = static_cast<float>(m_width) - 1.5f;
+    const float maxY = static_cast<float>(m_height) - 1.5f;
+    const float maxZ = static_cast<float>(m_depth) - 1.5f;
+    const size_t w = m_width;
+    const size_t plane = m_width * m_height;
+
+    parallelRows(1, m_depth - 1, [&](size_t _first, size_t _last) {
+        for (size_t k = _first; k < _last; k++)
+        {
+            const float kfloat = static_cast<float>(k);
+            for (size_t j = 1; j < m_height - 1; j++)
+            {
+                const float jfloat = static_cast<float>(j);
+                float ifloat = 1.0f;
+                for (size_t i = 1; i < w - 1; i++, ifloat++)
+                {
+                    const size_t c = IX(i, j, k);
+                    TrilinearSample sample = backtrace(ifloat - dtx * velocX[c], jfloat - dty * velocY[c],
+                                                       kfloat - dtz * velocZ[c], maxX, maxY, maxZ);
+                    d[c] = interpolate(d0, sample, w, plane);
+                }
+            }
+        }
+    });
+
+    set_boundary(_b, d);
+}
+
+void Fluid3D::project(std::vector<float> *_velocX, std::vector<float> *_velocY, std::vector<float> *_velocZ,
+                      std::vector<float> *_p, std::vector<float> *_div)
+{
+    assert(_velocX->size() == numCells() && _velocY->size() == numCells() && _velocZ->size() == numCells());
+    assert(_p->size() == numCells() && _div->size() == numCells());
+
+    float *FLUID_RESTRICT velocX = _velocX->data();
+    float *FLUID_RESTRICT velocY = _velocY->data();
+    float *FLUID_RESTRICT velocZ = _velocZ->data();
+    float *FLUID_RESTRICT p = _p->data();
+    float *FLUID_RESTRICT div = _div->data();
+
+    const float Wfloat = static_cast<float>(m_width);
+    const float Hfloat = static_cast<float>(m_height);
+    const float Dfloat = static_cast<float>(m_depth);
+    const size_t w = m_width;
+    const size_t plane = m_width * m_height;
+
+    parallelRows(1, m_depth - 1, [&](size_t _first, size_t _last) {
+        for (size_t k = _first; k < _last; k++)
+        {
+            for (size_t j = 1; j < m_height - 1; j++)
+            {
+                for (size_t i = 1; i < w - 1; i++)
+                {
+                    const size_t c = IX(i, j, k);
+                    div[c] = -0.5f * ((velocX[c + 1] - velocX[c - 1]) / Wfloat + (velocY[c + w] - velocY[c - w]) / Hfloat +
+                                      (velocZ[c + plane] - velocZ[c - plane]) / Dfloat);
+                    p[c] = 0;
+                }
+            }
+        }
+    });
+
+    set_boundary(Boundary::None, div);
+    set_boundary(Boundary::None, p);
+    linear_solve(Boundary::None, p, div, 1, 6, m_solveMode);
+
+    parallelRows(1, m_depth - 1, [&](size_t _first, size_t _last) {
+        for (size_t k = _first; k < _last; k++)
+        {
+            for (size_t j = 1; j < m_height - 1; j++)
+            {
+                for (size_t i = 1; i < w - 1; i++)
+                {
+                    const size_t c = IX(i, j, k);
+                    velocX[c] -= 0.5f * (p[c + 1] - p[c - 1]) * Wfloat;
+                    velocY[c] -= 0.5f * (p[c + w] - p[c - w]) * Hfloat;
+                    velocZ[c] -= 0.5f * (p[c + plane] - p[c - plane]) * Dfloat;
+                }
+            }
+        }
+    });
+    set_boundary(Boundary::X, velocX);
+    set_boundary(Boundary::Y, velocY);
+    set_boundary(Boundary::Z, velocZ);
+}
@@ -1,205 +1,558 @@
 /**
  * @file FluidGrid.cpp
- * @brief This class uses the Fluid solver and the NGL particle system to display a fluid to a screen
- * 
+ * @brief This class holds the state of a fluid simulation using the Fluid solver and moves tracer particles
+ * through the velocity field. It has no OpenGL or Qt dependencies, drawing is done by ParticleRenderer in the demo.
+ *
  * @copyright Copyright (c) 2021
  */
 
 #include "FluidGrid.h"
 
-#include <ngl/MultiBufferVAO.h>
-#include <ngl/NGLStream.h>
-#include <ngl/Random.h>
-#include <ngl/SimpleVAO.h>
-#include <ngl/Util.h>
-#include <ngl/VAOFactory.h>
-
-FluidGrid::FluidGrid(float viscosity, float dt) : m_numParticles{c_size * c_size},
-                                                  m_dt{dt},
-                                                  m_visc{viscosity},
-                                                  m_Vx(c_size * c_size),
-                                                  m_Vy(c_size * c_size),
-                                                  m_Vx0(c_size * c_size),
-                                                  m_Vy0(c_size * c_size),
-                                                  m_pos(m_numParticles),
-                                                  m_dir(m_numParticles)
-{
-    initGrid();
-
-    m_vao = ngl::VAOFactory::createVAO(ngl::multiBufferVAO, GL_POINTS);
-    m_vao->bind();
-    m_vao->setData(ngl::MultiBufferVAO::VertexData(m_pos.size() * sizeof(ngl::Vec3), m_pos[0].m_x));
-    m_vao->setVertexAttributePointer(0, 3, GL_FLOAT, 0, 0);
-    m_vao->setData(ngl::MultiBufferVAO::VertexData(m_dir.size() * sizeof(ngl::Vec3), m_dir[0].m_x));
-    m_vao->setVertexAttributePointer(1, 3, GL_FLOAT, 0, 0);
-    m_vao->setNumIndices(m_numParticles);
-    m_vao->unbind();
-
-    // Going to use a non NGL buffer as quicker
-    glGenVertexArrays(1, &m_svao);
-    glBindVertexArray(m_svao);
-    glGenBuffers(1, &m_vboID);
-    // now bind this to the VBO buffer
-    glBindBuffer(GL_ARRAY_BUFFER, m_vboID);
-    // allocate the buffer data we need two lots of vec3 one for pos one for dir use dynamic as we update
-    // per frame and it may be quicker
-    glBufferData(GL_ARRAY_BUFFER, (m_numParticles * 2) * sizeof(ngl::Vec3), 0, GL_DYNAMIC_DRAW);
-    // As we are using glBufferSubData later we can set these now and it will be the same.
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-    // The dir vec3 is going to be put at the end of the pos block
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, reinterpret_cast<float *>(m_numParticles * sizeof(ngl::Vec3)));
-    glEnableVertexAttribArray(1);
-
-    glBindVertexArray(0);
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <utility>
+
+#include "Checkpoint.h"
+
+namespace
+{
+    // the fraction of the frame budget a sub-step must stay under to win back a solver sweep
+    constexpr double c_budgetHeadroom = 0.85;
+    // particles per job when the update is split across threads, a multiple of every vector width
+    constexpr size_t c_particleBlock = 4096;
+}
+
+FluidGrid::FluidGrid(size_t width, size_t height, float viscosity, float dt, size_t numParticles) : m_fluid{width, height},
+                                                                                                    m_dt{dt},
+                                                                                                    m_visc{viscosity},
+                                                                                                    m_stepDt{dt},
+                                                                                                    m_rowSpeeds(height),
+                                                                                                    m_impulses{width, height},
+                                                                                                    m_particles{numParticles == 0 ? width * height : numParticles, width, height},
+                                                                                                    m_scalars{width, height}
+{
+    for (size_t field = 0; field < 4; field++)
+    {
+        m_arrays[field] = m_workspace.add<float>(width * height, width);
+    }
+    m_workspace.allocate(nullptr);
+    bindFields();
     resetVelocities();
 }
 
 void FluidGrid::step()
 {
-    diffuseX();
-    diffuseY();
+    const size_t heapAllocations = Workspace::heapAllocations();
+    const auto begin = std::chrono::steady_clock::now();
+    {
+        ScopedTimer stepTimer(m_profiler, Profiler::Stage::Step);
+        applyImpulses();
+        planStep();
+        const bool fused = m_fused && !m_mask && m_fluid.advectionScheme() == Fluid::AdvectionScheme::SemiLagrangian;
+        for (int subStep = 0; subStep < m_subSteps; subStep++)
+        {
+            if (fused)
+            {
+                stepFused();
+            }
+            else
+            {
+                stepSeparate();
+            }
+        }
+        ScopedTimer timer(m_profiler, Profiler::Stage::Particles);
+        updateParticles();
+    }
+    if (m_frameBudget > 0.0)
+    {
+        fitBudget(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+    }
+    m_stepAllocations = Workspace::heapAllocations() - heapAllocations;
+}
 
-    projectForwards();
+void FluidGrid::setFrameBudget(double _milliseconds)
+{
+    m_frameBudget = std::max(_milliseconds, 0.0);
+    m_subStepTime = 0.0;
+    m_fluid.setIterations(m_iterations);
+}
 
-    advectX();
-    advectY();
+float FluidGrid::maxSpeed()
+{
+    // in cells per unit time along each axis, as advect moves the fluid
+    const size_t w = width();
+    const float scaleX = static_cast<float>(w - 2);
+    const float scaleY = static_cast<float>(height() - 2);
+    auto rowSpeed = [&](size_t _j, size_t _i0, size_t _i1) {
+        float peak = 0.0f;
+        for (size_t i = _i0; i < _i1; i++)
+        {
+            const size_t c = i + _j * w;
+            peak = std::max(peak, std::max(std::fabs(m_Vx[c]) * scaleX, std::fabs(m_Vy[c]) * scaleY));
+        }
+        return peak;
+    };
+    // each row's peak goes in its own slot, and the maximum is the same whichever thread scanned which rows
+    m_fluid.parallelRows(0, height(), [&](size_t _first, size_t _last) {
+        for (size_t j = _first; j < _last; j++)
+        {
+            if (!m_mask)
+            {
+                m_rowSpeeds[j] = rowSpeed(j, 0, w);
+                continue;
+            }
+            // the inactive tiles are at rest
+            m_rowSpeeds[j] = 0.0f;
+            for (const ActivityMask::Span &span : m_mask->spans(j))
+            {
+                m_rowSpeeds[j] = std::max(m_rowSpeeds[j], rowSpeed(j, span.begin, span.end));
+            }
+        }
+    });
+    return *std::max_element(m_rowSpeeds.begin(), m_rowSpeeds.end());
+}
 
-    projectBackwards();
+void FluidGrid::planStep()
+{
+    m_stepDt = m_dt;
+    m_subSteps = 1;
+    m_speed = 0.0f;
+    if (m_stepping.mode == TimeStepping::Mode::Fixed)
+    {
+        return;
+    }
+
+    m_speed = maxSpeed();
+    if (m_stepping.mode == TimeStepping::Mode::Adaptive)
+    {
+        // nothing limits the step of fluid at rest
+        const float cflDt = m_speed > 0.0f ? m_stepping.cfl / m_speed : m_stepping.maxDt;
+        // the floor wins over the ceiling if they cross
+        m_stepDt = std::max(std::min(cflDt, m_stepping.maxDt), m_stepping.minDt);
+        return;
+    }
 
-    updateParticles();
+    const int maxSubSteps = std::max(m_stepping.maxSubSteps, 1);
+    const float needed = std::ceil(m_dt * m_speed / m_stepping.cfl);
+    m_subSteps = needed < static_cast<float>(maxSubSteps) ? std::max(static_cast<int>(needed), 1) : maxSubSteps;
+    if (m_frameBudget > 0.0 && m_subStepTime > 0.0)
+    {
+        const double fits = std::floor(m_frameBudget / m_subStepTime);
+        m_subSteps = std::max(fits < static_cast<double>(m_subSteps) ? static_cast<int>(fits) : m_subSteps, 1);
+    }
+    m_stepDt = m_dt / static_cast<float>(m_subSteps);
 }
 
-void FluidGrid::addVelocity(ngl::Vec2 _pos, ngl::Vec2 _v)
+void FluidGrid::fitBudget(double _milliseconds)
 {
-    // clamp x and y so inside the grid
-    size_t index = Fluid::IX(std::clamp(static_cast<size_t>(_pos.m_x), static_cast<size_t>(0), c_size - 1),
-                             std::clamp(static_cast<size_t>(_pos.m_y), static_cast<size_t>(0), c_size - 1));
+    // averaged over the last few steps, so one slow step, such as a preempted thread, does not swing the plan
+    const double subStepTime = _milliseconds / m_subSteps;
+    m_subStepTime = m_subStepTime > 0.0 ? 0.5 * (m_subStepTime + subStepTime) : subStepTime;
+
+    // the sweeps are most of the cost of a sub-step, so it is taken to scale with them
+    const int iterations = m_fluid.iterations();
+    int fitted = iterations;
+    if (m_subStepTime > m_frameBudget && iterations > 1)
+    {
+        fitted = std::max(static_cast<int>(iterations * m_frameBudget / m_subStepTime), 1);
+    }
+    else if (iterations < m_iterations && m_subStepTime * (iterations + 1) / iterations < c_budgetHeadroom * m_frameBudget)
+    {
+        fitted = iterations + 1;
+    }
+    if (fitted != iterations)
+    {
+        m_subStepTime *= static_cast<double>(fitted) / iterations;
+        m_fluid.setIterations(fitted);
+    }
+}
+
+void FluidGrid::stepSeparate()
+{
+    if (m_mask)
+    {
+        updateActivity();
+    }
+    applyBuoyancy();
 
-    m_Vx[index] += _v.m_x;
-    m_Vy[index] += _v.m_y;
+    // the X and Y passes read and write separate fields so they can run side by side
+    {
+        ScopedTimer timer(m_profiler, Profiler::Stage::Diffuse);
+        runPair([this]() { diffuseX(); }, [this]() { diffuseY(); });
+    }
+    {
+        ScopedTimer timer(m_profiler, Profiler::Stage::Project);
+        projectForwards();
+    }
+    {
+        ScopedTimer timer(m_profiler, Profiler::Stage::Advect);
+        runPair([this]() { advectX(); }, [this]() { advectY(); });
+    }
+    {
+        ScopedTimer timer(m_profiler, Profiler::Stage::Project);
+        projectBackwards();
+    }
+    stepScalars();
 }
 
-void FluidGrid::resetVelocities()
+void FluidGrid::stepFused()
 {
-    std::fill(m_Vx.begin(), m_Vx.end(), 0.0f);
-    std::fill(m_Vy.begin(), m_Vy.end(), 0.0f);
+    applyBuoyancy();
 
-    // add a small initial velocity to show something on the grid
-    addVelocity(ngl::Vec2{c_size / 2.0f, c_size / 2.0f}, ngl::Vec2{-.0001f, 0.0f});
+    {
+        ScopedTimer timer(m_profiler, Profiler::Stage::Diffuse);
+        runPair([this]() { diffuseX(); }, [this]() { diffuseY(); });
+    }
+    {
+        ScopedTimer timer(m_profiler, Profiler::Stage::Project);
+        m_fluid.divergence(m_Vx0, m_Vy0, m_Vx, m_Vy);
+        m_fluid.solvePressure(m_Vx, m_Vy);
+        m_fluid.subtractGradient(m_Vx0, m_Vy0, m_Vx);
+    }
+    {
+        // also computes the divergence for the projection below
+        ScopedTimer timer(m_profiler, Profiler::Stage::Advect);
+        m_fluid.advectVelocity(m_Vx, m_Vy, m_Vx0, m_Vy0, m_stepDt, m_pressure, m_divergence);
+    }
+    {
+        ScopedTimer timer(m_profiler, Profiler::Stage::Project);
+        m_fluid.solvePressure(m_pressure, m_divergence);
+        m_fluid.subtractGradient(m_Vx, m_Vy, m_pressure);
+        // the separate step leaves the pressure and divergence in m_Vx0 and m_Vy0, where the next diffusion starts
+        // its sweeps from, so swap them in to give the same results
+        std::swap(m_arrays[2], m_arrays[4]);
+        std::swap(m_arrays[3], m_arrays[5]);
+        bindFields();
+    }
+    stepScalars();
 }
 
-void FluidGrid::updateParticles()
+void FluidGrid::setFused(bool _fused)
+{
+    m_fused = _fused;
+    if (_fused && m_workspace.size() == 4)
+    {
+        // kept once added, so turning fusing back on does not allocate again
+        m_arrays[4] = m_workspace.add<float>(numCells(), width());
+        m_arrays[5] = m_workspace.add<float>(numCells(), width());
+        m_workspace.allocate(m_pool.get());
+        bindFields();
+    }
+}
+
+void FluidGrid::bindFields()
 {
+    m_Vx = m_workspace.array<float>(m_arrays[0]);
+    m_Vy = m_workspace.array<float>(m_arrays[1]);
+    m_Vx0 = m_workspace.array<float>(m_arrays[2]);
+    m_Vy0 = m_workspace.array<float>(m_arrays[3]);
+    if (m_workspace.size() > 4)
+    {
+        m_pressure = m_workspace.array<float>(m_arrays[4]);
+        m_divergence = m_workspace.array<float>(m_arrays[5]);
+    }
+}
 
-    for (int j = 0; j < c_size; j++)
+void FluidGrid::setSparse(bool _sparse)
+{
+    if (_sparse == isSparse())
     {
-        for (int i = 0; i < c_size; i++)
-        {
-            auto pos = m_pos[Fluid::IX(i, j)];
+        return;
+    }
+    m_fluid.setActivityMask(nullptr);
+    m_mask.reset();
+    if (_sparse)
+    {
+        // every tile starts active, the first step clears the quiet ones in every field
+        m_mask = std::make_unique<ActivityMask>(width(), height());
+        m_fluid.setActivityMask(m_mask.get());
+    }
+}
 
-            int x0 = static_cast<int>(floor(static_cast<float>(pos.m_x)));
-            int y0 = static_cast<int>(floor(static_cast<float>(pos.m_z)));
+void FluidGrid::updateActivity()
+{
+    m_mask->update(m_Vx, m_Vy, m_activityThreshold, m_activityHalo);
+    for (float *field : {m_Vx, m_Vy, m_Vx0, m_Vy0})
+    {
+        m_mask->clearDeactivated(field);
+    }
+    m_fluid.clearDeactivated();
+}
 
-            int x1 = static_cast<int>(ceil(static_cast<float>(pos.m_x)));
-            int y1 = static_cast<int>(ceil(static_cast<float>(pos.m_z)));
+void FluidGrid::setThreadCount(size_t _numThreads)
+{
+    m_fluid.setThreadPool(nullptr);
+    m_pool.reset();
+    if (_numThreads != 1)
+    {
+        m_pool = std::make_unique<ThreadPool>(_numThreads);
+        m_fluid.setThreadPool(m_pool.get());
+    }
+    m_workspace.allocate(m_pool.get());
+    bindFields();
+    m_scalars.setThreadPool(m_pool.get());
+}
 
-            // Get average velocity of 4 adjacent points
-            auto xVel = 0.25f * (m_Vx[Fluid::IX(x0, y0)] + m_Vx[Fluid::IX(x1, y0)] + m_Vx[Fluid::IX(x0, y1)] + m_Vx[Fluid::IX(x1, y1)]);
-            auto yVel = 0.25f * (m_Vy[Fluid::IX(x0, y0)] + m_Vy[Fluid::IX(x1, y0)] + m_Vy[Fluid::IX(x0, y1)] + m_Vy[Fluid::IX(x1, y1)]);
+void FluidGrid::addVelocity(float _x, float _y, float _vx, float _vy)
+{
+    // clamp x and y so inside the grid
+    size_t index = m_fluid.IX(std::clamp(static_cast<size_t>(_x), static_cast<size_t>(0), width() - 1),
+                              std::clamp(static_cast<size_t>(_y), static_cast<size_t>(0), height() - 1));
 
-            ngl::Vec3 velocity{xVel, 0.0f, yVel};
+    m_Vx[index] += _vx;
+    m_Vy[index] += _vy;
+    if (m_mask)
+    {
+        m_mask->activateCell(index % width(), index / width());
+    }
+}
 
-            pos += velocity * 0.2f;
+void FluidGrid::applyImpulses()
+{
+    if (m_impulses.empty())
+    {
+        return;
+    }
+    ScopedTimer timer(m_profiler, Profiler::Stage::Impulses);
+    m_impulses.apply(m_Vx, m_Vy, m_pool.get(), m_mask.get());
+}
 
-            if (pos.m_x < 0.0f)
-            {
-                pos.m_x = static_cast<ngl::Real>(c_size - 1);
-            }
+size_t FluidGrid::addScalar(const std::string &_name, float _diffusion)
+{
+    const size_t channel = m_scalars.add(_name, _diffusion);
+    m_scalarTargets.resize(m_scalars.size());
+    m_scalarSources.resize(m_scalars.size());
+    return channel;
+}
 
-            if (pos.m_x >= c_size - 1)
-            {
-                pos.m_x = static_cast<ngl::Real>(0.0f);
-            }
+void FluidGrid::addScalarSource(size_t _channel, float _x, float _y, float _amount)
+{
+    size_t index = m_fluid.IX(std::clamp(static_cast<size_t>(_x), static_cast<size_t>(0), width() - 1),
+                              std::clamp(static_cast<size_t>(_y), static_cast<size_t>(0), height() - 1));
 
-            if (pos.m_z < 0.0f)
-            {
-                pos.m_z = static_cast<ngl::Real>(c_size - 1);
-            }
+    m_scalars.current(_channel)[index] += _amount;
+    if (m_mask)
+    {
+        m_mask->activateCell(index % width(), index / width());
+    }
+}
+
+void FluidGrid::applyBuoyancy()
+{
+    if (m_buoyancy.temperature == ScalarFields::npos)
+    {
+        return;
+    }
 
-            if (pos.m_z >= c_size - 1)
+    const float *temperature = m_scalars.current(m_buoyancy.temperature);
+    const float *density = m_buoyancy.density == ScalarFields::npos ? nullptr : m_scalars.current(m_buoyancy.density);
+    const float lift = m_stepDt * m_buoyancy.lift;
+    const float weight = m_stepDt * m_buoyancy.weight;
+    const size_t w = width();
+    // the velocity must stay zero in the inactive tiles, so only the interior cells of the active ones are pushed
+    auto pushCells = [&](size_t _j, size_t _i0, size_t _i1) {
+        for (size_t i = _i0; i < _i1; i++)
+        {
+            const size_t c = i + _j * w;
+            m_Vy[c] += lift * temperature[c] - (density != nullptr ? weight * density[c] : 0.0f);
+        }
+    };
+    m_fluid.parallelRows(1, height() - 1, [&](size_t _first, size_t _last) {
+        for (size_t j = _first; j < _last; j++)
+        {
+            if (!m_mask)
             {
-                pos.m_z = static_cast<ngl::Real>(0.0f);
+                pushCells(j, 1, w - 1);
+                continue;
             }
-
-            m_pos[Fluid::IX(i, j)] = pos;
-
-            if (velocity.lengthSquared() != 0.0f)
+            for (const ActivityMask::Span &span : m_mask->spans(j))
             {
-                velocity.normalize();
+                pushCells(j, std::max<size_t>(span.begin, 1), std::min(span.end, w - 1));
             }
+        }
+    });
+}
+
+void FluidGrid::stepScalars()
+{
+    if (m_scalars.size() == 0)
+    {
+        return;
+    }
+    ScopedTimer timer(m_profiler, Profiler::Stage::Scalars);
+
+    // Jacobi sweeps through a scratch field that is zero outside the active tiles, which holds for the velocity but
+    // not for a scalar at rest, so sparse scalar diffusion sweeps red-black instead
+    const Fluid::SolveMode mode = m_mask && m_fluid.solveMode() == Fluid::SolveMode::Jacobi
+                                      ? Fluid::SolveMode::RedBlack
+                                      : m_fluid.solveMode();
+    for (size_t channel = 0; channel < m_scalars.size(); channel++)
+    {
+        if (m_scalars.diffusion(channel) <= 0.0f)
+        {
+            continue;
+        }
+        m_scalars.swap(channel);
+        if (m_mask)
+        {
+            m_mask->copyInactive(m_scalars.current(channel), m_scalars.previous(channel));
+        }
+        m_fluid.diffuse(Fluid::Boundary::None, m_scalars.current(channel), m_scalars.previous(channel),
+                        m_scalars.diffusion(channel), m_stepDt, mode);
+    }
 
-            m_dir[Fluid::IX(i, j)] = velocity / 2.0f;
+    // every channel in one pass through the final velocity, with no velocity the inactive tiles are carried over
+    for (size_t channel = 0; channel < m_scalars.size(); channel++)
+    {
+        m_scalars.swap(channel);
+        m_scalarTargets[channel] = m_scalars.current(channel);
+        m_scalarSources[channel] = m_scalars.previous(channel);
+        if (m_mask)
+        {
+            m_mask->copyInactive(m_scalars.current(channel), m_scalars.previous(channel));
         }
     }
+    m_fluid.advectFields(m_scalarTargets.data(), m_scalarSources.data(), m_scalars.size(), m_Vx, m_Vy, m_stepDt);
 }
 
-void FluidGrid::resetParticle(size_t i, size_t j)
+void FluidGrid::resetVelocities()
 {
-    m_pos[Fluid::IX(i, j)] = ngl::Vec3{static_cast<ngl::Real>(i), 0.0f, static_cast<ngl::Real>(j)};
+    std::fill(m_Vx, m_Vx + numCells(), 0.0f);
+    std::fill(m_Vy, m_Vy + numCells(), 0.0f);
+    if (m_mask)
+    {
+        // the other fields still hold the last pressure, so let the next step clear the quiet tiles of every field
+        m_mask->activateAll();
+    }
+
+    // add a small initial velocity to show something on the grid
+    addVelocity(width() / 2.0f, height() / 2.0f, -.0001f, 0.0f);
 }
 
-void FluidGrid::initGrid()
+void FluidGrid::capture(CheckpointState *_state, uint64_t _step) const
 {
-    for (int j = 0; j < c_size; j++)
+    _state->width = width();
+    _state->height = height();
+    _state->dt = m_dt;
+    _state->viscosity = m_visc;
+    _state->step = _step;
+    _state->velocityX.assign(m_Vx, m_Vx + numCells());
+    _state->velocityY.assign(m_Vy, m_Vy + numCells());
+    _state->velocityX0.assign(m_Vx0, m_Vx0 + numCells());
+    _state->velocityY0.assign(m_Vy0, m_Vy0 + numCells());
+    const size_t count = m_particles.size();
+    _state->x.assign(m_particles.x(), m_particles.x() + count);
+    _state->y.assign(m_particles.y(), m_particles.y() + count);
+    _state->dirX.assign(m_particles.dirX(), m_particles.dirX() + count);
+    _state->dirY.assign(m_particles.dirY(), m_particles.dirY() + count);
+    _state->scalars.resize(m_scalars.size());
+    for (size_t channel = 0; channel < m_scalars.size(); channel++)
     {
-        for (int i = 0; i < c_size; i++)
-        {
-            resetParticle(i, j);
-        }
+        CheckpointScalar &scalar = _state->scalars[channel];
+        scalar.name = m_scalars.name(channel);
+        scalar.diffusion = m_scalars.diffusion(channel);
+        scalar.current.assign(m_scalars.current(channel), m_scalars.current(channel) + numCells());
+        scalar.previous.assign(m_scalars.previous(channel), m_scalars.previous(channel) + numCells());
+    }
+}
+
+bool FluidGrid::restore(const Checkpoint &_checkpoint, std::string *_error)
+{
+    if (_checkpoint.width() != width() || _checkpoint.height() != height() ||
+        _checkpoint.numParticles() != m_particles.size())
+    {
+        *_error = "the checkpoint is " + std::to_string(_checkpoint.width()) + "x" +
+                  std::to_string(_checkpoint.height()) + " with " + std::to_string(_checkpoint.numParticles()) +
+                  " particles, the grid is " + std::to_string(width()) + "x" + std::to_string(height()) + " with " +
+                  std::to_string(m_particles.size());
+        return false;
+    }
+    bool sameScalars = _checkpoint.numScalars() == m_scalars.size();
+    for (size_t channel = 0; channel < m_scalars.size() && sameScalars; channel++)
+    {
+        sameScalars = _checkpoint.scalarName(channel) == m_scalars.name(channel);
+    }
+    if (!sameScalars)
+    {
+        *_error = "the checkpoint's scalar channels differ from the grid's";
+        return false;
     }
+
+    m_dt = _checkpoint.dt();
+    m_visc = _checkpoint.viscosity();
+    // one copy from the mapping, which only reads each page of the file from disk as it is reached
+    auto copyArray = [&](Checkpoint::Array _array, float *_field) {
+        const float *data = _checkpoint.data(_array);
+        std::copy(data, data + numCells(), _field);
+    };
+    copyArray(Checkpoint::Array::VelocityX, m_Vx);
+    copyArray(Checkpoint::Array::VelocityY, m_Vy);
+    copyArray(Checkpoint::Array::VelocityX0, m_Vx0);
+    copyArray(Checkpoint::Array::VelocityY0, m_Vy0);
+    for (size_t channel = 0; channel < m_scalars.size(); channel++)
+    {
+        const float *current = _checkpoint.scalarCurrent(channel);
+        const float *previous = _checkpoint.scalarPrevious(channel);
+        std::copy(current, current + numCells(), m_scalars.current(channel));
+        std::copy(previous, previous + numCells(), m_scalars.previous(channel));
+        m_scalars.setDiffusion(channel, _checkpoint.scalarDiffusion(channel));
+    }
+    if (m_mask)
+    {
+        m_mask->activateAll();
+    }
+    m_particles.assign(_checkpoint.data(Checkpoint::Array::ParticleX), _checkpoint.data(Checkpoint::Array::ParticleY),
+                       _checkpoint.data(Checkpoint::Array::ParticleDirX),
+                       _checkpoint.data(Checkpoint::Array::ParticleDirY));
+    return true;
 }
 
-void FluidGrid::draw() const
+void FluidGrid::updateParticles()
 {
-    glBindVertexArray(m_svao);
-    // bind the buffer to copy the data
-    glBindBuffer(GL_ARRAY_BUFFER, m_vboID);
-    // copy the pos data
-    glBufferSubData(GL_ARRAY_BUFFER, 0, m_numParticles * sizeof(ngl::Vec3), &m_pos[0].m_x);
-    // concatenate the dir data
-    glBufferSubData(GL_ARRAY_BUFFER, m_numParticles * sizeof(ngl::Vec3), m_numParticles * sizeof(ngl::Vec3), &m_dir[0].m_x);
-    // draw
-    glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(m_numParticles));
-    glBindVertexArray(0);
+    // every particle only reads the velocity field and writes its own slot, so blocks can be split across threads
+    const size_t numBlocks = (m_particles.size() + c_particleBlock - 1) / c_particleBlock;
+    auto updateBlocks = [&](size_t _first, size_t _last) {
+        m_particles.advect(_first * c_particleBlock, std::min(_last * c_particleBlock, m_particles.size()), m_Vx, m_Vy,
+                           m_particleMirror);
+    };
+
+    if (m_pool)
+    {
+        m_pool->parallelFor(0, numBlocks, updateBlocks);
+    }
+    else
+    {
+        updateBlocks(0, numBlocks);
+    }
 }
 
 void FluidGrid::diffuseX()
 {
-    Fluid::diffuse(Fluid::Boundary::X, &m_Vx0, &m_Vx, m_visc, m_dt);
+    m_fluid.diffuse(Fluid::Boundary::X, m_Vx0, m_Vx, m_visc, m_stepDt, m_fluid.solveMode());
 }
 
 void FluidGrid::diffuseY()
 {
-    Fluid::diffuse(Fluid::Boundary::Y, &m_Vy0, &m_Vy, m_visc, m_dt);
+    m_fluid.diffuse(Fluid::Boundary::Y, m_Vy0, m_Vy, m_visc, m_stepDt, m_fluid.solveMode());
 }
 
 void FluidGrid::projectForwards()
 {
-    Fluid::project(&m_Vx0, &m_Vy0, &m_Vx, &m_Vy);
+    m_fluid.project(m_Vx0, m_Vy0, m_Vx, m_Vy);
 }
 
 void FluidGrid::advectX()
 {
-    Fluid::advect(Fluid::Boundary::X, &m_Vx, &m_Vx0, &m_Vx0, &m_Vy0, m_dt);
+    m_fluid.advect(Fluid::Boundary::X, m_Vx, m_Vx0, m_Vx0, m_Vy0, m_stepDt);
 }
 
 void FluidGrid::advectY()
 {
-    Fluid::advect(Fluid::Boundary::Y, &m_Vy, &m_Vy0, &m_Vx0, &m_Vy0, m_dt);
+    m_fluid.advect(Fluid::Boundary::Y, m_Vy, m_Vy0, m_Vx0, m_Vy0, m_stepDt);
 }
 
 void FluidGrid::projectBackwards()
 {
-    Fluid::project(&m_Vx, &m_Vy, &m_Vx0, &m_Vy0);
+    m_fluid.project(m_Vx, m_Vy, m_Vx0, m_Vy0);
 }
@@ -0,0 +1,91 @@
+/**
+ * @file GpuContext.cpp
+ * @brief A GL 4.3 core context with no window, made with EGL on Mesa's surfaceless platform
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "GpuContext.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glcorearb.h>
+
+#include <sstream>
+
+namespace
+{
+    std::string eglErrorText(const char *_what)
+    {
+        std::ostringstream text;
+        text << _what << " failed with EGL error 0x" << std::hex << eglGetError();
+        return text.str();
+    }
+}
+
+GpuContext::~GpuContext()
+{
+    if (m_context != nullptr)
+    {
+        eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(m_display, m_context);
+    }
+    if (m_display != nullptr)
+    {
+        eglTerminate(m_display);
+    }
+}
+
+bool GpuContext::create(std::string *_error)
+{
+    // the surfaceless platform needs no display server, fall back to the default display where it is missing
+    auto getPlatformDisplay =
+        reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    EGLDisplay display = EGL_NO_DISPLAY;
+    if (getPlatformDisplay != nullptr)
+    {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+    if (display == EGL_NO_DISPLAY)
+    {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    EGLint major = 0;
+    EGLint minor = 0;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+    {
+        *_error = eglErrorText("eglInitialize");
+        return false;
+    }
+    m_display = display;
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        *_error = eglErrorText("eglBindAPI");
+        return false;
+    }
+    // compute shaders need 4.3, and with no surface to draw to the context needs no config
+    const EGLint attributes[] = {EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 3,
+                                 EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+    if (context == EGL_NO_CONTEXT)
+    {
+        *_error = eglErrorText("creating a GL 4.3 core context");
+        return false;
+    }
+    m_context = context;
+
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+    {
+        *_error = eglErrorText("eglMakeCurrent");
+        return false;
+    }
+    return true;
+}
+
+std::string GpuContext::renderer() const
+{
+    const GLubyte *name = isCreated() ? glGetString(GL_RENDERER) : nullptr;
+    return name != nullptr ? reinterpret_cast<const char *>(name) : "";
+}
@@ -0,0 +1,561 @@
+/**
+ * @file GpuFluidSolver.cpp
+ * @brief The velocity solve and tracer particles of a FluidGrid run as GL compute shaders, with every field kept in
+ * shader storage buffers on the GPU
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "GpuFluidSolver.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glcorearb.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "ParticleSystem.h"
+
+namespace
+{
+    // the kernels are built into the library rather than loaded from shaders/, so the headless runner works from any
+    // directory. Every kernel gets this header, location 0 is always the size of the grid.
+    const char *c_header = R"(#version 430 core
+layout(location = 0) uniform ivec2 gridSize;
+)";
+
+    // set_boundary, with the corners found straight from the interior cell both their neighbours copy, so the whole
+    // boundary is one dispatch
+    const char *c_setBoundary = R"(
+layout(local_size_x = 64) in;
+layout(location = 1) uniform int boundary;
+layout(std430, binding = 0) buffer Field { float x[]; };
+
+void main()
+{
+    int w = gridSize.x;
+    int h = gridSize.y;
+    int k = int(gl_GlobalInvocationID.x);
+    // negated across the walls the component is normal to, 1 is X and 2 is Y as in Fluid::Boundary
+    float signX = boundary == 1 ? -1.0 : 1.0;
+    float signY = boundary == 2 ? -1.0 : 1.0;
+    if (k >= 1 && k < w - 1)
+    {
+        x[k] = signY * x[k + w];
+        x[k + (h - 1) * w] = signY * x[k + (h - 2) * w];
+    }
+    if (k >= 1 && k < h - 1)
+    {
+        x[k * w] = signX * x[k * w + 1];
+        x[k * w + w - 1] = signX * x[k * w + w - 2];
+    }
+    if (k == 0)
+    {
+        precise float corner00 = 0.5 * (signY * x[1 + w] + signX * x[1 + w]);
+        precise float corner01 = 0.5 * (signY * x[1 + (h - 2) * w] + signX * x[1 + (h - 2) * w]);
+        precise float corner10 = 0.5 * (signY * x[w - 2 + w] + signX * x[w - 2 + w]);
+        precise float corner11 = 0.5 * (signY * x[w - 2 + (h - 2) * w] + signX * x[w - 2 + (h - 2) * w]);
+        x[0] = corner00;
+        x[(h - 1) * w] = corner01;
+        x[w - 1] = corner10;
+        x[w - 1 + (h - 1) * w] = corner11;
+    }
+}
+)";
+
+    // one colour of a red-black sweep of linear_solve, cells of one colour only read cells of the other
+    const char *c_redBlack = R"(
+layout(local_size_x = 16, local_size_y = 16) in;
+layout(location = 1) uniform float a;
+layout(location = 2) uniform float cRecip;
+layout(location = 3) uniform int colour;
+layout(std430, binding = 0) buffer Target { float x[]; };
+layout(std430, binding = 1) readonly buffer Source { float x0[]; };
+
+void main()
+{
+    int w = gridSize.x;
+    // cell (i, j) is red when i + j is even, each invocation takes the cell of the colour from a pair along X
+    int j = int(gl_GlobalInvocationID.y) + 1;
+    int i = 2 * int(gl_GlobalInvocationID.x) + 1 + ((j + 1 + colour) & 1);
+    if (i >= w - 1 || j >= gridSize.y - 1)
+    {
+        return;
+    }
+    int c = i + j * w;
+    precise float value = (x0[c] + a * (x[c + 1] + x[c - 1] + x[c + w] + x[c - w])) * cRecip;
+    x[c] = value;
+}
+)";
+
+    const char *c_advect = R"(
+layout(local_size_x = 16, local_size_y = 16) in;
+layout(location = 1) uniform float dtx;
+layout(location = 2) uniform float dty;
+layout(location = 3) uniform float maxX;
+layout(location = 4) uniform float maxY;
+layout(std430, binding = 0) writeonly buffer Target { float d[]; };
+layout(std430, binding = 1) readonly buffer Source { float d0[]; };
+layout(std430, binding = 2) readonly buffer VelocityX { float velX[]; };
+layout(std430, binding = 3) readonly buffer VelocityY { float velY[]; };
+
+void main()
+{
+    int w = gridSize.x;
+    int i = int(gl_GlobalInvocationID.x) + 1;
+    int j = int(gl_GlobalInvocationID.y) + 1;
+    if (i >= w - 1 || j >= gridSize.y - 1)
+    {
+        return;
+    }
+    int c = i + j * w;
+    // keep the back-traced point inside the interior so the four samples never leave the grid
+    precise float x = min(max(float(i) - dtx * velX[c], 0.5), maxX);
+    precise float y = min(max(float(j) - dty * velY[c], 0.5), maxY);
+    float i0 = floor(x);
+    float j0 = floor(y);
+    precise float s1 = x - i0;
+    precise float s0 = 1.0 - s1;
+    precise float t1 = y - j0;
+    precise float t0 = 1.0 - t1;
+    int c00 = int(i0) + int(j0) * w;
+    precise float value = s0 * (t0 * d0[c00] + t1 * d0[c00 + w]) + s1 * (t0 * d0[c00 + 1] + t1 * d0[c00 + 1 + w]);
+    d[c] = value;
+}
+)";
+
+    // the first half of project, the divergence and a zeroed pressure
+    const char *c_divergence = R"(
+layout(local_size_x = 16, local_size_y = 16) in;
+layout(location = 1) uniform vec2 gridScale;
+layout(std430, binding = 0) readonly buffer VelocityX { float velX[]; };
+layout(std430, binding = 1) readonly buffer VelocityY { float velY[]; };
+layout(std430, binding = 2) writeonly buffer Pressure { float p[]; };
+layout(std430, binding = 3) writeonly buffer Divergence { float div[]; };
+
+void main()
+{
+    int w = gridSize.x;
+    int i = int(gl_GlobalInvocationID.x) + 1;
+    int j = int(gl_GlobalInvocationID.y) + 1;
+    if (i >= w - 1 || j >= gridSize.y - 1)
+    {
+        return;
+    }
+    int c = i + j * w;
+    precise float value = -0.5 * ((velX[c + 1] - velX[c - 1]) / gridScale.x + (velY[c + w] - velY[c - w]) / gridScale.y);
+    div[c] = value;
+    p[c] = 0.0;
+}
+)";
+
+    // the last half of project
+    const char *c_subtractGradient = R"(
+layout(local_size_x = 16, local_size_y = 16) in;
+layout(location = 1) uniform vec2 gridScale;
+layout(std430, binding = 0) buffer VelocityX { float velX[]; };
+layout(std430, binding = 1) buffer VelocityY { float velY[]; };
+layout(std430, binding = 2) readonly buffer Pressure { float p[]; };
+
+void main()
+{
+    int w = gridSize.x;
+    int i = int(gl_GlobalInvocationID.x) + 1;
+    int j = int(gl_GlobalInvocationID.y) + 1;
+    if (i >= w - 1 || j >= gridSize.y - 1)
+    {
+        return;
+    }
+    int c = i + j * w;
+    precise float x = velX[c] - 0.5 * (p[c + 1] - p[c - 1]) * gridScale.x;
+    precise float y = velY[c] - 0.5 * (p[c + w] - p[c - w]) * gridScale.y;
+    velX[c] = x;
+    velY[c] = y;
+}
+)";
+
+    const char *c_addVelocity = R"(
+layout(local_size_x = 1) in;
+layout(location = 1) uniform int cell;
+layout(location = 2) uniform vec2 velocity;
+layout(std430, binding = 0) buffer VelocityX { float velX[]; };
+layout(std430, binding = 1) buffer VelocityY { float velY[]; };
+
+void main()
+{
+    velX[cell] += velocity.x;
+    velY[cell] += velocity.y;
+}
+)";
+
+    // the particle update of ParticleKernels, whose step and direction scales these must match
+    const char *c_advectParticles = R"(
+layout(local_size_x = 64) in;
+layout(location = 1) uniform int count;
+layout(std430, binding = 0) buffer Particles { float particles[]; };
+layout(std430, binding = 1) readonly buffer VelocityX { float velX[]; };
+layout(std430, binding = 2) readonly buffer VelocityY { float velY[]; };
+
+const float c_stepScale = 0.2;
+const float c_dirLength = 0.5;
+
+void main()
+{
+    int w = gridSize.x;
+    float maxX = float(w - 1);
+    float maxY = float(gridSize.y - 1);
+    int stride = int(gl_NumWorkGroups.x * gl_WorkGroupSize.x);
+    for (int p = int(gl_GlobalInvocationID.x); p < count; p += stride)
+    {
+        precise float px = particles[p];
+        precise float py = particles[count + p];
+        int x0 = int(floor(px));
+        int y0 = int(floor(py));
+        int x1 = int(ceil(px));
+        int y1 = int(ceil(py));
+
+        precise float xVel = 0.25 * (velX[x0 + y0 * w] + velX[x1 + y0 * w] + velX[x0 + y1 * w] + velX[x1 + y1 * w]);
+        precise float yVel = 0.25 * (velY[x0 + y0 * w] + velY[x1 + y0 * w] + velY[x0 + y1 * w] + velY[x1 + y1 * w]);
+        px = px + xVel * c_stepScale;
+        py = py + yVel * c_stepScale;
+
+        // wrap to the other side
+        px = px < 0.0 ? maxX : px;
+        px = px >= maxX ? 0.0 : px;
+        py = py < 0.0 ? maxY : py;
+        py = py >= maxY ? 0.0 : py;
+
+        precise float lengthSquared = xVel * xVel + yVel * yVel;
+        precise float scale = lengthSquared != 0.0 ? c_dirLength / sqrt(lengthSquared) : c_dirLength;
+        precise float dirX = xVel * scale;
+        precise float dirY = yVel * scale;
+        particles[p] = px;
+        particles[count + p] = py;
+        particles[2 * count + p] = dirX;
+        particles[3 * count + p] = dirY;
+    }
+}
+)";
+
+    // the invocations along each axis of a work group of the 2D kernels, and the 1D ones
+    constexpr size_t c_tileSize = 16;
+    constexpr size_t c_lineSize = 64;
+    // the most work groups along one axis every GL 4.3 implementation supports
+    constexpr size_t c_maxGroups = 65535;
+
+    GLuint compileProgram(const char *_source, std::string *_error)
+    {
+        const char *sources[] = {c_header, _source};
+        GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(shader, 2, sources, nullptr);
+        glCompileShader(shader);
+        GLint status = GL_FALSE;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+        if (status != GL_TRUE)
+        {
+            GLint length = 0;
+            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+            std::string log(static_cast<size_t>(std::max(length, 1)), '\0');
+            glGetShaderInfoLog(shader, length, nullptr, &log[0]);
+            *_error = "cannot compile a compute shader: " + log;
+            glDeleteShader(shader);
+            return 0;
+        }
+
+        GLuint program = glCreateProgram();
+        glAttachShader(program, shader);
+        glLinkProgram(program);
+        glDeleteShader(shader);
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (status != GL_TRUE)
+        {
+            GLint length = 0;
+            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+            std::string log(static_cast<size_t>(std::max(length, 1)), '\0');
+            glGetProgramInfoLog(program, length, nullptr, &log[0]);
+            *_error = "cannot link a compute shader: " + log;
+            glDeleteProgram(program);
+            return 0;
+        }
+        return program;
+    }
+
+    GLuint groups(size_t _invocations, size_t _groupSize)
+    {
+        return static_cast<GLuint>((_invocations + _groupSize - 1) / _groupSize);
+    }
+
+    /**
+     * @brief Puts back the program that was in use when it was made, so the solver can step between a renderer's
+     * draws without unbinding its shader
+     */
+    class KeepProgram
+    {
+    public:
+        KeepProgram() { glGetIntegerv(GL_CURRENT_PROGRAM, &m_program); }
+        ~KeepProgram() { glUseProgram(static_cast<GLuint>(m_program)); }
+
+    private:
+        GLint m_program = 0;
+    };
+
+    void bindFields(std::initializer_list<GLuint> _buffers)
+    {
+        GLuint binding = 0;
+        for (GLuint buffer : _buffers)
+        {
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding++, buffer);
+        }
+    }
+}
+
+GpuFluidSolver::GpuFluidSolver(size_t _width, size_t _height, float _viscosity, float _dt, size_t _numParticles)
+    : m_width{_width},
+      m_height{_height},
+      m_visc{_viscosity},
+      m_dt{_dt},
+      m_numParticles{_numParticles == 0 ? _width * _height : _numParticles}
+{
+}
+
+GpuFluidSolver::~GpuFluidSolver()
+{
+    for (GLuint program : m_programs)
+    {
+        if (program != 0)
+        {
+            glDeleteProgram(program);
+        }
+    }
+    if (m_particles != 0)
+    {
+        glDeleteBuffers(static_cast<GLsizei>(m_fields.size()), m_fields.data());
+        glDeleteBuffers(1, &m_particles);
+    }
+}
+
+bool GpuFluidSolver::create(std::string *_error)
+{
+    GLint major = 0;
+    GLint minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if (major < 4 || (major == 4 && minor < 3))
+    {
+        *_error = "compute shaders need GL 4.3, the context is " + std::to_string(major) + "." + std::to_string(minor);
+        return false;
+    }
+
+    const char *sources[NumPrograms] = {c_setBoundary, c_redBlack, c_advect, c_divergence, c_subtractGradient,
+                                        c_addVelocity, c_advectParticles};
+    KeepProgram keepProgram;
+    std::array<GLuint, NumPrograms> programs{};
+    for (size_t program = 0; program < NumPrograms; program++)
+    {
+        programs[program] = compileProgram(sources[program], _error);
+        if (programs[program] == 0)
+        {
+            for (GLuint compiled : programs)
+            {
+                glDeleteProgram(compiled);
+            }
+            return false;
+        }
+        glUseProgram(programs[program]);
+        glUniform2i(0, static_cast<GLint>(m_width), static_cast<GLint>(m_height));
+    }
+
+    // every field starts at zero, as in the CPU solver's workspace
+    const GLsizeiptr fieldBytes = static_cast<GLsizeiptr>(numCells() * sizeof(float));
+    glGenBuffers(static_cast<GLsizei>(m_fields.size()), m_fields.data());
+    for (GLuint field : m_fields)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, field);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, fieldBytes, nullptr, GL_DYNAMIC_COPY);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, nullptr);
+    }
+    glGenBuffers(1, &m_particles);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_particles);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, static_cast<GLsizeiptr>(4 * m_numParticles * sizeof(float)), nullptr,
+                 GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    m_programs = programs;
+    reset();
+    return true;
+}
+
+void GpuFluidSolver::step()
+{
+    KeepProgram program;
+    const GLuint vx = m_fields[0];
+    const GLuint vy = m_fields[1];
+    const GLuint vx0 = m_fields[2];
+    const GLuint vy0 = m_fields[3];
+
+    diffuse(Fluid::Boundary::X, vx0, vx);
+    diffuse(Fluid::Boundary::Y, vy0, vy);
+    project(vx0, vy0, vx, vy);
+    advect(Fluid::Boundary::X, vx, vx0, vx0, vy0);
+    advect(Fluid::Boundary::Y, vy, vy0, vx0, vy0);
+    project(vx, vy, vx0, vy0);
+    advectParticles();
+}
+
+void GpuFluidSolver::addVelocity(float _x, float _y, float _vx, float _vy)
+{
+    // clamp x and y so inside the grid
+    const size_t cell = std::clamp(static_cast<size_t>(_x), static_cast<size_t>(0), m_width - 1) +
+                        std::clamp(static_cast<size_t>(_y), static_cast<size_t>(0), m_height - 1) * m_width;
+    KeepProgram program;
+    glUseProgram(m_programs[AddVelocity]);
+    glUniform1i(1, static_cast<GLint>(cell));
+    glUniform2f(2, _vx, _vy);
+    bindFields({m_fields[0], m_fields[1]});
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void GpuFluidSolver::reset()
+{
+    for (size_t field = 0; field < 2; field++)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_fields[field]);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, nullptr);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    seedParticles();
+
+    // the same small initial velocity as the CPU grid
+    addVelocity(m_width / 2.0f, m_height / 2.0f, -.0001f, 0.0f);
+}
+
+void GpuFluidSolver::finish() const
+{
+    glFinish();
+}
+
+void GpuFluidSolver::readVelocity(float *_velocX, float *_velocY) const
+{
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    const GLsizeiptr bytes = static_cast<GLsizeiptr>(numCells() * sizeof(float));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_fields[0]);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bytes, _velocX);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_fields[1]);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bytes, _velocY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GpuFluidSolver::readParticles(float *_x, float *_y, float *_dirX, float *_dirY) const
+{
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    const GLsizeiptr bytes = static_cast<GLsizeiptr>(m_numParticles * sizeof(float));
+    float *arrays[] = {_x, _y, _dirX, _dirY};
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_particles);
+    for (GLintptr i = 0; i < 4; i++)
+    {
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, i * bytes, bytes, arrays[i]);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GpuFluidSolver::seedParticles()
+{
+    // seeded on the CPU once, so the particles start exactly where the CPU grid's do
+    ParticleSystem seeds(m_numParticles, m_width, m_height);
+    const GLsizeiptr bytes = static_cast<GLsizeiptr>(m_numParticles * sizeof(float));
+    const float *arrays[] = {seeds.x(), seeds.y(), seeds.dirX(), seeds.dirY()};
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_particles);
+    for (GLintptr i = 0; i < 4; i++)
+    {
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, i * bytes, bytes, arrays[i]);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GpuFluidSolver::setBoundary(Fluid::Boundary _b, unsigned int _x)
+{
+    glUseProgram(m_programs[SetBoundary]);
+    glUniform1i(1, static_cast<GLint>(_b));
+    bindFields({_x});
+    glDispatchCompute(groups(std::max(m_width, m_height), c_lineSize), 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void GpuFluidSolver::linearSolve(Fluid::Boundary _b, unsigned int _x, unsigned int _x0, float _a, float _c)
+{
+    const float cRecip = 1.0f / _c;
+    for (int k = 0; k < m_iterations; k++)
+    {
+        for (GLint colour = 0; colour < 2; colour++)
+        {
+            glUseProgram(m_programs[RedBlack]);
+            glUniform1f(1, _a);
+            glUniform1f(2, cRecip);
+            glUniform1i(3, colour);
+            bindFields({_x, _x0});
+            // half of each row is one colour
+            dispatchInterior((m_width - 1) / 2);
+        }
+        setBoundary(_b, _x);
+    }
+}
+
+void GpuFluidSolver::diffuse(Fluid::Boundary _b, unsigned int _x, unsigned int _x0)
+{
+    float a = m_dt * m_visc * (m_width - 2) * (m_height - 2);
+    linearSolve(_b, _x, _x0, a, 1 + 4 * a);
+}
+
+void GpuFluidSolver::advect(Fluid::Boundary _b, unsigned int _d, unsigned int _d0, unsigned int _velocX,
+                            unsigned int _velocY)
+{
+    glUseProgram(m_programs[Advect]);
+    glUniform1f(1, m_dt * (m_width - 2));
+    glUniform1f(2, m_dt * (m_height - 2));
+    glUniform1f(3, static_cast<float>(m_width) - 1.5f);
+    glUniform1f(4, static_cast<float>(m_height) - 1.5f);
+    bindFields({_d, _d0, _velocX, _velocY});
+    dispatchInterior(m_width - 2);
+    setBoundary(_b, _d);
+}
+
+void GpuFluidSolver::project(unsigned int _velocX, unsigned int _velocY, unsigned int _p, unsigned int _div)
+{
+    const float scaleX = static_cast<float>(m_width);
+    const float scaleY = static_cast<float>(m_height);
+
+    glUseProgram(m_programs[Divergence]);
+    glUniform2f(1, scaleX, scaleY);
+    bindFields({_velocX, _velocY, _p, _div});
+    dispatchInterior(m_width - 2);
+    setBoundary(Fluid::Boundary::None, _div);
+    setBoundary(Fluid::Boundary::None, _p);
+
+    linearSolve(Fluid::Boundary::None, _p, _div, 1, 4);
+
+    glUseProgram(m_programs[SubtractGradient]);
+    glUniform2f(1, scaleX, scaleY);
+    bindFields({_velocX, _velocY, _p});
+    dispatchInterior(m_width - 2);
+    setBoundary(Fluid::Boundary::X, _velocX);
+    setBoundary(Fluid::Boundary::Y, _velocY);
+}
+
+void GpuFluidSolver::advectParticles()
+{
+    glUseProgram(m_programs[AdvectParticles]);
+    glUniform1i(1, static_cast<GLint>(m_numParticles));
+    bindFields({m_particles, m_fields[0], m_fields[1]});
+    // the kernel strides over the particles left when there are more than the groups can cover at once
+    glDispatchCompute(std::min(groups(m_numParticles, c_lineSize), static_cast<GLuint>(c_maxGroups)), 1, 1);
+    // the renderer reads the particles as vertex attributes
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+void GpuFluidSolver::dispatchInterior(size_t _columns)
+{
+    glDispatchCompute(groups(_columns, c_tileSize), groups(m_height - 2, c_tileSize), 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
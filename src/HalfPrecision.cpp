@@ -0,0 +1,214 @@
+/**
+ * @file HalfPrecision.cpp
+ * @brief Row conversions between float and the 16 bit storage formats, with scalar, AVX2 and AVX-512 versions
+ * selected at runtime. The half conversions use the F16C and AVX-512 instructions, which round to nearest even like
+ * fromFloat<Half>, and bfloat16 is rounded with integer arithmetic the same way as fromFloat<BFloat16>.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "HalfPrecision.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FLUID_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FLUID_TARGET_AVX2 __attribute__((target("avx2")))
+#define FLUID_TARGET_AVX2_F16C __attribute__((target("avx2,f16c")))
+#define FLUID_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define FLUID_TARGET_AVX2
+#define FLUID_TARGET_AVX2_F16C
+#define FLUID_TARGET_AVX512
+#endif
+
+namespace
+{
+    void halfToFloatScalar(const Half *FLUID_RESTRICT _src, float *FLUID_RESTRICT _dst, size_t _count)
+    {
+        for (size_t i = 0; i < _count; i++)
+        {
+            _dst[i] = toFloat(_src[i]);
+        }
+    }
+
+    void floatToHalfScalar(const float *FLUID_RESTRICT _src, Half *FLUID_RESTRICT _dst, size_t _count)
+    {
+        for (size_t i = 0; i < _count; i++)
+        {
+            _dst[i] = fromFloat<Half>(_src[i]);
+        }
+    }
+
+    void bfloat16ToFloatScalar(const BFloat16 *FLUID_RESTRICT _src, float *FLUID_RESTRICT _dst, size_t _count)
+    {
+        for (size_t i = 0; i < _count; i++)
+        {
+            _dst[i] = toFloat(_src[i]);
+        }
+    }
+
+    void floatToBFloat16Scalar(const float *FLUID_RESTRICT _src, BFloat16 *FLUID_RESTRICT _dst, size_t _count)
+    {
+        for (size_t i = 0; i < _count; i++)
+        {
+            _dst[i] = fromFloat<BFloat16>(_src[i]);
+        }
+    }
+
+#ifdef FLUID_X86_SIMD
+    FLUID_TARGET_AVX2_F16C void halfToFloatAVX2(const Half *FLUID_RESTRICT _src, float *FLUID_RESTRICT _dst,
+                                                size_t _count)
+    {
+        size_t i = 0;
+        for (; i + 8 <= _count; i += 8)
+        {
+            const __m128i half = _mm_loadu_si128(reinterpret_cast<const __m128i *>(_src + i));
+            _mm256_storeu_ps(_dst + i, _mm256_cvtph_ps(half));
+        }
+        halfToFloatScalar(_src + i, _dst + i, _count - i);
+    }
+
+    FLUID_TARGET_AVX2_F16C void floatToHalfAVX2(const float *FLUID_RESTRICT _src, Half *FLUID_RESTRICT _dst,
+                                                size_t _count)
+    {
+        size_t i = 0;
+        for (; i + 8 <= _count; i += 8)
+        {
+            const __m128i half =
+                _mm256_cvtps_ph(_mm256_loadu_ps(_src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(_dst + i), half);
+        }
+        floatToHalfScalar(_src + i, _dst + i, _count - i);
+    }
+
+    FLUID_TARGET_AVX2 void bfloat16ToFloatAVX2(const BFloat16 *FLUID_RESTRICT _src, float *FLUID_RESTRICT _dst,
+                                               size_t _count)
+    {
+        size_t i = 0;
+        for (; i + 8 <= _count; i += 8)
+        {
+            const __m256i bits = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(_src + i)));
+            _mm256_storeu_ps(_dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(bits, 16)));
+        }
+        bfloat16ToFloatScalar(_src + i, _dst + i, _count - i);
+    }
+
+    FLUID_TARGET_AVX2 void floatToBFloat16AVX2(const float *FLUID_RESTRICT _src, BFloat16 *FLUID_RESTRICT _dst,
+                                               size_t _count)
+    {
+        const __m256i bias = _mm256_set1_epi32(0x7fff);
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i quiet = _mm256_set1_epi32(0x40);
+        size_t i = 0;
+        for (; i + 8 <= _count; i += 8)
+        {
+            const __m256 value = _mm256_loadu_ps(_src + i);
+            const __m256i bits = _mm256_castps_si256(value);
+            const __m256i odd = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+            const __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(bias, odd)), 16);
+            const __m256i nan = _mm256_or_si256(_mm256_srli_epi32(bits, 16), quiet);
+            const __m256i isNan = _mm256_castps_si256(_mm256_cmp_ps(value, value, _CMP_UNORD_Q));
+            const __m256i result = _mm256_blendv_epi8(rounded, nan, isNan);
+            // packus works within each 128 bit lane, so gather the two packed halves into the low lane
+            const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(result, result), 0x08);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(_dst + i), _mm256_castsi256_si128(packed));
+        }
+        floatToBFloat16Scalar(_src + i, _dst + i, _count - i);
+    }
+
+    FLUID_TARGET_AVX512 void halfToFloatAVX512(const Half *FLUID_RESTRICT _src, float *FLUID_RESTRICT _dst,
+                                               size_t _count)
+    {
+        size_t i = 0;
+        for (; i + 16 <= _count; i += 16)
+        {
+            const __m256i half = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(_src + i));
+            _mm512_storeu_ps(_dst + i, _mm512_cvtph_ps(half));
+        }
+        halfToFloatScalar(_src + i, _dst + i, _count - i);
+    }
+
+    FLUID_TARGET_AVX512 void floatToHalfAVX512(const float *FLUID_RESTRICT _src, Half *FLUID_RESTRICT _dst,
+                                               size_t _count)
+    {
+        size_t i = 0;
+        for (; i + 16 <= _count; i += 16)
+        {
+            const __m256i half =
+                _mm512_cvtps_ph(_mm512_loadu_ps(_src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(_dst + i), half);
+        }
+        floatToHalfScalar(_src + i, _dst + i, _count - i);
+    }
+
+    FLUID_TARGET_AVX512 void bfloat16ToFloatAVX512(const BFloat16 *FLUID_RESTRICT _src, float *FLUID_RESTRICT _dst,
+                                                   size_t _count)
+    {
+        size_t i = 0;
+        for (; i + 16 <= _count; i += 16)
+        {
+            const __m512i bits = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(_src + i)));
+            _mm512_storeu_ps(_dst + i, _mm512_castsi512_ps(_mm512_slli_epi32(bits, 16)));
+        }
+        bfloat16ToFloatScalar(_src + i, _dst + i, _count - i);
+    }
+
+    FLUID_TARGET_AVX512 void floatToBFloat16AVX512(const float *FLUID_RESTRICT _src, BFloat16 *FLUID_RESTRICT _dst,
+                                                   size_t _count)
+    {
+        const __m512i bias = _mm512_set1_epi32(0x7fff);
+        const __m512i one = _mm512_set1_epi32(1);
+        const __m512i quiet = _mm512_set1_epi32(0x40);
+        size_t i = 0;
+        for (; i + 16 <= _count; i += 16)
+        {
+            const __m512 value = _mm512_loadu_ps(_src + i);
+            const __m512i bits = _mm512_castps_si512(value);
+            const __m512i odd = _mm512_and_si512(_mm512_srli_epi32(bits, 16), one);
+            const __m512i rounded = _mm512_srli_epi32(_mm512_add_epi32(bits, _mm512_add_epi32(bias, odd)), 16);
+            const __m512i nan = _mm512_or_si512(_mm512_srli_epi32(bits, 16), quiet);
+            const __mmask16 isNan = _mm512_cmp_ps_mask(value, value, _CMP_UNORD_Q);
+            const __m512i result = _mm512_mask_blend_epi32(isNan, rounded, nan);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(_dst + i), _mm512_cvtepi32_epi16(result));
+        }
+        floatToBFloat16Scalar(_src + i, _dst + i, _count - i);
+    }
+#endif
+
+    const ConversionKernels c_scalarKernels{halfToFloatScalar, floatToHalfScalar, bfloat16ToFloatScalar,
+                                            floatToBFloat16Scalar};
+#ifdef FLUID_X86_SIMD
+    const ConversionKernels c_avx2Kernels{halfToFloatAVX2, floatToHalfAVX2, bfloat16ToFloatAVX2, floatToBFloat16AVX2};
+    // a few early AVX2 parts do without F16C, they still get the vector bfloat16 conversions
+    const ConversionKernels c_avx2NoF16CKernels{halfToFloatScalar, floatToHalfScalar, bfloat16ToFloatAVX2,
+                                                floatToBFloat16AVX2};
+    const ConversionKernels c_avx512Kernels{halfToFloatAVX512, floatToHalfAVX512, bfloat16ToFloatAVX512,
+                                            floatToBFloat16AVX512};
+#endif
+}
+
+const ConversionKernels &conversionKernels(SimdLevel _level)
+{
+#ifdef FLUID_X86_SIMD
+    SimdLevel supported = detectSimdLevel();
+    if (_level > supported)
+    {
+        _level = supported;
+    }
+    switch (_level)
+    {
+    case SimdLevel::AVX512:
+        return c_avx512Kernels;
+    case SimdLevel::AVX2:
+        return detectF16C() ? c_avx2Kernels : c_avx2NoF16CKernels;
+    default:
+        break;
+    }
+#else
+    (void)_level;
+#endif
+    return c_scalarKernels;
+}
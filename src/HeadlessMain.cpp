@@ -0,0 +1,513 @@
+/****************************************************************************
+Batch runner for the fluid simulation, steps the solver as fast as it can without Qt or OpenGL
+****************************************************************************/
+#include "Checkpoint.h"
+#include "FieldStream.h"
+#include "FluidGrid.h"
+#include "Profiler.h"
+#include "SimulationConfig.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#ifdef FLUID_HAVE_GPU
+#include "GpuContext.h"
+#include "GpuFluidSolver.h"
+#endif
+
+namespace
+{
+  const char *c_usage =
+      "Usage: FluidSimulationHeadless [--config file] [--key value]...\n"
+      "  --width, --height  grid cells including the boundary (100)\n"
+      "  --dt, --viscosity  time step (1e-7) and viscosity (20)\n"
+      "  --steps            number of steps to run (100)\n"
+      "  --threads          solver threads, 0 uses every core (1)\n"
+      "  --particles        tracer particles, 0 places one on every cell (0)\n"
+      "  --iterations       relaxation sweeps (4)\n"
+      "  --solve            gauss-seidel, red-black or jacobi\n"
+      "  --tile             sweeps run on a few rows at a time while in cache (1)\n"
+      "  --advection        semi-lagrangian, maccormack or bfecc\n"
+      "  --timestep         fixed, adaptive for dt from the CFL number, or substeps to split dt as needed (fixed)\n"
+      "  --cfl              cells the fastest fluid may cross per step or sub-step (1)\n"
+      "  --min-dt, --max-dt bounds of the adaptive dt (0, 1)\n"
+      "  --max-substeps     most sub-steps a step is split into (8)\n"
+      "  --frame-budget     milliseconds per step, capping sub-steps and cutting sweeps to fit (0, none)\n"
+      "  --backend          cpu, gpu for the compute shaders, or compare to run both and check they agree (cpu)\n"
+      "  --fused            on or off, step with the fused kernels (off)\n"
+      "  --sparse           on or off, only step the 16x16 tiles with moving fluid (off)\n"
+      "  --sparse-threshold fraction of the top speed above which a tile is moving (1e-4)\n"
+      "  --sparse-halo      tiles around each moving tile also stepped (1)\n"
+      "  --pressure         relaxation, multigrid or cg\n"
+      "  --tolerance        relative residual for multigrid and cg (1e-4)\n"
+      "  --preconditioner   mic0 or jacobi\n"
+      "  --force            \"step x y vx vy\", velocity added before a step, repeatable\n"
+      "  --impulse          \"step x y vx vy [radius]\", velocity splatted at the start of a step, repeatable\n"
+      "  --scalar           \"name [diffusion]\", a channel such as dye carried by the fluid, repeatable\n"
+      "  --source           \"step name x y amount\", scalar added before a step, repeatable\n"
+      "  --buoyancy         \"temperature lift [density weight]\", channels pushing the fluid along Y\n"
+      "  --output           write the final X then Y velocity, then each scalar, as raw 32 bit floats\n"
+      "  --profile          time each stage, writing <profile>.csv, .json and .trace.json\n"
+      "  --checkpoint       checkpoint file, written in the background after the last step\n"
+      "  --checkpoint-every also rewrite the checkpoint every this many steps (0)\n"
+      "  --restart          continue from a checkpoint up to --steps in total, with its size and scalar channels\n"
+      "  --fields           stream the velocity field to this file in the background\n"
+      "  --fields-every     stream every this many steps (1)\n"
+      "  --fields-format    stream, or raw for one <fields>_<step>.raw file per frame\n"
+      "  --compression      none, shuffle, zstd or lz4 for the stream (none)\n"
+      "  --delta            on or off, store each frame as its change from the last (off)\n"
+      "  --queue            frames buffered for the writer (4)\n"
+      "  --when-full        block, drop-newest or drop-oldest when the buffers are full\n";
+
+#ifdef FLUID_HAVE_GPU
+  // the largest difference between the CPU and GPU velocity the compare backend accepts, as a fraction of the peak
+  // CPU velocity. Both sweep red-black in the same order and agree exactly on llvmpipe, other drivers may round
+  // division and square roots differently.
+  constexpr float c_compareTolerance = 1.0e-3f;
+#endif
+
+  /**
+   * @brief The most trace events one step records: itself, impulses and particles once, and diffuse, advect, scalars
+   * and two projections for each sub-step
+   */
+  size_t eventsPerStep(const FluidGrid::TimeStepping &_stepping)
+  {
+    const bool subSteps = _stepping.mode == FluidGrid::TimeStepping::Mode::SubSteps;
+    return 3 + 5 * static_cast<size_t>(subSteps ? std::max(_stepping.maxSubSteps, 1) : 1);
+  }
+
+  bool writeFields(const float *_velocX, const float *_velocY, const FluidGrid &_grid, const std::string &_path)
+  {
+    FILE *file = std::fopen(_path.c_str(), "wb");
+    if (file == nullptr)
+    {
+      return false;
+    }
+    const size_t cells = _grid.numCells();
+    bool written = std::fwrite(_velocX, sizeof(float), cells, file) == cells &&
+                   std::fwrite(_velocY, sizeof(float), cells, file) == cells;
+    const ScalarFields &scalars = _grid.getScalars();
+    for (size_t channel = 0; channel < scalars.size() && written; channel++)
+    {
+      written = std::fwrite(scalars.current(channel), sizeof(float), scalars.numCells(), file) == scalars.numCells();
+    }
+    return std::fclose(file) == 0 && written;
+  }
+
+#ifdef FLUID_HAVE_GPU
+  /**
+   * @brief The first setting of a config the compute backend cannot run, empty when it can run all of them
+   */
+  std::string gpuUnsupported(const SimulationConfig &_config)
+  {
+    if (!_config.restart.empty() || !_config.checkpoint.empty())
+    {
+      return "checkpoints";
+    }
+    if (!_config.fieldOutput.path.empty())
+    {
+      return "field streams";
+    }
+    if (!_config.profile.empty())
+    {
+      return "profiles";
+    }
+    if (!_config.scalars.empty())
+    {
+      return "scalar channels";
+    }
+    if (!_config.impulses.empty())
+    {
+      return "impulses";
+    }
+    if (_config.sparse)
+    {
+      return "sparse stepping";
+    }
+    if (_config.pressureSolver.type != PressureSolver::Type::Relaxation)
+    {
+      return "the multigrid and cg pressure solvers";
+    }
+    if (_config.advectionScheme != Fluid::AdvectionScheme::SemiLagrangian)
+    {
+      return "higher order advection";
+    }
+    if (_config.timeStepping.mode != FluidGrid::TimeStepping::Mode::Fixed || _config.frameBudget > 0.0)
+    {
+      return "adaptive time steps";
+    }
+    return {};
+  }
+
+  /**
+   * @brief The largest difference between two fields, as a fraction of the largest value of the first
+   */
+  float relativeDifference(const float *_expected, const float *_actual, size_t _count)
+  {
+    float peak = 0.0f;
+    float difference = 0.0f;
+    for (size_t i = 0; i < _count; i++)
+    {
+      peak = std::max(peak, std::fabs(_expected[i]));
+      difference = std::max(difference, std::fabs(_expected[i] - _actual[i]));
+    }
+    return peak > 0.0f ? difference / peak : difference;
+  }
+#endif
+
+  bool writeProfile(const Profiler &_profiler, const std::string &_prefix)
+  {
+    std::ofstream csv(_prefix + ".csv");
+    _profiler.writeCsv(csv);
+    std::ofstream json(_prefix + ".json");
+    _profiler.writeJson(json);
+    std::ofstream trace(_prefix + ".trace.json");
+    _profiler.writeChromeTrace(trace);
+    return csv.good() && json.good() && trace.good();
+  }
+}
+
+int main(int argc, char **argv)
+{
+  SimulationConfig config;
+  std::string error;
+  if (argc == 2 && std::string(argv[1]) == "--help")
+  {
+    std::cout << c_usage;
+    return EXIT_SUCCESS;
+  }
+  if (!config.parseArguments(argc, argv, &error))
+  {
+    std::cerr << error << "\n" << c_usage;
+    return EXIT_FAILURE;
+  }
+
+  // a restart takes the size and physical settings of the run it continues
+  Checkpoint restart;
+  if (!config.restart.empty())
+  {
+    if (!restart.open(config.restart, &error))
+    {
+      std::cerr << error << "\n";
+      return EXIT_FAILURE;
+    }
+    config.width = restart.width();
+    config.height = restart.height();
+    config.dt = restart.dt();
+    config.viscosity = restart.viscosity();
+    config.particles = restart.numParticles();
+    config.scalars.clear();
+    for (size_t channel = 0; channel < restart.numScalars(); channel++)
+    {
+      config.scalars.push_back({restart.scalarName(channel), restart.scalarDiffusion(channel)});
+    }
+  }
+
+  FluidGrid grid(config.width, config.height, config.viscosity, config.dt, config.particles);
+  grid.setThreadCount(config.threads);
+  grid.setIterations(config.iterations);
+  grid.setSolveMode(config.solveMode);
+  grid.setSweepsPerTile(config.sweepsPerTile);
+  grid.setAdvectionScheme(config.advectionScheme);
+  grid.setTimeStepping(config.timeStepping);
+  grid.setFrameBudget(config.frameBudget);
+  grid.setFused(config.fused);
+  grid.setActivityThreshold(config.activityThreshold);
+  grid.setActivityHalo(config.activityHalo);
+  grid.setSparse(config.sparse);
+  grid.setPressureSolver(config.pressureSolver);
+  for (const ScalarChannel &channel : config.scalars)
+  {
+    grid.addScalar(channel.name, channel.diffusion);
+  }
+  size_t firstStep = 0;
+  if (restart.isOpen())
+  {
+    if (!grid.restore(restart, &error))
+    {
+      std::cerr << error << "\n";
+      return EXIT_FAILURE;
+    }
+    firstStep = static_cast<size_t>(restart.step());
+    restart.close();
+  }
+  // channels are referred to by name in the config, check they all exist before running
+  auto findChannel = [&](const std::string &_name, size_t *_channel) {
+    *_channel = grid.getScalars().find(_name);
+    if (*_channel == ScalarFields::npos)
+    {
+      std::cerr << "no scalar channel named '" << _name << "'\n";
+      return false;
+    }
+    return true;
+  };
+  if (!config.buoyancyTemperature.empty())
+  {
+    FluidGrid::Buoyancy buoyancy;
+    buoyancy.lift = config.buoyancyLift;
+    buoyancy.weight = config.buoyancyWeight;
+    if (!findChannel(config.buoyancyTemperature, &buoyancy.temperature) ||
+        (!config.buoyancyDensity.empty() && !findChannel(config.buoyancyDensity, &buoyancy.density)))
+    {
+      return EXIT_FAILURE;
+    }
+    grid.setBuoyancy(buoyancy);
+  }
+
+  const bool runCpu = config.backend != SolverBackend::Gpu;
+#ifdef FLUID_HAVE_GPU
+  // the context must outlive the solver, which releases its buffers in it
+  GpuContext gpuContext;
+  std::unique_ptr<GpuFluidSolver> gpu;
+  if (config.backend != SolverBackend::Cpu)
+  {
+    const std::string unsupported = gpuUnsupported(config);
+    if (!unsupported.empty())
+    {
+      std::cerr << "the gpu backend does not support " << unsupported << "\n";
+      return EXIT_FAILURE;
+    }
+    gpu = std::make_unique<GpuFluidSolver>(config.width, config.height, config.viscosity, config.dt, config.particles);
+    if (!gpuContext.create(&error) || !gpu->create(&error))
+    {
+      std::cerr << error << "\n";
+      return EXIT_FAILURE;
+    }
+    gpu->setIterations(config.iterations);
+    // the GPU sweeps red-black, so the CPU must too for the two to agree
+    grid.setSolveMode(Fluid::SolveMode::RedBlack);
+    std::cout << "compute shaders on " << gpuContext.renderer() << "\n";
+  }
+#else
+  if (config.backend != SolverBackend::Cpu)
+  {
+    std::cerr << "built without the OpenGL compute backend\n";
+    return EXIT_FAILURE;
+  }
+#endif
+
+  std::unique_ptr<Profiler> profiler;
+  if (!config.profile.empty())
+  {
+    profiler = std::make_unique<Profiler>(config.steps * eventsPerStep(config.timeStepping));
+    grid.setProfiler(profiler.get());
+  }
+
+  std::vector<ForceInjection> forces = config.sortedForces();
+  size_t nextForce = 0;
+  // forces before a restart were already applied by the run that wrote the checkpoint
+  while (nextForce < forces.size() && forces[nextForce].step < firstStep)
+  {
+    nextForce++;
+  }
+  std::vector<ImpulseInjection> impulses = config.sortedImpulses();
+  size_t nextImpulse = 0;
+  while (nextImpulse < impulses.size() && impulses[nextImpulse].step < firstStep)
+  {
+    nextImpulse++;
+  }
+  // the impulses of one step, handed to the grid as a batch
+  std::vector<Impulse> stepImpulses;
+  std::vector<ScalarInjection> sources = config.sortedSources();
+  std::vector<size_t> sourceChannels(sources.size());
+  for (size_t i = 0; i < sources.size(); i++)
+  {
+    if (!findChannel(sources[i].channel, &sourceChannels[i]))
+    {
+      return EXIT_FAILURE;
+    }
+  }
+  size_t nextSource = 0;
+  while (nextSource < sources.size() && sources[nextSource].step < firstStep)
+  {
+    nextSource++;
+  }
+
+  // checkpoints are written on their own thread, the steps only wait for the state to be copied
+  std::unique_ptr<CheckpointWriter> checkpoints;
+  if (!config.checkpoint.empty())
+  {
+    checkpoints = std::make_unique<CheckpointWriter>();
+  }
+  auto saveCheckpoint = [&](size_t _step) {
+    grid.capture(&checkpoints->acquire(), _step);
+    checkpoints->submit(config.checkpoint);
+  };
+
+  // field frames are copied into the writer's buffers, compressing and writing them happens on its thread
+  FieldWriter fields;
+  if (!config.fieldOutput.path.empty() && !fields.open(config.width, config.height, config.fieldOutput, &error))
+  {
+    std::cerr << error << "\n";
+    return EXIT_FAILURE;
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t step = firstStep; step < config.steps; step++)
+  {
+    for (; nextForce < forces.size() && forces[nextForce].step == step; nextForce++)
+    {
+      const ForceInjection &force = forces[nextForce];
+      grid.addVelocity(force.x, force.y, force.vx, force.vy);
+#ifdef FLUID_HAVE_GPU
+      if (gpu)
+      {
+        gpu->addVelocity(force.x, force.y, force.vx, force.vy);
+      }
+#endif
+    }
+    stepImpulses.clear();
+    for (; nextImpulse < impulses.size() && impulses[nextImpulse].step == step; nextImpulse++)
+    {
+      stepImpulses.push_back(impulses[nextImpulse].impulse);
+    }
+    grid.addImpulses(stepImpulses.data(), stepImpulses.size());
+    for (; nextSource < sources.size() && sources[nextSource].step == step; nextSource++)
+    {
+      const ScalarInjection &source = sources[nextSource];
+      grid.addScalarSource(sourceChannels[nextSource], source.x, source.y, source.amount);
+    }
+    if (runCpu)
+    {
+      grid.step();
+    }
+#ifdef FLUID_HAVE_GPU
+    if (gpu)
+    {
+      gpu->step();
+    }
+#endif
+    if (fields.isOpen() && (step + 1) % config.fieldInterval == 0)
+    {
+      fields.write(step + 1, {grid.getVelocityX(), grid.getVelocityY()});
+    }
+    if (checkpoints && config.checkpointInterval > 0 && (step + 1) % config.checkpointInterval == 0 &&
+        step + 1 < config.steps)
+    {
+      saveCheckpoint(step + 1);
+    }
+  }
+#ifdef FLUID_HAVE_GPU
+  if (gpu)
+  {
+    gpu->finish();
+  }
+#endif
+  auto end = std::chrono::steady_clock::now();
+  if (checkpoints)
+  {
+    saveCheckpoint(std::max(firstStep, config.steps));
+  }
+
+  double seconds = std::chrono::duration<double>(end - begin).count();
+  const size_t stepsRun = config.steps > firstStep ? config.steps - firstStep : 0;
+  std::cout << stepsRun << " steps of " << config.width << "x" << config.height << " on " << grid.getThreadCount()
+            << " threads with " << grid.getNumParticles() << " particles in " << seconds << " s";
+  if (stepsRun > 0)
+  {
+    std::cout << ", " << seconds * 1.0e6 / static_cast<double>(stepsRun) << " uS per step";
+  }
+  std::cout << "\n";
+  if (const ActivityMask *mask = grid.activityMask())
+  {
+    std::cout << mask->numActive() << " of " << mask->numTiles() << " tiles active\n";
+  }
+  if (config.timeStepping.mode != FluidGrid::TimeStepping::Mode::Fixed && stepsRun > 0)
+  {
+    std::cout << "last step: dt " << grid.lastDt() << " x " << grid.lastSubSteps() << " sub-steps at speed "
+              << grid.lastSpeed() << " cells per unit time\n";
+  }
+  if (config.frameBudget > 0.0)
+  {
+    std::cout << grid.iterations() << " of " << config.iterations << " sweeps fit the frame budget\n";
+  }
+  if (Workspace::countsHeapAllocations() && stepsRun > 0)
+  {
+    // the fields and solver scratch are all allocated before the first step, so this should be 0
+    std::cout << grid.lastStepAllocations() << " heap allocations in the last step\n";
+  }
+
+  if (profiler)
+  {
+    grid.setProfiler(nullptr);
+    profiler->writeCsv(std::cout);
+    if (profiler->droppedEvents() > 0)
+    {
+      std::cout << profiler->droppedEvents() << " trace events dropped, the trace was full\n";
+    }
+    if (!writeProfile(*profiler, config.profile))
+    {
+      std::cerr << "cannot write the profile to " << config.profile << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  const float *velocX = grid.getVelocityX();
+  const float *velocY = grid.getVelocityY();
+#ifdef FLUID_HAVE_GPU
+  std::vector<float> gpuVelocity;
+  if (gpu)
+  {
+    gpuVelocity.resize(2 * gpu->numCells());
+    gpu->readVelocity(gpuVelocity.data(), gpuVelocity.data() + gpu->numCells());
+  }
+  if (config.backend == SolverBackend::Compare)
+  {
+    const size_t cells = grid.numCells();
+    const float differenceX = relativeDifference(velocX, gpuVelocity.data(), cells);
+    const float differenceY = relativeDifference(velocY, gpuVelocity.data() + cells, cells);
+    // the particles follow the velocity, so they only drift apart as far as it does
+    const size_t count = gpu->numParticles();
+    std::vector<float> particles(4 * count);
+    gpu->readParticles(particles.data(), particles.data() + count, particles.data() + 2 * count,
+                       particles.data() + 3 * count);
+    const float *cpuParticles[] = {grid.getParticles().x(), grid.getParticles().y()};
+    float drift = 0.0f;
+    for (size_t axis = 0; axis < 2; axis++)
+    {
+      for (size_t p = 0; p < count; p++)
+      {
+        drift = std::max(drift, std::fabs(cpuParticles[axis][p] - particles[axis * count + p]));
+      }
+    }
+    std::cout << "gpu velocity differs from the cpu by at most " << differenceX << " along X and " << differenceY
+              << " along Y of the peak, particles by " << drift << " cells\n";
+    if (differenceX > c_compareTolerance || differenceY > c_compareTolerance)
+    {
+      std::cerr << "the gpu and cpu solvers disagree by more than " << c_compareTolerance << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  else if (gpu)
+  {
+    velocX = gpuVelocity.data();
+    velocY = gpuVelocity.data() + gpu->numCells();
+  }
+#endif
+
+  if (!config.output.empty() && !writeFields(velocX, velocY, grid, config.output))
+  {
+    std::cerr << "cannot write " << config.output << "\n";
+    return EXIT_FAILURE;
+  }
+  if (fields.isOpen())
+  {
+    bool written = fields.close(&error);
+    std::cout << fields.framesWritten() << " field frames written, " << fields.framesDropped() << " dropped\n";
+    if (!written)
+    {
+      std::cerr << error << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  if (checkpoints && !checkpoints->wait(&error))
+  {
+    std::cerr << error << "\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,186 @@
+/**
+ * @file ImpulseQueue.cpp
+ * @brief Impulses queued for a grid and splatted into its velocity field in one parallel pass.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "ImpulseQueue.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "ActivityMask.h"
+#include "ThreadPool.h"
+
+namespace
+{
+    /**
+     * @brief How far a Gaussian splat reaches in radii, where its weight has fallen to about 1e-4
+     */
+    constexpr float c_splatReach = 3.0f;
+}
+
+ImpulseQueue::ImpulseQueue(size_t _width, size_t _height) : m_width{_width}, m_height{_height}
+{
+}
+
+void ImpulseQueue::add(const Impulse *_impulses, size_t _count)
+{
+    const float maxX = static_cast<float>(m_width - 2);
+    const float maxY = static_cast<float>(m_height - 2);
+    for (size_t n = 0; n < _count; n++)
+    {
+        Impulse impulse = _impulses[n];
+        impulse.x = std::clamp(impulse.x, 1.0f, maxX);
+        impulse.y = std::clamp(impulse.y, 1.0f, maxY);
+        impulse.radius = std::max(impulse.radius, 0.0f);
+
+        Footprint footprint;
+        if (impulse.radius > 0.0f)
+        {
+            const float reach = c_splatReach * impulse.radius;
+            footprint.i0 = static_cast<size_t>(std::max(std::ceil(impulse.x - reach), 1.0f));
+            footprint.i1 = static_cast<size_t>(std::min(std::floor(impulse.x + reach), maxX)) + 1;
+            footprint.j0 = static_cast<size_t>(std::max(std::ceil(impulse.y - reach), 1.0f));
+            footprint.j1 = static_cast<size_t>(std::min(std::floor(impulse.y + reach), maxY)) + 1;
+        }
+        else
+        {
+            // the cell past the last interior one only ever gets a weight of 0, so it is left out
+            footprint.i0 = static_cast<size_t>(impulse.x);
+            footprint.i1 = std::min(footprint.i0 + 2, m_width - 1);
+            footprint.j0 = static_cast<size_t>(impulse.y);
+            footprint.j1 = std::min(footprint.j0 + 2, m_height - 1);
+        }
+        m_impulses.push_back(impulse);
+        m_footprints.push_back(footprint);
+    }
+}
+
+void ImpulseQueue::clear()
+{
+    m_impulses.clear();
+    m_footprints.clear();
+}
+
+void ImpulseQueue::apply(float *_velocX, float *_velocY, ThreadPool *_pool, ActivityMask *_mask)
+{
+    if (m_impulses.empty())
+    {
+        return;
+    }
+
+    if (_mask != nullptr)
+    {
+        for (const Footprint &footprint : m_footprints)
+        {
+            _mask->activateRegion(footprint.i0, footprint.j0, footprint.i1, footprint.j1);
+        }
+    }
+
+    binByBand();
+    auto splatBands = [&](size_t _first, size_t _last) {
+        for (size_t band = _first; band < _last; band++)
+        {
+            splatBand(band, _velocX, _velocY);
+        }
+    };
+    const size_t numBands = m_bandStarts.size() - 1;
+    if (_pool != nullptr)
+    {
+        _pool->parallelFor(0, numBands, splatBands);
+    }
+    else
+    {
+        splatBands(0, numBands);
+    }
+    clear();
+}
+
+void ImpulseQueue::binByBand()
+{
+    // a counting sort, so each band lists its impulses in the order they were queued
+    const size_t numBands = (m_height + c_bandRows - 1) / c_bandRows;
+    m_bandStarts.assign(numBands + 1, 0);
+    for (const Footprint &footprint : m_footprints)
+    {
+        for (size_t band = footprint.j0 / c_bandRows; band * c_bandRows < footprint.j1; band++)
+        {
+            m_bandStarts[band + 1]++;
+        }
+    }
+    for (size_t band = 0; band < numBands; band++)
+    {
+        m_bandStarts[band + 1] += m_bandStarts[band];
+    }
+
+    // fill each band using its start as a cursor, which leaves every start at the end of its band
+    m_bandImpulses.resize(m_bandStarts[numBands]);
+    for (size_t n = 0; n < m_footprints.size(); n++)
+    {
+        for (size_t band = m_footprints[n].j0 / c_bandRows; band * c_bandRows < m_footprints[n].j1; band++)
+        {
+            m_bandImpulses[m_bandStarts[band]++] = n;
+        }
+    }
+    for (size_t band = numBands; band > 0; band--)
+    {
+        m_bandStarts[band] = m_bandStarts[band - 1];
+    }
+    m_bandStarts[0] = 0;
+}
+
+void ImpulseQueue::splatBand(size_t _band, float *_velocX, float *_velocY) const
+{
+    const size_t bandBegin = _band * c_bandRows;
+    const size_t bandEnd = bandBegin + c_bandRows;
+    for (size_t k = m_bandStarts[_band]; k < m_bandStarts[_band + 1]; k++)
+    {
+        const Impulse &impulse = m_impulses[m_bandImpulses[k]];
+        const Footprint &footprint = m_footprints[m_bandImpulses[k]];
+        const size_t j0 = std::max(footprint.j0, bandBegin);
+        const size_t j1 = std::min(footprint.j1, bandEnd);
+
+        if (impulse.radius > 0.0f)
+        {
+            // step along each row with exp(-(dx + 1)^2 f) = exp(-dx^2 f) * exp(-(2 dx + 1) f), where the second
+            // factor shrinks by exp(-2 f) each cell, so each row only takes one exp
+            const float falloff = 1.0f / (impulse.radius * impulse.radius);
+            const float dx0 = static_cast<float>(footprint.i0) - impulse.x;
+            const float firstWeight = std::exp(-dx0 * dx0 * falloff);
+            const float firstRatio = std::exp(-(2.0f * dx0 + 1.0f) * falloff);
+            const float ratioStep = std::exp(-2.0f * falloff);
+            for (size_t j = j0; j < j1; j++)
+            {
+                const float dy = static_cast<float>(j) - impulse.y;
+                const float rowWeight = std::exp(-dy * dy * falloff);
+                float *rowX = _velocX + j * m_width;
+                float *rowY = _velocY + j * m_width;
+                float weight = rowWeight * firstWeight;
+                float ratio = firstRatio;
+                for (size_t i = footprint.i0; i < footprint.i1; i++)
+                {
+                    rowX[i] += impulse.vx * weight;
+                    rowY[i] += impulse.vy * weight;
+                    weight *= ratio;
+                    ratio *= ratioStep;
+                }
+            }
+            continue;
+        }
+
+        const float s1 = impulse.x - static_cast<float>(footprint.i0);
+        const float t1 = impulse.y - static_cast<float>(footprint.j0);
+        for (size_t j = j0; j < j1; j++)
+        {
+            const float t = j == footprint.j0 ? 1.0f - t1 : t1;
+            for (size_t i = footprint.i0; i < footprint.i1; i++)
+            {
+                const float weight = (i == footprint.i0 ? 1.0f - s1 : s1) * t;
+                _velocX[i + j * m_width] += impulse.vx * weight;
+                _velocY[i + j * m_width] += impulse.vy * weight;
+            }
+        }
+    }
+}
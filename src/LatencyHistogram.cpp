@@ -0,0 +1,100 @@
+/**
+ * @file LatencyHistogram.cpp
+ * @brief A lock-free histogram of durations in nanoseconds, used to report percentiles of the solver stages.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "LatencyHistogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::record(uint64_t _nanoseconds)
+{
+    m_buckets[bucketIndex(_nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_total.fetch_add(_nanoseconds, std::memory_order_relaxed);
+
+    uint64_t previous = m_max.load(std::memory_order_relaxed);
+    while (previous < _nanoseconds && !m_max.compare_exchange_weak(previous, _nanoseconds, std::memory_order_relaxed))
+    {
+    }
+}
+
+void LatencyHistogram::reset()
+{
+    for (auto &bucket : m_buckets)
+    {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_total.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const
+{
+    uint64_t n = count();
+    return n == 0 ? 0.0 : static_cast<double>(total()) / static_cast<double>(n);
+}
+
+uint64_t LatencyHistogram::percentile(double _quantile) const
+{
+    uint64_t n = count();
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    // the rank of the wanted value counting from 1, so p0 is the smallest and p100 the largest
+    uint64_t rank = static_cast<uint64_t>(std::ceil(std::clamp(_quantile, 0.0, 1.0) * static_cast<double>(n)));
+    rank = std::max<uint64_t>(rank, 1);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < c_numBuckets; i++)
+    {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+            return std::min(bucketUpperBound(i), max());
+        }
+    }
+    return max();
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t _value)
+{
+    if (_value < c_subBuckets)
+    {
+        return static_cast<size_t>(_value);
+    }
+
+    // position of the highest set bit, the next c_subBucketBits bits pick the sub-bucket
+    int exponent = 63;
+    while ((_value >> exponent) == 0)
+    {
+        exponent--;
+    }
+    size_t shift = static_cast<size_t>(exponent - c_subBucketBits);
+    size_t sub = static_cast<size_t>(_value >> shift) & (c_subBuckets - 1);
+    return (shift + 1) * c_subBuckets + sub;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t _index)
+{
+    if (_index < c_subBuckets)
+    {
+        return _index;
+    }
+
+    size_t shift = _index / c_subBuckets - 1;
+    uint64_t sub = _index % c_subBuckets;
+    uint64_t lower = (c_subBuckets + sub) << shift;
+    return lower + ((uint64_t{1} << shift) - 1);
+}
@@ -0,0 +1,420 @@
+/**
+ * @file MixedPrecisionFluid.cpp
+ * @brief The velocity step of FluidGrid with the velocity fields stored in a 16 bit format
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "MixedPrecisionFluid.h"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "Bilinear.h"
+#include "StencilKernels.h"
+
+namespace
+{
+    /**
+     * @brief Cells of a row converted at a time, small enough that every buffer a pass needs stays in L1
+     */
+    constexpr size_t c_block = 256;
+
+    void toFloats(const Half *_src, float *_dst, size_t _count, const ConversionKernels &_kernels)
+    {
+        _kernels.halfToFloat(_src, _dst, _count);
+    }
+
+    void toFloats(const BFloat16 *_src, float *_dst, size_t _count, const ConversionKernels &_kernels)
+    {
+        _kernels.bfloat16ToFloat(_src, _dst, _count);
+    }
+
+    void fromFloats(const float *_src, Half *_dst, size_t _count, const ConversionKernels &_kernels)
+    {
+        _kernels.floatToHalf(_src, _dst, _count);
+    }
+
+    void fromFloats(const float *_src, BFloat16 *_dst, size_t _count, const ConversionKernels &_kernels)
+    {
+        _kernels.floatToBFloat16(_src, _dst, _count);
+    }
+
+    /**
+     * @brief _count values of a field as floats, converted into _buffer unless the field already holds floats
+     */
+    template <typename Storage>
+    const float *readRow(const Storage *_src, float *_buffer, size_t _count, const ConversionKernels &_kernels)
+    {
+        if constexpr (std::is_same_v<Storage, float>)
+        {
+            return _src;
+        }
+        else
+        {
+            toFloats(_src, _buffer, _count, _kernels);
+            return _buffer;
+        }
+    }
+
+    /**
+     * @brief Where to compute values of a field, the field itself when it holds floats and otherwise _buffer, which
+     * writeRow then rounds into the field
+     */
+    template <typename Storage>
+    float *outputRow(Storage *_dst, float *_buffer)
+    {
+        if constexpr (std::is_same_v<Storage, float>)
+        {
+            return _dst;
+        }
+        else
+        {
+            return _buffer;
+        }
+    }
+
+    /**
+     * @brief _count values of a field to update, as floats in the field itself or converted into _buffer
+     */
+    template <typename Storage>
+    float *editRow(Storage *_field, float *_buffer, size_t _count, const ConversionKernels &_kernels)
+    {
+        if constexpr (std::is_same_v<Storage, float>)
+        {
+            return _field;
+        }
+        else
+        {
+            toFloats(_field, _buffer, _count, _kernels);
+            return _buffer;
+        }
+    }
+
+    template <typename Storage>
+    void writeRow(const float *_row, Storage *_dst, size_t _count, const ConversionKernels &_kernels)
+    {
+        if constexpr (!std::is_same_v<Storage, float>)
+        {
+            fromFloats(_row, _dst, _count, _kernels);
+        }
+    }
+
+    /**
+     * @brief Run _fn(j, i0, count) over blocks of at most c_block cells covering the interior of rows [_first, _last)
+     */
+    template <typename Fn>
+    void forBlocks(size_t _first, size_t _last, size_t _width, Fn &&_fn)
+    {
+        for (size_t j = _first; j < _last; j++)
+        {
+            for (size_t i0 = 1; i0 < _width - 1; i0 += c_block)
+            {
+                _fn(j, i0, std::min(c_block, _width - 1 - i0));
+            }
+        }
+    }
+}
+
+template <typename Storage>
+MixedPrecisionFluid<Storage>::MixedPrecisionFluid(size_t _width, size_t _height, float _viscosity, float _dt,
+                                                  int _iterations) : m_fluid{_width, _height, _iterations},
+                                                                     m_visc{_viscosity},
+                                                                     m_dt{_dt}
+{
+    // diffuse only sweeps Jacobi, so relax the pressure the same way
+    m_fluid.setSolveMode(Fluid::SolveMode::Jacobi);
+    for (size_t field = 0; field < 5; field++)
+    {
+        m_arrays[field] = m_workspace.add<Storage>(numCells(), _width);
+    }
+    m_arrays[5] = m_workspace.add<float>(numCells(), _width);
+    m_arrays[6] = m_workspace.add<float>(numCells(), _width);
+    m_workspace.allocate(nullptr);
+    bindFields();
+    reset();
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::bindFields()
+{
+    m_Vx = m_workspace.array<Storage>(m_arrays[0]);
+    m_Vy = m_workspace.array<Storage>(m_arrays[1]);
+    m_Vx0 = m_workspace.array<Storage>(m_arrays[2]);
+    m_Vy0 = m_workspace.array<Storage>(m_arrays[3]);
+    m_scratch = m_workspace.array<Storage>(m_arrays[4]);
+    m_pressure = m_workspace.array<float>(m_arrays[5]);
+    m_divergence = m_workspace.array<float>(m_arrays[6]);
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::setThreadPool(ThreadPool *_pool)
+{
+    m_pool = _pool;
+    m_fluid.setThreadPool(_pool);
+    m_workspace.allocate(_pool);
+    bindFields();
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::setSimdLevel(SimdLevel _level)
+{
+    m_fluid.setSimdLevel(_level);
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::step()
+{
+    diffuse(Fluid::Boundary::X, m_Vx0, m_Vx, m_visc, m_dt);
+    diffuse(Fluid::Boundary::Y, m_Vy0, m_Vy, m_visc, m_dt);
+    project(m_Vx0, m_Vy0);
+    advect(Fluid::Boundary::X, m_Vx, m_Vx0, m_Vx0, m_Vy0, m_dt);
+    advect(Fluid::Boundary::Y, m_Vy, m_Vy0, m_Vx0, m_Vy0, m_dt);
+    project(m_Vx, m_Vy);
+    stepScalars();
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::stepScalars()
+{
+    for (ScalarChannel &channel : m_scalars)
+    {
+        if (channel.diffusion <= 0.0f)
+        {
+            continue;
+        }
+        std::swap(channel.current, channel.previous);
+        diffuse(Fluid::Boundary::None, m_workspace.array<Storage>(channel.current),
+                m_workspace.array<Storage>(channel.previous), channel.diffusion, m_dt);
+    }
+    // the channels sample the stored values of the last stage through interpolate, with no copy to float
+    for (ScalarChannel &channel : m_scalars)
+    {
+        std::swap(channel.current, channel.previous);
+        advect(Fluid::Boundary::None, m_workspace.array<Storage>(channel.current),
+               m_workspace.array<Storage>(channel.previous), m_Vx, m_Vy, m_dt);
+    }
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::addVelocity(float _x, float _y, float _vx, float _vy)
+{
+    // clamp x and y so inside the grid
+    size_t index = m_fluid.IX(std::clamp(static_cast<size_t>(_x), static_cast<size_t>(0), width() - 1),
+                              std::clamp(static_cast<size_t>(_y), static_cast<size_t>(0), height() - 1));
+
+    m_Vx[index] = fromFloat<Storage>(toFloat(m_Vx[index]) + _vx);
+    m_Vy[index] = fromFloat<Storage>(toFloat(m_Vy[index]) + _vy);
+}
+
+template <typename Storage>
+size_t MixedPrecisionFluid<Storage>::addScalar(float _diffusion)
+{
+    const size_t current = m_workspace.add<Storage>(numCells(), width());
+    const size_t previous = m_workspace.add<Storage>(numCells(), width());
+    m_workspace.allocate(m_pool);
+    bindFields();
+    m_scalars.push_back({_diffusion, current, previous});
+    return m_scalars.size() - 1;
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::addScalarSource(size_t _channel, float _x, float _y, float _amount)
+{
+    size_t index = m_fluid.IX(std::clamp(static_cast<size_t>(_x), static_cast<size_t>(0), width() - 1),
+                              std::clamp(static_cast<size_t>(_y), static_cast<size_t>(0), height() - 1));
+
+    Storage *field = m_workspace.array<Storage>(m_scalars[_channel].current);
+    field[index] = fromFloat<Storage>(toFloat(field[index]) + _amount);
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::reset()
+{
+    std::fill(m_Vx, m_Vx + numCells(), fromFloat<Storage>(0.0f));
+    std::fill(m_Vy, m_Vy + numCells(), fromFloat<Storage>(0.0f));
+
+    // add a small initial velocity to show something on the grid
+    addVelocity(width() / 2.0f, height() / 2.0f, -.0001f, 0.0f);
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::readVelocity(float *_velocX, float *_velocY) const
+{
+    for (size_t c = 0; c < numCells(); c++)
+    {
+        _velocX[c] = toFloat(m_Vx[c]);
+        _velocY[c] = toFloat(m_Vy[c]);
+    }
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::readScalar(size_t _channel, float *_values) const
+{
+    const Storage *field = scalar(_channel);
+    for (size_t c = 0; c < numCells(); c++)
+    {
+        _values[c] = toFloat(field[c]);
+    }
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::set_boundary(Fluid::Boundary _b, Storage *_x) const
+{
+    const size_t w = width();
+    const size_t h = height();
+    auto value = [&](size_t _i, size_t _j) { return toFloat(_x[_i + _j * w]); };
+    auto assign = [&](size_t _i, size_t _j, float _value) { _x[_i + _j * w] = fromFloat<Storage>(_value); };
+
+    for (size_t i = 1; i < w - 1; i++)
+    {
+        assign(i, 0, _b == Fluid::Boundary::Y ? -value(i, 1) : value(i, 1));
+        assign(i, h - 1, _b == Fluid::Boundary::Y ? -value(i, h - 2) : value(i, h - 2));
+    }
+    for (size_t j = 1; j < h - 1; j++)
+    {
+        assign(0, j, _b == Fluid::Boundary::X ? -value(1, j) : value(1, j));
+        assign(w - 1, j, _b == Fluid::Boundary::X ? -value(w - 2, j) : value(w - 2, j));
+    }
+
+    assign(0, 0, 0.5f * (value(1, 0) + value(0, 1)));
+    assign(0, h - 1, 0.5f * (value(1, h - 1) + value(0, h - 2)));
+    assign(w - 1, 0, 0.5f * (value(w - 2, 0) + value(w - 1, 1)));
+    assign(w - 1, h - 1, 0.5f * (value(w - 2, h - 1) + value(w - 1, h - 2)));
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::diffuse(Fluid::Boundary _b, Storage *_x, const Storage *_x0, float _diff, float _dt)
+{
+    const size_t w = width();
+    const float a = _dt * _diff * (w - 2) * (height() - 2);
+    const float c = 1 + 4 * a;
+    const float cRecip = 1.0f / c;
+    const StencilKernels &kernels = stencilKernels(m_fluid.simdLevel());
+    const ConversionKernels &conversion = conversionKernels(m_fluid.simdLevel());
+
+    // Jacobi sweeps ping-pong between the field and the scratch field
+    Storage *src = _x;
+    Storage *dst = m_scratch;
+    for (int k = 0; k < m_fluid.iterations(); k++)
+    {
+        m_fluid.parallelRows(1, height() - 1, [&](size_t _first, size_t _last) {
+            float row[c_block + 2];
+            float below[c_block];
+            float above[c_block];
+            float x0[c_block];
+            float out[c_block];
+            forBlocks(_first, _last, w, [&](size_t _j, size_t _i0, size_t _count) {
+                const size_t cell = _i0 + _j * w;
+                float *result = outputRow(dst + cell, out);
+                kernels.jacobiRow(result, readRow(src + cell - w, below, _count, conversion),
+                                  readRow(src + cell - 1, row, _count + 2, conversion) + 1,
+                                  readRow(src + cell + w, above, _count, conversion),
+                                  readRow(_x0 + cell, x0, _count, conversion), _count, a, cRecip);
+                writeRow(result, dst + cell, _count, conversion);
+            });
+        });
+        set_boundary(_b, dst);
+        std::swap(src, dst);
+    }
+    if (src != _x)
+    {
+        std::memcpy(_x, src, numCells() * sizeof(Storage));
+    }
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::advect(Fluid::Boundary _b, Storage *_d, const Storage *_d0, const Storage *_velocX,
+                                          const Storage *_velocY, float _dt) const
+{
+    const size_t w = width();
+    float dtx = _dt * (w - 2);
+    float dty = _dt * (height() - 2);
+
+    // keep the back-traced point inside the interior so the four samples never leave the grid
+    float maxX = static_cast<float>(w) - 1.5f;
+    float maxY = static_cast<float>(height()) - 1.5f;
+    const ConversionKernels &conversion = conversionKernels(m_fluid.simdLevel());
+
+    m_fluid.parallelRows(1, height() - 1, [&](size_t _first, size_t _last) {
+        float velocX[c_block];
+        float velocY[c_block];
+        float out[c_block];
+        forBlocks(_first, _last, w, [&](size_t _j, size_t _i0, size_t _count) {
+            const size_t cell = _i0 + _j * w;
+            const float *vx = readRow(_velocX + cell, velocX, _count, conversion);
+            const float *vy = readRow(_velocY + cell, velocY, _count, conversion);
+            float *d = outputRow(_d + cell, out);
+            const float jfloat = static_cast<float>(_j);
+            for (size_t i = 0; i < _count; i++)
+            {
+                float tmp1 = dtx * vx[i];
+                float tmp2 = dty * vy[i];
+                BilinearSample sample = backtrace(static_cast<float>(_i0 + i) - tmp1, jfloat - tmp2, maxX, maxY);
+                d[i] = interpolate(_d0, sample, w);
+            }
+            writeRow(d, _d + cell, _count, conversion);
+        });
+    });
+
+    set_boundary(_b, _d);
+}
+
+template <typename Storage>
+void MixedPrecisionFluid<Storage>::project(Storage *_velocX, Storage *_velocY)
+{
+    const size_t w = width();
+    float *p = m_pressure;
+    float *div = m_divergence;
+    float Wfloat = static_cast<float>(w);
+    float Hfloat = static_cast<float>(height());
+    const ConversionKernels &conversion = conversionKernels(m_fluid.simdLevel());
+
+    m_fluid.parallelRows(1, height() - 1, [&](size_t _first, size_t _last) {
+        float row[c_block + 2];
+        float below[c_block];
+        float above[c_block];
+        forBlocks(_first, _last, w, [&](size_t _j, size_t _i0, size_t _count) {
+            const size_t cell = _i0 + _j * w;
+            const float *velocX = readRow(_velocX + cell - 1, row, _count + 2, conversion) + 1;
+            const float *velocYBelow = readRow(_velocY + cell - w, below, _count, conversion);
+            const float *velocYAbove = readRow(_velocY + cell + w, above, _count, conversion);
+            for (size_t i = 0; i < _count; i++)
+            {
+                div[cell + i] = -0.5f * ((velocX[i + 1] - velocX[i - 1]) / Wfloat +
+                                         (velocYAbove[i] - velocYBelow[i]) / Hfloat);
+                p[cell + i] = 0;
+            }
+        });
+    });
+
+    m_fluid.set_boundary(Fluid::Boundary::None, div);
+    m_fluid.set_boundary(Fluid::Boundary::None, p);
+    m_fluid.solvePressure(p, div);
+
+    m_fluid.parallelRows(1, height() - 1, [&](size_t _first, size_t _last) {
+        float rowX[c_block];
+        float rowY[c_block];
+        forBlocks(_first, _last, w, [&](size_t _j, size_t _i0, size_t _count) {
+            const size_t cell = _i0 + _j * w;
+            float *velocX = editRow(_velocX + cell, rowX, _count, conversion);
+            float *velocY = editRow(_velocY + cell, rowY, _count, conversion);
+            for (size_t i = 0; i < _count; i++)
+            {
+                const size_t c = cell + i;
+                velocX[i] -= 0.5f * (p[c + 1] - p[c - 1]) * Wfloat;
+                velocY[i] -= 0.5f * (p[c + w] - p[c - w]) * Hfloat;
+            }
+            writeRow(velocX, _velocX + cell, _count, conversion);
+            writeRow(velocY, _velocY + cell, _count, conversion);
+        });
+    });
+    set_boundary(Fluid::Boundary::X, _velocX);
+    set_boundary(Fluid::Boundary::Y, _velocY);
+}
+
+template class MixedPrecisionFluid<float>;
+template class MixedPrecisionFluid<Half>;
+template class MixedPrecisionFluid<BFloat16>;
@@ -0,0 +1,211 @@
+/**
+ * @file MultigridSolver.cpp
+ * @brief Geometric multigrid pressure solver. Runs V-cycles with red-black Gauss-Seidel smoothing until the residual
+ * drops below the tolerance.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "MultigridSolver.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Fluid.h"
+#include "StencilKernels.h"
+
+namespace
+{
+    constexpr int c_preSmooth = 2;
+    constexpr int c_postSmooth = 2;
+    constexpr size_t c_maxLevels = 16;
+    // levels with fewer rows than this are cheaper to run on one thread
+    constexpr size_t c_parallelRows = 64;
+}
+
+template <typename Fn>
+void MultigridSolver::levelRows(const Fluid &_fluid, const Level &_level, Fn &&_fn) const
+{
+    if (_level.height - 2 >= c_parallelRows)
+    {
+        _fluid.parallelRows(1, _level.height - 1, _fn);
+    }
+    else
+    {
+        _fn(1, _level.height - 1);
+    }
+}
+
+MultigridSolver::MultigridSolver(const Settings &_settings, size_t _width, size_t _height, ThreadPool *_pool)
+    : m_settings{_settings}
+{
+    // the finest level solves straight into the caller's pressure field, its solution array is left empty
+    m_levels.push_back(Level{_width, _height, nullptr, nullptr, nullptr, m_workspace.add<float>(0)});
+    m_workspace.add<float>(_width * _height, _width);
+    m_workspace.add<float>(_width * _height, _width);
+
+    size_t nx = _width - 2;
+    size_t ny = _height - 2;
+    while (std::min(nx, ny) > 2 && m_levels.size() < c_maxLevels)
+    {
+        nx = (nx + 1) / 2;
+        ny = (ny + 1) / 2;
+        size_t cells = (nx + 2) * (ny + 2);
+        m_levels.push_back(Level{nx + 2, ny + 2, nullptr, nullptr, nullptr, m_workspace.add<float>(cells, nx + 2)});
+        m_workspace.add<float>(cells, nx + 2);
+        m_workspace.add<float>(cells, nx + 2);
+    }
+    m_workspace.add<double>(_height);
+    m_workspace.allocate(_pool);
+    bindArrays();
+}
+
+void MultigridSolver::placeArrays(ThreadPool *_pool)
+{
+    m_workspace.allocate(_pool);
+    bindArrays();
+}
+
+void MultigridSolver::bindArrays()
+{
+    for (size_t level = 0; level < m_levels.size(); level++)
+    {
+        Level &l = m_levels[level];
+        l.u = level == 0 ? nullptr : m_workspace.array<float>(l.firstArray);
+        l.f = m_workspace.array<float>(l.firstArray + 1);
+        l.r = m_workspace.array<float>(l.firstArray + 2);
+    }
+    m_rowSums = m_workspace.array<double>(m_workspace.size() - 1);
+}
+
+int MultigridSolver::solve(Fluid &_fluid, float *_p, const float *_div)
+{
+    Level &fine = m_levels.front();
+    const size_t w = fine.width;
+
+    removeMean(_fluid, _div, fine.f, m_rowSums);
+    double bNorm = std::sqrt(dot(_fluid, fine.f, fine.f, m_rowSums));
+
+    int iteration = 0;
+    double rNorm = 0.0;
+    while (bNorm > 0.0 && iteration < m_settings.maxIterations)
+    {
+        vCycle(_fluid, 0, _p);
+        iteration++;
+
+        setNeumannBoundary(w, fine.height, _p);
+        levelRows(_fluid, fine, [&](size_t _first, size_t _last) {
+            residualRows(w, _p, fine.f, fine.r, _first, _last);
+        });
+        rNorm = std::sqrt(dot(_fluid, fine.r, fine.r, m_rowSums));
+        if (rNorm <= m_settings.tolerance * bNorm)
+        {
+            break;
+        }
+    }
+
+    _fluid.set_boundary(Fluid::Boundary::None, _p);
+    m_lastIterations = iteration;
+    m_lastResidual = bNorm > 0.0 ? static_cast<float>(rNorm / bNorm) : 0.0f;
+    return iteration;
+}
+
+void MultigridSolver::vCycle(Fluid &_fluid, size_t _level, float *_u)
+{
+    Level &level = m_levels[_level];
+    if (_level + 1 == m_levels.size())
+    {
+        // the coarsest level is small enough to relax until it has converged
+        smooth(_fluid, level, _u, static_cast<int>(2 * (level.width + level.height)));
+        return;
+    }
+
+    smooth(_fluid, level, _u, c_preSmooth);
+
+    Level &coarse = m_levels[_level + 1];
+    restrictResidual(_fluid, level, _u, coarse);
+    std::fill(coarse.u, coarse.u + coarse.width * coarse.height, 0.0f);
+    vCycle(_fluid, _level + 1, coarse.u);
+    prolongAndCorrect(_fluid, level, coarse, _u);
+
+    smooth(_fluid, level, _u, c_postSmooth);
+}
+
+void MultigridSolver::smooth(Fluid &_fluid, const Level &_level, float *_u, int _sweeps) const
+{
+    const StencilKernels &kernels = stencilKernels(_fluid.simdLevel());
+    const size_t w = _level.width;
+    const float *f = _level.f;
+    for (int k = 0; k < _sweeps; k++)
+    {
+        for (size_t colour = 0; colour < 2; colour++)
+        {
+            setNeumannBoundary(w, _level.height, _u);
+            levelRows(_fluid, _level, [&](size_t _first, size_t _last) {
+                for (size_t j = _first; j < _last; j++)
+                {
+                    const size_t row = 1 + j * w;
+                    kernels.redBlackRow(_u + row, f + row, w, w - 2, (1 + j + colour) % 2, 1.0f, 0.25f);
+                }
+            });
+        }
+    }
+}
+
+void MultigridSolver::restrictResidual(Fluid &_fluid, Level &_fine, float *_u, Level &_coarse) const
+{
+    const size_t fw = _fine.width;
+    const size_t cw = _coarse.width;
+
+    setNeumannBoundary(fw, _fine.height, _u);
+    levelRows(_fluid, _fine, [&](size_t _first, size_t _last) {
+        residualRows(fw, _u, _fine.f, _fine.r, _first, _last);
+    });
+
+    const float *r = _fine.r;
+    float *f = _coarse.f;
+    levelRows(_fluid, _coarse, [&](size_t _first, size_t _last) {
+        for (size_t J = _first; J < _last; J++)
+        {
+            for (size_t I = 1; I < cw - 1; I++)
+            {
+                // fine cells 2I - 1 and 2I, the second one is missing when the fine interior has an odd size
+                float sum = 0.0f;
+                for (size_t j = 2 * J - 1; j <= 2 * J && j < _fine.height - 1; j++)
+                {
+                    for (size_t i = 2 * I - 1; i <= 2 * I && i < fw - 1; i++)
+                    {
+                        sum += r[i + j * fw];
+                    }
+                }
+                // averaging the residual and doubling the grid spacing scales the equation by 4, so the coarse right
+                // hand side is the sum of the 4 fine cells. Missing cells count as zero, which keeps the coarse
+                // problem's mean at zero so it still has a solution.
+                f[I + J * cw] = sum;
+            }
+        }
+    });
+}
+
+void MultigridSolver::prolongAndCorrect(Fluid &_fluid, const Level &_fine, Level &_coarse, float *_u) const
+{
+    const size_t fw = _fine.width;
+    const size_t cw = _coarse.width;
+    float *e = _coarse.u;
+    setNeumannBoundary(cw, _coarse.height, e);
+
+    levelRows(_fluid, _fine, [&](size_t _first, size_t _last) {
+        for (size_t j = _first; j < _last; j++)
+        {
+            const size_t J = (j + 1) / 2;
+            // the second nearest coarse row is above for the first child and below for the second
+            const size_t J2 = (j % 2 == 1) ? J - 1 : J + 1;
+            for (size_t i = 1; i < fw - 1; i++)
+            {
+                const size_t I = (i + 1) / 2;
+                const size_t I2 = (i % 2 == 1) ? I - 1 : I + 1;
+                _u[i + j * fw] += 0.5625f * e[I + J * cw] + 0.1875f * (e[I2 + J * cw] + e[I + J2 * cw]) + 0.0625f * e[I2 + J2 * cw];
+            }
+        }
+    });
+}
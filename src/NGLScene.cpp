@@ -3,33 +3,54 @@
 
 #include "NGLScene.h"
 #include <chrono>
+#include <cmath>
 #include <fmt/format.h>
+#include <fstream>
 #include <ngl/NGLInit.h>
 #include <ngl/Random.h>
 #include <ngl/ShaderLib.h>
 #include <ngl/SimpleVAO.h>
 #include <ngl/Transformation.h>
+#include <ngl/Util.h>
 #include <ngl/VAOFactory.h>
 #include <ngl/Vec2.h>
-
-constexpr size_t c_sampleSize = 500;
-
-NGLScene::NGLScene()
+#include <numeric>
+
+// enough trace events for a few minutes of steps and frames before the trace stops recording
+constexpr size_t c_traceEvents = 100000;
+// vertical field of view of the camera in degrees
+constexpr float c_fov = 45.0f;
+// when zoomed out past this many particles to a pixel the renderer skips particles to keep the draw cheap
+constexpr float c_particlesPerPixel = 2.0f;
+
+NGLScene::NGLScene(size_t _gridWidth, size_t _gridHeight, size_t _numThreads, size_t _numParticles,
+                   const PressureSolver::Settings &_pressureSolver, double _stepsPerSecond, bool _gpu)
+    : m_gridWidth{_gridWidth},
+      m_gridHeight{_gridHeight},
+      m_numThreads{_numThreads},
+      m_numParticles{_numParticles},
+      m_pressureSolver{_pressureSolver},
+      m_stepsPerSecond{_stepsPerSecond},
+      m_profiler{c_traceEvents},
+      m_useGpu{_gpu}
 {
   setTitle("2D Grid-Based Fluid Simulation");
-
-  // we need to add an initial value to the rolling average to make code simpler
-  m_updateTime.push_back(1);
 }
 
 NGLScene::~NGLScene()
 {
+  // the simulation thread records into m_profiler, so stop it first
+  m_simulation.reset();
+  // the compute solver's buffers belong to the window's context
+  makeCurrent();
+  m_renderer.reset();
+  m_gpu.reset();
   std::cout << "Shutting down NGL, removing VAO's and Shaders\n";
 }
 
 void NGLScene::resizeGL(int _w, int _h)
 {
-  m_project = ngl::perspective(45.0f, static_cast<float>(_w) / _h, 0.01f, 150.0f);
+  m_project = ngl::perspective(c_fov, static_cast<float>(_w) / _h, 0.01f, farPlane());
   m_win.width = static_cast<int>(_w * devicePixelRatio());
   m_win.height = static_cast<int>(_h * devicePixelRatio());
   m_text->setScreenSize(_w, _h);
@@ -52,25 +73,73 @@ void NGLScene::initializeGL()
   // Now we will create a basic Camera from the graphics library
   // This is a static camera so it only needs to be set once
   // First create Values for the camera position
-  ngl::Vec3 from(static_cast<float>(c_size - 1) / 2.0f, c_size + 17, static_cast<float>(c_size - 1) / 2.0f);
-  ngl::Vec3 to(static_cast<float>(c_size - 1) / 2.0f, 0, static_cast<float>(c_size - 1) / 2.0f);
+  ngl::Vec3 from(static_cast<float>(m_gridWidth - 1) / 2.0f, cameraHeight(), static_cast<float>(m_gridHeight - 1) / 2.0f);
+  ngl::Vec3 to(static_cast<float>(m_gridWidth - 1) / 2.0f, 0, static_cast<float>(m_gridHeight - 1) / 2.0f);
   ngl::Vec3 up(0, 0, 1);
   m_view = ngl::lookAt(from, to, up);
 
   // set the shape using FOV 45 Aspect Ratio based on Width and Height
-  m_project = ngl::perspective(45, 1024.0f / 720.0f, 0.01f, 150.0f);
-
-  // now to load the shader and set the values
-  ngl::ShaderLib::loadShader("PosDir", "shaders/PosDirVertex.glsl", "shaders/PosDirFragment.glsl", "shaders/PosDirGeo.glsl");
-  ngl::ShaderLib::use("PosDir");
+  m_project = ngl::perspective(c_fov, 1024.0f / 720.0f, 0.01f, farPlane());
 
-  // Create the fluid with viscosity 20.0f and a time step of 0.0000001f
-  m_fluidGrid = std::make_unique<FluidGrid>(20.0f, 0.0000001f);
+  // now to load the shader and set the values, pulling the particles from their buffer when the context can, as the
+  // geometry shader struggles with millions of points
+  if (ParticleRenderer::canPullVertices())
+  {
+    m_particleShader = "PosDirPull";
+    ngl::ShaderLib::loadShader(m_particleShader, "shaders/PosDirPullVertex.glsl", "shaders/PosDirFragment.glsl");
+  }
+  else
+  {
+    m_particleShader = "PosDir";
+    ngl::ShaderLib::loadShader(m_particleShader, "shaders/PosDirVertex.glsl", "shaders/PosDirFragment.glsl", "shaders/PosDirGeo.glsl");
+  }
+  ngl::ShaderLib::use(m_particleShader);
 
   m_text = std::make_unique<ngl::Text>("fonts/Arial.ttf", 18);
   m_text->setColour(1.0f, 1.0f, 0.0f);
 
-  startTimer(20);
+  if (m_useGpu)
+  {
+    m_gpu = std::make_unique<GpuFluidSolver>(m_gridWidth, m_gridHeight, 20.0f, 0.0000001f, m_numParticles);
+    std::string error;
+    if (m_gpu->create(&error))
+    {
+      m_renderer = std::make_unique<ParticleRenderer>(m_gpu->particleBuffer(), m_gpu->numParticles());
+      m_nextGpuStep = std::chrono::steady_clock::now();
+    }
+    else
+    {
+      std::cerr << error << ", solving on the CPU\n";
+      m_gpu.reset();
+    }
+  }
+
+  if (!m_gpu)
+  {
+    // Create the fluid with viscosity 20.0f and a time step of 0.0000001f
+    auto fluidGrid = std::make_unique<FluidGrid>(m_gridWidth, m_gridHeight, 20.0f, 0.0000001f, m_numParticles);
+    fluidGrid->setThreadCount(m_numThreads);
+    fluidGrid->setPressureSolver(m_pressureSolver);
+    // same results as the separate passes with less memory traffic
+    fluidGrid->setFused(true);
+    fluidGrid->setProfiler(&m_profiler);
+    // a hard drag is split into sub-steps rather than tearing the fluid apart, and each step must fit its slot
+    FluidGrid::TimeStepping stepping;
+    stepping.mode = FluidGrid::TimeStepping::Mode::SubSteps;
+    fluidGrid->setTimeStepping(stepping);
+    std::chrono::nanoseconds interval{0};
+    if (m_stepsPerSecond > 0.0)
+    {
+      fluidGrid->setFrameBudget(1000.0 / m_stepsPerSecond);
+      interval = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(1.0 / m_stepsPerSecond));
+    }
+    m_simulation = std::make_unique<SimulationThread>(std::move(fluidGrid), interval);
+    m_renderer = std::make_unique<ParticleRenderer>(m_simulation->frame());
+
+    m_simulation->start();
+  }
+  // repaint at about 60Hz, independent of how fast the simulation steps
+  startTimer(16);
 }
 
 void NGLScene::paintGL()
@@ -79,21 +148,33 @@ void NGLScene::paintGL()
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   m_mouseGlobalTX.m_m[3][1] = m_modelPos.m_z;
 
-  ngl::ShaderLib::use("PosDir");
+  ngl::ShaderLib::use(m_particleShader);
   ngl::Mat4 MVP;
   MVP = m_project * m_view * m_mouseGlobalTX;
   ngl::ShaderLib::setUniform("MVP", MVP);
+  if (m_renderer->pullsVertices())
+  {
+    ngl::ShaderLib::setUniform("cull", m_cull ? 1 : 0);
+  }
 
-  glPointSize(100);
-
-  auto drawbegin = std::chrono::steady_clock::now();
-  m_fluidGrid->draw();
-  auto drawend = std::chrono::steady_clock::now();
-  auto updateTime = std::accumulate(std::begin(m_updateTime), std::end(m_updateTime), 0) / m_updateTime.size();
-
-  m_text->renderText(10, 50, "[Spacebar] to reset");
-  m_text->renderText(10, 30, fmt::format("- Draw took {0} uS", std::chrono::duration_cast<std::chrono::microseconds>(drawend - drawbegin).count()));
-  m_text->renderText(10, 10, fmt::format("- Update took {0} uS for {1} particles", updateTime, m_fluidGrid->getNumParticles()));
+  // take the newest step without waiting for the simulation thread, skipping any the display was too slow for
+  if (m_gpu)
+  {
+    stepGpu();
+  }
+  else if (m_simulation->updateFrame())
+  {
+    ScopedTimer timer(&m_profiler, Profiler::Stage::Upload);
+    m_renderer->upload(m_simulation->frame());
+  }
+  m_renderer->draw(particleStride());
+
+  // percentiles rather than a mean so frames that blow the budget show up
+  const LatencyHistogram &step = m_profiler.histogram(Profiler::Stage::Step);
+  const LatencyHistogram &upload = m_profiler.histogram(Profiler::Stage::Upload);
+  m_text->renderText(10, 50, fmt::format("[Spacebar] to reset, [P] to save the profile, [C] to toggle culling ({0})", m_cull ? "on" : "off"));
+  m_text->renderText(10, 30, fmt::format("- Upload p50 {0} p99 {1} uS", upload.percentile(0.5) / 1000, upload.percentile(0.99) / 1000));
+  m_text->renderText(10, 10, fmt::format("- Update p50 {0} p99 {1} max {2} uS for {3} particles", step.percentile(0.5) / 1000, step.percentile(0.99) / 1000, step.max() / 1000, m_gpu ? m_gpu->numParticles() : m_simulation->frame().x.size()));
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -132,21 +213,21 @@ void NGLScene::mouseReleaseEvent(QMouseEvent *_event)
     velocity *= m_win.scale;
 
     // Convert mouse coordinates to grid coordinates
-    int x = c_size - static_cast<int>(static_cast<float>(m_win.x0) / m_win.width * c_size);
-    int y = c_size - static_cast<int>(static_cast<float>(m_win.y0) / m_win.height * c_size);
-
-    // add velocity in a 3x3 area where the mouse clicked with direction of the drag
-    m_fluidGrid->addVelocity(ngl::Vec2{static_cast<ngl::Real>(x - 1), static_cast<ngl::Real>(y - 1)}, velocity);
-    m_fluidGrid->addVelocity(ngl::Vec2{static_cast<ngl::Real>(x), static_cast<ngl::Real>(y - 1)}, velocity);
-    m_fluidGrid->addVelocity(ngl::Vec2{static_cast<ngl::Real>(x - 1), static_cast<ngl::Real>(y - 1)}, velocity);
-
-    m_fluidGrid->addVelocity(ngl::Vec2{static_cast<ngl::Real>(x - 1), static_cast<ngl::Real>(y)}, velocity);
-    m_fluidGrid->addVelocity(ngl::Vec2{static_cast<ngl::Real>(x), static_cast<ngl::Real>(y)}, velocity);
-    m_fluidGrid->addVelocity(ngl::Vec2{static_cast<ngl::Real>(x - 1), static_cast<ngl::Real>(y)}, velocity);
-
-    m_fluidGrid->addVelocity(ngl::Vec2{static_cast<ngl::Real>(x - 1), static_cast<ngl::Real>(y + 1)}, velocity);
-    m_fluidGrid->addVelocity(ngl::Vec2{static_cast<ngl::Real>(x), static_cast<ngl::Real>(y + 1)}, velocity);
-    m_fluidGrid->addVelocity(ngl::Vec2{static_cast<ngl::Real>(x - 1), static_cast<ngl::Real>(y + 1)}, velocity);
+    int gridWidth = static_cast<int>(m_gridWidth);
+    int gridHeight = static_cast<int>(m_gridHeight);
+    int x = gridWidth - static_cast<int>(static_cast<float>(m_win.x0) / m_win.width * gridWidth);
+    int y = gridHeight - static_cast<int>(static_cast<float>(m_win.y0) / m_win.height * gridHeight);
+
+    // splat velocity over a few cells around where the mouse clicked with direction of the drag, the compute solver
+    // only adds velocity to single cells
+    if (m_gpu)
+    {
+      makeCurrent();
+      m_gpu->addVelocity(static_cast<float>(x), static_cast<float>(y), velocity.m_x, velocity.m_y);
+      update();
+      return;
+    }
+    m_simulation->addImpulse({static_cast<float>(x) - 0.5f, static_cast<float>(y), velocity.m_x, velocity.m_y, 1.5f});
 
     update();
   }
@@ -165,7 +246,8 @@ void NGLScene::wheelEvent(QWheelEvent *_event)
   {
     m_modelPos.m_z -= ZOOM;
   }
-  m_modelPos.m_z = std::clamp(m_modelPos.m_z, 0.0f, static_cast<ngl::Real>(c_size + 17));
+  m_modelPos.m_z = std::clamp(m_modelPos.m_z, 0.0f, cameraHeight());
+  // the next paint also draws fewer particles the further out this zooms, see particleStride
   update();
 }
 //----------------------------------------------------------------------------------------------------------------------
@@ -180,7 +262,22 @@ void NGLScene::keyPressEvent(QKeyEvent *_event)
     QGuiApplication::exit(EXIT_SUCCESS);
     break;
   case Qt::Key_Space:
-    m_fluidGrid->reset();
+    if (m_gpu)
+    {
+      makeCurrent();
+      m_gpu->reset();
+    }
+    else
+    {
+      m_simulation->reset();
+    }
+    m_profiler.reset();
+    break;
+  case Qt::Key_P:
+    saveProfile();
+    break;
+  case Qt::Key_C:
+    m_cull = !m_cull;
     break;
   default:
     break;
@@ -189,20 +286,66 @@ void NGLScene::keyPressEvent(QKeyEvent *_event)
   update();
 }
 
-void NGLScene::timerEvent(QTimerEvent *)
+float NGLScene::cameraHeight() const
 {
-  auto updatebegin = std::chrono::steady_clock::now();
-  m_fluidGrid->step();
-  auto updateend = std::chrono::steady_clock::now();
-
-  // add to the rolling average
-  m_updateTime.push_back(std::chrono::duration_cast<std::chrono::microseconds>(updateend - updatebegin).count());
+  // keep the whole grid in view whatever its resolution
+  return static_cast<float>(std::max(m_gridWidth, m_gridHeight) + 17);
+}
 
-  // if greater than sample size remove front element
-  if (m_updateTime.size() > c_sampleSize)
+size_t NGLScene::particleStride() const
+{
+  // the zoom moves the grid towards the camera, so work out how many pixels a cell covers at that distance
+  const float distance = std::max(cameraHeight() - m_modelPos.m_z, 1.0f);
+  const float visibleHeight = 2.0f * distance * std::tan(ngl::radians(c_fov / 2.0f));
+  const float cellPixels = static_cast<float>(std::max(m_win.height, 1)) / visibleHeight;
+  const float particlesPerCell = static_cast<float>(m_renderer->numParticles()) / static_cast<float>(m_gridWidth * m_gridHeight);
+  const float particlesPerPixel = particlesPerCell / (cellPixels * cellPixels);
+  size_t stride = static_cast<size_t>(std::max(particlesPerPixel / c_particlesPerPixel, 1.0f));
+  // particles seeded one a cell are in row order, so a stride sharing a factor with the width would keep whole
+  // columns and drop others, where a coprime one keeps an even lattice
+  while (stride > 1 && std::gcd(stride, m_gridWidth) != 1)
   {
-    m_updateTime.pop_front();
+    stride++;
   }
+  return stride;
+}
 
+float NGLScene::farPlane() const
+{
+  return std::max(150.0f, 2.0f * cameraHeight());
+}
+
+void NGLScene::timerEvent(QTimerEvent *)
+{
   update();
 }
+
+void NGLScene::stepGpu()
+{
+  // catch up on at most one step per frame, as the simulation thread drops steps the display was too slow for
+  const auto now = std::chrono::steady_clock::now();
+  if (now < m_nextGpuStep)
+  {
+    return;
+  }
+  if (m_stepsPerSecond > 0.0)
+  {
+    m_nextGpuStep = std::max(m_nextGpuStep + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                 std::chrono::duration<double>(1.0 / m_stepsPerSecond)),
+                             now);
+  }
+  // only times queueing the step, the GPU runs it while the frame is drawn
+  ScopedTimer timer(&m_profiler, Profiler::Stage::Step);
+  m_gpu->step();
+}
+
+void NGLScene::saveProfile() const
+{
+  std::ofstream csv("profile.csv");
+  m_profiler.writeCsv(csv);
+  std::ofstream json("profile.json");
+  m_profiler.writeJson(json);
+  std::ofstream trace("profile.trace.json");
+  m_profiler.writeChromeTrace(trace);
+  std::cout << "Saved profile.csv, profile.json and profile.trace.json\n";
+}
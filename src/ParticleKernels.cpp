@@ -0,0 +1,254 @@
+/**
+ * @file ParticleKernels.cpp
+ * @brief Unchecked kernels that move structure-of-arrays particles through a velocity field, with scalar, AVX2 and
+ * AVX-512 versions selected at runtime.
+ * This file is built with floating point contraction disabled so the vector paths round exactly like the scalar one.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "ParticleKernels.h"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FLUID_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FLUID_TARGET_AVX2 __attribute__((target("avx2")))
+#define FLUID_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define FLUID_TARGET_AVX2
+#define FLUID_TARGET_AVX512
+#endif
+
+namespace
+{
+    // fraction of the velocity a particle moves each step, and the drawn length of its direction
+    constexpr float c_stepScale = 0.2f;
+    constexpr float c_dirLength = 0.5f;
+
+    /**
+     * @brief Move particles [_first, _count), shared by every level for the particles left over after the vectors
+     */
+    void advectScalar(const ParticleArrays &_particles, const ParticleArrays *_mirror, size_t _first, size_t _count,
+                      const float *_velocX, const float *_velocY, size_t _width, size_t _height)
+    {
+        float *FLUID_RESTRICT posX = _particles.x;
+        float *FLUID_RESTRICT posY = _particles.y;
+        float *FLUID_RESTRICT dirX = _particles.dirX;
+        float *FLUID_RESTRICT dirY = _particles.dirY;
+        const float maxX = static_cast<float>(_width - 1);
+        const float maxY = static_cast<float>(_height - 1);
+        for (size_t p = _first; p < _count; p++)
+        {
+            float px = posX[p];
+            float py = posY[p];
+
+            size_t x0 = static_cast<size_t>(std::floor(px));
+            size_t y0 = static_cast<size_t>(std::floor(py));
+            size_t x1 = static_cast<size_t>(std::ceil(px));
+            size_t y1 = static_cast<size_t>(std::ceil(py));
+
+            // Get average velocity of 4 adjacent points
+            float xVel = 0.25f * (_velocX[x0 + y0 * _width] + _velocX[x1 + y0 * _width] + _velocX[x0 + y1 * _width] + _velocX[x1 + y1 * _width]);
+            float yVel = 0.25f * (_velocY[x0 + y0 * _width] + _velocY[x1 + y0 * _width] + _velocY[x0 + y1 * _width] + _velocY[x1 + y1 * _width]);
+
+            px += xVel * c_stepScale;
+            py += yVel * c_stepScale;
+
+            // wrap to the other side, written as selects so the compiler does not need branches
+            px = px < 0.0f ? maxX : px;
+            px = px >= maxX ? 0.0f : px;
+            py = py < 0.0f ? maxY : py;
+            py = py >= maxY ? 0.0f : py;
+
+            float lengthSquared = xVel * xVel + yVel * yVel;
+            float scale = lengthSquared != 0.0f ? c_dirLength / std::sqrt(lengthSquared) : c_dirLength;
+
+            posX[p] = px;
+            posY[p] = py;
+            dirX[p] = xVel * scale;
+            dirY[p] = yVel * scale;
+            if (_mirror != nullptr)
+            {
+                _mirror->x[p] = px;
+                _mirror->y[p] = py;
+                _mirror->dirX[p] = dirX[p];
+                _mirror->dirY[p] = dirY[p];
+            }
+        }
+    }
+
+    void advectScalarAll(const ParticleArrays &_particles, const ParticleArrays *_mirror, size_t _count,
+                         const float *_velocX, const float *_velocY, size_t _width, size_t _height)
+    {
+        advectScalar(_particles, _mirror, 0, _count, _velocX, _velocY, _width, _height);
+    }
+
+#ifdef FLUID_X86_SIMD
+    FLUID_TARGET_AVX2 void advectAVX2(const ParticleArrays &_particles, const ParticleArrays *_mirror, size_t _count,
+                                      const float *_velocX, const float *_velocY, size_t _width, size_t _height)
+    {
+        float *FLUID_RESTRICT posX = _particles.x;
+        float *FLUID_RESTRICT posY = _particles.y;
+        float *FLUID_RESTRICT dirX = _particles.dirX;
+        float *FLUID_RESTRICT dirY = _particles.dirY;
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 maxX = _mm256_set1_ps(static_cast<float>(_width - 1));
+        const __m256 maxY = _mm256_set1_ps(static_cast<float>(_height - 1));
+        const __m256 quarter = _mm256_set1_ps(0.25f);
+        const __m256 stepScale = _mm256_set1_ps(c_stepScale);
+        const __m256 dirLength = _mm256_set1_ps(c_dirLength);
+        const __m256i stride = _mm256_set1_epi32(static_cast<int>(_width));
+
+        size_t p = 0;
+        for (; p + 8 <= _count; p += 8)
+        {
+            __m256 px = _mm256_loadu_ps(posX + p);
+            __m256 py = _mm256_loadu_ps(posY + p);
+
+            __m256i x0 = _mm256_cvttps_epi32(_mm256_floor_ps(px));
+            __m256i x1 = _mm256_cvttps_epi32(_mm256_ceil_ps(px));
+            __m256i row0 = _mm256_mullo_epi32(_mm256_cvttps_epi32(_mm256_floor_ps(py)), stride);
+            __m256i row1 = _mm256_mullo_epi32(_mm256_cvttps_epi32(_mm256_ceil_ps(py)), stride);
+            __m256i c00 = _mm256_add_epi32(x0, row0);
+            __m256i c10 = _mm256_add_epi32(x1, row0);
+            __m256i c01 = _mm256_add_epi32(x0, row1);
+            __m256i c11 = _mm256_add_epi32(x1, row1);
+
+            __m256 xVel = _mm256_add_ps(_mm256_i32gather_ps(_velocX, c00, 4), _mm256_i32gather_ps(_velocX, c10, 4));
+            xVel = _mm256_add_ps(xVel, _mm256_i32gather_ps(_velocX, c01, 4));
+            xVel = _mm256_mul_ps(quarter, _mm256_add_ps(xVel, _mm256_i32gather_ps(_velocX, c11, 4)));
+            __m256 yVel = _mm256_add_ps(_mm256_i32gather_ps(_velocY, c00, 4), _mm256_i32gather_ps(_velocY, c10, 4));
+            yVel = _mm256_add_ps(yVel, _mm256_i32gather_ps(_velocY, c01, 4));
+            yVel = _mm256_mul_ps(quarter, _mm256_add_ps(yVel, _mm256_i32gather_ps(_velocY, c11, 4)));
+
+            px = _mm256_add_ps(px, _mm256_mul_ps(xVel, stepScale));
+            py = _mm256_add_ps(py, _mm256_mul_ps(yVel, stepScale));
+            px = _mm256_blendv_ps(px, maxX, _mm256_cmp_ps(px, zero, _CMP_LT_OQ));
+            px = _mm256_blendv_ps(px, zero, _mm256_cmp_ps(px, maxX, _CMP_GE_OQ));
+            py = _mm256_blendv_ps(py, maxY, _mm256_cmp_ps(py, zero, _CMP_LT_OQ));
+            py = _mm256_blendv_ps(py, zero, _mm256_cmp_ps(py, maxY, _CMP_GE_OQ));
+
+            __m256 lengthSquared = _mm256_add_ps(_mm256_mul_ps(xVel, xVel), _mm256_mul_ps(yVel, yVel));
+            __m256 scale = _mm256_div_ps(dirLength, _mm256_sqrt_ps(lengthSquared));
+            scale = _mm256_blendv_ps(dirLength, scale, _mm256_cmp_ps(lengthSquared, zero, _CMP_NEQ_OQ));
+
+            __m256 newDirX = _mm256_mul_ps(xVel, scale);
+            __m256 newDirY = _mm256_mul_ps(yVel, scale);
+            _mm256_storeu_ps(posX + p, px);
+            _mm256_storeu_ps(posY + p, py);
+            _mm256_storeu_ps(dirX + p, newDirX);
+            _mm256_storeu_ps(dirY + p, newDirY);
+            if (_mirror != nullptr)
+            {
+                _mm256_storeu_ps(_mirror->x + p, px);
+                _mm256_storeu_ps(_mirror->y + p, py);
+                _mm256_storeu_ps(_mirror->dirX + p, newDirX);
+                _mm256_storeu_ps(_mirror->dirY + p, newDirY);
+            }
+        }
+        advectScalar(_particles, _mirror, p, _count, _velocX, _velocY, _width, _height);
+    }
+
+    FLUID_TARGET_AVX512 void advectAVX512(const ParticleArrays &_particles, const ParticleArrays *_mirror,
+                                          size_t _count, const float *_velocX, const float *_velocY, size_t _width,
+                                          size_t _height)
+    {
+        float *FLUID_RESTRICT posX = _particles.x;
+        float *FLUID_RESTRICT posY = _particles.y;
+        float *FLUID_RESTRICT dirX = _particles.dirX;
+        float *FLUID_RESTRICT dirY = _particles.dirY;
+        constexpr int floorMode = _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC;
+        constexpr int ceilMode = _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC;
+        const __m512 zero = _mm512_setzero_ps();
+        const __m512 maxX = _mm512_set1_ps(static_cast<float>(_width - 1));
+        const __m512 maxY = _mm512_set1_ps(static_cast<float>(_height - 1));
+        const __m512 quarter = _mm512_set1_ps(0.25f);
+        const __m512 stepScale = _mm512_set1_ps(c_stepScale);
+        const __m512 dirLength = _mm512_set1_ps(c_dirLength);
+        const __m512i stride = _mm512_set1_epi32(static_cast<int>(_width));
+
+        size_t p = 0;
+        for (; p + 16 <= _count; p += 16)
+        {
+            __m512 px = _mm512_loadu_ps(posX + p);
+            __m512 py = _mm512_loadu_ps(posY + p);
+
+            __m512i x0 = _mm512_cvttps_epi32(_mm512_roundscale_ps(px, floorMode));
+            __m512i x1 = _mm512_cvttps_epi32(_mm512_roundscale_ps(px, ceilMode));
+            __m512i row0 = _mm512_mullo_epi32(_mm512_cvttps_epi32(_mm512_roundscale_ps(py, floorMode)), stride);
+            __m512i row1 = _mm512_mullo_epi32(_mm512_cvttps_epi32(_mm512_roundscale_ps(py, ceilMode)), stride);
+            __m512i c00 = _mm512_add_epi32(x0, row0);
+            __m512i c10 = _mm512_add_epi32(x1, row0);
+            __m512i c01 = _mm512_add_epi32(x0, row1);
+            __m512i c11 = _mm512_add_epi32(x1, row1);
+
+            __m512 xVel = _mm512_add_ps(_mm512_i32gather_ps(c00, _velocX, 4), _mm512_i32gather_ps(c10, _velocX, 4));
+            xVel = _mm512_add_ps(xVel, _mm512_i32gather_ps(c01, _velocX, 4));
+            xVel = _mm512_mul_ps(quarter, _mm512_add_ps(xVel, _mm512_i32gather_ps(c11, _velocX, 4)));
+            __m512 yVel = _mm512_add_ps(_mm512_i32gather_ps(c00, _velocY, 4), _mm512_i32gather_ps(c10, _velocY, 4));
+            yVel = _mm512_add_ps(yVel, _mm512_i32gather_ps(c01, _velocY, 4));
+            yVel = _mm512_mul_ps(quarter, _mm512_add_ps(yVel, _mm512_i32gather_ps(c11, _velocY, 4)));
+
+            px = _mm512_add_ps(px, _mm512_mul_ps(xVel, stepScale));
+            py = _mm512_add_ps(py, _mm512_mul_ps(yVel, stepScale));
+            px = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(px, zero, _CMP_LT_OQ), px, maxX);
+            px = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(px, maxX, _CMP_GE_OQ), px, zero);
+            py = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(py, zero, _CMP_LT_OQ), py, maxY);
+            py = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(py, maxY, _CMP_GE_OQ), py, zero);
+
+            __m512 lengthSquared = _mm512_add_ps(_mm512_mul_ps(xVel, xVel), _mm512_mul_ps(yVel, yVel));
+            __mmask16 moving = _mm512_cmp_ps_mask(lengthSquared, zero, _CMP_NEQ_OQ);
+            __m512 scale = _mm512_mask_div_ps(dirLength, moving, dirLength, _mm512_sqrt_ps(lengthSquared));
+
+            __m512 newDirX = _mm512_mul_ps(xVel, scale);
+            __m512 newDirY = _mm512_mul_ps(yVel, scale);
+            _mm512_storeu_ps(posX + p, px);
+            _mm512_storeu_ps(posY + p, py);
+            _mm512_storeu_ps(dirX + p, newDirX);
+            _mm512_storeu_ps(dirY + p, newDirY);
+            if (_mirror != nullptr)
+            {
+                _mm512_storeu_ps(_mirror->x + p, px);
+                _mm512_storeu_ps(_mirror->y + p, py);
+                _mm512_storeu_ps(_mirror->dirX + p, newDirX);
+                _mm512_storeu_ps(_mirror->dirY + p, newDirY);
+            }
+        }
+        advectScalar(_particles, _mirror, p, _count, _velocX, _velocY, _width, _height);
+    }
+#endif
+
+    const ParticleKernels c_scalarKernels{advectScalarAll};
+#ifdef FLUID_X86_SIMD
+    const ParticleKernels c_avx2Kernels{advectAVX2};
+    const ParticleKernels c_avx512Kernels{advectAVX512};
+#endif
+}
+
+const ParticleKernels &particleKernels(SimdLevel _level)
+{
+#ifdef FLUID_X86_SIMD
+    SimdLevel supported = detectSimdLevel();
+    if (_level > supported)
+    {
+        _level = supported;
+    }
+    switch (_level)
+    {
+    case SimdLevel::AVX512:
+        return c_avx512Kernels;
+    case SimdLevel::AVX2:
+        return c_avx2Kernels;
+    default:
+        break;
+    }
+#else
+    (void)_level;
+#endif
+    return c_scalarKernels;
+}
@@ -0,0 +1,242 @@
+/**
+ * @file ParticleRenderer.cpp
+ * @brief This class owns the OpenGL buffers used to draw the particles of a simulation frame, so the simulation itself
+ * does not need a GL context
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "ParticleRenderer.h"
+
+#include <algorithm>
+
+namespace
+{
+    // each slot stores the particle arrays one after another, x, y, dirX then dirY, one float attribute each
+    constexpr GLuint c_numArrays = 4;
+    // how long to wait on a fence before checking it again, in nanoseconds
+    constexpr GLuint64 c_fenceTimeout = 1000000;
+    // where the PosDirPull shader reads the particles from and the locations of its count and stride uniforms
+    constexpr GLuint c_particleBinding = 0;
+    constexpr GLint c_countLocation = 1;
+    constexpr GLint c_strideLocation = 2;
+
+    bool hasVersion(GLint _major, GLint _minor)
+    {
+        GLint major = 0;
+        GLint minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        return major > _major || (major == _major && minor >= _minor);
+    }
+
+    bool hasBufferStorage()
+    {
+        return hasVersion(4, 4);
+    }
+
+    size_t slotBytes(size_t _numParticles, bool _pulling)
+    {
+        const size_t bytes = c_numArrays * _numParticles * sizeof(float);
+        if (!_pulling)
+        {
+            return bytes;
+        }
+        GLint alignment = 1;
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        const size_t align = static_cast<size_t>(std::max(alignment, 1));
+        return (bytes + align - 1) / align * align;
+    }
+}
+
+bool ParticleRenderer::canPullVertices()
+{
+    return hasVersion(4, 3);
+}
+
+ParticleRenderer::ParticleRenderer(const SimulationFrame &_frame)
+    : m_numParticles{_frame.x.size()},
+      m_pulling{canPullVertices()},
+      m_slotBytes{slotBytes(m_numParticles, m_pulling)}
+{
+    const size_t bytes = m_numParticles * sizeof(float);
+    const bool persistent = hasBufferStorage();
+    size_t numSlots = persistent ? c_numSlots : 1;
+
+    glGenBuffers(1, &m_vboID);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vboID);
+    if (persistent)
+    {
+        // coherent, so writes are seen by the GPU without a flush, and never unmapped
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(numSlots * m_slotBytes), nullptr, flags);
+        m_mapped = static_cast<float *>(
+            glMapBufferRange(GL_ARRAY_BUFFER, 0, static_cast<GLsizeiptr>(numSlots * m_slotBytes), flags));
+        if (m_mapped == nullptr)
+        {
+            // immutable storage cannot be given new data or written by glBufferSubData, so start a plain buffer
+            glDeleteBuffers(1, &m_vboID);
+            glGenBuffers(1, &m_vboID);
+            glBindBuffer(GL_ARRAY_BUFFER, m_vboID);
+            numSlots = 1;
+        }
+    }
+    if (m_mapped == nullptr)
+    {
+        // allocate the buffer data we need for the 4 arrays, use dynamic as we update per frame and it may be quicker
+        glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(c_numArrays * bytes), nullptr, GL_DYNAMIC_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    if (m_pulling)
+    {
+        // nothing is read through attributes, but core profiles still need a vertex array bound to draw
+        glGenVertexArrays(1, m_vaos.data());
+    }
+    else
+    {
+        glGenVertexArrays(static_cast<GLsizei>(numSlots), m_vaos.data());
+        for (size_t slot = 0; slot < numSlots; slot++)
+        {
+            createVertexArray(m_vaos[slot], slot * m_slotBytes);
+        }
+    }
+    upload(_frame);
+}
+
+ParticleRenderer::ParticleRenderer(GLuint _buffer, size_t _numParticles)
+    : m_numParticles{_numParticles},
+      m_pulling{canPullVertices()},
+      m_slotBytes{slotBytes(m_numParticles, m_pulling)},
+      m_vboID{_buffer},
+      m_ownsBuffer{false}
+{
+    glGenVertexArrays(1, m_vaos.data());
+    if (!m_pulling)
+    {
+        createVertexArray(m_vaos[0], 0);
+    }
+}
+
+ParticleRenderer::~ParticleRenderer()
+{
+    for (GLsync &fence : m_fences)
+    {
+        if (fence != nullptr)
+        {
+            glDeleteSync(fence);
+        }
+    }
+    if (m_mapped != nullptr)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, m_vboID);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    if (m_ownsBuffer)
+    {
+        glDeleteBuffers(1, &m_vboID);
+    }
+    // names never generated are 0, which is ignored
+    glDeleteVertexArrays(static_cast<GLsizei>(c_numSlots), m_vaos.data());
+}
+
+void ParticleRenderer::createVertexArray(GLuint _vao, size_t _offset) const
+{
+    const size_t bytes = m_numParticles * sizeof(float);
+    glBindVertexArray(_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vboID);
+    for (GLuint i = 0; i < c_numArrays; i++)
+    {
+        glVertexAttribPointer(i, 1, GL_FLOAT, GL_FALSE, 0, reinterpret_cast<const void *>(_offset + i * bytes));
+        glEnableVertexAttribArray(i);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void ParticleRenderer::waitForSlot(size_t _slot)
+{
+    GLsync &fence = m_fences[_slot];
+    if (fence == nullptr)
+    {
+        return;
+    }
+    // flush on the first wait so the fence is guaranteed to signal
+    GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+    GLenum status = GL_TIMEOUT_EXPIRED;
+    while (status == GL_TIMEOUT_EXPIRED)
+    {
+        status = glClientWaitSync(fence, flags, c_fenceTimeout);
+        flags = 0;
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+void ParticleRenderer::copyToSlot(const SimulationFrame &_frame, size_t _slot)
+{
+    const float *arrays[c_numArrays] = {_frame.x.data(), _frame.y.data(), _frame.dirX.data(), _frame.dirY.data()};
+    float *first = m_mapped + _slot * m_slotBytes / sizeof(float);
+    for (GLuint i = 0; i < c_numArrays; i++)
+    {
+        std::copy(arrays[i], arrays[i] + m_numParticles, first + i * m_numParticles);
+    }
+}
+
+void ParticleRenderer::upload(const SimulationFrame &_frame)
+{
+    if (isPersistent())
+    {
+        // the slot after the one being drawn was drawn two frames ago, so its fence has usually already signalled
+        const size_t slot = (m_drawSlot + 1) % c_numSlots;
+        waitForSlot(slot);
+        copyToSlot(_frame, slot);
+        m_drawSlot = slot;
+        return;
+    }
+
+    const size_t bytes = m_numParticles * sizeof(float);
+    const float *arrays[c_numArrays] = {_frame.x.data(), _frame.y.data(), _frame.dirX.data(), _frame.dirY.data()};
+
+    // bind the buffer to copy the data
+    glBindBuffer(GL_ARRAY_BUFFER, m_vboID);
+    for (GLuint i = 0; i < c_numArrays; i++)
+    {
+        glBufferSubData(GL_ARRAY_BUFFER, static_cast<GLintptr>(i * bytes), static_cast<GLsizeiptr>(bytes), arrays[i]);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void ParticleRenderer::draw(size_t _stride)
+{
+    if (m_pulling)
+    {
+        const size_t stride = std::max<size_t>(_stride, 1);
+        const size_t numDrawn = (m_numParticles + stride - 1) / stride;
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, c_particleBinding, m_vboID,
+                          static_cast<GLintptr>(m_drawSlot * m_slotBytes),
+                          static_cast<GLsizeiptr>(c_numArrays * m_numParticles * sizeof(float)));
+        glUniform1i(c_countLocation, static_cast<GLint>(m_numParticles));
+        glUniform1i(c_strideLocation, static_cast<GLint>(stride));
+        // two vertices per particle, the shader works out which particle and which end from gl_VertexID
+        glBindVertexArray(m_vaos[0]);
+        glDrawArrays(GL_LINES, 0, static_cast<GLsizei>(2 * numDrawn));
+    }
+    else
+    {
+        glBindVertexArray(m_vaos[m_drawSlot]);
+        glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(m_numParticles));
+    }
+    glBindVertexArray(0);
+
+    if (isPersistent())
+    {
+        // mark when the GPU is done reading this slot, replacing the fence of any earlier draw of it
+        if (m_fences[m_drawSlot] != nullptr)
+        {
+            glDeleteSync(m_fences[m_drawSlot]);
+        }
+        m_fences[m_drawSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
@@ -0,0 +1,84 @@
+/**
+ * @file ParticleSystem.cpp
+ * @brief Tracer particles stored as separate aligned arrays of X, Y and direction, so the update can run several
+ * particles per vector instruction.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "ParticleSystem.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace
+{
+    // steps of the 2D R2 sequence, 1 / g and 1 / g^2 where g is the plastic number
+    constexpr double c_sequenceX = 0.7548776662466927;
+    constexpr double c_sequenceY = 0.5698402909980532;
+}
+
+ParticleSystem::ParticleSystem(size_t _numParticles, size_t _width, size_t _height) : m_width{_width},
+                                                                                      m_height{_height},
+                                                                                      m_simdLevel{detectSimdLevel()},
+                                                                                      m_x(_numParticles),
+                                                                                      m_y(_numParticles),
+                                                                                      m_dirX(_numParticles),
+                                                                                      m_dirY(_numParticles)
+{
+    seed();
+}
+
+void ParticleSystem::seed()
+{
+    std::fill(m_dirX.begin(), m_dirX.end(), 0.0f);
+    std::fill(m_dirY.begin(), m_dirY.end(), 0.0f);
+
+    if (size() == m_width * m_height)
+    {
+        for (size_t j = 0; j < m_height; j++)
+        {
+            for (size_t i = 0; i < m_width; i++)
+            {
+                m_x[i + j * m_width] = static_cast<float>(i);
+                m_y[i + j * m_width] = static_cast<float>(j);
+            }
+        }
+        return;
+    }
+
+    // keep clear of the far edge, which wraps back to 0
+    const double rangeX = static_cast<double>(m_width - 1);
+    const double rangeY = static_cast<double>(m_height - 1);
+    for (size_t p = 0; p < size(); p++)
+    {
+        double n = static_cast<double>(p);
+        double u = 0.5 + c_sequenceX * n;
+        double v = 0.5 + c_sequenceY * n;
+        m_x[p] = std::min(static_cast<float>((u - std::floor(u)) * rangeX), std::nextafter(static_cast<float>(rangeX), 0.0f));
+        m_y[p] = std::min(static_cast<float>((v - std::floor(v)) * rangeY), std::nextafter(static_cast<float>(rangeY), 0.0f));
+    }
+}
+
+void ParticleSystem::advect(size_t _first, size_t _last, const float *_velocX, const float *_velocY,
+                            const ParticleArrays *_mirror)
+{
+    assert(_first <= _last && _last <= size());
+    ParticleArrays particles{m_x.data() + _first, m_y.data() + _first, m_dirX.data() + _first, m_dirY.data() + _first};
+    if (_mirror == nullptr)
+    {
+        particleKernels(m_simdLevel).advect(particles, nullptr, _last - _first, _velocX, _velocY, m_width, m_height);
+        return;
+    }
+    ParticleArrays mirror{_mirror->x + _first, _mirror->y + _first, _mirror->dirX + _first, _mirror->dirY + _first};
+    particleKernels(m_simdLevel).advect(particles, &mirror, _last - _first, _velocX, _velocY, m_width, m_height);
+}
+
+void ParticleSystem::assign(const float *_x, const float *_y, const float *_dirX, const float *_dirY)
+{
+    std::copy(_x, _x + size(), m_x.begin());
+    std::copy(_y, _y + size(), m_y.begin());
+    std::copy(_dirX, _dirX + size(), m_dirX.begin());
+    std::copy(_dirY, _dirY + size(), m_dirY.begin());
+}
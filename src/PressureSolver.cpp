@@ -0,0 +1,143 @@
+/**
+ * @file PressureSolver.cpp
+ * @brief Interface for the pressure solve in Fluid::project, so the Gauss-Seidel relaxation from the paper can be
+ * swapped for solvers that converge to a tolerance.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "PressureSolver.h"
+
+#include <cmath>
+
+#include "ConjugateGradientSolver.h"
+#include "Fluid.h"
+#include "MultigridSolver.h"
+
+std::unique_ptr<PressureSolver> PressureSolver::create(const Settings &_settings, size_t _width, size_t _height,
+                                                       ThreadPool *_pool)
+{
+    switch (_settings.type)
+    {
+    case Type::Multigrid:
+        return std::make_unique<MultigridSolver>(_settings, _width, _height, _pool);
+    case Type::ConjugateGradient:
+        return std::make_unique<ConjugateGradientSolver>(_settings, _width, _height, _pool);
+    default:
+        return std::make_unique<RelaxationSolver>();
+    }
+}
+
+float PressureSolver::relativeResidual(const Fluid &_fluid, const float *_p, const float *_div)
+{
+    const size_t w = _fluid.width();
+    const size_t h = _fluid.height();
+    std::vector<double> rowSums(h);
+    std::vector<float> p(_p, _p + _fluid.numCells());
+    std::vector<float> b(_fluid.numCells());
+    std::vector<float> r(_fluid.numCells());
+
+    removeMean(_fluid, _div, b.data(), rowSums.data());
+    setNeumannBoundary(w, h, p.data());
+    residualRows(w, p.data(), b.data(), r.data(), 1, h - 1);
+
+    double bNorm = std::sqrt(dot(_fluid, b.data(), b.data(), rowSums.data()));
+    double rNorm = std::sqrt(dot(_fluid, r.data(), r.data(), rowSums.data()));
+    return bNorm > 0.0 ? static_cast<float>(rNorm / bNorm) : 0.0f;
+}
+
+void PressureSolver::setNeumannBoundary(size_t _width, size_t _height, float *_x)
+{
+    float *top = _x + (_height - 1) * _width;
+    for (size_t i = 1; i < _width - 1; i++)
+    {
+        _x[i] = _x[i + _width];
+        top[i] = top[i - _width];
+    }
+    for (size_t j = 1; j < _height - 1; j++)
+    {
+        float *row = _x + j * _width;
+        row[0] = row[1];
+        row[_width - 1] = row[_width - 2];
+    }
+    _x[0] = _x[_width + 1];
+    _x[_width - 1] = _x[2 * _width - 2];
+    top[0] = top[1 - _width];
+    top[_width - 1] = top[-2];
+}
+
+void PressureSolver::residualRows(size_t _width, const float *_x, const float *_b, float *_r, size_t _first, size_t _last)
+{
+    for (size_t j = _first; j < _last; j++)
+    {
+        for (size_t i = j * _width + 1; i < (j + 1) * _width - 1; i++)
+        {
+            _r[i] = _b[i] - (4.0f * _x[i] - (_x[i + 1] + _x[i - 1] + _x[i + _width] + _x[i - _width]));
+        }
+    }
+}
+
+double PressureSolver::dot(const Fluid &_fluid, const float *_a, const float *_b, double *_rowSums)
+{
+    const size_t w = _fluid.width();
+    const size_t h = _fluid.height();
+    _fluid.parallelRows(1, h - 1, [&](size_t _first, size_t _last) {
+        for (size_t j = _first; j < _last; j++)
+        {
+            double sum = 0.0;
+            for (size_t i = j * w + 1; i < (j + 1) * w - 1; i++)
+            {
+                sum += static_cast<double>(_a[i]) * _b[i];
+            }
+            _rowSums[j] = sum;
+        }
+    });
+
+    double total = 0.0;
+    for (size_t j = 1; j < h - 1; j++)
+    {
+        total += _rowSums[j];
+    }
+    return total;
+}
+
+void PressureSolver::removeMean(const Fluid &_fluid, const float *_src, float *_dst, double *_rowSums)
+{
+    const size_t w = _fluid.width();
+    const size_t h = _fluid.height();
+    _fluid.parallelRows(1, h - 1, [&](size_t _first, size_t _last) {
+        for (size_t j = _first; j < _last; j++)
+        {
+            double sum = 0.0;
+            for (size_t i = j * w + 1; i < (j + 1) * w - 1; i++)
+            {
+                sum += _src[i];
+            }
+            _rowSums[j] = sum;
+        }
+    });
+
+    double total = 0.0;
+    for (size_t j = 1; j < h - 1; j++)
+    {
+        total += _rowSums[j];
+    }
+    const float mean = static_cast<float>(total / static_cast<double>((w - 2) * (h - 2)));
+
+    _fluid.parallelRows(1, h - 1, [&](size_t _first, size_t _last) {
+        for (size_t j = _first; j < _last; j++)
+        {
+            for (size_t i = j * w + 1; i < (j + 1) * w - 1; i++)
+            {
+                _dst[i] = _src[i] - mean;
+            }
+        }
+    });
+}
+
+int RelaxationSolver::solve(Fluid &_fluid, float *_p, const float *_div)
+{
+    _fluid.linear_solve(Fluid::Boundary::None, _p, _div, 1, 4, _fluid.solveMode());
+    m_lastIterations = _fluid.iterations();
+    return m_lastIterations;
+}
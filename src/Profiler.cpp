@@ -0,0 +1,151 @@
+/**
+ * @file Profiler.cpp
+ * @brief Per-stage timing of the simulation, exported as percentiles or as a Chrome trace.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "Profiler.h"
+
+#include <algorithm>
+
+namespace
+{
+    constexpr double c_microseconds = 1.0e-3;
+
+    std::chrono::nanoseconds::rep toNanoseconds(Profiler::Clock::duration _duration)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(_duration).count();
+    }
+}
+
+Profiler::Profiler(size_t _traceCapacity) : m_trace(_traceCapacity),
+                                            m_origin{Clock::now()}
+{
+}
+
+void Profiler::record(Stage _stage, Clock::time_point _begin, Clock::time_point _end)
+{
+    uint64_t duration = static_cast<uint64_t>(std::max<std::chrono::nanoseconds::rep>(toNanoseconds(_end - _begin), 0));
+    m_histograms[static_cast<size_t>(_stage)].record(duration);
+
+    if (m_trace.empty())
+    {
+        return;
+    }
+    // claim a slot, once the trace is full events are only counted so droppedEvents can report them
+    size_t index = m_nextEvent.fetch_add(1, std::memory_order_relaxed);
+    if (index < m_trace.size())
+    {
+        uint64_t begin = static_cast<uint64_t>(std::max<std::chrono::nanoseconds::rep>(toNanoseconds(_begin - m_origin), 0));
+        m_trace[index] = TraceEvent{_stage, threadNumber(), begin, duration};
+    }
+}
+
+void Profiler::reset()
+{
+    for (auto &histogram : m_histograms)
+    {
+        histogram.reset();
+    }
+    m_nextEvent.store(0, std::memory_order_relaxed);
+    m_origin = Clock::now();
+}
+
+size_t Profiler::droppedEvents() const
+{
+    size_t events = m_nextEvent.load(std::memory_order_relaxed);
+    return events > m_trace.size() ? events - m_trace.size() : 0;
+}
+
+const char *Profiler::stageName(Stage _stage)
+{
+    switch (_stage)
+    {
+    case Stage::Step:
+        return "step";
+    case Stage::Impulses:
+        return "impulses";
+    case Stage::Diffuse:
+        return "diffuse";
+    case Stage::Project:
+        return "project";
+    case Stage::Advect:
+        return "advect";
+    case Stage::Scalars:
+        return "scalars";
+    case Stage::Particles:
+        return "particles";
+    case Stage::Upload:
+        return "upload";
+    default:
+        return "unknown";
+    }
+}
+
+void Profiler::writeCsv(std::ostream &_out) const
+{
+    _out << "stage,count,mean_us,p50_us,p95_us,p99_us,max_us\n";
+    for (size_t i = 0; i < m_histograms.size(); i++)
+    {
+        const LatencyHistogram &h = m_histograms[i];
+        if (h.count() == 0)
+        {
+            continue;
+        }
+        _out << stageName(static_cast<Stage>(i)) << "," << h.count() << ","
+             << h.mean() * c_microseconds << ","
+             << static_cast<double>(h.percentile(0.50)) * c_microseconds << ","
+             << static_cast<double>(h.percentile(0.95)) * c_microseconds << ","
+             << static_cast<double>(h.percentile(0.99)) * c_microseconds << ","
+             << static_cast<double>(h.max()) * c_microseconds << "\n";
+    }
+}
+
+void Profiler::writeJson(std::ostream &_out) const
+{
+    _out << "{";
+    bool first = true;
+    for (size_t i = 0; i < m_histograms.size(); i++)
+    {
+        const LatencyHistogram &h = m_histograms[i];
+        if (h.count() == 0)
+        {
+            continue;
+        }
+        _out << (first ? "\n" : ",\n");
+        first = false;
+        _out << "  \"" << stageName(static_cast<Stage>(i)) << "\": {"
+             << "\"count\": " << h.count()
+             << ", \"mean_us\": " << h.mean() * c_microseconds
+             << ", \"p50_us\": " << static_cast<double>(h.percentile(0.50)) * c_microseconds
+             << ", \"p95_us\": " << static_cast<double>(h.percentile(0.95)) * c_microseconds
+             << ", \"p99_us\": " << static_cast<double>(h.percentile(0.99)) * c_microseconds
+             << ", \"max_us\": " << static_cast<double>(h.max()) * c_microseconds << "}";
+    }
+    _out << "\n}\n";
+}
+
+void Profiler::writeChromeTrace(std::ostream &_out) const
+{
+    size_t numEvents = std::min(m_nextEvent.load(std::memory_order_relaxed), m_trace.size());
+
+    // complete ("X") events with microsecond timestamps, one row per thread
+    _out << "{\"traceEvents\": [";
+    for (size_t i = 0; i < numEvents; i++)
+    {
+        const TraceEvent &event = m_trace[i];
+        _out << (i == 0 ? "\n" : ",\n");
+        _out << "  {\"name\": \"" << stageName(event.stage) << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << event.thread
+             << ", \"ts\": " << static_cast<double>(event.begin) * c_microseconds
+             << ", \"dur\": " << static_cast<double>(event.duration) * c_microseconds << "}";
+    }
+    _out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+}
+
+uint32_t Profiler::threadNumber()
+{
+    static std::atomic<uint32_t> s_nextThread{0};
+    thread_local uint32_t t_thread = s_nextThread.fetch_add(1, std::memory_order_relaxed);
+    return t_thread;
+}
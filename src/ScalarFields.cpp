@@ -0,0 +1,51 @@
+/**
+ * @file ScalarFields.cpp
+ * @brief Passive scalar channels carried by the fluid, kept together in one workspace.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "ScalarFields.h"
+
+#include <algorithm>
+#include <utility>
+
+size_t ScalarFields::add(const std::string &_name, float _diffusion)
+{
+    const size_t current = m_workspace.add<float>(m_numCells, m_width);
+    const size_t previous = m_workspace.add<float>(m_numCells, m_width);
+    m_workspace.allocate(m_pool);
+    m_channels.push_back({_name, _diffusion, current, previous});
+    return m_channels.size() - 1;
+}
+
+size_t ScalarFields::find(const std::string &_name) const
+{
+    for (size_t channel = 0; channel < m_channels.size(); channel++)
+    {
+        if (m_channels[channel].name == _name)
+        {
+            return channel;
+        }
+    }
+    return npos;
+}
+
+void ScalarFields::clear()
+{
+    for (size_t index = 0; index < m_workspace.size(); index++)
+    {
+        std::fill(m_workspace.array<float>(index), m_workspace.array<float>(index) + m_numCells, 0.0f);
+    }
+}
+
+void ScalarFields::setThreadPool(ThreadPool *_pool)
+{
+    m_pool = _pool;
+    m_workspace.allocate(_pool);
+}
+
+void ScalarFields::swap(size_t _channel)
+{
+    std::swap(m_channels[_channel].current, m_channels[_channel].previous);
+}
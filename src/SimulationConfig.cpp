@@ -0,0 +1,521 @@
+/**
+ * @file SimulationConfig.cpp
+ * @brief The settings of a batch simulation run, read from "key = value" config files and "--key value" command line
+ * arguments using the same keys.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "SimulationConfig.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace
+{
+    /**
+     * @brief Read exactly one value of type T from _text, nothing else may follow it
+     */
+    template <typename T>
+    bool parseValue(const std::string &_text, T *_value)
+    {
+        std::istringstream stream(_text);
+        stream >> *_value;
+        if (stream.fail())
+        {
+            return false;
+        }
+        stream >> std::ws;
+        return stream.eof();
+    }
+
+    /**
+     * @brief Read on/off, true/false or 1/0
+     */
+    bool parseFlag(const std::string &_text, bool *_value)
+    {
+        if (_text == "on" || _text == "true" || _text == "1")
+        {
+            *_value = true;
+            return true;
+        }
+        if (_text == "off" || _text == "false" || _text == "0")
+        {
+            *_value = false;
+            return true;
+        }
+        return false;
+    }
+
+    std::string trim(const std::string &_text)
+    {
+        size_t first = _text.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos)
+        {
+            return {};
+        }
+        size_t last = _text.find_last_not_of(" \t\r\n");
+        return _text.substr(first, last - first + 1);
+    }
+}
+
+bool SimulationConfig::set(const std::string &_key, const std::string &_value, std::string *_error)
+{
+    bool valid = true;
+    if (_key == "width")
+    {
+        valid = parseValue(_value, &width) && width >= c_minGridSize;
+    }
+    else if (_key == "height")
+    {
+        valid = parseValue(_value, &height) && height >= c_minGridSize;
+    }
+    else if (_key == "dt")
+    {
+        valid = parseValue(_value, &dt);
+    }
+    else if (_key == "viscosity")
+    {
+        valid = parseValue(_value, &viscosity);
+    }
+    else if (_key == "steps")
+    {
+        valid = parseValue(_value, &steps);
+    }
+    else if (_key == "threads")
+    {
+        valid = parseValue(_value, &threads);
+    }
+    else if (_key == "particles")
+    {
+        valid = parseValue(_value, &particles);
+    }
+    else if (_key == "iterations")
+    {
+        valid = parseValue(_value, &iterations) && iterations > 0;
+    }
+    else if (_key == "solve")
+    {
+        if (_value == "gauss-seidel")
+        {
+            solveMode = Fluid::SolveMode::GaussSeidel;
+        }
+        else if (_value == "red-black")
+        {
+            solveMode = Fluid::SolveMode::RedBlack;
+        }
+        else if (_value == "jacobi")
+        {
+            solveMode = Fluid::SolveMode::Jacobi;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    else if (_key == "tile")
+    {
+        valid = parseValue(_value, &sweepsPerTile) && sweepsPerTile > 0;
+    }
+    else if (_key == "advection")
+    {
+        if (_value == "semi-lagrangian")
+        {
+            advectionScheme = Fluid::AdvectionScheme::SemiLagrangian;
+        }
+        else if (_value == "maccormack")
+        {
+            advectionScheme = Fluid::AdvectionScheme::MacCormack;
+        }
+        else if (_value == "bfecc")
+        {
+            advectionScheme = Fluid::AdvectionScheme::BFECC;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    else if (_key == "timestep")
+    {
+        if (_value == "fixed")
+        {
+            timeStepping.mode = FluidGrid::TimeStepping::Mode::Fixed;
+        }
+        else if (_value == "adaptive")
+        {
+            timeStepping.mode = FluidGrid::TimeStepping::Mode::Adaptive;
+        }
+        else if (_value == "substeps")
+        {
+            timeStepping.mode = FluidGrid::TimeStepping::Mode::SubSteps;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    else if (_key == "cfl")
+    {
+        valid = parseValue(_value, &timeStepping.cfl) && timeStepping.cfl > 0.0f;
+    }
+    else if (_key == "min-dt")
+    {
+        valid = parseValue(_value, &timeStepping.minDt) && timeStepping.minDt >= 0.0f;
+    }
+    else if (_key == "max-dt")
+    {
+        valid = parseValue(_value, &timeStepping.maxDt) && timeStepping.maxDt > 0.0f;
+    }
+    else if (_key == "max-substeps")
+    {
+        valid = parseValue(_value, &timeStepping.maxSubSteps) && timeStepping.maxSubSteps > 0;
+    }
+    else if (_key == "frame-budget")
+    {
+        valid = parseValue(_value, &frameBudget) && frameBudget >= 0.0;
+    }
+    else if (_key == "backend")
+    {
+        if (_value == "cpu")
+        {
+            backend = SolverBackend::Cpu;
+        }
+        else if (_value == "gpu")
+        {
+            backend = SolverBackend::Gpu;
+        }
+        else if (_value == "compare")
+        {
+            backend = SolverBackend::Compare;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    else if (_key == "fused")
+    {
+        valid = parseFlag(_value, &fused);
+    }
+    else if (_key == "sparse")
+    {
+        valid = parseFlag(_value, &sparse);
+    }
+    else if (_key == "sparse-threshold")
+    {
+        valid = parseValue(_value, &activityThreshold) && activityThreshold >= 0.0f;
+    }
+    else if (_key == "sparse-halo")
+    {
+        valid = parseValue(_value, &activityHalo);
+    }
+    else if (_key == "pressure")
+    {
+        if (_value == "relaxation")
+        {
+            pressureSolver.type = PressureSolver::Type::Relaxation;
+        }
+        else if (_value == "multigrid")
+        {
+            pressureSolver.type = PressureSolver::Type::Multigrid;
+        }
+        else if (_value == "cg")
+        {
+            pressureSolver.type = PressureSolver::Type::ConjugateGradient;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    else if (_key == "tolerance")
+    {
+        valid = parseValue(_value, &pressureSolver.tolerance);
+    }
+    else if (_key == "preconditioner")
+    {
+        if (_value == "mic0")
+        {
+            pressureSolver.preconditioner = PressureSolver::Preconditioner::MIC0;
+        }
+        else if (_value == "jacobi")
+        {
+            pressureSolver.preconditioner = PressureSolver::Preconditioner::Jacobi;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    else if (_key == "output")
+    {
+        output = _value;
+    }
+    else if (_key == "profile")
+    {
+        profile = _value;
+    }
+    else if (_key == "checkpoint")
+    {
+        checkpoint = _value;
+    }
+    else if (_key == "checkpoint-every")
+    {
+        valid = parseValue(_value, &checkpointInterval);
+    }
+    else if (_key == "restart")
+    {
+        restart = _value;
+    }
+    else if (_key == "fields")
+    {
+        fieldOutput.path = _value;
+    }
+    else if (_key == "fields-every")
+    {
+        valid = parseValue(_value, &fieldInterval) && fieldInterval > 0;
+    }
+    else if (_key == "fields-format")
+    {
+        if (_value == "stream")
+        {
+            fieldOutput.format = FieldWriter::Format::Stream;
+        }
+        else if (_value == "raw")
+        {
+            fieldOutput.format = FieldWriter::Format::RawFrames;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    else if (_key == "compression")
+    {
+        if (_value == "none")
+        {
+            fieldOutput.compression = FieldWriter::Compression::None;
+        }
+        else if (_value == "shuffle")
+        {
+            fieldOutput.compression = FieldWriter::Compression::Shuffle;
+        }
+        else if (_value == "zstd")
+        {
+            fieldOutput.compression = FieldWriter::Compression::Zstd;
+        }
+        else if (_value == "lz4")
+        {
+            fieldOutput.compression = FieldWriter::Compression::LZ4;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    else if (_key == "delta")
+    {
+        valid = parseFlag(_value, &fieldOutput.delta);
+    }
+    else if (_key == "queue")
+    {
+        valid = parseValue(_value, &fieldOutput.queueFrames) && fieldOutput.queueFrames >= 2;
+    }
+    else if (_key == "when-full")
+    {
+        if (_value == "block")
+        {
+            fieldOutput.policy = FieldWriter::FullPolicy::Block;
+        }
+        else if (_value == "drop-newest")
+        {
+            fieldOutput.policy = FieldWriter::FullPolicy::DropNewest;
+        }
+        else if (_value == "drop-oldest")
+        {
+            fieldOutput.policy = FieldWriter::FullPolicy::DropOldest;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    else if (_key == "force")
+    {
+        ForceInjection force;
+        std::istringstream stream(_value);
+        stream >> force.step >> force.x >> force.y >> force.vx >> force.vy;
+        valid = !stream.fail() && (stream >> std::ws).eof();
+        if (valid)
+        {
+            forces.push_back(force);
+        }
+    }
+    else if (_key == "impulse")
+    {
+        ImpulseInjection injection;
+        Impulse &impulse = injection.impulse;
+        std::istringstream stream(_value);
+        std::string radius;
+        stream >> injection.step >> impulse.x >> impulse.y >> impulse.vx >> impulse.vy;
+        valid = !stream.fail();
+        std::getline(stream, radius);
+        valid = valid && (trim(radius).empty() || parseValue(radius, &impulse.radius)) && impulse.radius >= 0.0f;
+        if (valid)
+        {
+            impulses.push_back(injection);
+        }
+    }
+    else if (_key == "scalar")
+    {
+        ScalarChannel channel;
+        std::istringstream stream(_value);
+        std::string diffusion;
+        stream >> channel.name;
+        std::getline(stream, diffusion);
+        valid = !channel.name.empty() && (trim(diffusion).empty() || parseValue(diffusion, &channel.diffusion)) &&
+                channel.diffusion >= 0.0f;
+        if (valid)
+        {
+            scalars.push_back(channel);
+        }
+    }
+    else if (_key == "source")
+    {
+        ScalarInjection source;
+        std::istringstream stream(_value);
+        stream >> source.step >> source.channel >> source.x >> source.y >> source.amount;
+        valid = !stream.fail() && (stream >> std::ws).eof();
+        if (valid)
+        {
+            sources.push_back(source);
+        }
+    }
+    else if (_key == "buoyancy")
+    {
+        std::string temperature;
+        float lift = 0.0f;
+        std::string density;
+        float weight = 0.0f;
+        std::istringstream stream(_value);
+        std::string rest;
+        stream >> temperature >> lift;
+        valid = !stream.fail();
+        std::getline(stream, rest);
+        if (valid && !trim(rest).empty())
+        {
+            std::istringstream densityStream(rest);
+            densityStream >> density >> weight;
+            valid = !densityStream.fail() && (densityStream >> std::ws).eof();
+        }
+        if (valid)
+        {
+            buoyancyTemperature = temperature;
+            buoyancyLift = lift;
+            buoyancyDensity = density;
+            buoyancyWeight = weight;
+        }
+    }
+    else
+    {
+        *_error = "unknown setting '" + _key + "'";
+        return false;
+    }
+
+    if (!valid)
+    {
+        *_error = "invalid value '" + _value + "' for " + _key;
+    }
+    return valid;
+}
+
+bool SimulationConfig::load(const std::string &_path, std::string *_error)
+{
+    std::ifstream file(_path);
+    if (!file)
+    {
+        *_error = "cannot open config file " + _path;
+        return false;
+    }
+
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        size_t equals = line.find('=');
+        if (equals == std::string::npos)
+        {
+            *_error = _path + ":" + std::to_string(lineNumber) + ": expected key = value";
+            return false;
+        }
+        if (!set(trim(line.substr(0, equals)), trim(line.substr(equals + 1)), _error))
+        {
+            *_error = _path + ":" + std::to_string(lineNumber) + ": " + *_error;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SimulationConfig::parseArguments(int _argc, const char *const *_argv, std::string *_error)
+{
+    for (int i = 1; i < _argc; i++)
+    {
+        std::string argument = _argv[i];
+        if (argument.size() < 3 || argument.compare(0, 2, "--") != 0)
+        {
+            *_error = "unexpected argument '" + argument + "'";
+            return false;
+        }
+        if (i + 1 == _argc)
+        {
+            *_error = "missing value for " + argument;
+            return false;
+        }
+
+        std::string key = argument.substr(2);
+        std::string value = _argv[++i];
+        bool valid = (key == "config") ? load(value, _error) : set(key, value, _error);
+        if (!valid)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<ForceInjection> SimulationConfig::sortedForces() const
+{
+    std::vector<ForceInjection> sorted = forces;
+    std::stable_sort(sorted.begin(), sorted.end(), [](const ForceInjection &_a, const ForceInjection &_b) {
+        return _a.step < _b.step;
+    });
+    return sorted;
+}
+
+std::vector<ImpulseInjection> SimulationConfig::sortedImpulses() const
+{
+    std::vector<ImpulseInjection> sorted = impulses;
+    std::stable_sort(sorted.begin(), sorted.end(), [](const ImpulseInjection &_a, const ImpulseInjection &_b) {
+        return _a.step < _b.step;
+    });
+    return sorted;
+}
+
+std::vector<ScalarInjection> SimulationConfig::sortedSources() const
+{
+    std::vector<ScalarInjection> sorted = sources;
+    std::stable_sort(sorted.begin(), sorted.end(), [](const ScalarInjection &_a, const ScalarInjection &_b) {
+        return _a.step < _b.step;
+    });
+    return sorted;
+}
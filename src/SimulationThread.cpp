@@ -0,0 +1,135 @@
+/**
+ * @file SimulationThread.cpp
+ * @brief Steps a FluidGrid on its own thread at a fixed rate, publishing a snapshot after each step
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "SimulationThread.h"
+
+#include <algorithm>
+
+namespace
+{
+    SimulationFrame captureFrame(const FluidGrid &_grid)
+    {
+        const ParticleSystem &particles = _grid.getParticles();
+        const size_t count = particles.size();
+        SimulationFrame frame;
+        frame.x.assign(particles.x(), particles.x() + count);
+        frame.y.assign(particles.y(), particles.y() + count);
+        frame.dirX.assign(particles.dirX(), particles.dirX() + count);
+        frame.dirY.assign(particles.dirY(), particles.dirY() + count);
+        frame.velocityX.assign(_grid.getVelocityX(), _grid.getVelocityX() + _grid.numCells());
+        frame.velocityY.assign(_grid.getVelocityY(), _grid.getVelocityY() + _grid.numCells());
+        return frame;
+    }
+}
+
+SimulationThread::SimulationThread(std::unique_ptr<FluidGrid> _grid, std::chrono::nanoseconds _interval)
+    : m_grid{std::move(_grid)}, m_interval{_interval}, m_frames{captureFrame(*m_grid)}
+{
+}
+
+SimulationThread::~SimulationThread()
+{
+    stop();
+}
+
+void SimulationThread::start()
+{
+    if (isRunning())
+    {
+        return;
+    }
+    m_running.store(true, std::memory_order_relaxed);
+    m_thread = std::thread(&SimulationThread::run, this);
+}
+
+void SimulationThread::stop()
+{
+    if (!isRunning())
+    {
+        return;
+    }
+    m_running.store(false, std::memory_order_relaxed);
+    m_thread.join();
+}
+
+bool SimulationThread::addVelocity(float _x, float _y, float _vx, float _vy)
+{
+    return push({SimulationCommand::Type::AddVelocity, _x, _y, _vx, _vy});
+}
+
+bool SimulationThread::addImpulse(const Impulse &_impulse)
+{
+    return push({SimulationCommand::Type::AddImpulse, _impulse.x, _impulse.y, _impulse.vx, _impulse.vy,
+                 _impulse.radius});
+}
+
+bool SimulationThread::reset()
+{
+    SimulationCommand command;
+    command.type = SimulationCommand::Type::Reset;
+    return push(command);
+}
+
+bool SimulationThread::push(const SimulationCommand &_command)
+{
+    return m_commands.push(_command);
+}
+
+void SimulationThread::apply(const SimulationCommand &_command)
+{
+    switch (_command.type)
+    {
+    case SimulationCommand::Type::AddVelocity:
+        m_grid->addVelocity(_command.x, _command.y, _command.vx, _command.vy);
+        break;
+    case SimulationCommand::Type::AddImpulse:
+    {
+        const Impulse impulse{_command.x, _command.y, _command.vx, _command.vy, _command.radius};
+        m_grid->addImpulses(&impulse, 1);
+        break;
+    }
+    case SimulationCommand::Type::Reset:
+        m_grid->reset();
+        break;
+    }
+}
+
+void SimulationThread::run()
+{
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point next = Clock::now();
+    while (m_running.load(std::memory_order_relaxed))
+    {
+        SimulationCommand command;
+        while (m_commands.pop(command))
+        {
+            apply(command);
+        }
+
+        // the step writes every particle, so it fills the frame's particles as it goes rather than copying after
+        SimulationFrame &frame = m_frames.writeBuffer();
+        ParticleArrays mirror{frame.x.data(), frame.y.data(), frame.dirX.data(), frame.dirY.data()};
+        m_grid->setParticleMirror(&mirror);
+        m_grid->step();
+        m_grid->setParticleMirror(nullptr);
+        std::copy(m_grid->getVelocityX(), m_grid->getVelocityX() + m_grid->numCells(), frame.velocityX.begin());
+        std::copy(m_grid->getVelocityY(), m_grid->getVelocityY() + m_grid->numCells(), frame.velocityY.begin());
+        frame.step = m_steps.fetch_add(1, std::memory_order_relaxed) + 1;
+        m_frames.publish();
+
+        next += m_interval;
+        const Clock::time_point now = Clock::now();
+        if (next < now)
+        {
+            next = now;
+        }
+        else
+        {
+            std::this_thread::sleep_until(next);
+        }
+    }
+}
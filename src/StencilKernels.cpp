@@ -0,0 +1,275 @@
+/**
+ * @file StencilKernels.cpp
+ * @brief Unchecked row kernels for the 5-point stencil solved by Fluid::linear_solve and the 7-point stencil solved by
+ * Fluid3D::linear_solve, with scalar, AVX2 and AVX-512 versions selected at runtime.
+ * This file is built with floating point contraction disabled so the vector paths round exactly like the scalar one.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "StencilKernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define FLUID_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FLUID_TARGET_AVX2 __attribute__((target("avx2")))
+#define FLUID_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define FLUID_TARGET_AVX2
+#define FLUID_TARGET_AVX512
+#endif
+
+namespace
+{
+    void jacobiRowScalar(float *FLUID_RESTRICT _dst, const float *FLUID_RESTRICT _below,
+                         const float *FLUID_RESTRICT _src, const float *FLUID_RESTRICT _above,
+                         const float *FLUID_RESTRICT _x0, size_t _count, float _a, float _cRecip)
+    {
+        for (size_t i = 0; i < _count; i++)
+        {
+            _dst[i] = (_x0[i] + _a * (_src[i + 1] + _src[i - 1] + _above[i] + _below[i])) * _cRecip;
+        }
+    }
+
+    void redBlackRowScalar(float *_x, const float *_x0, size_t _stride, size_t _count, size_t _first, float _a,
+                           float _cRecip)
+    {
+        for (size_t i = _first; i < _count; i += 2)
+        {
+            _x[i] = (_x0[i] + _a * (_x[i + 1] + _x[i - 1] + _x[i + _stride] + _x[i - _stride])) * _cRecip;
+        }
+    }
+
+    void jacobiRow7Scalar(float *FLUID_RESTRICT _dst, const float *FLUID_RESTRICT _below,
+                          const float *FLUID_RESTRICT _src, const float *FLUID_RESTRICT _above,
+                          const float *FLUID_RESTRICT _back, const float *FLUID_RESTRICT _front,
+                          const float *FLUID_RESTRICT _x0, size_t _count, float _a, float _cRecip)
+    {
+        for (size_t i = 0; i < _count; i++)
+        {
+            _dst[i] = (_x0[i] + _a * (_src[i + 1] + _src[i - 1] + _above[i] + _below[i] + _front[i] + _back[i])) *
+                      _cRecip;
+        }
+    }
+
+    void redBlackRow7Scalar(float *_x, const float *_x0, size_t _stride, size_t _planeStride, size_t _count,
+                            size_t _first, float _a, float _cRecip)
+    {
+        for (size_t i = _first; i < _count; i += 2)
+        {
+            _x[i] = (_x0[i] + _a * (_x[i + 1] + _x[i - 1] + _x[i + _stride] + _x[i - _stride] + _x[i + _planeStride] +
+                                    _x[i - _planeStride])) *
+                    _cRecip;
+        }
+    }
+
+#ifdef FLUID_X86_SIMD
+    FLUID_TARGET_AVX2 inline __m256 stencilAVX2(const float *_below, const float *_x, const float *_above,
+                                                const float *_x0, __m256 _a, __m256 _cRecip)
+    {
+        __m256 sum = _mm256_add_ps(_mm256_loadu_ps(_x + 1), _mm256_loadu_ps(_x - 1));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(_above));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(_below));
+        return _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(_x0), _mm256_mul_ps(_a, sum)), _cRecip);
+    }
+
+    FLUID_TARGET_AVX2 void jacobiRowAVX2(float *FLUID_RESTRICT _dst, const float *FLUID_RESTRICT _below,
+                                         const float *FLUID_RESTRICT _src, const float *FLUID_RESTRICT _above,
+                                         const float *FLUID_RESTRICT _x0, size_t _count, float _a, float _cRecip)
+    {
+        const __m256 a = _mm256_set1_ps(_a);
+        const __m256 cRecip = _mm256_set1_ps(_cRecip);
+        size_t i = 0;
+        for (; i + 8 <= _count; i += 8)
+        {
+            _mm256_storeu_ps(_dst + i, stencilAVX2(_below + i, _src + i, _above + i, _x0 + i, a, cRecip));
+        }
+        jacobiRowScalar(_dst + i, _below + i, _src + i, _above + i, _x0 + i, _count - i, _a, _cRecip);
+    }
+
+    FLUID_TARGET_AVX2 void redBlackRowAVX2(float *_x, const float *_x0, size_t _stride, size_t _count, size_t _first,
+                                           float _a, float _cRecip)
+    {
+        const __m256 a = _mm256_set1_ps(_a);
+        const __m256 cRecip = _mm256_set1_ps(_cRecip);
+        // every vector starts on an even offset so the same lanes are updated in each of them. Only those lanes are
+        // stored, the other colour belongs to the rows next to this one, which other threads may be reading
+        const __m256i mask = _first == 0 ? _mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0)
+                                         : _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+        size_t i = 0;
+        for (; i + 8 <= _count; i += 8)
+        {
+            __m256 updated = stencilAVX2(_x + i - _stride, _x + i, _x + i + _stride, _x0 + i, a, cRecip);
+            _mm256_maskstore_ps(_x + i, mask, updated);
+        }
+        redBlackRowScalar(_x + i, _x0 + i, _stride, _count - i, _first, _a, _cRecip);
+    }
+
+    FLUID_TARGET_AVX2 inline __m256 stencil7AVX2(const float *_below, const float *_x, const float *_above,
+                                                 const float *_back, const float *_front, const float *_x0, __m256 _a,
+                                                 __m256 _cRecip)
+    {
+        __m256 sum = _mm256_add_ps(_mm256_loadu_ps(_x + 1), _mm256_loadu_ps(_x - 1));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(_above));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(_below));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(_front));
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(_back));
+        return _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(_x0), _mm256_mul_ps(_a, sum)), _cRecip);
+    }
+
+    FLUID_TARGET_AVX2 void jacobiRow7AVX2(float *FLUID_RESTRICT _dst, const float *FLUID_RESTRICT _below,
+                                          const float *FLUID_RESTRICT _src, const float *FLUID_RESTRICT _above,
+                                          const float *FLUID_RESTRICT _back, const float *FLUID_RESTRICT _front,
+                                          const float *FLUID_RESTRICT _x0, size_t _count, float _a, float _cRecip)
+    {
+        const __m256 a = _mm256_set1_ps(_a);
+        const __m256 cRecip = _mm256_set1_ps(_cRecip);
+        size_t i = 0;
+        for (; i + 8 <= _count; i += 8)
+        {
+            _mm256_storeu_ps(_dst + i, stencil7AVX2(_below + i, _src + i, _above + i, _back + i, _front + i, _x0 + i, a,
+                                                    cRecip));
+        }
+        jacobiRow7Scalar(_dst + i, _below + i, _src + i, _above + i, _back + i, _front + i, _x0 + i, _count - i, _a,
+                         _cRecip);
+    }
+
+    FLUID_TARGET_AVX2 void redBlackRow7AVX2(float *_x, const float *_x0, size_t _stride, size_t _planeStride,
+                                            size_t _count, size_t _first, float _a, float _cRecip)
+    {
+        const __m256 a = _mm256_set1_ps(_a);
+        const __m256 cRecip = _mm256_set1_ps(_cRecip);
+        const __m256i mask = _first == 0 ? _mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0)
+                                         : _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+        size_t i = 0;
+        for (; i + 8 <= _count; i += 8)
+        {
+            __m256 updated = stencil7AVX2(_x + i - _stride, _x + i, _x + i + _stride, _x + i - _planeStride,
+                                          _x + i + _planeStride, _x0 + i, a, cRecip);
+            _mm256_maskstore_ps(_x + i, mask, updated);
+        }
+        redBlackRow7Scalar(_x + i, _x0 + i, _stride, _planeStride, _count - i, _first, _a, _cRecip);
+    }
+
+    FLUID_TARGET_AVX512 inline __m512 stencilAVX512(const float *_below, const float *_x, const float *_above,
+                                                    const float *_x0, __m512 _a, __m512 _cRecip, __mmask16 _lanes)
+    {
+        __m512 sum = _mm512_add_ps(_mm512_maskz_loadu_ps(_lanes, _x + 1), _mm512_maskz_loadu_ps(_lanes, _x - 1));
+        sum = _mm512_add_ps(sum, _mm512_maskz_loadu_ps(_lanes, _above));
+        sum = _mm512_add_ps(sum, _mm512_maskz_loadu_ps(_lanes, _below));
+        return _mm512_mul_ps(_mm512_add_ps(_mm512_maskz_loadu_ps(_lanes, _x0), _mm512_mul_ps(_a, sum)), _cRecip);
+    }
+
+    FLUID_TARGET_AVX512 void jacobiRowAVX512(float *FLUID_RESTRICT _dst, const float *FLUID_RESTRICT _below,
+                                             const float *FLUID_RESTRICT _src, const float *FLUID_RESTRICT _above,
+                                             const float *FLUID_RESTRICT _x0, size_t _count, float _a, float _cRecip)
+    {
+        const __m512 a = _mm512_set1_ps(_a);
+        const __m512 cRecip = _mm512_set1_ps(_cRecip);
+        for (size_t i = 0; i < _count; i += 16)
+        {
+            // the masked loads and stores handle the end of the row without a scalar tail
+            size_t remaining = _count - i;
+            __mmask16 lanes = remaining >= 16 ? static_cast<__mmask16>(0xffff)
+                                              : static_cast<__mmask16>((1u << remaining) - 1);
+            _mm512_mask_storeu_ps(_dst + i, lanes,
+                                  stencilAVX512(_below + i, _src + i, _above + i, _x0 + i, a, cRecip, lanes));
+        }
+    }
+
+    FLUID_TARGET_AVX512 void redBlackRowAVX512(float *_x, const float *_x0, size_t _stride, size_t _count,
+                                               size_t _first, float _a, float _cRecip)
+    {
+        const __m512 a = _mm512_set1_ps(_a);
+        const __m512 cRecip = _mm512_set1_ps(_cRecip);
+        const __mmask16 colour = _first == 0 ? static_cast<__mmask16>(0x5555) : static_cast<__mmask16>(0xaaaa);
+        for (size_t i = 0; i < _count; i += 16)
+        {
+            size_t remaining = _count - i;
+            __mmask16 lanes = remaining >= 16 ? static_cast<__mmask16>(0xffff)
+                                              : static_cast<__mmask16>((1u << remaining) - 1);
+            _mm512_mask_storeu_ps(_x + i, lanes & colour,
+                                  stencilAVX512(_x + i - _stride, _x + i, _x + i + _stride, _x0 + i, a, cRecip, lanes));
+        }
+    }
+
+    FLUID_TARGET_AVX512 inline __m512 stencil7AVX512(const float *_below, const float *_x, const float *_above,
+                                                     const float *_back, const float *_front, const float *_x0,
+                                                     __m512 _a, __m512 _cRecip, __mmask16 _lanes)
+    {
+        __m512 sum = _mm512_add_ps(_mm512_maskz_loadu_ps(_lanes, _x + 1), _mm512_maskz_loadu_ps(_lanes, _x - 1));
+        sum = _mm512_add_ps(sum, _mm512_maskz_loadu_ps(_lanes, _above));
+        sum = _mm512_add_ps(sum, _mm512_maskz_loadu_ps(_lanes, _below));
+        sum = _mm512_add_ps(sum, _mm512_maskz_loadu_ps(_lanes, _front));
+        sum = _mm512_add_ps(sum, _mm512_maskz_loadu_ps(_lanes, _back));
+        return _mm512_mul_ps(_mm512_add_ps(_mm512_maskz_loadu_ps(_lanes, _x0), _mm512_mul_ps(_a, sum)), _cRecip);
+    }
+
+    FLUID_TARGET_AVX512 void jacobiRow7AVX512(float *FLUID_RESTRICT _dst, const float *FLUID_RESTRICT _below,
+                                              const float *FLUID_RESTRICT _src, const float *FLUID_RESTRICT _above,
+                                              const float *FLUID_RESTRICT _back, const float *FLUID_RESTRICT _front,
+                                              const float *FLUID_RESTRICT _x0, size_t _count, float _a, float _cRecip)
+    {
+        const __m512 a = _mm512_set1_ps(_a);
+        const __m512 cRecip = _mm512_set1_ps(_cRecip);
+        for (size_t i = 0; i < _count; i += 16)
+        {
+            size_t remaining = _count - i;
+            __mmask16 lanes = remaining >= 16 ? static_cast<__mmask16>(0xffff)
+                                              : static_cast<__mmask16>((1u << remaining) - 1);
+            _mm512_mask_storeu_ps(_dst + i, lanes,
+                                  stencil7AVX512(_below + i, _src + i, _above + i, _back + i, _front + i, _x0 + i, a,
+                                                 cRecip, lanes));
+        }
+    }
+
+    FLUID_TARGET_AVX512 void redBlackRow7AVX512(float *_x, const float *_x0, size_t _stride, size_t _planeStride,
+                                                size_t _count, size_t _first, float _a, float _cRecip)
+    {
+        const __m512 a = _mm512_set1_ps(_a);
+        const __m512 cRecip = _mm512_set1_ps(_cRecip);
+        const __mmask16 colour = _first == 0 ? static_cast<__mmask16>(0x5555) : static_cast<__mmask16>(0xaaaa);
+        for (size_t i = 0; i < _count; i += 16)
+        {
+            size_t remaining = _count - i;
+            __mmask16 lanes = remaining >= 16 ? static_cast<__mmask16>(0xffff)
+                                              : static_cast<__mmask16>((1u << remaining) - 1);
+            _mm512_mask_storeu_ps(_x + i, lanes & colour,
+                                  stencil7AVX512(_x + i - _stride, _x + i, _x + i + _stride, _x + i - _planeStride,
+                                                 _x + i + _planeStride, _x0 + i, a, cRecip, lanes));
+        }
+    }
+#endif
+
+    const StencilKernels c_scalarKernels{jacobiRowScalar, redBlackRowScalar, jacobiRow7Scalar, redBlackRow7Scalar};
+#ifdef FLUID_X86_SIMD
+    const StencilKernels c_avx2Kernels{jacobiRowAVX2, redBlackRowAVX2, jacobiRow7AVX2, redBlackRow7AVX2};
+    const StencilKernels c_avx512Kernels{jacobiRowAVX512, redBlackRowAVX512, jacobiRow7AVX512, redBlackRow7AVX512};
+#endif
+}
+
+const StencilKernels &stencilKernels(SimdLevel _level)
+{
+#ifdef FLUID_X86_SIMD
+    SimdLevel supported = detectSimdLevel();
+    if (_level > supported)
+    {
+        _level = supported;
+    }
+    switch (_level)
+    {
+    case SimdLevel::AVX512:
+        return c_avx512Kernels;
+    case SimdLevel::AVX2:
+        return c_avx2Kernels;
+    default:
+        break;
+    }
+#else
+    (void)_level;
+#endif
+    return c_scalarKernels;
+}
@@ -0,0 +1,121 @@
+/**
+ * @file ThreadPool.cpp
+ * @brief A persistent pool of worker threads used to split the solver loops across cores.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(size_t _numThreads)
+{
+    if (_numThreads == 0)
+    {
+        _numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    m_workers.reserve(_numThreads - 1);
+    for (size_t i = 1; i < _numThreads; i++)
+    {
+        m_workers.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto &worker : m_workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::run(Job &_job)
+{
+    _job.m_remaining = _job.m_numChunks;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        _job.m_next = m_jobs;
+        m_jobs = &_job;
+    }
+    m_wake.notify_all();
+
+    work(_job);
+
+    // every chunk is claimed, wait for the workers still running one before the job goes out of scope
+    std::unique_lock<std::mutex> lock(m_mutex);
+    unlinkJob(_job);
+    m_done.wait(lock, [&_job]() { return _job.m_remaining == 0 && _job.m_active == 0; });
+}
+
+void ThreadPool::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        Job *job = nullptr;
+        m_wake.wait(lock, [this, &job]() {
+            job = findJob();
+            return m_stop || job != nullptr;
+        });
+        if (m_stop)
+        {
+            return;
+        }
+
+        job->m_active++;
+        lock.unlock();
+        work(*job);
+        lock.lock();
+        job->m_active--;
+        m_done.notify_all();
+    }
+}
+
+void ThreadPool::work(Job &_job)
+{
+    const size_t range = _job.m_end - _job.m_begin;
+    while (true)
+    {
+        size_t chunk = _job.m_nextChunk.fetch_add(1);
+        if (chunk >= _job.m_numChunks)
+        {
+            return;
+        }
+        // chunk boundaries only depend on the range and chunk count, never on which thread runs them
+        size_t begin = _job.m_begin + range * chunk / _job.m_numChunks;
+        size_t end = _job.m_begin + range * (chunk + 1) / _job.m_numChunks;
+        _job.m_invoke(_job.m_context, begin, end);
+        _job.m_remaining.fetch_sub(1);
+    }
+}
+
+ThreadPool::Job *ThreadPool::findJob()
+{
+    Job **link = &m_jobs;
+    while (*link != nullptr)
+    {
+        Job *job = *link;
+        if (job->m_nextChunk.load() < job->m_numChunks)
+        {
+            return job;
+        }
+        *link = job->m_next;
+    }
+    return nullptr;
+}
+
+void ThreadPool::unlinkJob(Job &_job)
+{
+    for (Job **link = &m_jobs; *link != nullptr; link = &(*link)->m_next)
+    {
+        if (*link == &_job)
+        {
+            *link = _job.m_next;
+            return;
+        }
+    }
+}
@@ -0,0 +1,331 @@
+/**
+ * @file Workspace.cpp
+ * @brief An arena holding the arrays a solver works in, laid out in one allocation with every array starting on a
+ * cache line.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include "Workspace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "ThreadPool.h"
+
+// the replacement operators below need aligned_alloc, which MSVC does not provide
+#if defined(FLUID_COUNT_ALLOCATIONS) && !defined(_MSC_VER)
+#define FLUID_HEAP_COUNTER 1
+#endif
+
+namespace
+{
+    std::atomic<size_t> s_blockAllocations{0};
+    /**
+     * @brief Gap left after each array. Fields of a power of two size would otherwise all start at the same offset
+     * in a page, and a kernel storing to one while loading from another stalls on the false 4K aliasing.
+     */
+    constexpr size_t c_arrayStagger = 3 * c_cacheLine;
+
+    size_t roundUp(size_t _value, size_t _multiple)
+    {
+        return (_value + _multiple - 1) / _multiple * _multiple;
+    }
+
+#ifdef FLUID_HEAP_COUNTER
+    std::atomic<size_t> s_heapAllocations{0};
+
+    void *countedAllocation(size_t _size, size_t _alignment)
+    {
+        s_heapAllocations.fetch_add(1, std::memory_order_relaxed);
+        _size = std::max<size_t>(_size, 1);
+        void *p = _alignment > alignof(std::max_align_t) ? std::aligned_alloc(_alignment, roundUp(_size, _alignment))
+                                                          : std::malloc(_size);
+        if (p == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+#endif
+}
+
+#ifdef FLUID_HEAP_COUNTER
+// Every form of new and delete is replaced, so none of them is left to a library or sanitizer runtime that would
+// pair its own allocator with these
+void *operator new(size_t _size)
+{
+    return countedAllocation(_size, 0);
+}
+
+void *operator new[](size_t _size)
+{
+    return countedAllocation(_size, 0);
+}
+
+void *operator new(size_t _size, std::align_val_t _alignment)
+{
+    return countedAllocation(_size, static_cast<size_t>(_alignment));
+}
+
+void *operator new[](size_t _size, std::align_val_t _alignment)
+{
+    return countedAllocation(_size, static_cast<size_t>(_alignment));
+}
+
+void *operator new(size_t _size, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return countedAllocation(_size, 0);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new[](size_t _size, const std::nothrow_t &) noexcept
+{
+    return operator new(_size, std::nothrow);
+}
+
+void *operator new(size_t _size, std::align_val_t _alignment, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return countedAllocation(_size, static_cast<size_t>(_alignment));
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new[](size_t _size, std::align_val_t _alignment, const std::nothrow_t &) noexcept
+{
+    return operator new(_size, _alignment, std::nothrow);
+}
+
+void operator delete(void *_p) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete[](void *_p) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete(void *_p, size_t) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete[](void *_p, size_t) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete(void *_p, std::align_val_t) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete[](void *_p, std::align_val_t) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete(void *_p, size_t, std::align_val_t) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete[](void *_p, size_t, std::align_val_t) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete(void *_p, const std::nothrow_t &) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete[](void *_p, const std::nothrow_t &) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete(void *_p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(_p);
+}
+
+void operator delete[](void *_p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(_p);
+}
+#endif
+
+Workspace::~Workspace()
+{
+    release();
+}
+
+Workspace::Workspace(Workspace &&_other) noexcept
+{
+    *this = std::move(_other);
+}
+
+Workspace &Workspace::operator=(Workspace &&_other) noexcept
+{
+    if (this != &_other)
+    {
+        release();
+        m_arrays = std::move(_other.m_arrays);
+        m_allocatedArrays = std::exchange(_other.m_allocatedArrays, 0);
+        m_layoutBytes = std::exchange(_other.m_layoutBytes, 0);
+        m_block = std::exchange(_other.m_block, nullptr);
+        m_bytes = std::exchange(_other.m_bytes, 0);
+        m_mapped = std::exchange(_other.m_mapped, false);
+        m_hugePages = std::exchange(_other.m_hugePages, false);
+        _other.m_arrays.clear();
+    }
+    return *this;
+}
+
+size_t Workspace::addBytes(size_t _bytes, size_t _rowBytes)
+{
+    m_arrays.push_back({m_layoutBytes, _bytes, _rowBytes});
+    m_layoutBytes += roundUp(_bytes, c_cacheLine) + c_arrayStagger;
+    return m_arrays.size() - 1;
+}
+
+void Workspace::allocate(ThreadPool *_pool)
+{
+    Workspace old;
+    std::swap(old.m_block, m_block);
+    std::swap(old.m_bytes, m_bytes);
+    std::swap(old.m_mapped, m_mapped);
+    m_hugePages = false;
+    if (m_layoutBytes == 0)
+    {
+        return;
+    }
+
+#ifdef __linux__
+    if (m_layoutBytes >= c_hugePageSize)
+    {
+        // map a huge page more than needed and trim it, so the block starts on a huge page boundary
+        const size_t bytes = roundUp(m_layoutBytes, c_hugePageSize);
+        void *mapping = mmap(nullptr, bytes + c_hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping != MAP_FAILED)
+        {
+            uint8_t *begin = static_cast<uint8_t *>(mapping);
+            uint8_t *start = reinterpret_cast<uint8_t *>(roundUp(reinterpret_cast<uintptr_t>(begin), c_hugePageSize));
+            if (start != begin)
+            {
+                munmap(begin, static_cast<size_t>(start - begin));
+            }
+            if (start + bytes != begin + bytes + c_hugePageSize)
+            {
+                munmap(start + bytes, static_cast<size_t>(begin + bytes + c_hugePageSize - (start + bytes)));
+            }
+            m_block = start;
+            m_bytes = bytes;
+            m_mapped = true;
+            m_hugePages = madvise(start, bytes, MADV_HUGEPAGE) == 0;
+        }
+    }
+#endif
+    if (m_block == nullptr)
+    {
+        m_block = static_cast<uint8_t *>(::operator new(m_layoutBytes, std::align_val_t{c_cacheLine}));
+        m_bytes = m_layoutBytes;
+    }
+    s_blockAllocations.fetch_add(1, std::memory_order_relaxed);
+
+    // the first write to each page decides where it lives, so the rows are copied or zeroed by the threads that
+    // will sweep them
+    for (size_t index = 0; index < m_arrays.size(); index++)
+    {
+        const Array &array = m_arrays[index];
+        const uint8_t *src = index < m_allocatedArrays ? old.m_block + array.offset : nullptr;
+        uint8_t *dst = m_block + array.offset;
+        auto fill = [&](size_t _begin, size_t _end) {
+            if (src != nullptr)
+            {
+                std::memcpy(dst + _begin, src + _begin, _end - _begin);
+            }
+            else
+            {
+                std::memset(dst + _begin, 0, _end - _begin);
+            }
+        };
+        const size_t rows = array.rowBytes > 0 ? array.bytes / array.rowBytes : 0;
+        if (_pool != nullptr && rows > 1)
+        {
+            _pool->parallelFor(0, rows, [&](size_t _first, size_t _last) {
+                fill(_first * array.rowBytes, _last == rows ? array.bytes : _last * array.rowBytes);
+            });
+        }
+        else
+        {
+            fill(0, array.bytes);
+        }
+    }
+    m_allocatedArrays = m_arrays.size();
+}
+
+void Workspace::release()
+{
+    if (m_block == nullptr)
+    {
+        return;
+    }
+#ifdef __linux__
+    if (m_mapped)
+    {
+        munmap(m_block, m_bytes);
+    }
+    else
+#endif
+    {
+        ::operator delete(m_block, std::align_val_t{c_cacheLine});
+    }
+    m_block = nullptr;
+    m_bytes = 0;
+    m_mapped = false;
+}
+
+size_t Workspace::blockAllocations()
+{
+    return s_blockAllocations.load(std::memory_order_relaxed);
+}
+
+size_t Workspace::heapAllocations()
+{
+#ifdef FLUID_HEAP_COUNTER
+    return s_heapAllocations.load(std::memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
+
+bool Workspace::countsHeapAllocations()
+{
+#ifdef FLUID_HEAP_COUNTER
+    return true;
+#else
+    return false;
+#endif
+}
@@ -4,12 +4,63 @@ basic OpenGL demo modified from http://qt-project.org/doc/qt-5.0/qtgui/openglwin
 #include "NGLScene.h"
 #include <QCommandLineParser>
 #include <QtGui/QGuiApplication>
+#include <algorithm>
 #include <iostream>
 
 int main(int argc, char **argv)
 {
   QGuiApplication app(argc, argv);
 
+  // the grid resolution can be set from the command line, e.g. --width 512 --height 512
+  QCommandLineParser parser;
+  parser.setApplicationDescription("2D Grid-Based Fluid Simulation");
+  parser.addHelpOption();
+  QCommandLineOption widthOption("width", "Number of fluid cells along X.", "cells", "100");
+  QCommandLineOption heightOption("height", "Number of fluid cells along Y.", "cells", "100");
+  QCommandLineOption threadsOption("threads", "Number of solver threads, 0 uses every core.", "count", "1");
+  parser.addOption(widthOption);
+  parser.addOption(heightOption);
+  QCommandLineOption particlesOption("particles", "Number of tracer particles, 0 places one on every cell.", "count", "0");
+  QCommandLineOption pressureOption("pressure", "Pressure solver: relaxation, multigrid or cg.", "solver", "relaxation");
+  QCommandLineOption toleranceOption("tolerance", "Relative residual the multigrid and cg solvers stop at.", "value", "0.0001");
+  QCommandLineOption preconditionerOption("preconditioner", "Preconditioner for cg: mic0 or jacobi.", "name", "mic0");
+  QCommandLineOption backendOption("backend", "Solve on the cpu, or the gpu with compute shaders.", "name", "cpu");
+  QCommandLineOption rateOption("rate", "Simulation steps per second, 0 steps as fast as possible.", "steps", "50");
+  parser.addOption(threadsOption);
+  parser.addOption(particlesOption);
+  parser.addOption(pressureOption);
+  parser.addOption(toleranceOption);
+  parser.addOption(preconditionerOption);
+  parser.addOption(rateOption);
+  parser.addOption(backendOption);
+  parser.process(app);
+
+  size_t gridWidth = std::max(parser.value(widthOption).toULongLong(), 3ULL);
+  size_t gridHeight = std::max(parser.value(heightOption).toULongLong(), 3ULL);
+  size_t numThreads = parser.value(threadsOption).toULongLong();
+  size_t numParticles = parser.value(particlesOption).toULongLong();
+  double stepsPerSecond = std::max(parser.value(rateOption).toDouble(), 0.0);
+
+  PressureSolver::Settings pressureSolver;
+  QString pressureName = parser.value(pressureOption);
+  if (pressureName == "multigrid")
+  {
+    pressureSolver.type = PressureSolver::Type::Multigrid;
+  }
+  else if (pressureName == "cg")
+  {
+    pressureSolver.type = PressureSolver::Type::ConjugateGradient;
+  }
+  else if (pressureName != "relaxation")
+  {
+    std::cerr << "Unknown pressure solver " << pressureName.toStdString() << ", using relaxation\n";
+  }
+  pressureSolver.tolerance = parser.value(toleranceOption).toFloat();
+  if (parser.value(preconditionerOption) == "jacobi")
+  {
+    pressureSolver.preconditioner = PressureSolver::Preconditioner::Jacobi;
+  }
+
   // create an OpenGL format specifier
   QSurfaceFormat format;
   // set the number of samples for multisampling
@@ -29,7 +80,9 @@ int main(int argc, char **argv)
   format.setProfile(QSurfaceFormat::CoreProfile);
   // now set the depth buffer to 24 bits
   format.setDepthBufferSize(24);
-  NGLScene window;
+  // the compute solver needs the GL 4.3 context asked for below
+  const bool gpu = parser.value(backendOption) == "gpu";
+  NGLScene window(gridWidth, gridHeight, numThreads, numParticles, pressureSolver, stepsPerSecond, gpu);
   // and set the OpenGL format
   window.setFormat(format);
   // we can now query the version to see if it worked
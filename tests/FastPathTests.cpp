@@ -0,0 +1,340 @@
+/**
+ * @file FastPathTests.cpp
+ * @brief Every fast path of the solver against its reference: the SIMD kernels against the scalar ones, threaded
+ * stages against one thread, tiled sweeps against whole-grid sweeps and the fused stages against the separate ones.
+ * Each of these is documented to give identical results, so the fields must match bit for bit.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "CpuFeatures.h"
+#include "FieldComparison.h"
+#include "Fluid.h"
+#include "Fluid3D.h"
+#include "FluidGrid.h"
+#include "ParticleKernels.h"
+#include "ThreadPool.h"
+
+namespace
+{
+    constexpr size_t c_poolThreads = 3;
+    constexpr float c_dt = 0.02f;
+
+    /**
+     * @brief A repeatable value in [-1, 1) for each index, so fields have detail in every cell
+     */
+    float noise(size_t _index, uint32_t _seed)
+    {
+        uint32_t h = static_cast<uint32_t>(_index) * 0x9e3779b9u ^ _seed;
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        return static_cast<float>(h & 0xffffffu) / static_cast<float>(0x800000u) - 1.0f;
+    }
+
+    /**
+     * @brief A smooth swirl with some noise on top, scaled to move a few cells a step
+     */
+    std::vector<float> makeField(size_t _width, size_t _height, uint32_t _seed)
+    {
+        std::vector<float> field(_width * _height);
+        for (size_t j = 0; j < _height; j++)
+        {
+            for (size_t i = 0; i < _width; i++)
+            {
+                const size_t c = i + j * _width;
+                const float swirl = std::sin(6.2831853f * static_cast<float>(_seed % 2 == 0 ? j : i) / _height);
+                field[c] = 0.5f * swirl + 0.1f * noise(c, _seed);
+            }
+        }
+        return field;
+    }
+
+    std::vector<SimdLevel> supportedLevels()
+    {
+        std::vector<SimdLevel> levels;
+        for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::AVX2, SimdLevel::AVX512})
+        {
+            if (level <= detectSimdLevel())
+            {
+                levels.push_back(level);
+            }
+        }
+        return levels;
+    }
+
+    /**
+     * @brief The grid widths tested, one taking the generic kernels and one the kernels specialised for its width
+     */
+    class FluidFastPaths : public ::testing::TestWithParam<size_t>
+    {
+    protected:
+        size_t width() const { return GetParam(); }
+        size_t height() const { return 50; }
+        size_t numCells() const { return width() * height(); }
+        std::vector<float> field(uint32_t _seed) const { return makeField(width(), height(), _seed); }
+    };
+}
+
+TEST_P(FluidFastPaths, LinearSolveSimdMatchesScalar)
+{
+    const std::vector<float> x0 = field(1);
+    for (Fluid::SolveMode mode : {Fluid::SolveMode::RedBlack, Fluid::SolveMode::Jacobi})
+    {
+        Fluid reference(width(), height());
+        reference.setSimdLevel(SimdLevel::Scalar);
+        std::vector<float> expected = field(2);
+        reference.linear_solve(Fluid::Boundary::X, expected.data(), x0.data(), 0.7f, 1.0f + 4.0f * 0.7f, mode);
+
+        for (SimdLevel level : supportedLevels())
+        {
+            Fluid fluid(width(), height());
+            fluid.setSimdLevel(level);
+            std::vector<float> actual = field(2);
+            fluid.linear_solve(Fluid::Boundary::X, actual.data(), x0.data(), 0.7f, 1.0f + 4.0f * 0.7f, mode);
+            EXPECT_TRUE(fieldsMatch(simdLevelName(level), expected.data(), actual.data(), numCells()));
+        }
+    }
+}
+
+TEST_P(FluidFastPaths, ThreadedMatchesSerial)
+{
+    ThreadPool pool(c_poolThreads);
+    Fluid serial(width(), height());
+    Fluid threaded(width(), height());
+    threaded.setThreadPool(&pool);
+    serial.setSolveMode(Fluid::SolveMode::RedBlack);
+    threaded.setSolveMode(Fluid::SolveMode::RedBlack);
+    const std::vector<float> vx = field(3);
+    const std::vector<float> vy = field(4);
+
+    for (Fluid::SolveMode mode : {Fluid::SolveMode::RedBlack, Fluid::SolveMode::Jacobi})
+    {
+        std::vector<float> expected = field(5);
+        std::vector<float> actual = expected;
+        serial.linear_solve(Fluid::Boundary::Y, expected.data(), vx.data(), 0.3f, 2.2f, mode);
+        threaded.linear_solve(Fluid::Boundary::Y, actual.data(), vx.data(), 0.3f, 2.2f, mode);
+        EXPECT_TRUE(fieldsMatch("linear_solve", expected.data(), actual.data(), numCells()));
+    }
+
+    for (Fluid::AdvectionScheme scheme : {Fluid::AdvectionScheme::SemiLagrangian, Fluid::AdvectionScheme::MacCormack,
+                                          Fluid::AdvectionScheme::BFECC})
+    {
+        serial.setAdvectionScheme(scheme);
+        threaded.setAdvectionScheme(scheme);
+        const std::vector<float> d0 = field(6);
+        std::vector<float> expected(numCells());
+        std::vector<float> actual(numCells());
+        serial.advect(Fluid::Boundary::None, expected.data(), d0.data(), vx.data(), vy.data(), c_dt);
+        threaded.advect(Fluid::Boundary::None, actual.data(), d0.data(), vx.data(), vy.data(), c_dt);
+        EXPECT_TRUE(fieldsMatch("advect", expected.data(), actual.data(), numCells()));
+    }
+
+    std::vector<float> expectedX = vx;
+    std::vector<float> expectedY = vy;
+    std::vector<float> actualX = vx;
+    std::vector<float> actualY = vy;
+    std::vector<float> p(numCells());
+    std::vector<float> div(numCells());
+    serial.project(expectedX.data(), expectedY.data(), p.data(), div.data());
+    threaded.project(actualX.data(), actualY.data(), p.data(), div.data());
+    EXPECT_TRUE(fieldsMatch("project X", expectedX.data(), actualX.data(), numCells()));
+    EXPECT_TRUE(fieldsMatch("project Y", expectedY.data(), actualY.data(), numCells()));
+}
+
+TEST_P(FluidFastPaths, TiledSweepsMatchWholeGrid)
+{
+    ThreadPool pool(c_poolThreads);
+    const std::vector<float> x0 = field(7);
+    for (ThreadPool *threads : {static_cast<ThreadPool *>(nullptr), &pool})
+    {
+        for (Fluid::SolveMode mode : {Fluid::SolveMode::GaussSeidel, Fluid::SolveMode::RedBlack, Fluid::SolveMode::Jacobi})
+        {
+            Fluid whole(width(), height(), 6);
+            Fluid tiled(width(), height(), 6);
+            whole.setThreadPool(threads);
+            tiled.setThreadPool(threads);
+            tiled.setSweepsPerTile(4);
+            std::vector<float> expected = field(8);
+            std::vector<float> actual = expected;
+            whole.linear_solve(Fluid::Boundary::X, expected.data(), x0.data(), 0.5f, 3.0f, mode);
+            tiled.linear_solve(Fluid::Boundary::X, actual.data(), x0.data(), 0.5f, 3.0f, mode);
+            EXPECT_TRUE(fieldsMatch("linear_solve", expected.data(), actual.data(), numCells()))
+                << "mode " << static_cast<int>(mode) << (threads ? " threaded" : " serial");
+        }
+    }
+}
+
+TEST_P(FluidFastPaths, TiledSweepsMatchWholeGridInBands)
+{
+    // A band needs 4 times its halo in interior rows, 8 rows a red-black halo for 4 sweeps a tile, so the grid above
+    // is swept as one band. 256 interior rows give every mode one band per thread, with the halo rows each red-black
+    // band sweeps again in its own copy.
+    const size_t height = 258;
+    const size_t cells = width() * height;
+    const std::vector<float> x0 = makeField(width(), height, 9);
+    for (size_t threads : {2, 3})
+    {
+        ThreadPool pool(threads);
+        for (int sweepsPerTile : {2, 4})
+        {
+            for (Fluid::SolveMode mode : {Fluid::SolveMode::RedBlack, Fluid::SolveMode::Jacobi})
+            {
+                Fluid whole(width(), height, 6);
+                Fluid tiled(width(), height, 6);
+                whole.setThreadPool(&pool);
+                tiled.setThreadPool(&pool);
+                tiled.setSweepsPerTile(sweepsPerTile);
+                std::vector<float> expected = makeField(width(), height, 10);
+                std::vector<float> actual = expected;
+                whole.linear_solve(Fluid::Boundary::Y, expected.data(), x0.data(), 0.5f, 3.0f, mode);
+                tiled.linear_solve(Fluid::Boundary::Y, actual.data(), x0.data(), 0.5f, 3.0f, mode);
+                EXPECT_TRUE(fieldsMatch("linear_solve", expected.data(), actual.data(), cells))
+                    << "mode " << static_cast<int>(mode) << ", " << threads << " threads, " << sweepsPerTile
+                    << " sweeps a tile";
+            }
+        }
+    }
+}
+
+TEST_P(FluidFastPaths, FusedMatchesSeparate)
+{
+    Fluid fluid(width(), height());
+    fluid.setSolveMode(Fluid::SolveMode::RedBlack);
+    const std::vector<float> vx0 = field(9);
+    const std::vector<float> vy0 = field(10);
+
+    // advect both components and project, as FluidGrid::stepSeparate does after its diffusion
+    std::vector<float> expectedX(numCells());
+    std::vector<float> expectedY(numCells());
+    std::vector<float> expectedP(numCells());
+    std::vector<float> expectedDiv(numCells());
+    fluid.advect(Fluid::Boundary::X, expectedX.data(), vx0.data(), vx0.data(), vy0.data(), c_dt);
+    fluid.advect(Fluid::Boundary::Y, expectedY.data(), vy0.data(), vx0.data(), vy0.data(), c_dt);
+    fluid.project(expectedX.data(), expectedY.data(), expectedP.data(), expectedDiv.data());
+
+    // and the same with the fused stages, as FluidGrid::stepFused does
+    std::vector<float> actualX(numCells());
+    std::vector<float> actualY(numCells());
+    std::vector<float> actualP(numCells());
+    std::vector<float> actualDiv(numCells());
+    fluid.advectVelocity(actualX.data(), actualY.data(), vx0.data(), vy0.data(), c_dt, actualP.data(), actualDiv.data());
+    fluid.solvePressure(actualP.data(), actualDiv.data());
+    fluid.subtractGradient(actualX.data(), actualY.data(), actualP.data());
+
+    EXPECT_TRUE(fieldsMatch("velocity X", expectedX.data(), actualX.data(), numCells()));
+    EXPECT_TRUE(fieldsMatch("velocity Y", expectedY.data(), actualY.data(), numCells()));
+    EXPECT_TRUE(fieldsMatch("divergence", expectedDiv.data(), actualDiv.data(), numCells()));
+    EXPECT_TRUE(fieldsMatch("pressure", expectedP.data(), actualP.data(), numCells()));
+}
+
+INSTANTIATE_TEST_SUITE_P(Widths, FluidFastPaths, ::testing::Values(size_t{66}, size_t{128}));
+
+TEST(FastPaths, ParticleKernelsMatchScalar)
+{
+    constexpr size_t c_width = 40;
+    constexpr size_t c_height = 30;
+    // not a multiple of any vector width, so the remainder loops run too
+    constexpr size_t c_count = 1001;
+    const std::vector<float> vx = makeField(c_width, c_height, 11);
+    const std::vector<float> vy = makeField(c_width, c_height, 12);
+
+    auto run = [&](SimdLevel _level, std::vector<float> *_out, std::vector<float> *_mirror) {
+        // x, y, dirX then dirY, with the positions spread over the wrap range
+        _out->assign(4 * c_count, 0.0f);
+        _mirror->assign(4 * c_count, 0.0f);
+        for (size_t n = 0; n < c_count; n++)
+        {
+            (*_out)[n] = (0.5f + 0.5f * noise(n, 13)) * (c_width - 1);
+            (*_out)[c_count + n] = (0.5f + 0.5f * noise(n, 14)) * (c_height - 1);
+        }
+        float *out = _out->data();
+        float *mirror = _mirror->data();
+        const ParticleArrays particles{out, out + c_count, out + 2 * c_count, out + 3 * c_count};
+        const ParticleArrays mirrored{mirror, mirror + c_count, mirror + 2 * c_count, mirror + 3 * c_count};
+        for (int step = 0; step < 5; step++)
+        {
+            particleKernels(_level).advect(particles, &mirrored, c_count, vx.data(), vy.data(), c_width, c_height);
+        }
+    };
+
+    std::vector<float> expected;
+    std::vector<float> expectedMirror;
+    run(SimdLevel::Scalar, &expected, &expectedMirror);
+    EXPECT_TRUE(fieldsMatch("mirror", expected.data(), expectedMirror.data(), expected.size()));
+    for (SimdLevel level : supportedLevels())
+    {
+        std::vector<float> actual;
+        std::vector<float> mirror;
+        run(level, &actual, &mirror);
+        EXPECT_TRUE(fieldsMatch(simdLevelName(level), expected.data(), actual.data(), expected.size()));
+        EXPECT_TRUE(fieldsMatch(simdLevelName(level), expected.data(), mirror.data(), expected.size()));
+    }
+}
+
+TEST(FastPaths, LinearSolve3DSimdMatchesScalar)
+{
+    constexpr size_t c_size = 21;
+    constexpr size_t c_cells = c_size * c_size * c_size;
+    std::vector<float> x0(c_cells);
+    for (size_t c = 0; c < c_cells; c++)
+    {
+        x0[c] = noise(c, 15);
+    }
+    for (Fluid::SolveMode mode : {Fluid::SolveMode::RedBlack, Fluid::SolveMode::Jacobi})
+    {
+        Fluid3D reference(c_size, c_size, c_size);
+        reference.setSimdLevel(SimdLevel::Scalar);
+        std::vector<float> expected(c_cells, 0.0f);
+        reference.linear_solve(Fluid3D::Boundary::Z, &expected, &x0, 0.4f, 1.0f + 6.0f * 0.4f, mode);
+        for (SimdLevel level : supportedLevels())
+        {
+            Fluid3D fluid(c_size, c_size, c_size);
+            fluid.setSimdLevel(level);
+            std::vector<float> actual(c_cells, 0.0f);
+            fluid.linear_solve(Fluid3D::Boundary::Z, &actual, &x0, 0.4f, 1.0f + 6.0f * 0.4f, mode);
+            EXPECT_TRUE(fieldsMatch(simdLevelName(level), expected.data(), actual.data(), c_cells));
+        }
+    }
+}
+
+TEST(FastPaths, GridStepsMatchAcrossThreadsAndFusing)
+{
+    constexpr size_t c_size = 64;
+    constexpr int c_steps = 8;
+    auto run = [&](size_t _threads, bool _fused) {
+        auto grid = std::make_unique<FluidGrid>(c_size, c_size, 0.0001f, c_dt, c_size * c_size);
+        grid->setSolveMode(Fluid::SolveMode::RedBlack);
+        grid->setThreadCount(_threads);
+        grid->setFused(_fused);
+        for (int step = 0; step < c_steps; step++)
+        {
+            grid->addVelocity(20.0f + step, 30.0f, 1.0f, 0.5f);
+            grid->step();
+        }
+        return grid;
+    };
+
+    const auto reference = run(1, false);
+    const size_t cells = reference->numCells();
+    const size_t particles = reference->getNumParticles();
+    for (size_t threads : {size_t{1}, c_poolThreads})
+    {
+        for (bool fused : {false, true})
+        {
+            const auto grid = run(threads, fused);
+            SCOPED_TRACE(::testing::Message() << threads << " threads" << (fused ? " fused" : " separate"));
+            EXPECT_TRUE(fieldsMatch("velocity X", reference->getVelocityX(), grid->getVelocityX(), cells));
+            EXPECT_TRUE(fieldsMatch("velocity Y", reference->getVelocityY(), grid->getVelocityY(), cells));
+            EXPECT_TRUE(fieldsMatch("particle X", reference->getParticles().x(), grid->getParticles().x(), particles));
+            EXPECT_TRUE(fieldsMatch("particle Y", reference->getParticles().y(), grid->getParticles().y(), particles));
+        }
+    }
+}
@@ -0,0 +1,95 @@
+/**
+ * @file FieldComparison.h
+ * @brief GoogleTest assertions comparing solver fields cell by cell, exactly or within a tolerance
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#ifndef FIELD_COMPARISON_H_
+#define FIELD_COMPARISON_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+
+#include <gtest/gtest.h>
+
+/**
+ * @brief How far a field may be from its reference. A cell passes when it is within ulps representable floats of the
+ * reference, or within relative times the largest magnitude of the reference field, which covers cells close to zero
+ * where a few ULPs are a tiny absolute difference.
+ */
+struct FieldTolerance
+{
+    uint32_t ulps = 0;
+    float relative = 0.0f;
+};
+
+/**
+ * @brief The number of representable floats between two values, 0 when they are bit-identical or both zero
+ */
+inline uint32_t ulpDistance(float _a, float _b)
+{
+    if (_a == _b)
+    {
+        return 0;
+    }
+    if (std::isnan(_a) || std::isnan(_b))
+    {
+        return UINT32_MAX;
+    }
+    // map the sign-magnitude bits onto one ordered range, so adjacent floats are adjacent integers across zero
+    auto ordered = [](float _x) {
+        int32_t bits;
+        std::memcpy(&bits, &_x, sizeof(bits));
+        return bits < 0 ? static_cast<int64_t>(INT32_MIN) - bits : static_cast<int64_t>(bits);
+    };
+    const int64_t distance = ordered(_a) - ordered(_b);
+    return static_cast<uint32_t>(std::min<int64_t>(distance < 0 ? -distance : distance, UINT32_MAX));
+}
+
+/**
+ * @brief Check every cell of _actual against _expected, reporting the worst cell on failure.
+ * Use with EXPECT_TRUE or ASSERT_TRUE, a default tolerance asks for bit-identical fields.
+ */
+inline ::testing::AssertionResult fieldsMatch(const char *_name, const float *_expected, const float *_actual,
+                                              size_t _count, const FieldTolerance &_tolerance = {})
+{
+    float scale = 0.0f;
+    for (size_t c = 0; c < _count; c++)
+    {
+        scale = std::max(scale, std::fabs(_expected[c]));
+    }
+    const float allowed = _tolerance.relative * scale;
+
+    size_t failures = 0;
+    size_t worst = 0;
+    uint32_t worstUlps = 0;
+    for (size_t c = 0; c < _count; c++)
+    {
+        const uint32_t ulps = ulpDistance(_expected[c], _actual[c]);
+        if (ulps <= _tolerance.ulps || std::fabs(_expected[c] - _actual[c]) <= allowed)
+        {
+            continue;
+        }
+        if (failures++ == 0 || ulps > worstUlps)
+        {
+            worst = c;
+            worstUlps = ulps;
+        }
+    }
+    if (failures == 0)
+    {
+        return ::testing::AssertionSuccess();
+    }
+    std::ostringstream message;
+    message << _name << ": " << failures << " of " << _count << " cells differ, the worst is cell " << worst
+            << " expected " << _expected[worst] << " got " << _actual[worst] << " (" << worstUlps << " ULPs, "
+            << std::fabs(_expected[worst] - _actual[worst]) / std::max(scale, 1e-30f) << " of the largest value)";
+    return ::testing::AssertionFailure() << message.str();
+}
+
+#endif // !FIELD_COMPARISON_H_
@@ -0,0 +1,169 @@
+/**
+ * @file GoldenTests.cpp
+ * @brief Runs fixed FluidGrid scenarios and compares their fields every few steps with snapshots stored in
+ * tests/golden, so optimising the solver cannot quietly change what it computes.
+ * The snapshots are field streams, see FieldStream.h. Run the tests with FLUID_UPDATE_GOLDEN=1 in the environment to
+ * write them again after a change that is meant to alter the results, and say why in the commit.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "FieldComparison.h"
+#include "FieldStream.h"
+#include "FluidGrid.h"
+
+namespace
+{
+    constexpr size_t c_size = 66;
+    constexpr int c_steps = 30;
+    constexpr int c_snapshotInterval = 15;
+    constexpr float c_viscosity = 0.0001f;
+    constexpr float c_dt = 0.02f;
+    // the snapshots are written by one compiler and CPU and read on others, where libm and the kernels the CPU
+    // supports may round a little differently, and thirty steps grow that
+    constexpr FieldTolerance c_goldenTolerance{64, 1e-5f};
+
+    const std::vector<std::string> c_fields = {"velocityX", "velocityY", "particleX", "particleY", "dye"};
+
+    std::string goldenPath(const std::string &_name)
+    {
+        return std::string(FLUID_GOLDEN_DIR) + "/" + _name + ".fields";
+    }
+
+    /**
+     * @brief Run a scenario, set up by _configure, and keep its fields every c_snapshotInterval steps. Every
+     * scenario is stirred and dyed the same way, with one particle a cell so the particles fit a field.
+     */
+    std::vector<FieldFrame> run(const std::function<void(FluidGrid &, size_t)> &_configure)
+    {
+        FluidGrid grid(c_size, c_size, c_viscosity, c_dt, c_size * c_size);
+        const size_t dye = grid.addScalar("dye", 0.0001f);
+        _configure(grid, dye);
+
+        std::vector<FieldFrame> frames;
+        for (int step = 0; step < c_steps; step++)
+        {
+            grid.addVelocity(20.0f, 33.0f, 3.0f, 1.0f);
+            grid.addVelocity(45.0f, 30.0f, -2.0f, 2.5f);
+            const Impulse impulse{33.0f, 15.0f, 0.5f, 4.0f, 2.0f};
+            grid.addImpulses(&impulse, 1);
+            grid.addScalarSource(dye, 33.0f, 16.0f, 1.0f);
+            grid.step();
+            if ((step + 1) % c_snapshotInterval == 0)
+            {
+                const size_t cells = grid.numCells();
+                FieldFrame frame;
+                frame.step = static_cast<uint64_t>(step + 1);
+                for (const float *field : {grid.getVelocityX(), grid.getVelocityY(), grid.getParticles().x(),
+                                           grid.getParticles().y(), grid.getScalars().current(dye)})
+                {
+                    frame.fields.emplace_back(field, field + cells);
+                }
+                frames.push_back(std::move(frame));
+            }
+        }
+        return frames;
+    }
+
+    void writeGolden(const std::string &_path, const std::vector<FieldFrame> &_frames)
+    {
+        FieldWriter writer;
+        FieldWriter::Settings settings;
+        settings.path = _path;
+        settings.compression = FieldWriter::Compression::Shuffle;
+        settings.fields = c_fields;
+        std::string error;
+        ASSERT_TRUE(writer.open(c_size, c_size, settings, &error)) << error;
+        for (const FieldFrame &frame : _frames)
+        {
+            const std::vector<std::vector<float>> &f = frame.fields;
+            writer.write(frame.step, {f[0].data(), f[1].data(), f[2].data(), f[3].data(), f[4].data()});
+        }
+        ASSERT_TRUE(writer.close(&error)) << error;
+    }
+
+    /**
+     * @brief Compare a scenario with its snapshot, or write the snapshot when asked to
+     */
+    void checkGolden(const std::string &_name, const std::function<void(FluidGrid &, size_t)> &_configure)
+    {
+        const std::vector<FieldFrame> frames = run(_configure);
+        const std::string path = goldenPath(_name);
+        if (std::getenv("FLUID_UPDATE_GOLDEN") != nullptr)
+        {
+            writeGolden(path, frames);
+            GTEST_SKIP() << "wrote " << path;
+        }
+
+        FieldStreamReader reader;
+        std::string error;
+        ASSERT_TRUE(reader.open(path, &error)) << error << ", run with FLUID_UPDATE_GOLDEN=1 to create it";
+        ASSERT_EQ(reader.width(), c_size);
+        ASSERT_EQ(reader.height(), c_size);
+        ASSERT_EQ(reader.fields(), c_fields);
+
+        FieldFrame golden;
+        for (const FieldFrame &frame : frames)
+        {
+            ASSERT_TRUE(reader.next(&golden, &error)) << "missing step " << frame.step << " " << error;
+            ASSERT_EQ(golden.step, frame.step);
+            for (size_t f = 0; f < c_fields.size(); f++)
+            {
+                const std::string name = c_fields[f] + " at step " + std::to_string(frame.step);
+                EXPECT_TRUE(fieldsMatch(name.c_str(), golden.fields[f].data(), frame.fields[f].data(),
+                                        frame.fields[f].size(), c_goldenTolerance));
+            }
+        }
+        EXPECT_FALSE(reader.next(&golden, &error)) << "the snapshot has more steps than the scenario";
+    }
+}
+
+TEST(Golden, PaperDefaults)
+{
+    checkGolden("paper", [](FluidGrid &, size_t) {});
+}
+
+TEST(Golden, RedBlackMacCormackMultigrid)
+{
+    checkGolden("redblack_maccormack_multigrid", [](FluidGrid &_grid, size_t) {
+        _grid.setSolveMode(Fluid::SolveMode::RedBlack);
+        _grid.setAdvectionScheme(Fluid::AdvectionScheme::MacCormack);
+        PressureSolver::Settings pressure;
+        pressure.type = PressureSolver::Type::Multigrid;
+        _grid.setPressureSolver(pressure);
+        _grid.setThreadCount(2);
+    });
+}
+
+TEST(Golden, FusedConjugateGradientBuoyancy)
+{
+    checkGolden("fused_cg_buoyancy", [](FluidGrid &_grid, size_t _dye) {
+        _grid.setSolveMode(Fluid::SolveMode::Jacobi);
+        _grid.setFused(true);
+        PressureSolver::Settings pressure;
+        pressure.type = PressureSolver::Type::ConjugateGradient;
+        _grid.setPressureSolver(pressure);
+        FluidGrid::Buoyancy buoyancy;
+        buoyancy.temperature = _dye;
+        buoyancy.lift = 0.5f;
+        _grid.setBuoyancy(buoyancy);
+    });
+}
+
+TEST(Golden, AdaptiveSubSteps)
+{
+    checkGolden("substeps_bfecc", [](FluidGrid &_grid, size_t) {
+        _grid.setAdvectionScheme(Fluid::AdvectionScheme::BFECC);
+        FluidGrid::TimeStepping stepping;
+        stepping.mode = FluidGrid::TimeStepping::Mode::SubSteps;
+        stepping.cfl = 1.0f;
+        _grid.setTimeStepping(stepping);
+    });
+}
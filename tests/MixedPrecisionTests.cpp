@@ -0,0 +1,318 @@
+/**
+ * @file MixedPrecisionTests.cpp
+ * @brief The 16 bit storage formats and MixedPrecisionFluid: every conversion kernel against the scalar conversions,
+ * float storage against FluidGrid, threads against one thread, and how far the 16 bit formats drift from float, for
+ * the velocity and for a scalar channel.
+ *
+ * @copyright Copyright (c) 2021
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "CpuFeatures.h"
+#include "FieldComparison.h"
+#include "Fluid.h"
+#include "HalfPrecision.h"
+#include "MixedPrecisionFluid.h"
+#include "ThreadPool.h"
+
+namespace
+{
+    constexpr size_t c_width = 130;
+    constexpr size_t c_height = 66;
+    constexpr float c_viscosity = 0.0001f;
+    constexpr float c_dt = 0.02f;
+    constexpr int c_steps = 20;
+
+    std::vector<SimdLevel> supportedLevels()
+    {
+        std::vector<SimdLevel> levels;
+        for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::AVX2, SimdLevel::AVX512})
+        {
+            if (level <= detectSimdLevel())
+            {
+                levels.push_back(level);
+            }
+        }
+        return levels;
+    }
+
+    float fromBits(uint32_t _bits)
+    {
+        float value;
+        std::memcpy(&value, &_bits, sizeof(value));
+        return value;
+    }
+
+    /**
+     * @brief Floats spread over every exponent, with the values on and either side of the half and bfloat16 rounding
+     * ties, the subnormal and overflow edges, infinities and NaNs
+     */
+    std::vector<float> conversionInputs()
+    {
+        std::vector<float> values;
+        for (uint64_t bits = 0; bits <= UINT32_MAX; bits += 65521)
+        {
+            values.push_back(fromBits(static_cast<uint32_t>(bits)));
+        }
+        for (uint32_t base : {0x33000000u, 0x387fe000u, 0x38800000u, 0x3f801000u, 0x3f802000u, 0x3f808000u,
+                              0x3f818000u, 0x477fe000u, 0x477ff000u, 0x7f7f8000u, 0x7f800000u, 0x7f800001u})
+        {
+            for (uint32_t sign : {0u, 0x80000000u})
+            {
+                values.push_back(fromBits((base - 1) | sign));
+                values.push_back(fromBits(base | sign));
+                values.push_back(fromBits((base + 1) | sign));
+            }
+        }
+        return values;
+    }
+
+    /**
+     * @brief A smooth swirl with a little detail on top, small enough to move under a cell a step
+     */
+    std::vector<float> makeField(size_t _width, size_t _height, int _seed)
+    {
+        std::vector<float> field(_width * _height);
+        for (size_t j = 0; j < _height; j++)
+        {
+            for (size_t i = 0; i < _width; i++)
+            {
+                const float x = 6.2831853f * static_cast<float>(i) / _width;
+                const float y = 6.2831853f * static_cast<float>(j) / _height;
+                field[i + j * _width] = 0.2f * std::sin(_seed * x + y) + 0.02f * std::cos(7.0f * x * _seed - 5.0f * y);
+            }
+        }
+        return field;
+    }
+
+    /**
+     * @brief Start a fluid from a smooth swirl and step it, without stirring it further as sources every step make
+     * the flow chaotic, which would grow any rounding difference whatever the storage
+     */
+    template <typename Storage>
+    void runMixed(MixedPrecisionFluid<Storage> &_fluid, std::vector<float> *_velocX, std::vector<float> *_velocY)
+    {
+        const std::vector<float> velocX = makeField(c_width, c_height, 1);
+        const std::vector<float> velocY = makeField(c_width, c_height, 2);
+        for (size_t j = 1; j < c_height - 1; j++)
+        {
+            for (size_t i = 1; i < c_width - 1; i++)
+            {
+                const size_t c = i + j * c_width;
+                _fluid.addVelocity(static_cast<float>(i), static_cast<float>(j), velocX[c], velocY[c]);
+            }
+        }
+        for (int step = 0; step < c_steps; step++)
+        {
+            _fluid.step();
+        }
+        _velocX->resize(_fluid.numCells());
+        _velocY->resize(_fluid.numCells());
+        _fluid.readVelocity(_velocX->data(), _velocY->data());
+    }
+
+    /**
+     * @brief runMixed with a diffusing channel of dye added in a band across the middle first, returning the dye
+     */
+    template <typename Storage>
+    std::vector<float> runDye(MixedPrecisionFluid<Storage> &_fluid)
+    {
+        const size_t dye = _fluid.addScalar(0.0005f);
+        for (size_t j = c_height / 3; j < 2 * c_height / 3; j++)
+        {
+            for (size_t i = 1; i < c_width - 1; i++)
+            {
+                _fluid.addScalarSource(dye, static_cast<float>(i), static_cast<float>(j), 1.0f);
+            }
+        }
+        std::vector<float> velocX;
+        std::vector<float> velocY;
+        runMixed(_fluid, &velocX, &velocY);
+        std::vector<float> values(_fluid.numCells());
+        _fluid.readScalar(dye, values.data());
+        return values;
+    }
+
+    /**
+     * @brief Root mean square difference of two fields relative to the root mean square of the first
+     */
+    double relativeError(const std::vector<float> &_expected, const std::vector<float> &_actual)
+    {
+        double difference = 0.0;
+        double magnitude = 0.0;
+        for (size_t c = 0; c < _expected.size(); c++)
+        {
+            const double error = static_cast<double>(_actual[c]) - _expected[c];
+            difference += error * error;
+            magnitude += static_cast<double>(_expected[c]) * _expected[c];
+        }
+        return std::sqrt(difference / magnitude);
+    }
+}
+
+TEST(HalfPrecision, EveryHalfConvertsExactlyAndBack)
+{
+    std::vector<Half> halves(65536);
+    for (size_t n = 0; n < halves.size(); n++)
+    {
+        halves[n].bits = static_cast<uint16_t>(n);
+    }
+    for (SimdLevel level : supportedLevels())
+    {
+        const ConversionKernels &kernels = conversionKernels(level);
+        std::vector<float> floats(halves.size());
+        kernels.halfToFloat(halves.data(), floats.data(), halves.size());
+        std::vector<Half> back(halves.size());
+        kernels.floatToHalf(floats.data(), back.data(), floats.size());
+        for (size_t n = 0; n < halves.size(); n++)
+        {
+            const float expected = toFloat(halves[n]);
+            ASSERT_EQ(std::memcmp(&floats[n], &expected, sizeof(float)), 0)
+                << simdLevelName(level) << " half " << std::hex << n;
+            // NaNs come back quiet, everything else exactly
+            const size_t bits = (n & 0x7fffu) > 0x7c00u ? n | 0x200u : n;
+            ASSERT_EQ(back[n].bits, bits) << simdLevelName(level) << " half " << std::hex << n;
+        }
+    }
+}
+
+TEST(HalfPrecision, KernelsRoundLikeTheScalarConversions)
+{
+    const std::vector<float> values = conversionInputs();
+    for (SimdLevel level : supportedLevels())
+    {
+        const ConversionKernels &kernels = conversionKernels(level);
+        std::vector<Half> halves(values.size());
+        kernels.floatToHalf(values.data(), halves.data(), values.size());
+        std::vector<BFloat16> bfloats(values.size());
+        kernels.floatToBFloat16(values.data(), bfloats.data(), values.size());
+        std::vector<float> widened(values.size());
+        kernels.bfloat16ToFloat(bfloats.data(), widened.data(), bfloats.size());
+        for (size_t n = 0; n < values.size(); n++)
+        {
+            ASSERT_EQ(halves[n].bits, fromFloat<Half>(values[n]).bits)
+                << simdLevelName(level) << " float " << std::hexfloat << values[n];
+            ASSERT_EQ(bfloats[n].bits, fromFloat<BFloat16>(values[n]).bits)
+                << simdLevelName(level) << " float " << std::hexfloat << values[n];
+            const float expected = toFloat(bfloats[n]);
+            ASSERT_EQ(std::memcmp(&widened[n], &expected, sizeof(float)), 0) << simdLevelName(level);
+        }
+    }
+}
+
+TEST(HalfPrecision, RoundsToNearestEven)
+{
+    // 1 + 2^-11 is halfway between 1 and the next half up, 1 + 3 * 2^-11 halfway between two odd and even ones
+    EXPECT_EQ(fromFloat<Half>(1.0f + 0x1p-11f).bits, 0x3c00u);
+    EXPECT_EQ(fromFloat<Half>(1.0f + 3 * 0x1p-11f).bits, 0x3c02u);
+    EXPECT_EQ(fromFloat<Half>(65504.0f).bits, 0x7bffu);
+    EXPECT_EQ(fromFloat<Half>(65519.0f).bits, 0x7bffu);
+    EXPECT_EQ(fromFloat<Half>(65520.0f).bits, 0x7c00u);
+    EXPECT_EQ(fromFloat<Half>(-0x1p-24f).bits, 0x8001u);
+    EXPECT_EQ(fromFloat<Half>(0x1p-25f).bits, 0x0000u);
+    EXPECT_EQ(fromFloat<Half>(0x1.8p-24f).bits, 0x0002u);
+    EXPECT_EQ(fromFloat<BFloat16>(1.0f + 0x1p-8f).bits, 0x3f80u);
+    EXPECT_EQ(fromFloat<BFloat16>(1.0f + 3 * 0x1p-8f).bits, 0x3f82u);
+    EXPECT_TRUE(std::isnan(toFloat(fromFloat<BFloat16>(fromBits(0x7f800001u)))));
+}
+
+TEST(MixedPrecision, FloatStorageMatchesFluid)
+{
+    // each stage on the same fields, as FluidGrid's step reuses its fields for the pressure and so starts its
+    // diffusion sweeps from a different first guess
+    Fluid reference(c_width, c_height);
+    reference.setSolveMode(Fluid::SolveMode::Jacobi);
+    MixedPrecisionFluid<float> fluid(c_width, c_height, c_viscosity, c_dt);
+    const size_t cells = reference.numCells();
+    std::vector<float> velocX = makeField(c_width, c_height, 1);
+    std::vector<float> velocY = makeField(c_width, c_height, 2);
+    std::vector<float> expectedX = makeField(c_width, c_height, 3);
+    std::vector<float> expectedY = expectedX;
+    std::vector<float> actualX = expectedX;
+    std::vector<float> actualY = expectedY;
+
+    reference.diffuse(Fluid::Boundary::X, expectedX.data(), velocX.data(), c_viscosity, c_dt, Fluid::SolveMode::Jacobi);
+    fluid.diffuse(Fluid::Boundary::X, actualX.data(), velocX.data(), c_viscosity, c_dt);
+    EXPECT_TRUE(fieldsMatch("diffuse", expectedX.data(), actualX.data(), cells));
+
+    reference.advect(Fluid::Boundary::Y, expectedY.data(), velocY.data(), velocX.data(), velocY.data(), c_dt);
+    fluid.advect(Fluid::Boundary::Y, actualY.data(), velocY.data(), velocX.data(), velocY.data(), c_dt);
+    EXPECT_TRUE(fieldsMatch("advect", expectedY.data(), actualY.data(), cells));
+
+    std::vector<float> p(cells);
+    std::vector<float> div(cells);
+    reference.project(expectedX.data(), expectedY.data(), p.data(), div.data());
+    fluid.project(actualX.data(), actualY.data());
+    EXPECT_TRUE(fieldsMatch("project X", expectedX.data(), actualX.data(), cells));
+    EXPECT_TRUE(fieldsMatch("project Y", expectedY.data(), actualY.data(), cells));
+}
+
+TEST(MixedPrecision, ThreadsAndSimdLevelsDoNotChangeHalfStorage)
+{
+    MixedPrecisionFluid<Half> reference(c_width, c_height, c_viscosity, c_dt);
+    reference.setSimdLevel(SimdLevel::Scalar);
+    std::vector<float> expectedX;
+    std::vector<float> expectedY;
+    runMixed(reference, &expectedX, &expectedY);
+
+    ThreadPool pool(3);
+    for (SimdLevel level : supportedLevels())
+    {
+        MixedPrecisionFluid<Half> fluid(c_width, c_height, c_viscosity, c_dt);
+        fluid.setThreadPool(&pool);
+        fluid.setSimdLevel(level);
+        std::vector<float> velocX;
+        std::vector<float> velocY;
+        runMixed(fluid, &velocX, &velocY);
+        EXPECT_TRUE(fieldsMatch(simdLevelName(level), expectedX.data(), velocX.data(), velocX.size()));
+        EXPECT_TRUE(fieldsMatch(simdLevelName(level), expectedY.data(), velocY.data(), velocY.size()));
+    }
+}
+
+TEST(MixedPrecision, SixteenBitStorageStaysCloseToFloat)
+{
+    MixedPrecisionFluid<float> reference(c_width, c_height, c_viscosity, c_dt);
+    std::vector<float> expectedX;
+    std::vector<float> expectedY;
+    runMixed(reference, &expectedX, &expectedY);
+
+    // every pass rounds the stored values to 11 or 8 bits, which adds up over the steps to about 0.1% and 1%
+    MixedPrecisionFluid<Half> half(c_width, c_height, c_viscosity, c_dt);
+    std::vector<float> halfX;
+    std::vector<float> halfY;
+    runMixed(half, &halfX, &halfY);
+    EXPECT_LT(relativeError(expectedX, halfX), 2e-3);
+    EXPECT_LT(relativeError(expectedY, halfY), 2e-3);
+
+    MixedPrecisionFluid<BFloat16> bfloat(c_width, c_height, c_viscosity, c_dt);
+    std::vector<float> bfloatX;
+    std::vector<float> bfloatY;
+    runMixed(bfloat, &bfloatX, &bfloatY);
+    EXPECT_LT(relativeError(expectedX, bfloatX), 3e-2);
+    EXPECT_LT(relativeError(expectedY, bfloatY), 3e-2);
+}
+
+TEST(MixedPrecision, ScalarChannelsStayCloseToFloat)
+{
+    MixedPrecisionFluid<float> reference(c_width, c_height, c_viscosity, c_dt);
+    const std::vector<float> expected = runDye(reference);
+
+    MixedPrecisionFluid<Half> half(c_width, c_height, c_viscosity, c_dt);
+    const std::vector<float> halfDye = runDye(half);
+    EXPECT_LT(relativeError(expected, halfDye), 2e-3);
+
+    MixedPrecisionFluid<BFloat16> bfloat(c_width, c_height, c_viscosity, c_dt);
+    EXPECT_LT(relativeError(expected, runDye(bfloat)), 3e-2);
+
+    ThreadPool pool(3);
+    MixedPrecisionFluid<Half> threaded(c_width, c_height, c_viscosity, c_dt);
+    threaded.setThreadPool(&pool);
+    const std::vector<float> threadedDye = runDye(threaded);
+    EXPECT_TRUE(fieldsMatch("dye", halfDye.data(), threadedDye.data(), threadedDye.size()));
+}